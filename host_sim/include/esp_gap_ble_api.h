@@ -0,0 +1,261 @@
+#ifndef ESP_GAP_BLE_API_H
+#define ESP_GAP_BLE_API_H
+
+#include "esp_bt_defs.h"
+
+#define ESP_BLE_ADV_FLAG_LIMIT_DISC     (0x01 << 0)
+#define ESP_BLE_ADV_FLAG_GEN_DISC       (0x01 << 1)
+#define ESP_BLE_ADV_FLAG_BREDR_NOT_SPT  (0x01 << 2)
+
+typedef enum {
+    ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT = 0,
+    ESP_GAP_BLE_SCAN_RSP_DATA_SET_COMPLETE_EVT = 1,
+    ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT = 4,
+    ESP_GAP_BLE_SCAN_RSP_DATA_RAW_SET_COMPLETE_EVT = 5,
+    ESP_GAP_BLE_ADV_START_COMPLETE_EVT = 6,
+    ESP_GAP_BLE_AUTH_CMPL_EVT = 8,
+    ESP_GAP_BLE_SEC_REQ_EVT = 10,
+    ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT = 17,
+    ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT = 20,
+    ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT = 21,
+    ESP_GAP_BLE_UPDATE_WHITELIST_COMPLETE_EVT = 27,
+    ESP_GAP_BLE_SET_PREFERRED_PHY_COMPLETE_EVT = 32,
+    ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT = 55,
+} esp_gap_ble_cb_event_t;
+
+typedef enum {
+    ESP_BLE_WHITELIST_REMOVE = 0,
+    ESP_BLE_WHITELIST_ADD = 1,
+    ESP_BLE_WHITELIST_CLEAR = 2,
+} esp_ble_wl_operation_t;
+
+typedef enum {
+    ADV_TYPE_IND = 0x00,
+    ADV_TYPE_DIRECT_IND_HIGH = 0x01,
+    ADV_TYPE_SCAN_IND = 0x02,
+    ADV_TYPE_NONCONN_IND = 0x03,
+    ADV_TYPE_DIRECT_IND_LOW = 0x04,
+} esp_ble_adv_type_t;
+
+typedef enum {
+    ADV_CHNL_37 = 0x01,
+    ADV_CHNL_38 = 0x02,
+    ADV_CHNL_39 = 0x04,
+    ADV_CHNL_ALL = 0x07,
+} esp_ble_adv_channel_t;
+
+typedef enum {
+    ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY = 0x00,
+    ADV_FILTER_ALLOW_SCAN_WLST_CON_ANY,
+    ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST,
+    ADV_FILTER_ALLOW_SCAN_WLST_CON_WLST,
+} esp_ble_adv_filter_t;
+
+typedef struct {
+    uint16_t adv_int_min;
+    uint16_t adv_int_max;
+    esp_ble_adv_type_t adv_type;
+    esp_ble_addr_type_t own_addr_type;
+    esp_bd_addr_t peer_addr;
+    esp_ble_addr_type_t peer_addr_type;
+    esp_ble_adv_channel_t channel_map;
+    esp_ble_adv_filter_t adv_filter_policy;
+} esp_ble_adv_params_t;
+
+typedef struct {
+    bool set_scan_rsp;
+    bool include_name;
+    bool include_txpower;
+    int min_interval;
+    int max_interval;
+    int appearance;
+    uint16_t manufacturer_len;
+    uint8_t *p_manufacturer_data;
+    uint16_t service_data_len;
+    uint8_t *p_service_data;
+    uint16_t service_uuid_len;
+    uint8_t *p_service_uuid;
+    uint8_t flag;
+} esp_ble_adv_data_t;
+
+typedef struct {
+    esp_bd_addr_t bda;
+    uint16_t min_int;
+    uint16_t max_int;
+    uint16_t latency;
+    uint16_t timeout;
+} esp_ble_conn_update_params_t;
+
+typedef uint8_t esp_ble_gap_all_phys_t;
+typedef uint8_t esp_ble_gap_phy_mask_t;
+typedef uint16_t esp_ble_gap_prefer_phy_options_t;
+typedef uint8_t esp_ble_gap_phy_t;
+
+#define ESP_BLE_GAP_PHY_1M_PREF_MASK    (1 << 0)
+#define ESP_BLE_GAP_PHY_2M_PREF_MASK    (1 << 1)
+#define ESP_BLE_GAP_PHY_CODED_PREF_MASK (1 << 2)
+#define ESP_BLE_GAP_PHY_OPTIONS_NO_PREF 0
+#define ESP_BLE_GAP_PHY_1M              1
+#define ESP_BLE_GAP_PHY_2M              2
+#define ESP_BLE_GAP_PHY_CODED           3
+
+typedef struct {
+    uint16_t rx_len;
+    uint16_t tx_len;
+} esp_ble_pkt_data_length_params_t;
+
+typedef enum {
+    ESP_BLE_SM_PASSKEY = 0,
+    ESP_BLE_SM_AUTHEN_REQ_MODE,
+    ESP_BLE_SM_IOCAP_MODE,
+    ESP_BLE_SM_SET_INIT_KEY,
+    ESP_BLE_SM_SET_RSP_KEY,
+    ESP_BLE_SM_MAX_KEY_SIZE,
+    ESP_BLE_SM_MIN_KEY_SIZE,
+    ESP_BLE_SM_SET_STATIC_PASSKEY,
+    ESP_BLE_SM_CLEAR_STATIC_PASSKEY,
+    ESP_BLE_SM_ONLY_ACCEPT_SPECIFIED_SEC_AUTH,
+    ESP_BLE_SM_OOB_SUPPORT,
+} esp_ble_sm_param_t;
+
+typedef uint8_t esp_ble_auth_req_t;
+typedef uint8_t esp_ble_io_cap_t;
+typedef uint8_t esp_ble_key_mask_t;
+
+#define ESP_LE_AUTH_BOND                (1 << 0)
+#define ESP_LE_AUTH_REQ_MITM            (1 << 2)
+#define ESP_LE_AUTH_REQ_SC_ONLY         (1 << 3)
+#define ESP_LE_AUTH_REQ_SC_BOND         (ESP_LE_AUTH_BOND | ESP_LE_AUTH_REQ_SC_ONLY)
+#define ESP_IO_CAP_NONE                 3
+#define ESP_BLE_ENC_KEY_MASK            (1 << 0)
+#define ESP_BLE_ID_KEY_MASK             (1 << 1)
+#define ESP_BLE_ONLY_ACCEPT_SPECIFIED_AUTH_ENABLE 1
+#define ESP_LE_KEY_PENC                 (1 << 0)
+#define ESP_LE_KEY_PID                  (1 << 1)
+
+typedef enum {
+    ESP_BLE_SEC_ENCRYPT = 1,
+    ESP_BLE_SEC_ENCRYPT_NO_MITM,
+    ESP_BLE_SEC_ENCRYPT_MITM,
+} esp_ble_sec_act_t;
+
+typedef struct {
+    esp_bt_octet16_t ltk;
+    uint8_t rand[8];
+    uint16_t ediv;
+    uint8_t sec_level;
+    uint8_t key_size;
+} esp_ble_penc_keys_t;
+
+typedef struct {
+    esp_bt_octet16_t irk;
+    esp_ble_addr_type_t addr_type;
+    esp_bd_addr_t static_addr;
+} esp_ble_pid_keys_t;
+
+typedef struct {
+    esp_bt_octet16_t csrk;
+    uint32_t counter;
+    uint8_t sec_level;
+} esp_ble_pcsrk_keys_t;
+
+typedef struct {
+    esp_ble_key_mask_t key_mask;
+    esp_ble_penc_keys_t penc_key;
+    esp_ble_pcsrk_keys_t pcsrk_key;
+    esp_ble_pid_keys_t pid_key;
+} esp_ble_bond_key_info_t;
+
+typedef struct {
+    esp_bd_addr_t bd_addr;
+    esp_ble_bond_key_info_t bond_key;
+} esp_ble_bond_dev_t;
+
+typedef struct {
+    esp_bd_addr_t bd_addr;
+} esp_ble_sec_req_t;
+
+typedef struct {
+    esp_bd_addr_t bd_addr;
+    bool key_present;
+    uint8_t key_type;
+    bool success;
+    uint8_t fail_reason;
+    esp_ble_addr_type_t addr_type;
+    uint8_t dev_type;
+    esp_ble_auth_req_t auth_mode;
+} esp_ble_auth_cmpl_t;
+
+typedef union {
+    esp_ble_sec_req_t ble_req;
+    esp_ble_auth_cmpl_t auth_cmpl;
+} esp_ble_sec_t;
+
+typedef union {
+    struct ble_adv_data_cmpl_evt_param {
+        uint8_t status;
+    } adv_data_cmpl;
+    struct ble_adv_data_raw_cmpl_evt_param {
+        esp_bt_status_t status;
+    } adv_data_raw_cmpl;
+    struct ble_scan_rsp_data_raw_cmpl_evt_param {
+        esp_bt_status_t status;
+    } scan_rsp_data_raw_cmpl;
+    struct ble_adv_start_cmpl_evt_param {
+        uint8_t status;
+    } adv_start_cmpl;
+    struct ble_adv_stop_cmpl_evt_param {
+        uint8_t status;
+    } adv_stop_cmpl;
+    esp_ble_sec_t ble_security;
+    struct ble_update_conn_params_evt_param {
+        uint8_t status;
+        esp_bd_addr_t bda;
+        uint16_t min_int;
+        uint16_t max_int;
+        uint16_t latency;
+        uint16_t conn_int;
+        uint16_t timeout;
+    } update_conn_params;
+    struct ble_pkt_data_length_cmpl_evt_param {
+        esp_bt_status_t status;
+        esp_ble_pkt_data_length_params_t params;
+    } pkt_data_length_cmpl;
+    struct ble_update_whitelist_cmpl_evt_param {
+        esp_bt_status_t status;
+        esp_ble_wl_operation_t wl_operation;
+    } update_whitelist_cmpl;
+    struct ble_set_perf_phy_cmpl_evt_param {
+        esp_bt_status_t status;
+    } set_perf_phy;
+    struct ble_phy_update_cmpl_param {
+        esp_bt_status_t status;
+        esp_bd_addr_t bda;
+        esp_ble_gap_phy_t tx_phy;
+        esp_ble_gap_phy_t rx_phy;
+    } phy_update;
+} esp_ble_gap_cb_param_t;
+
+typedef void (*esp_gap_ble_cb_t)(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback);
+esp_err_t esp_ble_gap_config_adv_data(esp_ble_adv_data_t *adv_data);
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t *raw_data, uint32_t raw_data_len);
+esp_err_t esp_ble_gap_config_scan_rsp_data_raw(uint8_t *raw_data, uint32_t raw_data_len);
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t *adv_params);
+esp_err_t esp_ble_gap_stop_advertising(void);
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params);
+esp_err_t esp_ble_gap_update_whitelist(bool add_remove, esp_bd_addr_t remote_bda, esp_ble_wl_addr_type_t wl_addr_type);
+esp_err_t esp_ble_gap_get_whitelist_size(uint16_t *length);
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remote_device, uint16_t tx_data_length);
+esp_err_t esp_ble_gap_set_preferred_phy(esp_bd_addr_t bd_addr, esp_ble_gap_all_phys_t all_phys_mask,
+                                        esp_ble_gap_phy_mask_t tx_phy_mask, esp_ble_gap_phy_mask_t rx_phy_mask,
+                                        esp_ble_gap_prefer_phy_options_t phy_options);
+esp_err_t esp_ble_gap_set_security_param(esp_ble_sm_param_t param_type, void *value, uint8_t len);
+esp_err_t esp_ble_gap_security_rsp(esp_bd_addr_t bd_addr, bool accept);
+esp_err_t esp_ble_set_encryption(esp_bd_addr_t bd_addr, esp_ble_sec_act_t sec_act);
+int esp_ble_get_bond_device_num(void);
+esp_err_t esp_ble_get_bond_device_list(int *dev_num, esp_ble_bond_dev_t *dev_list);
+esp_err_t esp_ble_remove_bond_device(esp_bd_addr_t bd_addr);
+
+#endif // ESP_GAP_BLE_API_H
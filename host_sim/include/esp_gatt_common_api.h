@@ -0,0 +1,9 @@
+#ifndef ESP_GATT_COMMON_API_H
+#define ESP_GATT_COMMON_API_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu);
+
+#endif // ESP_GATT_COMMON_API_H
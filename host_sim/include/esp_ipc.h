@@ -0,0 +1,16 @@
+#ifndef ESP_IPC_H
+#define ESP_IPC_H
+
+// esp_ipc.h - Host simulator stand-in; there is one core, so the call runs in place
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef void (*esp_ipc_func_t)(void *arg);
+
+static inline esp_err_t esp_ipc_call_blocking(uint32_t cpu_id, esp_ipc_func_t func, void *arg) {
+    func(arg);
+    return ESP_OK;
+}
+
+#endif // ESP_IPC_H
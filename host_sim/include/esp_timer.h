@@ -0,0 +1,11 @@
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+#include <stdint.h>
+
+/**
+ * @brief Microseconds since the simulator started, from CLOCK_MONOTONIC.
+ */
+int64_t esp_timer_get_time(void);
+
+#endif // ESP_TIMER_H
@@ -0,0 +1,14 @@
+#ifndef HAL_GPIO_LL_H
+#define HAL_GPIO_LL_H
+
+#include <stdint.h>
+#include "driver/gpio.h"
+
+// The register-level GPIO calls the firmware makes from its ISRs; there is one GPIO port
+#define GPIO_PORT_0 0
+typedef struct sim_gpio_dev gpio_dev_t;
+#define GPIO_LL_GET_HW(num) ((gpio_dev_t *)NULL)
+
+void gpio_ll_set_intr_type(gpio_dev_t *hw, uint32_t gpio_num, gpio_int_type_t intr_type);
+
+#endif // HAL_GPIO_LL_H
@@ -0,0 +1,86 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+// sdkconfig.h - Configuration for the host simulator build
+//
+// Mirrors the project defaults from main/Kconfig.projbuild and the relevant IDF
+// options from sdkconfig. Keep it in step when adding options there.
+
+#define CONFIG_IDF_TARGET "linux"
+#define CONFIG_FREERTOS_HZ 100
+#define CONFIG_BT_ENABLED 1
+#define CONFIG_NVS_ENABLE 1
+#define CONFIG_BT_BLUEDROID_ENABLED 1
+#define CONFIG_BT_BLUEDROID_PINNED_TO_CORE 0
+#define CONFIG_BT_BLE_SMP_ENABLE 1
+#define CONFIG_BT_SMP_MAX_BONDS 4
+#define CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ 160
+// As in the sdkconfig.pm profile, so the scenarios see the power management locks
+#define CONFIG_PM_ENABLE 1
+#define CONFIG_FREERTOS_USE_TICKLESS_IDLE 1
+
+#define CONFIG_EXAMPLE_LOCAL_DEVICE_NAME "BLE Remote controller"
+#define CONFIG_BLE_LOCAL_MTU 247
+#define CONFIG_BLE_MAX_CONNECTIONS 2
+#define CONFIG_BT_EVENT_FLUSH_DEADLINE_MS 10
+#define CONFIG_BLE_TX_QUEUE_LEN 32
+#define CONFIG_BLE_TX_EVENT_TTL_MS 20000
+#define CONFIG_BLE_TX_WINDOW 8
+#define CONFIG_BLE_TX_RETRY_MS 250
+
+#define CONFIG_BLE_CONN_FAST_MIN_INT 12
+#define CONFIG_BLE_CONN_FAST_MAX_INT 24
+#define CONFIG_BLE_CONN_IDLE_MIN_INT 320
+#define CONFIG_BLE_CONN_IDLE_MAX_INT 400
+#define CONFIG_BLE_CONN_IDLE_LATENCY 2
+#define CONFIG_BLE_CONN_SUPERVISION_TIMEOUT 500
+#define CONFIG_BLE_CONN_IDLE_TIMEOUT_MS 10000
+#define CONFIG_BLE_CONN_FAST_WAIT_MS 100
+#define CONFIG_BLE_CONN_RETRY_MS 1000
+#define CONFIG_BLE_LINK_2M_PHY 1
+#define CONFIG_BLE_LINK_DATA_LEN 251
+
+#define CONFIG_BLE_ADV_DIRECTED 1
+#define CONFIG_BLE_ADV_FAST_MIN_INT 32
+#define CONFIG_BLE_ADV_FAST_MAX_INT 64
+#define CONFIG_BLE_ADV_FAST_DURATION_MS 5000    // Shortened so scenarios reach the slow tier quickly
+#define CONFIG_BLE_ADV_SLOW_MIN_INT 1600
+#define CONFIG_BLE_ADV_SLOW_MAX_INT 1920
+
+#define CONFIG_BLE_BEACON 1
+#define CONFIG_BLE_BEACON_BURST_MS 150
+#define CONFIG_BLE_BEACON_INT 32
+#define CONFIG_BLE_BEACON_COMPANY_ID 0xFFFF
+
+#define CONFIG_BLE_ACCEPT_LIST 1
+#define CONFIG_BLE_ACCEPT_LIST_MAX 16
+
+#define CONFIG_BLE_BOND 1
+#define CONFIG_BLE_BOND_TIMEOUT_MS 2000     // Shortened so scenarios see the timeout
+
+#define CONFIG_BT_PROV_MAX_DEVICES 4    // Small, so scenarios can fill it
+
+#define CONFIG_BT_TELEMETRY_PERIOD_MS 10000
+#define CONFIG_BT_TELEMETRY_STACK_MIN_FREE 512
+#define CONFIG_BT_TELEMETRY_HEAP_MIN_FREE 16384
+
+#define CONFIG_FLIGHT_REC_QUEUE_LEN 64
+#define CONFIG_FLIGHT_REC_FLUSH_MS 2000
+
+#define CONFIG_BT_SCHED_PROFILE_ISOLATED 1
+#define CONFIG_BT_SCHED_EVENT_TASK_PRIO 10
+#define CONFIG_BT_SCHED_STORAGE_PRIO 1
+
+#define CONFIG_BT_PM_MIN_FREQ_MHZ 40
+#define CONFIG_BT_PM_BLE_HOLD_MS 50
+
+#define CONFIG_BT_TRACE_ENABLE 1
+#define CONFIG_BT_TRACE_BUF_LEN 128
+#define CONFIG_BT_TRACE_FLUSH_MS 200
+#define CONFIG_BT_TRACE_LEVEL_GPIO 3
+#define CONFIG_BT_TRACE_LEVEL_EVT 3
+#define CONFIG_BT_TRACE_LEVEL_TX 3
+#define CONFIG_BT_TRACE_LEVEL_BLE 3
+#define CONFIG_BT_TRACE_LEVEL_STORAGE 3
+
+#endif // SDKCONFIG_H
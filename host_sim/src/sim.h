@@ -0,0 +1,320 @@
+#ifndef SIM_H
+#define SIM_H
+
+// sim.h - Control interface of the host simulator
+//
+// Scenarios drive the firmware through simulated GPIO edges and a simulated phone,
+// and inspect what the phone received. Everything runs in real time on the host
+// clock that backs esp_timer_get_time().
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "driver/gpio.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gatt_defs.h"
+#include "esp_pm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Clock
+ */
+
+/**
+ * @brief Sleeps until esp_timer_get_time() reaches the given time.
+ */
+void sim_sleep_until_us(int64_t t_us);
+
+/**
+ * @brief Sleeps for the given number of milliseconds.
+ */
+void sim_sleep_ms(uint32_t ms);
+
+/*
+ * GPIO
+ */
+
+/**
+ * @brief Drives an input pin and runs its ISR, in interrupt context, if the edge matches.
+ *
+ * Interrupts are serialized as on a single core.
+ */
+void sim_gpio_set_level(gpio_num_t gpio, int level);
+
+/**
+ * @brief Marks the calling thread as running an ISR, for xPortInIsrContext().
+ */
+void sim_set_isr_context(bool in_isr);
+
+/*
+ * BLE link and phone
+ *
+ * Up to SIM_PHONE_COUNT phones can be connected at once, each on its own link. The
+ * functions without a phone argument act on phone 0.
+ */
+
+#define SIM_PHONE_COUNT 2
+
+typedef struct {
+    uint16_t mtu;               // MTU the phone requests
+    bool indications;           // Subscribe with indications instead of notifications
+    bool sync_time;             // Write "time:<ms>" before subscribing
+    bool subscribe;             // Write the CCCD; a bonded phone may rely on the remote keeping it
+    uint32_t conn_interval_us;  // Connection interval of the simulated link
+    uint8_t pdus_per_event;     // PDUs the link carries per connection event
+    bool reject_conn_params;    // Refuse connection parameter update requests
+    bool phy_2m;                // Supports the 2M PHY
+    uint16_t max_data_len;      // Longest link-layer payload; 27 if it lacks data length extension
+    uint32_t event_air_us;      // Air time the phone gives a connection event, 0 for no limit
+    bool ignore_security;       // Leave the remote's requests to encrypt unanswered
+} sim_phone_config_t;
+
+#define SIM_PHONE_CONFIG_DEFAULT() { \
+        .mtu = 247, \
+        .indications = false, \
+        .sync_time = true, \
+        .subscribe = true, \
+        .conn_interval_us = 30000, \
+        .pdus_per_event = 4, \
+        .reject_conn_params = false, \
+        .phy_2m = true, \
+        .max_data_len = 251, \
+        .event_air_us = 0, \
+        .ignore_security = false, \
+    }
+
+typedef struct {
+    int64_t rx_us;      // esp_timer time the phone received the record
+    uint16_t seq;
+    int button;
+    bool long_press;
+    int64_t ts_ms;      // Press timestamp in phone time, or -1 if the record had none
+} sim_record_t;
+
+typedef struct {
+    uint32_t pdus;          // Notifications and indications received on the remote characteristic
+    uint32_t records;       // Records received, including duplicates
+    uint32_t duplicates;    // Records received more than once
+    uint32_t malformed;     // Records that did not parse
+    uint32_t oversize;      // PDUs longer than the negotiated MTU allowed
+    uint32_t rejected;      // Sends refused because the link buffer was full or down
+    uint32_t congestions;   // Times the link reported congestion
+    uint32_t conn_updates;  // Connection parameter updates requested by the remote
+    uint32_t conn_rejects;  // Of those, refused by the phone
+    uint32_t dump_bytes;    // Bytes received on the dump characteristic
+} sim_phone_stats_t;
+
+/**
+ * @brief Waits until the firmware has built its GATT service and started advertising.
+ *
+ * @return true if it did within timeout_ms.
+ */
+bool sim_ble_wait_advertising(uint32_t timeout_ms);
+
+/**
+ * @brief Returns the connection interval in use, in microseconds, or 0 if not connected.
+ */
+uint32_t sim_ble_conn_interval_us(void);
+uint32_t sim_ble_conn_interval_us_at(int phone);
+
+/**
+ * @brief Copies the parameters of the advertising in progress.
+ *
+ * @return false if the remote is not advertising.
+ */
+bool sim_ble_adv_params(esp_ble_adv_params_t *params);
+
+typedef struct {
+    uint8_t tx_phy;         // ESP_BLE_GAP_PHY_*
+    uint8_t rx_phy;
+    uint16_t tx_octets;     // Longest link-layer payload from the remote
+    uint16_t rx_octets;
+    uint64_t air_us;        // Air time taken by notifications and indications so far
+    size_t queued;          // PDUs in the link buffer
+    bool encrypted;
+} sim_link_info_t;
+
+/**
+ * @brief Copies the state of a phone's link.
+ *
+ * @return false if the phone is not connected.
+ */
+bool sim_ble_link_info(int phone, sim_link_info_t *info);
+
+/**
+ * @brief Copies the advertising data and scan response the controller holds.
+ *
+ * Each buffer takes up to 31 bytes.
+ */
+void sim_ble_adv_data(uint8_t *adv, size_t *adv_len, uint8_t *scan_rsp, size_t *scan_rsp_len);
+
+/**
+ * @brief Copies the data of the latest non-connectable advertising, up to 31 bytes.
+ *
+ * @return Number of times non-connectable advertising was started.
+ */
+uint32_t sim_ble_broadcasts(uint8_t *data, size_t *len);
+
+/**
+ * @brief Makes the phone lose the keys of its bond, as a device that only copies its address.
+ */
+void sim_ble_phone_forget_keys(int phone);
+
+/**
+ * @brief Makes the stack refuse the next count notifications or indications to the phone.
+ */
+void sim_ble_refuse_sends(int phone, uint32_t count);
+
+/**
+ * @brief Empties the host's bond database, as if its storage was erased.
+ */
+void sim_ble_forget_bonds(void);
+
+/**
+ * @brief Returns true if the host has a bond with the phone.
+ */
+bool sim_ble_bonded(int phone);
+
+/**
+ * @brief Returns how many times the phone paired.
+ */
+uint32_t sim_ble_pairings(int phone);
+
+/**
+ * @brief Connects the simulated phone, exchanges MTUs and subscribes.
+ *
+ * @return false if the remote's accept list kept the phone from connecting.
+ */
+bool sim_phone_connect(const sim_phone_config_t *config);
+bool sim_phone_connect_at(int phone, const sim_phone_config_t *config);
+
+/**
+ * @brief Returns the address the phone connects with.
+ */
+void sim_ble_phone_bda(int phone, esp_bd_addr_t bda);
+
+/**
+ * @brief Drops the link as if the phone went out of range. PDUs not yet on air are lost.
+ */
+void sim_phone_disconnect(void);
+void sim_phone_disconnect_at(int phone);
+
+/**
+ * @brief Returns the phone's wall clock in milliseconds since the epoch.
+ */
+int64_t sim_phone_clock_ms(int64_t at_us);
+
+/**
+ * @brief Copies the unique records received so far, in arrival order.
+ *
+ * @return Number of records copied.
+ */
+size_t sim_phone_records(sim_record_t *out, size_t max);
+size_t sim_phone_records_at(int phone, sim_record_t *out, size_t max);
+
+/**
+ * @brief Copies the phone's counters.
+ */
+void sim_phone_get_stats(sim_phone_stats_t *stats);
+void sim_phone_get_stats_at(int phone, sim_phone_stats_t *stats);
+
+/**
+ * @brief Writes a characteristic with one write request.
+ */
+void sim_phone_write_at(int phone, uint16_t uuid_tail, const void *data, uint16_t len);
+
+/**
+ * @brief Writes the CCCD of a characteristic.
+ */
+void sim_phone_subscribe_at(int phone, uint16_t uuid_tail, uint16_t cccd);
+
+/**
+ * @brief Writes a characteristic with prepared writes of MTU - 5 bytes each, then
+ * executes them, or cancels them if execute is false.
+ *
+ * @return ESP_GATT_OK, or the first error the remote answered with.
+ */
+esp_gatt_status_t sim_phone_long_write_at(int phone, uint16_t uuid_tail, const void *data, uint16_t len,
+                                          bool execute);
+
+/**
+ * @brief Reads a characteristic, with as many read requests as a long value takes.
+ *
+ * @return Number of bytes read, or -1 if the remote answered with an error.
+ */
+int sim_phone_read_at(int phone, uint16_t uuid_tail, uint8_t *data, size_t max);
+
+/*
+ * Power management
+ */
+
+/**
+ * @brief Returns how many acquisitions of locks of the given type are outstanding.
+ */
+int sim_pm_held(esp_pm_lock_type_t type);
+
+/*
+ * Storage
+ */
+
+/**
+ * @brief Returns how many times nvs_commit() succeeded since start.
+ */
+uint32_t sim_nvs_commit_count(void);
+
+/**
+ * @brief Makes every set after the next `sets` ones fail as on a full partition; -1 stops it.
+ */
+void sim_nvs_fail_sets_after(int sets);
+
+/**
+ * @brief Writes the contents of an emulated partition to a file, as esptool.py read_flash would.
+ *
+ * @return false if there is no such partition or the file could not be written.
+ */
+bool sim_partition_save(const char *label, const char *path);
+
+/*
+ * Scenarios
+ */
+
+typedef struct {
+    const char *name;
+    bool connect;               // Connect the phone before the scenario runs
+    int (*run)(void);           // Returns the number of failed checks
+} sim_scenario_t;
+
+extern const sim_scenario_t sim_scenarios[];
+extern const size_t sim_scenario_count;
+
+/*
+ * Used between simulator modules
+ */
+
+// sim_ble.c: the stack and the link, driven by the phone
+uint16_t sim_ble_char_handle(uint16_t uuid_tail);
+uint16_t sim_ble_cccd_handle(uint16_t uuid_tail);
+bool sim_ble_link_up(int phone, const sim_phone_config_t *config);
+void sim_ble_link_down(int phone);
+void sim_ble_mtu_exchange(int phone, uint16_t mtu);
+void sim_ble_phone_write(int phone, uint16_t handle, const void *data, uint16_t len);
+void sim_ble_confirm(int phone, uint16_t handle);
+uint16_t sim_ble_mtu(int phone);
+esp_gatt_status_t sim_ble_phone_prepare_write(int phone, uint16_t handle, uint16_t offset, const void *data,
+                                              uint16_t len);
+esp_gatt_status_t sim_ble_phone_execute_write(int phone, bool execute);
+esp_gatt_status_t sim_ble_phone_read(int phone, uint16_t handle, uint16_t offset, uint8_t *data, uint16_t *len);
+
+// sim_phone.c: called by the link
+void sim_phone_receive(int phone, uint16_t handle, const uint8_t *data, uint16_t len, bool indicate, int64_t rx_us);
+void sim_phone_count_link_event(int phone, bool oversize, bool rejected, bool congested);
+void sim_phone_count_conn_update(int phone, bool rejected);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIM_H
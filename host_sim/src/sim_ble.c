@@ -0,0 +1,1154 @@
+/**
+ * @file sim_ble.c
+ * @brief Fake Bluedroid GATT server, GAP and radio link for the host simulator.
+ *
+ * Stack callbacks run on a "BTC_TASK" thread in the order the stack posted them, as on
+ * the target. Every simulated phone has its own link: notifications and indications go
+ * into a bounded link buffer that a "btController" thread per link drains a few PDUs per
+ * connection event and hands to that phone. A full buffer reports congestion the way
+ * Bluedroid does. Phone n connects with conn_id n.
+ *
+ * Links start on the 1M PHY with 27-octet link-layer payloads. A PDU takes the air time
+ * of its link-layer fragments, each with the phone's empty reply, and a connection event
+ * carries PDUs until the phone's air time for it (event_air_us) runs out. Requests for
+ * the 2M PHY are answered a few connection events later, with an unsupported feature
+ * error by a phone without it; data length requests are answered at once, and not at
+ * all by a phone without data length extension.
+ *
+ * Advertising data set with the raw APIs is checked and kept; the data of the latest
+ * non-connectable advertising is kept apart, for scenarios that listen to broadcasts.
+ *
+ * The controller's accept list holds SIM_ACCEPT_LIST_SIZE addresses. While undirected
+ * advertising filters connections through it, phones not on it cannot connect.
+ *
+ * Reads, prepared writes and executes wait for the firmware's response, one request at
+ * a time as ATT allows.
+ *
+ * The security manager pairs with a made-up LTK per pairing, which the host's bond
+ * database and the phone both keep. Asked to encrypt, a phone holding the LTK of a bond
+ * the host has encrypts at once; any other phone fails to encrypt if it holds a key,
+ * and asks to pair. A phone configured to ignore security requests does neither.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_bt_device.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gatts_api.h"
+#include "esp_gatt_common_api.h"
+#include "esp_timer.h"
+#include "sim.h"
+
+#define BTC_QUEUE_LEN       64
+#define LINK_BUF_LEN        16      // PDUs the controller can hold
+#define LINK_CONGEST_LEVEL  10      // Congestion is reported at this many queued PDUs...
+#define LINK_UNCONGEST_LEVEL 5      // ...and cleared again at this many
+#define SIM_GATTS_IF        3
+#define FIRST_HANDLE        40
+#define MAX_ATTRS           32
+#define IDLE_POLL_US        10000
+#define UPDATE_INSTANT_EVENTS 6     // Connection events until a parameter update takes effect
+#define HCI_ERR_UNACCEPTABLE_CONN_PARAMS 0x3B
+#define HCI_ERR_MEMORY_FULL 0x07
+#define SIM_ACCEPT_LIST_SIZE 2      // Small, so scenarios can overflow it
+#define RESPONSE_TIMEOUT_MS 1000
+#define ADV_DATA_MAX_LEN    31      // Legacy advertising and scan response data
+#define HCI_ERR_UNSUPPORTED_REMOTE_FEATURE 0x1A
+#define LL_MIN_DATA_LEN     27
+#define LL_MAX_DATA_LEN     251
+#define ATT_L2CAP_HEADER_LEN 7      // ATT opcode and handle, L2CAP length and channel
+#define T_IFS_US            150     // Inter-frame space
+#define SIM_MAX_BONDS       CONFIG_BT_SMP_MAX_BONDS
+#define SIM_KEY_SIZE        16
+#define HCI_ERR_KEY_MISSING 0x06
+#define SMP_PAIR_NOT_SUPPORT 0x05
+#define SMP_UNSPECIFIED     0x08
+
+typedef struct {
+    bool gap;
+    int event;
+    union {
+        esp_ble_gatts_cb_param_t gatts;
+        esp_ble_gap_cb_param_t gap;
+    } param;
+    uint8_t data[ESP_GATT_MAX_ATTR_LEN];    // Value of a write
+} btc_msg_t;
+
+typedef struct {
+    uint16_t handle;
+    esp_bt_uuid_t uuid;
+    bool descr;
+    uint16_t char_handle;       // Owning characteristic of a descriptor
+} sim_attr_t;
+
+typedef struct {
+    uint16_t handle;
+    uint16_t len;
+    bool indicate;
+    uint8_t data[ESP_GATT_MAX_MTU_SIZE];
+} sim_pdu_t;
+
+static esp_gatts_cb_t gatts_callback;
+static esp_gap_ble_cb_t gap_callback;
+static QueueHandle_t btc_queue;
+
+static pthread_mutex_t ble_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t advertising_changed = PTHREAD_COND_INITIALIZER;
+static sim_attr_t attrs[MAX_ATTRS];
+static size_t attr_count;
+static uint16_t next_handle = FIRST_HANDLE;
+static uint16_t last_char;
+static uint16_t local_mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+static bool advertising;
+static esp_ble_adv_params_t adv_params;
+static uint8_t adv_data[ADV_DATA_MAX_LEN];
+static size_t adv_data_len;
+static uint8_t scan_rsp_data[ADV_DATA_MAX_LEN];
+static size_t scan_rsp_data_len;
+static uint32_t broadcast_count;    // Non-connectable advertising starts
+static uint8_t broadcast_data[ADV_DATA_MAX_LEN];
+static size_t broadcast_data_len;
+static uint32_t trans_id;
+static esp_bd_addr_t accept_list[SIM_ACCEPT_LIST_SIZE];
+static size_t accept_count;
+
+typedef struct {
+    bool used;
+    esp_bd_addr_t bda;
+    esp_bt_octet16_t ltk;
+} sim_bond_t;
+
+static sim_bond_t bonds[SIM_MAX_BONDS];     // The host's bond database
+static uint32_t key_seed;
+
+// Keys each phone holds, across connections
+static struct {
+    bool valid;
+    esp_bt_octet16_t ltk;
+    uint32_t pairings;
+} phone_keys[SIM_PHONE_COUNT];
+
+// Response to the request a phone is waiting for
+static pthread_cond_t response_ready = PTHREAD_COND_INITIALIZER;
+static uint32_t awaited_trans_id;
+static bool response_received;
+static esp_gatt_status_t response_status;
+static esp_gatt_rsp_t response;
+
+typedef struct {
+    bool connected;
+    bool congested;
+    uint16_t mtu;
+    sim_phone_config_t config;
+    sim_pdu_t pdus[LINK_BUF_LEN];
+    size_t head;
+    size_t count;
+    bool update_pending;
+    int64_t update_at_us;
+    esp_ble_conn_update_params_t update;
+    bool phy_pending;
+    int64_t phy_at_us;
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+    uint16_t tx_octets;
+    uint16_t rx_octets;
+    uint64_t air_us;
+    bool encrypted;
+} sim_link_t;
+
+static sim_link_t links[SIM_PHONE_COUNT];
+static uint32_t refused_sends[SIM_PHONE_COUNT];    // Sends still to be refused, as a full link buffer would
+
+void sim_ble_phone_bda(int phone, esp_bd_addr_t bda) {
+    const esp_bd_addr_t base = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+    memcpy(bda, base, sizeof(esp_bd_addr_t));
+    bda[5] += phone;
+}
+
+static void post_gatts(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t *param,
+                       const void *data, uint16_t len) {
+    btc_msg_t msg = { .gap = false, .event = event, .param.gatts = *param };
+    if (len > 0) {
+        memcpy(msg.data, data, len);
+    }
+    xQueueSend(btc_queue, &msg, portMAX_DELAY);
+}
+
+static void post_gap(esp_gap_ble_cb_event_t event, const esp_ble_gap_cb_param_t *param) {
+    btc_msg_t msg = { .gap = true, .event = event, .param.gap = *param };
+    xQueueSend(btc_queue, &msg, portMAX_DELAY);
+}
+
+static void btc_task(void *arg) {
+    btc_msg_t msg;
+
+    while (1) {
+        xQueueReceive(btc_queue, &msg, portMAX_DELAY);
+        if (msg.gap) {
+            if (gap_callback) {
+                gap_callback(msg.event, &msg.param.gap);
+            }
+        } else if (gatts_callback) {
+            if (msg.event == ESP_GATTS_WRITE_EVT) {
+                msg.param.gatts.write.value = msg.data;
+            }
+            gatts_callback(msg.event, SIM_GATTS_IF, &msg.param.gatts);
+        }
+    }
+}
+
+// Air time of a PDU of len bytes: per fragment, the remote's packet (preamble, access
+// address, header, payload, CRC), the phone's empty reply and two inter-frame spaces
+static uint32_t pdu_air_us(const sim_link_t *link, uint16_t len) {
+    uint32_t payload = len + ATT_L2CAP_HEADER_LEN;
+    uint32_t fragments = (payload + link->tx_octets - 1) / link->tx_octets;
+
+    if (link->tx_phy == ESP_BLE_GAP_PHY_2M) {
+        return (payload + fragments * 11) * 4 + fragments * (2 * T_IFS_US + 11 * 4);
+    }
+    return (payload + fragments * 10) * 8 + fragments * (2 * T_IFS_US + 10 * 8);
+}
+
+// Drains one link buffer one connection event at a time
+static void controller_task(void *arg) {
+    int phone = (int)(intptr_t)arg;
+    sim_link_t *link = &links[phone];
+    sim_pdu_t on_air[LINK_BUF_LEN];
+
+    while (1) {
+        pthread_mutex_lock(&ble_lock);
+        int64_t interval = link->connected ? link->config.conn_interval_us : IDLE_POLL_US;
+        pthread_mutex_unlock(&ble_lock);
+        sim_sleep_until_us(esp_timer_get_time() + interval);
+
+        size_t n = 0;
+        bool uncongested = false;
+        bool updated = false;
+        bool phy_updated = false;
+        uint32_t event_us = 0;
+        esp_ble_gap_cb_param_t update_param = { 0 };
+        esp_ble_gap_cb_param_t phy_param = { 0 };
+        pthread_mutex_lock(&ble_lock);
+        if (link->connected && link->update_pending && esp_timer_get_time() >= link->update_at_us) {
+            // The phone picks the longest interval allowed, as iOS and Android do
+            link->update_pending = false;
+            updated = true;
+            update_param.update_conn_params = (struct ble_update_conn_params_evt_param) {
+                .min_int = link->update.min_int,
+                .max_int = link->update.max_int,
+                .latency = link->update.latency,
+                .timeout = link->update.timeout,
+            };
+            if (link->config.reject_conn_params) {
+                update_param.update_conn_params.status = HCI_ERR_UNACCEPTABLE_CONN_PARAMS;
+            } else {
+                link->config.conn_interval_us = link->update.max_int * 1250;
+            }
+            update_param.update_conn_params.conn_int = link->config.conn_interval_us / 1250;
+            memcpy(update_param.update_conn_params.bda, link->update.bda, sizeof(esp_bd_addr_t));
+        }
+        if (link->connected && link->phy_pending && esp_timer_get_time() >= link->phy_at_us) {
+            link->phy_pending = false;
+            phy_updated = true;
+            if (link->config.phy_2m) {
+                link->tx_phy = ESP_BLE_GAP_PHY_2M;
+                link->rx_phy = ESP_BLE_GAP_PHY_2M;
+            } else {
+                phy_param.phy_update.status = HCI_ERR_UNSUPPORTED_REMOTE_FEATURE;
+            }
+            phy_param.phy_update.tx_phy = link->tx_phy;
+            phy_param.phy_update.rx_phy = link->rx_phy;
+            sim_ble_phone_bda(phone, phy_param.phy_update.bda);
+        }
+        while (link->connected && link->count > 0 && n < link->config.pdus_per_event) {
+            // The first PDU always goes out; the ones after it only while air time is left
+            uint32_t pdu_us = pdu_air_us(link, link->pdus[link->head].len);
+            if (n > 0 && link->config.event_air_us > 0 && event_us + pdu_us > link->config.event_air_us) {
+                break;
+            }
+            event_us += pdu_us;
+            on_air[n++] = link->pdus[link->head];
+            link->head = (link->head + 1) % LINK_BUF_LEN;
+            link->count--;
+        }
+        link->air_us += event_us;
+        if (link->congested && link->count <= LINK_UNCONGEST_LEVEL) {
+            link->congested = false;
+            uncongested = true;
+        }
+        pthread_mutex_unlock(&ble_lock);
+
+        if (updated) {
+            sim_phone_count_conn_update(phone, update_param.update_conn_params.status != 0);
+            post_gap(ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, &update_param);
+        }
+        if (phy_updated) {
+            post_gap(ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT, &phy_param);
+        }
+        if (uncongested) {
+            esp_ble_gatts_cb_param_t param = { .congest = { .conn_id = phone, .congested = false } };
+            post_gatts(ESP_GATTS_CONGEST_EVT, &param, NULL, 0);
+        }
+        int64_t rx_us = esp_timer_get_time();
+        for (size_t i = 0; i < n; i++) {
+            sim_phone_receive(phone, on_air[i].handle, on_air[i].data, on_air[i].len, on_air[i].indicate, rx_us);
+        }
+    }
+}
+
+/*
+ * Controller and host stack lifecycle
+ */
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *cfg) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) {
+    for (int phone = 0; phone < SIM_PHONE_COUNT; phone++) {
+        if (xTaskCreate(controller_task, "btController", 3584, (void *)(intptr_t)phone, 23, NULL) != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_init(void) {
+    btc_queue = xQueueCreate(BTC_QUEUE_LEN, sizeof(btc_msg_t));
+    return btc_queue ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_bluedroid_enable(void) {
+    return xTaskCreate(btc_task, "BTC_TASK", 3072, NULL, 19, NULL) == pdPASS ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_bt_dev_set_device_name(const char *name) {
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu) {
+    if (mtu < ESP_GATT_DEF_BLE_MTU_SIZE || mtu > ESP_GATT_MAX_MTU_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    local_mtu = mtu;
+    return ESP_OK;
+}
+
+/*
+ * GAP
+ */
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback) {
+    gap_callback = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_config_adv_data(esp_ble_adv_data_t *adv_data) {
+    esp_ble_gap_cb_param_t param = { .adv_data_cmpl = { .status = 0 } };
+    post_gap(ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+// True if the data is a run of AD structures that fits a legacy advertisement
+static bool ad_valid(const uint8_t *data, uint32_t len) {
+    uint32_t pos = 0;
+
+    if (len > ADV_DATA_MAX_LEN) {
+        return false;
+    }
+    while (pos < len) {
+        if (data[pos] == 0 || pos + 1 + data[pos] > len) {
+            return false;
+        }
+        pos += 1 + data[pos];
+    }
+    return true;
+}
+
+// The controller rejects malformed data with an error status and keeps what it had
+static esp_bt_status_t set_ad(uint8_t *dst, size_t *dst_len, const uint8_t *data, uint32_t len) {
+    if (!ad_valid(data, len)) {
+        return ESP_BT_STATUS_FAIL;
+    }
+    pthread_mutex_lock(&ble_lock);
+    memcpy(dst, data, len);
+    *dst_len = len;
+    pthread_mutex_unlock(&ble_lock);
+    return ESP_BT_STATUS_SUCCESS;
+}
+
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t *raw_data, uint32_t raw_data_len) {
+    esp_ble_gap_cb_param_t param = {
+        .adv_data_raw_cmpl = { .status = set_ad(adv_data, &adv_data_len, raw_data, raw_data_len) }
+    };
+    post_gap(ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_config_scan_rsp_data_raw(uint8_t *raw_data, uint32_t raw_data_len) {
+    esp_ble_gap_cb_param_t param = {
+        .scan_rsp_data_raw_cmpl = { .status = set_ad(scan_rsp_data, &scan_rsp_data_len, raw_data, raw_data_len) }
+    };
+    post_gap(ESP_GAP_BLE_SCAN_RSP_DATA_RAW_SET_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t *adv_params_in) {
+    esp_ble_gap_cb_param_t param = { .adv_start_cmpl = { .status = 0 } };
+
+    pthread_mutex_lock(&ble_lock);
+    advertising = true;
+    adv_params = *adv_params_in;
+    if (adv_params.adv_type == ADV_TYPE_NONCONN_IND) {
+        broadcast_count++;
+        memcpy(broadcast_data, adv_data, adv_data_len);
+        broadcast_data_len = adv_data_len;
+    }
+    pthread_cond_broadcast(&advertising_changed);
+    pthread_mutex_unlock(&ble_lock);
+    post_gap(ESP_GAP_BLE_ADV_START_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_stop_advertising(void) {
+    esp_ble_gap_cb_param_t param = { .adv_stop_cmpl = { .status = 0 } };
+
+    pthread_mutex_lock(&ble_lock);
+    advertising = false;
+    pthread_mutex_unlock(&ble_lock);
+    post_gap(ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+// The update is answered once its instant passes, a few connection events later
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params) {
+    if (params->min_int > params->max_int) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ble_lock);
+    for (int phone = 0; phone < SIM_PHONE_COUNT; phone++) {
+        sim_link_t *link = &links[phone];
+        esp_bd_addr_t bda;
+        sim_ble_phone_bda(phone, bda);
+        if (link->connected && !link->update_pending && memcmp(bda, params->bda, sizeof(bda)) == 0) {
+            link->update_pending = true;
+            link->update = *params;
+            link->update_at_us = esp_timer_get_time() + (int64_t)UPDATE_INSTANT_EVENTS * link->config.conn_interval_us;
+        }
+    }
+    pthread_mutex_unlock(&ble_lock);
+    return ESP_OK;
+}
+
+// Returns the connected phone with the given address, or -1. Call with ble_lock held.
+static int find_link(const esp_bd_addr_t bda) {
+    for (int phone = 0; phone < SIM_PHONE_COUNT; phone++) {
+        esp_bd_addr_t phone_bda;
+        sim_ble_phone_bda(phone, phone_bda);
+        if (links[phone].connected && memcmp(phone_bda, bda, sizeof(phone_bda)) == 0) {
+            return phone;
+        }
+    }
+    return -1;
+}
+
+// The controller takes the request at once; the PHY update completes a few connection events later
+esp_err_t esp_ble_gap_set_preferred_phy(esp_bd_addr_t bd_addr, esp_ble_gap_all_phys_t all_phys_mask,
+                                        esp_ble_gap_phy_mask_t tx_phy_mask, esp_ble_gap_phy_mask_t rx_phy_mask,
+                                        esp_ble_gap_prefer_phy_options_t phy_options) {
+    esp_ble_gap_cb_param_t param = { .set_perf_phy = { .status = 0 } };
+
+    pthread_mutex_lock(&ble_lock);
+    int phone = find_link(bd_addr);
+    if (phone < 0) {
+        param.set_perf_phy.status = ESP_BT_STATUS_FAIL;
+    } else if ((tx_phy_mask & rx_phy_mask & ESP_BLE_GAP_PHY_2M_PREF_MASK) && !links[phone].phy_pending) {
+        links[phone].phy_pending = true;
+        links[phone].phy_at_us = esp_timer_get_time() +
+                                 (int64_t)UPDATE_INSTANT_EVENTS * links[phone].config.conn_interval_us;
+    }
+    pthread_mutex_unlock(&ble_lock);
+    post_gap(ESP_GAP_BLE_SET_PREFERRED_PHY_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+// A phone without data length extension never answers
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remote_device, uint16_t tx_data_length) {
+    esp_ble_gap_cb_param_t param = { 0 };
+
+    if (tx_data_length < LL_MIN_DATA_LEN || tx_data_length > LL_MAX_DATA_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&ble_lock);
+    int phone = find_link(remote_device);
+    bool answered = phone >= 0 && links[phone].config.max_data_len > LL_MIN_DATA_LEN;
+    if (answered) {
+        sim_link_t *link = &links[phone];
+        uint16_t phone_max = link->config.max_data_len < LL_MAX_DATA_LEN ? link->config.max_data_len : LL_MAX_DATA_LEN;
+        link->tx_octets = tx_data_length < phone_max ? tx_data_length : phone_max;
+        link->rx_octets = phone_max;
+        param.pkt_data_length_cmpl.params.tx_len = link->tx_octets;
+        param.pkt_data_length_cmpl.params.rx_len = link->rx_octets;
+    }
+    pthread_mutex_unlock(&ble_lock);
+    if (answered) {
+        post_gap(ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT, &param);
+    }
+    return ESP_OK;
+}
+
+static int find_accepted(const esp_bd_addr_t bda) {
+    for (size_t i = 0; i < accept_count; i++) {
+        if (memcmp(accept_list[i], bda, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+esp_err_t esp_ble_gap_update_whitelist(bool add_remove, esp_bd_addr_t remote_bda, esp_ble_wl_addr_type_t wl_addr_type) {
+    esp_ble_gap_cb_param_t param = {
+        .update_whitelist_cmpl = { .wl_operation = add_remove ? ESP_BLE_WHITELIST_ADD : ESP_BLE_WHITELIST_REMOVE },
+    };
+
+    pthread_mutex_lock(&ble_lock);
+    int i = find_accepted(remote_bda);
+    if (add_remove && i < 0) {
+        if (accept_count < SIM_ACCEPT_LIST_SIZE) {
+            memcpy(accept_list[accept_count++], remote_bda, sizeof(esp_bd_addr_t));
+        } else {
+            param.update_whitelist_cmpl.status = HCI_ERR_MEMORY_FULL;
+        }
+    } else if (!add_remove && i >= 0) {
+        memmove(accept_list[i], accept_list[i + 1], (--accept_count - i) * sizeof(esp_bd_addr_t));
+    }
+    pthread_mutex_unlock(&ble_lock);
+    post_gap(ESP_GAP_BLE_UPDATE_WHITELIST_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_get_whitelist_size(uint16_t *length) {
+    *length = SIM_ACCEPT_LIST_SIZE;
+    return ESP_OK;
+}
+
+/*
+ * Security manager
+ */
+
+esp_err_t esp_ble_gap_set_security_param(esp_ble_sm_param_t param_type, void *value, uint8_t len) {
+    return value != NULL && len > 0 ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// Call with ble_lock held
+static int find_bond(const esp_bd_addr_t bda) {
+    for (int i = 0; i < SIM_MAX_BONDS; i++) {
+        if (bonds[i].used && memcmp(bonds[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void post_auth(int phone, bool success, uint8_t reason) {
+    esp_ble_gap_cb_param_t param = {
+        .ble_security.auth_cmpl = {
+            .success = success,
+            .fail_reason = reason,
+            .addr_type = BLE_ADDR_TYPE_PUBLIC,
+            .auth_mode = ESP_LE_AUTH_REQ_SC_BOND,
+        },
+    };
+    sim_ble_phone_bda(phone, param.ble_security.auth_cmpl.bd_addr);
+    post_gap(ESP_GAP_BLE_AUTH_CMPL_EVT, &param);
+}
+
+esp_err_t esp_ble_set_encryption(esp_bd_addr_t bd_addr, esp_ble_sec_act_t sec_act) {
+    esp_ble_gap_cb_param_t param = { 0 };
+
+    pthread_mutex_lock(&ble_lock);
+    int phone = find_link(bd_addr);
+    if (phone < 0) {
+        pthread_mutex_unlock(&ble_lock);
+        return ESP_FAIL;
+    }
+    sim_link_t *link = &links[phone];
+    bool ignored = link->encrypted || link->config.ignore_security;
+    bool has_key = phone_keys[phone].valid;
+    int bond = find_bond(bd_addr);
+    bool match = has_key && bond >= 0 && memcmp(bonds[bond].ltk, phone_keys[phone].ltk, SIM_KEY_SIZE) == 0;
+    if (!ignored && match) {
+        link->encrypted = true;
+    }
+    pthread_mutex_unlock(&ble_lock);
+
+    if (ignored) {
+        return ESP_OK;
+    }
+    if (match) {
+        post_auth(phone, true, 0);
+        return ESP_OK;
+    }
+    if (has_key) {
+        post_auth(phone, false, HCI_ERR_KEY_MISSING);
+    }
+    memcpy(param.ble_security.ble_req.bd_addr, bd_addr, sizeof(esp_bd_addr_t));
+    post_gap(ESP_GAP_BLE_SEC_REQ_EVT, &param);
+    return ESP_OK;
+}
+
+// Answers the phone's pairing request; an accepted one completes at once with a new LTK
+esp_err_t esp_ble_gap_security_rsp(esp_bd_addr_t bd_addr, bool accept) {
+    uint8_t reason = accept ? 0 : SMP_PAIR_NOT_SUPPORT;
+
+    pthread_mutex_lock(&ble_lock);
+    int phone = find_link(bd_addr);
+    if (phone < 0) {
+        pthread_mutex_unlock(&ble_lock);
+        return ESP_FAIL;
+    }
+    int bond = find_bond(bd_addr);
+    for (int i = 0; i < SIM_MAX_BONDS && bond < 0; i++) {
+        bond = bonds[i].used ? -1 : i;
+    }
+    if (accept && bond < 0) {
+        reason = SMP_UNSPECIFIED;
+    } else if (accept) {
+        key_seed++;
+        bonds[bond].used = true;
+        memcpy(bonds[bond].bda, bd_addr, sizeof(esp_bd_addr_t));
+        for (int i = 0; i < SIM_KEY_SIZE; i++) {
+            bonds[bond].ltk[i] = (uint8_t)(key_seed * 31 + i);
+        }
+        phone_keys[phone].valid = true;
+        memcpy(phone_keys[phone].ltk, bonds[bond].ltk, SIM_KEY_SIZE);
+        phone_keys[phone].pairings++;
+        links[phone].encrypted = true;
+    }
+    pthread_mutex_unlock(&ble_lock);
+    post_auth(phone, reason == 0, reason);
+    return ESP_OK;
+}
+
+int esp_ble_get_bond_device_num(void) {
+    int count = 0;
+
+    pthread_mutex_lock(&ble_lock);
+    for (int i = 0; i < SIM_MAX_BONDS; i++) {
+        count += bonds[i].used;
+    }
+    pthread_mutex_unlock(&ble_lock);
+    return count;
+}
+
+// Phones hand out their identity key with a public identity address
+esp_err_t esp_ble_get_bond_device_list(int *dev_num, esp_ble_bond_dev_t *dev_list) {
+    int written = 0;
+
+    pthread_mutex_lock(&ble_lock);
+    for (int i = 0; i < SIM_MAX_BONDS && written < *dev_num; i++) {
+        if (!bonds[i].used) {
+            continue;
+        }
+        esp_ble_bond_dev_t *dev = &dev_list[written++];
+        *dev = (esp_ble_bond_dev_t) {
+            .bond_key = {
+                .key_mask = ESP_LE_KEY_PENC | ESP_LE_KEY_PID,
+                .penc_key = { .key_size = SIM_KEY_SIZE },
+                .pid_key = { .addr_type = BLE_ADDR_TYPE_PUBLIC },
+            },
+        };
+        memcpy(dev->bd_addr, bonds[i].bda, sizeof(esp_bd_addr_t));
+        memcpy(dev->bond_key.penc_key.ltk, bonds[i].ltk, SIM_KEY_SIZE);
+        memcpy(dev->bond_key.pid_key.irk, bonds[i].bda, sizeof(esp_bd_addr_t));
+        memcpy(dev->bond_key.pid_key.static_addr, bonds[i].bda, sizeof(esp_bd_addr_t));
+    }
+    pthread_mutex_unlock(&ble_lock);
+    *dev_num = written;
+    return ESP_OK;
+}
+
+// As Bluedroid, a connected phone is disconnected along with its bond
+esp_err_t esp_ble_remove_bond_device(esp_bd_addr_t bd_addr) {
+    pthread_mutex_lock(&ble_lock);
+    int bond = find_bond(bd_addr);
+    if (bond >= 0) {
+        bonds[bond].used = false;
+    }
+    int phone = find_link(bd_addr);
+    pthread_mutex_unlock(&ble_lock);
+    if (bond < 0) {
+        return ESP_FAIL;
+    }
+    if (phone >= 0) {
+        sim_ble_link_down(phone);
+    }
+    return ESP_OK;
+}
+
+void sim_ble_phone_forget_keys(int phone) {
+    pthread_mutex_lock(&ble_lock);
+    phone_keys[phone].valid = false;
+    pthread_mutex_unlock(&ble_lock);
+}
+
+void sim_ble_refuse_sends(int phone, uint32_t count) {
+    pthread_mutex_lock(&ble_lock);
+    refused_sends[phone] = count;
+    pthread_mutex_unlock(&ble_lock);
+}
+
+void sim_ble_forget_bonds(void) {
+    pthread_mutex_lock(&ble_lock);
+    memset(bonds, 0, sizeof(bonds));
+    pthread_mutex_unlock(&ble_lock);
+}
+
+bool sim_ble_bonded(int phone) {
+    esp_bd_addr_t bda;
+
+    sim_ble_phone_bda(phone, bda);
+    pthread_mutex_lock(&ble_lock);
+    bool bonded = find_bond(bda) >= 0;
+    pthread_mutex_unlock(&ble_lock);
+    return bonded;
+}
+
+uint32_t sim_ble_pairings(int phone) {
+    pthread_mutex_lock(&ble_lock);
+    uint32_t pairings = phone_keys[phone].pairings;
+    pthread_mutex_unlock(&ble_lock);
+    return pairings;
+}
+
+/*
+ * GATT server
+ */
+
+esp_err_t esp_ble_gatts_register_callback(esp_gatts_cb_t callback) {
+    gatts_callback = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_app_register(uint16_t app_id) {
+    esp_ble_gatts_cb_param_t param = { .reg = { .status = ESP_GATT_OK, .app_id = app_id } };
+    post_gatts(ESP_GATTS_REG_EVT, &param, NULL, 0);
+    return ESP_OK;
+}
+
+// Handles are assigned in table order; a row after a characteristic declaration is its value
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t *gatts_attr_db, esp_gatt_if_t gatts_if,
+                                        uint16_t max_nb_attr, uint8_t srvc_inst_id) {
+    static uint16_t tab_handles[MAX_ATTRS];
+    esp_ble_gatts_cb_param_t param = {
+        .add_attr_tab = { .status = ESP_GATT_OK, .svc_inst_id = srvc_inst_id, .handles = tab_handles },
+    };
+    bool value_next = false;
+
+    pthread_mutex_lock(&ble_lock);
+    if (attr_count + max_nb_attr > MAX_ATTRS) {
+        pthread_mutex_unlock(&ble_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint16_t i = 0; i < max_nb_attr; i++) {
+        const esp_attr_desc_t *desc = &gatts_attr_db[i].att_desc;
+        esp_bt_uuid_t uuid = { .len = desc->uuid_length };
+        memcpy(uuid.uuid.uuid128, desc->uuid_p, desc->uuid_length);
+        uint16_t handle = next_handle++;
+        tab_handles[i] = handle;
+        if (value_next) {
+            last_char = handle;
+            attrs[attr_count++] = (sim_attr_t) { .handle = handle, .uuid = uuid };
+        } else if (uuid.len == ESP_UUID_LEN_16 && uuid.uuid.uuid16 == ESP_GATT_UUID_CHAR_CLIENT_CONFIG) {
+            attrs[attr_count++] = (sim_attr_t) { .handle = handle, .uuid = uuid, .descr = true, .char_handle = last_char };
+        }
+        value_next = uuid.len == ESP_UUID_LEN_16 && uuid.uuid.uuid16 == ESP_GATT_UUID_CHAR_DECLARE;
+    }
+    param.add_attr_tab.num_handle = max_nb_attr;
+    pthread_mutex_unlock(&ble_lock);
+    post_gatts(ESP_GATTS_CREAT_ATTR_TAB_EVT, &param, NULL, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_start_service(uint16_t service_handle) {
+    esp_ble_gatts_cb_param_t param = { .start = { .status = ESP_GATT_OK, .service_handle = service_handle } };
+    post_gatts(ESP_GATTS_START_EVT, &param, NULL, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t attr_handle,
+                                      uint16_t value_len, uint8_t *value, bool need_confirm) {
+    bool congested = false;
+
+    if (conn_id >= SIM_PHONE_COUNT) {
+        return ESP_FAIL;
+    }
+    sim_link_t *link = &links[conn_id];
+    pthread_mutex_lock(&ble_lock);
+    if (!link->connected || link->count == LINK_BUF_LEN || refused_sends[conn_id] > 0) {
+        if (refused_sends[conn_id] > 0) {
+            refused_sends[conn_id]--;
+        }
+        pthread_mutex_unlock(&ble_lock);
+        sim_phone_count_link_event(conn_id, false, true, false);
+        return ESP_FAIL;
+    }
+    bool oversize = value_len > link->mtu - 3;
+    if (oversize) {
+        value_len = link->mtu - 3;  // Bluedroid truncates to the MTU
+    }
+    sim_pdu_t *pdu = &link->pdus[(link->head + link->count++) % LINK_BUF_LEN];
+    pdu->handle = attr_handle;
+    pdu->len = value_len;
+    pdu->indicate = need_confirm;
+    memcpy(pdu->data, value, value_len);
+    if (!link->congested && link->count >= LINK_CONGEST_LEVEL) {
+        link->congested = congested = true;
+    }
+    pthread_mutex_unlock(&ble_lock);
+
+    sim_phone_count_link_event(conn_id, oversize, false, congested);
+    if (congested) {
+        esp_ble_gatts_cb_param_t param = { .congest = { .conn_id = conn_id, .congested = true } };
+        post_gatts(ESP_GATTS_CONGEST_EVT, &param, NULL, 0);
+    }
+    if (!need_confirm) {
+        // Bluedroid reports notifications as sent once L2CAP has taken them
+        esp_ble_gatts_cb_param_t param = {
+            .conf = { .status = ESP_GATT_OK, .conn_id = conn_id, .handle = attr_handle },
+        };
+        post_gatts(ESP_GATTS_CONF_EVT, &param, NULL, 0);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_send_response(esp_gatt_if_t gatts_if, uint16_t conn_id, uint32_t trans_id,
+                                      esp_gatt_status_t status, esp_gatt_rsp_t *rsp) {
+    pthread_mutex_lock(&ble_lock);
+    if (trans_id == awaited_trans_id) {
+        response_received = true;
+        response_status = status;
+        if (rsp != NULL) {
+            response = *rsp;
+        }
+        pthread_cond_broadcast(&response_ready);
+    }
+    pthread_mutex_unlock(&ble_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_close(esp_gatt_if_t gatts_if, uint16_t conn_id) {
+    if (conn_id < SIM_PHONE_COUNT) {
+        sim_ble_link_down(conn_id);
+    }
+    return ESP_OK;
+}
+
+/*
+ * Phone side
+ */
+
+static void deadline_after(uint32_t timeout_ms, struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+bool sim_ble_wait_advertising(uint32_t timeout_ms) {
+    struct timespec deadline;
+    bool ok = true;
+
+    deadline_after(timeout_ms, &deadline);
+    pthread_mutex_lock(&ble_lock);
+    while (!advertising && ok) {
+        ok = pthread_cond_timedwait(&advertising_changed, &ble_lock, &deadline) == 0;
+    }
+    ok = advertising;
+    pthread_mutex_unlock(&ble_lock);
+    return ok;
+}
+
+static uint16_t find_char(uint16_t uuid_tail) {
+    for (size_t i = 0; i < attr_count; i++) {
+        const sim_attr_t *attr = &attrs[i];
+        if (!attr->descr && attr->uuid.len == ESP_UUID_LEN_128 &&
+            (attr->uuid.uuid.uuid128[12] | attr->uuid.uuid.uuid128[13] << 8) == uuid_tail) {
+            return attr->handle;
+        }
+    }
+    return 0;
+}
+
+uint16_t sim_ble_char_handle(uint16_t uuid_tail) {
+    pthread_mutex_lock(&ble_lock);
+    uint16_t handle = find_char(uuid_tail);
+    pthread_mutex_unlock(&ble_lock);
+    return handle;
+}
+
+uint16_t sim_ble_cccd_handle(uint16_t uuid_tail) {
+    uint16_t handle = 0;
+
+    pthread_mutex_lock(&ble_lock);
+    uint16_t char_handle = find_char(uuid_tail);
+    for (size_t i = 0; char_handle != 0 && i < attr_count; i++) {
+        if (attrs[i].descr && attrs[i].char_handle == char_handle &&
+            attrs[i].uuid.uuid.uuid16 == ESP_GATT_UUID_CHAR_CLIENT_CONFIG) {
+            handle = attrs[i].handle;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ble_lock);
+    return handle;
+}
+
+bool sim_ble_link_up(int phone, const sim_phone_config_t *config) {
+    sim_link_t *link = &links[phone];
+    esp_ble_gatts_cb_param_t param = {
+        .connect = {
+            .conn_id = phone,
+            .conn_params = { .interval = config->conn_interval_us / 1250, .latency = 0, .timeout = 400 },
+            .ble_addr_type = BLE_ADDR_TYPE_PUBLIC,
+        },
+    };
+    sim_ble_phone_bda(phone, param.connect.remote_bda);
+
+    pthread_mutex_lock(&ble_lock);
+    bool filtered = adv_params.adv_filter_policy == ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST ||
+                    adv_params.adv_filter_policy == ADV_FILTER_ALLOW_SCAN_WLST_CON_WLST;
+    if (advertising && adv_params.adv_type == ADV_TYPE_IND && filtered &&
+        find_accepted(param.connect.remote_bda) < 0) {
+        // The controller ignores the connection request
+        pthread_mutex_unlock(&ble_lock);
+        return false;
+    }
+    link->connected = true;
+    link->congested = false;
+    link->mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+    link->config = *config;
+    link->head = 0;
+    link->count = 0;
+    link->update_pending = false;
+    link->phy_pending = false;
+    link->tx_phy = ESP_BLE_GAP_PHY_1M;
+    link->rx_phy = ESP_BLE_GAP_PHY_1M;
+    link->tx_octets = LL_MIN_DATA_LEN;
+    link->rx_octets = LL_MIN_DATA_LEN;
+    link->air_us = 0;
+    link->encrypted = false;
+    advertising = false;
+    pthread_mutex_unlock(&ble_lock);
+    post_gatts(ESP_GATTS_CONNECT_EVT, &param, NULL, 0);
+    return true;
+}
+
+bool sim_ble_adv_params(esp_ble_adv_params_t *params) {
+    pthread_mutex_lock(&ble_lock);
+    bool on = advertising;
+    *params = adv_params;
+    pthread_mutex_unlock(&ble_lock);
+    return on;
+}
+
+void sim_ble_adv_data(uint8_t *adv, size_t *adv_len, uint8_t *scan_rsp, size_t *scan_rsp_len) {
+    pthread_mutex_lock(&ble_lock);
+    memcpy(adv, adv_data, adv_data_len);
+    *adv_len = adv_data_len;
+    memcpy(scan_rsp, scan_rsp_data, scan_rsp_data_len);
+    *scan_rsp_len = scan_rsp_data_len;
+    pthread_mutex_unlock(&ble_lock);
+}
+
+uint32_t sim_ble_broadcasts(uint8_t *data, size_t *len) {
+    pthread_mutex_lock(&ble_lock);
+    uint32_t count = broadcast_count;
+    memcpy(data, broadcast_data, broadcast_data_len);
+    *len = broadcast_data_len;
+    pthread_mutex_unlock(&ble_lock);
+    return count;
+}
+
+uint32_t sim_ble_conn_interval_us_at(int phone) {
+    pthread_mutex_lock(&ble_lock);
+    uint32_t interval = links[phone].connected ? links[phone].config.conn_interval_us : 0;
+    pthread_mutex_unlock(&ble_lock);
+    return interval;
+}
+
+bool sim_ble_link_info(int phone, sim_link_info_t *info) {
+    pthread_mutex_lock(&ble_lock);
+    const sim_link_t *link = &links[phone];
+    bool connected = link->connected;
+    *info = (sim_link_info_t) {
+        .tx_phy = link->tx_phy,
+        .rx_phy = link->rx_phy,
+        .tx_octets = link->tx_octets,
+        .rx_octets = link->rx_octets,
+        .air_us = link->air_us,
+        .queued = link->count,
+        .encrypted = link->encrypted,
+    };
+    pthread_mutex_unlock(&ble_lock);
+    return connected;
+}
+
+uint32_t sim_ble_conn_interval_us(void) {
+    return sim_ble_conn_interval_us_at(0);
+}
+
+void sim_ble_link_down(int phone) {
+    sim_link_t *link = &links[phone];
+    esp_ble_gatts_cb_param_t param = {
+        .disconnect = { .conn_id = phone, .reason = ESP_GATT_CONN_TIMEOUT },
+    };
+    sim_ble_phone_bda(phone, param.disconnect.remote_bda);
+
+    pthread_mutex_lock(&ble_lock);
+    bool was_connected = link->connected;
+    link->connected = false;
+    link->congested = false;
+    link->count = 0;
+    pthread_mutex_unlock(&ble_lock);
+    if (was_connected) {
+        post_gatts(ESP_GATTS_DISCONNECT_EVT, &param, NULL, 0);
+    }
+}
+
+void sim_ble_mtu_exchange(int phone, uint16_t mtu) {
+    esp_ble_gatts_cb_param_t param = { .mtu = { .conn_id = phone } };
+
+    pthread_mutex_lock(&ble_lock);
+    links[phone].mtu = mtu < local_mtu ? mtu : local_mtu;
+    param.mtu.mtu = links[phone].mtu;
+    pthread_mutex_unlock(&ble_lock);
+    post_gatts(ESP_GATTS_MTU_EVT, &param, NULL, 0);
+}
+
+void sim_ble_phone_write(int phone, uint16_t handle, const void *data, uint16_t len) {
+    esp_ble_gatts_cb_param_t param = {
+        .write = { .conn_id = phone, .handle = handle, .need_rsp = true, .len = len },
+    };
+    sim_ble_phone_bda(phone, param.write.bda);
+
+    pthread_mutex_lock(&ble_lock);
+    bool connected = links[phone].connected;
+    param.write.trans_id = ++trans_id;
+    pthread_mutex_unlock(&ble_lock);
+    if (connected && len <= ESP_GATT_MAX_ATTR_LEN) {
+        post_gatts(ESP_GATTS_WRITE_EVT, &param, data, len);
+    }
+}
+
+void sim_ble_confirm(int phone, uint16_t handle) {
+    esp_ble_gatts_cb_param_t param = {
+        .conf = { .status = ESP_GATT_OK, .conn_id = phone, .handle = handle },
+    };
+
+    pthread_mutex_lock(&ble_lock);
+    bool connected = links[phone].connected;
+    pthread_mutex_unlock(&ble_lock);
+    if (connected) {
+        post_gatts(ESP_GATTS_CONF_EVT, &param, NULL, 0);
+    }
+}
+
+uint16_t sim_ble_mtu(int phone) {
+    pthread_mutex_lock(&ble_lock);
+    uint16_t mtu = links[phone].mtu;
+    pthread_mutex_unlock(&ble_lock);
+    return mtu;
+}
+
+// Posts a request and waits for the firmware to answer it; ESP_GATT_ERROR if it does not
+static esp_gatt_status_t request(int phone, esp_gatts_cb_event_t event, esp_ble_gatts_cb_param_t *param,
+                                 uint32_t *param_trans_id, const void *data, uint16_t len, esp_gatt_rsp_t *rsp) {
+    struct timespec deadline;
+    esp_gatt_status_t status = ESP_GATT_ERROR;
+
+    pthread_mutex_lock(&ble_lock);
+    if (!links[phone].connected) {
+        pthread_mutex_unlock(&ble_lock);
+        return ESP_GATT_ERROR;
+    }
+    *param_trans_id = ++trans_id;
+    awaited_trans_id = trans_id;
+    response_received = false;
+    pthread_mutex_unlock(&ble_lock);
+
+    post_gatts(event, param, data, len);
+
+    deadline_after(RESPONSE_TIMEOUT_MS, &deadline);
+    pthread_mutex_lock(&ble_lock);
+    while (!response_received && pthread_cond_timedwait(&response_ready, &ble_lock, &deadline) == 0) {
+    }
+    if (response_received) {
+        status = response_status;
+        if (rsp != NULL) {
+            *rsp = response;
+        }
+    }
+    awaited_trans_id = 0;
+    pthread_mutex_unlock(&ble_lock);
+    return status;
+}
+
+esp_gatt_status_t sim_ble_phone_prepare_write(int phone, uint16_t handle, uint16_t offset, const void *data,
+                                              uint16_t len) {
+    esp_ble_gatts_cb_param_t param = {
+        .write = { .conn_id = phone, .handle = handle, .offset = offset, .need_rsp = true, .is_prep = true,
+                   .len = len },
+    };
+    esp_gatt_rsp_t rsp = {};
+    sim_ble_phone_bda(phone, param.write.bda);
+
+    if (len > ESP_GATT_MAX_ATTR_LEN) {
+        return ESP_GATT_INVALID_ATTR_LEN;
+    }
+    esp_gatt_status_t status = request(phone, ESP_GATTS_WRITE_EVT, &param, &param.write.trans_id, data, len, &rsp);
+    if (status == ESP_GATT_OK &&
+        (rsp.attr_value.offset != offset || rsp.attr_value.len != len || memcmp(rsp.attr_value.value, data, len) != 0)) {
+        return ESP_GATT_ERROR;  // The phone checks the echo and aborts on a mismatch
+    }
+    return status;
+}
+
+esp_gatt_status_t sim_ble_phone_execute_write(int phone, bool execute) {
+    esp_ble_gatts_cb_param_t param = {
+        .exec_write = {
+            .conn_id = phone,
+            .exec_write_flag = execute ? ESP_GATT_PREP_WRITE_EXEC : ESP_GATT_PREP_WRITE_CANCEL,
+        },
+    };
+    sim_ble_phone_bda(phone, param.exec_write.bda);
+
+    return request(phone, ESP_GATTS_EXEC_WRITE_EVT, &param, &param.exec_write.trans_id, NULL, 0, NULL);
+}
+
+esp_gatt_status_t sim_ble_phone_read(int phone, uint16_t handle, uint16_t offset, uint8_t *data, uint16_t *len) {
+    esp_ble_gatts_cb_param_t param = {
+        .read = { .conn_id = phone, .handle = handle, .offset = offset, .is_long = offset > 0, .need_rsp = true },
+    };
+    esp_gatt_rsp_t rsp = {};
+    sim_ble_phone_bda(phone, param.read.bda);
+
+    esp_gatt_status_t status = request(phone, ESP_GATTS_READ_EVT, &param, &param.read.trans_id, NULL, 0, &rsp);
+    if (status == ESP_GATT_OK) {
+        *len = rsp.attr_value.len;
+        memcpy(data, rsp.attr_value.value, rsp.attr_value.len);
+    }
+    return status;
+}
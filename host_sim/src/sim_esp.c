@@ -0,0 +1,271 @@
+/**
+ * @file sim_esp.c
+ * @brief esp_timer, logging, heap, reset, partition and power management APIs for the host simulator.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "sim.h"
+
+#define SIM_HEAP_SIZE   (200 * 1024)
+
+typedef struct {
+    esp_partition_t info;
+    uint8_t *data;
+} sim_partition_t;
+
+// Data partitions from partitions.csv that the firmware opens by label
+static sim_partition_t partitions[] = {
+    { .info = { .type = ESP_PARTITION_TYPE_DATA, .subtype = 0x40, .address = 0x1C0000, .size = 0x40000,
+                .erase_size = 4096, .label = "flightrec" } },
+};
+
+struct esp_pm_lock {
+    esp_pm_lock_type_t type;
+    int count;
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pm_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pm_held[ESP_PM_NO_LIGHT_SLEEP + 1];  // Acquisitions outstanding per lock type
+static esp_log_level_t log_level = ESP_LOG_WARN;
+static struct timespec start;
+
+__attribute__((constructor))
+static void sim_esp_init(void) {
+    static const char levels[] = "NEWIDV";
+    const char *env = getenv("BT_SIM_LOG");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (env != NULL && env[0] != '\0') {
+        const char *level = strchr(levels, env[0]);
+        if (level != NULL) {
+            log_level = (esp_log_level_t)(level - levels);
+        }
+    }
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+void sim_sleep_until_us(int64_t t_us) {
+    int64_t delay_us = t_us - esp_timer_get_time();
+    if (delay_us <= 0) {
+        return;
+    }
+    struct timespec ts = { .tv_sec = delay_us / 1000000, .tv_nsec = (delay_us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+void sim_sleep_ms(uint32_t ms) {
+    sim_sleep_until_us(esp_timer_get_time() + (int64_t)ms * 1000);
+}
+
+void sim_log(esp_log_level_t level, const char *tag, const char *fmt, ...) {
+    static const char letters[] = "NEWIDV";
+    va_list args;
+
+    if (level > log_level) {
+        return;
+    }
+    pthread_mutex_lock(&log_lock);
+    fprintf(stderr, "%c (%lld) %s: ", letters[level], (long long)(esp_timer_get_time() / 1000), tag);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+    pthread_mutex_unlock(&log_lock);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+        case ESP_ERR_NVS_NOT_ENOUGH_SPACE: return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+        case ESP_ERR_NVS_INVALID_HANDLE: return "ESP_ERR_NVS_INVALID_HANDLE";
+        case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    return SIM_HEAP_SIZE;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+    return SIM_HEAP_SIZE;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return SIM_HEAP_SIZE;
+}
+
+esp_reset_reason_t esp_reset_reason(void) {
+    return ESP_RST_POWERON;
+}
+
+void esp_restart(void) {
+    fprintf(stderr, "esp_restart() called\n");
+    exit(EXIT_FAILURE);
+}
+
+// The firmware is built with settimeofday=sim_settimeofday so it never sets the host clock
+int sim_settimeofday(const struct timeval *tv, const struct timezone *tz) {
+    return 0;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label) {
+    for (size_t i = 0; i < sizeof(partitions) / sizeof(partitions[0]); i++) {
+        sim_partition_t *part = &partitions[i];
+        if (part->info.type != type ||
+            (subtype != ESP_PARTITION_SUBTYPE_ANY && part->info.subtype != subtype) ||
+            (label != NULL && strcmp(part->info.label, label) != 0)) {
+            continue;
+        }
+        if (part->data == NULL) {
+            part->data = malloc(part->info.size);
+            if (part->data == NULL) {
+                return NULL;
+            }
+            memset(part->data, 0xFF, part->info.size);
+        }
+        return &part->info;
+    }
+    return NULL;
+}
+
+static uint8_t *partition_data(const esp_partition_t *partition, size_t offset, size_t size) {
+    sim_partition_t *part = (sim_partition_t *)partition;
+    if (offset + size > part->info.size || offset + size < offset) {
+        return NULL;
+    }
+    return part->data + offset;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size) {
+    uint8_t *src = partition_data(partition, src_offset, size);
+    if (src == NULL) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, src, size);
+    return ESP_OK;
+}
+
+// NOR flash can only clear bits
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size) {
+    uint8_t *dst = partition_data(partition, dst_offset, size);
+    if (dst == NULL) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t i = 0; i < size; i++) {
+        dst[i] &= ((const uint8_t *)src)[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+    uint8_t *dst = partition_data(partition, offset, size);
+    if (dst == NULL || offset % partition->erase_size != 0 || size % partition->erase_size != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(dst, 0xFF, size);
+    return ESP_OK;
+}
+
+bool sim_partition_save(const char *label, const char *path) {
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                                label);
+    if (partition == NULL) {
+        return false;
+    }
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fwrite(((sim_partition_t *)partition)->data, 1, partition->size, file) == partition->size;
+    return fclose(file) == 0 && ok;
+}
+
+esp_err_t esp_pm_configure(const void *config) {
+    const esp_pm_config_t *pm = config;
+    return pm->min_freq_mhz <= pm->max_freq_mhz ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char *name,
+                             esp_pm_lock_handle_t *out_handle) {
+    struct esp_pm_lock *lock = calloc(1, sizeof(*lock));
+    if (lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    lock->type = lock_type;
+    *out_handle = lock;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle) {
+    pthread_mutex_lock(&pm_lock);
+    handle->count++;
+    pm_held[handle->type]++;
+    pthread_mutex_unlock(&pm_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle) {
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&pm_lock);
+    if (handle->count == 0) {
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        handle->count--;
+        pm_held[handle->type]--;
+    }
+    pthread_mutex_unlock(&pm_lock);
+    return err;
+}
+
+esp_err_t esp_pm_dump_locks(FILE *stream) {
+    pthread_mutex_lock(&pm_lock);
+    fprintf(stream, "CPU_FREQ_MAX %d, NO_LIGHT_SLEEP %d\n", pm_held[ESP_PM_CPU_FREQ_MAX],
+            pm_held[ESP_PM_NO_LIGHT_SLEEP]);
+    pthread_mutex_unlock(&pm_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_gpio_wakeup(void) {
+    return ESP_OK;
+}
+
+int sim_pm_held(esp_pm_lock_type_t type) {
+    pthread_mutex_lock(&pm_lock);
+    int held = pm_held[type];
+    pthread_mutex_unlock(&pm_lock);
+    return held;
+}
@@ -0,0 +1,545 @@
+/**
+ * @file sim_freertos.c
+ * @brief FreeRTOS tasks, queues, semaphores and software timers on POSIX threads.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_timer.h"
+#include "sim.h"
+
+#define TICK_US (1000000 / configTICK_RATE_HZ)
+
+struct sim_task {
+    char name[16];
+    TaskFunction_t fn;
+    void *arg;
+    uint32_t stack_depth;
+    UBaseType_t priority;
+    pthread_t thread;
+    struct sim_task *next;
+};
+
+struct sim_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t *items;
+    size_t item_size;
+    size_t length;
+    size_t head;
+    size_t count;
+};
+
+struct sim_semaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+struct sim_timer {
+    char name[16];
+    TickType_t period;
+    bool auto_reload;
+    void *id;
+    TimerCallbackFunction_t callback;
+    bool active;
+    int64_t expiry_us;
+    struct sim_timer *next;
+};
+
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_task *tasks;
+static __thread struct sim_task *current_task;
+static __thread bool in_isr;
+
+static pthread_mutex_t critical_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timers_changed;
+static pthread_once_t timers_once = PTHREAD_ONCE_INIT;
+static struct sim_timer *timers;
+
+#define PENDED_CALLS_LEN 16
+
+typedef struct {
+    PendedFunction_t fn;
+    void *arg1;
+    uint32_t arg2;
+} pended_call_t;
+
+static pended_call_t pended_calls[PENDED_CALLS_LEN];
+static size_t pended_head;
+static size_t pended_count;
+
+static void init_cond(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// esp_timer_get_time() counts from the first call; convert to a CLOCK_MONOTONIC deadline
+static struct timespec deadline_after_us(int64_t delay_us) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t ns = ts.tv_nsec + (delay_us % 1000000) * 1000;
+    ts.tv_sec += delay_us / 1000000 + ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
+}
+
+// Waits on cond for up to wait ticks. Returns false on timeout.
+static bool wait_ticks(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t wait) {
+    if (wait == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    struct timespec deadline = deadline_after_us((int64_t)wait * TICK_US);
+    return pthread_cond_timedwait(cond, lock, &deadline) != ETIMEDOUT;
+}
+
+/*
+ * Critical sections and interrupt context
+ */
+
+void sim_critical_enter(void) {
+    pthread_mutex_lock(&critical_lock);
+}
+
+void sim_critical_exit(void) {
+    pthread_mutex_unlock(&critical_lock);
+}
+
+void sim_set_isr_context(bool isr) {
+    in_isr = isr;
+}
+
+BaseType_t xPortInIsrContext(void) {
+    return in_isr;
+}
+
+BaseType_t xPortGetCoreID(void) {
+    return 0;
+}
+
+/*
+ * Tasks
+ */
+
+static void *task_entry(void *arg) {
+    struct sim_task *task = arg;
+    current_task = task;
+    task->fn(task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core_id) {
+    struct sim_task *task = calloc(1, sizeof(*task));
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    strncpy(task->name, name, sizeof(task->name) - 1);
+    task->fn = fn;
+    task->arg = arg;
+    task->stack_depth = stack_depth;
+    task->priority = priority;
+
+    pthread_mutex_lock(&tasks_lock);
+    task->next = tasks;
+    tasks = task;
+    pthread_mutex_unlock(&tasks_lock);
+
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0) {
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (created) {
+        *created = task;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created) {
+    return xTaskCreatePinnedToCore(fn, name, stack_depth, arg, priority, created, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == current_task) {
+        pthread_exit(NULL);
+    }
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(esp_timer_get_time() / TICK_US);
+}
+
+TickType_t xTaskGetTickCountFromISR(void) {
+    return xTaskGetTickCount();
+}
+
+void vTaskDelay(TickType_t ticks) {
+    sim_sleep_until_us(esp_timer_get_time() + (int64_t)ticks * TICK_US);
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t increment) {
+    *previous_wake += increment;
+    sim_sleep_until_us((int64_t)*previous_wake * TICK_US);
+}
+
+TaskHandle_t xTaskGetHandle(const char *name) {
+    struct sim_task *task;
+
+    pthread_mutex_lock(&tasks_lock);
+    for (task = tasks; task != NULL; task = task->next) {
+        if (strcmp(task->name, name) == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tasks_lock);
+    return task;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return current_task;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    task = task ? task : current_task;
+    return task ? task->stack_depth : 0;
+}
+
+/*
+ * Queues
+ */
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    struct sim_queue *queue = calloc(1, sizeof(*queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->items = calloc(length, item_size);
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->item_size = item_size;
+    queue->length = length;
+    pthread_mutex_init(&queue->lock, NULL);
+    init_cond(&queue->changed);
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    free(queue->items);
+    free(queue);
+}
+
+static BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t wait, bool front) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length) {
+        if (wait == 0 || !wait_ticks(&queue->changed, &queue->lock, wait)) {
+            pthread_mutex_unlock(&queue->lock);
+            return pdFALSE;
+        }
+    }
+    size_t slot;
+    if (front) {
+        queue->head = (queue->head + queue->length - 1) % queue->length;
+        slot = queue->head;
+    } else {
+        slot = (queue->head + queue->count) % queue->length;
+    }
+    memcpy(queue->items + slot * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait) {
+    return queue_send(queue, item, wait, false);
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t wait) {
+    return queue_send(queue, item, wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t wait) {
+    return queue_send(queue, item, wait, true);
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *woken) {
+    if (woken) {
+        *woken = pdFALSE;
+    }
+    return queue_send(queue, item, 0, false);
+}
+
+BaseType_t xQueueSendToFrontFromISR(QueueHandle_t queue, const void *item, BaseType_t *woken) {
+    if (woken) {
+        *woken = pdFALSE;
+    }
+    return queue_send(queue, item, 0, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        if (wait == 0 || !wait_ticks(&queue->changed, &queue->lock, wait)) {
+            pthread_mutex_unlock(&queue->lock);
+            return pdFALSE;
+        }
+    }
+    memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+UBaseType_t uxQueueMessagesWaitingFromISR(QueueHandle_t queue) {
+    return uxQueueMessagesWaiting(queue);
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+    return queue->length - uxQueueMessagesWaiting(queue);
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->head = 0;
+    queue->count = 0;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+/*
+ * Semaphores
+ */
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    struct sim_semaphore *sem = calloc(1, sizeof(*sem));
+    if (sem == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&sem->lock, NULL);
+    init_cond(&sem->changed);
+    sem->count = initial_count;
+    sem->max = max_count;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    free(sem);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait) {
+    pthread_mutex_lock(&sem->lock);
+    while (sem->count == 0) {
+        if (wait == 0 || !wait_ticks(&sem->changed, &sem->lock, wait)) {
+            pthread_mutex_unlock(&sem->lock);
+            return pdFALSE;
+        }
+    }
+    sem->count--;
+    pthread_mutex_unlock(&sem->lock);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    BaseType_t given = pdFALSE;
+
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count < sem->max) {
+        sem->count++;
+        given = pdTRUE;
+        pthread_cond_broadcast(&sem->changed);
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return given;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken) {
+    if (woken) {
+        *woken = pdFALSE;
+    }
+    return xSemaphoreGive(sem);
+}
+
+/*
+ * Software timers
+ */
+
+static void timer_task(void *arg) {
+    pthread_mutex_lock(&timers_lock);
+    while (1) {
+        if (pended_count > 0) {
+            pended_call_t call = pended_calls[pended_head];
+            pended_head = (pended_head + 1) % PENDED_CALLS_LEN;
+            pended_count--;
+            pthread_mutex_unlock(&timers_lock);
+            call.fn(call.arg1, call.arg2);
+            pthread_mutex_lock(&timers_lock);
+            continue;
+        }
+
+        int64_t now = esp_timer_get_time();
+        struct sim_timer *due = NULL;
+        int64_t next = INT64_MAX;
+
+        for (struct sim_timer *timer = timers; timer != NULL; timer = timer->next) {
+            if (!timer->active) {
+                continue;
+            }
+            if (timer->expiry_us <= now) {
+                due = timer;
+                break;
+            }
+            if (timer->expiry_us < next) {
+                next = timer->expiry_us;
+            }
+        }
+
+        if (due != NULL) {
+            if (due->auto_reload) {
+                due->expiry_us += (int64_t)due->period * TICK_US;
+            } else {
+                due->active = false;
+            }
+            pthread_mutex_unlock(&timers_lock);
+            due->callback(due);
+            pthread_mutex_lock(&timers_lock);
+        } else if (next == INT64_MAX) {
+            pthread_cond_wait(&timers_changed, &timers_lock);
+        } else {
+            struct timespec deadline = deadline_after_us(next - now);
+            pthread_cond_timedwait(&timers_changed, &timers_lock, &deadline);
+        }
+    }
+}
+
+static void start_timer_task(void) {
+    init_cond(&timers_changed);
+    xTaskCreate(timer_task, "Tmr Svc", 2048, NULL, 1, NULL);
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t auto_reload, void *timer_id,
+                           TimerCallbackFunction_t callback) {
+    pthread_once(&timers_once, start_timer_task);
+
+    struct sim_timer *timer = calloc(1, sizeof(*timer));
+    if (timer == NULL) {
+        return NULL;
+    }
+    strncpy(timer->name, name, sizeof(timer->name) - 1);
+    timer->period = period;
+    timer->auto_reload = auto_reload;
+    timer->id = timer_id;
+    timer->callback = callback;
+
+    pthread_mutex_lock(&timers_lock);
+    timer->next = timers;
+    timers = timer;
+    pthread_mutex_unlock(&timers_lock);
+    return timer;
+}
+
+static BaseType_t timer_set_active(TimerHandle_t timer, bool active) {
+    pthread_mutex_lock(&timers_lock);
+    timer->active = active;
+    timer->expiry_us = esp_timer_get_time() + (int64_t)timer->period * TICK_US;
+    pthread_cond_broadcast(&timers_changed);
+    pthread_mutex_unlock(&timers_lock);
+    return pdPASS;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait) {
+    return timer_set_active(timer, true);
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait) {
+    return timer_set_active(timer, false);
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t wait) {
+    return timer_set_active(timer, true);
+}
+
+BaseType_t xTimerStartFromISR(TimerHandle_t timer, BaseType_t *woken) {
+    return timer_set_active(timer, true);
+}
+
+BaseType_t xTimerStopFromISR(TimerHandle_t timer, BaseType_t *woken) {
+    return timer_set_active(timer, false);
+}
+
+BaseType_t xTimerResetFromISR(TimerHandle_t timer, BaseType_t *woken) {
+    return timer_set_active(timer, true);
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t wait) {
+    pthread_mutex_lock(&timers_lock);
+    timer->period = period;
+    pthread_mutex_unlock(&timers_lock);
+    return timer_set_active(timer, true);
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer) {
+    pthread_mutex_lock(&timers_lock);
+    BaseType_t active = timer->active;
+    pthread_mutex_unlock(&timers_lock);
+    return active;
+}
+
+BaseType_t xTimerPendFunctionCallFromISR(PendedFunction_t fn, void *arg1, uint32_t arg2, BaseType_t *woken) {
+    BaseType_t ret = pdFAIL;
+
+    pthread_once(&timers_once, start_timer_task);
+    pthread_mutex_lock(&timers_lock);
+    if (pended_count < PENDED_CALLS_LEN) {
+        pended_calls[(pended_head + pended_count++) % PENDED_CALLS_LEN] = (pended_call_t) { fn, arg1, arg2 };
+        pthread_cond_broadcast(&timers_changed);
+        ret = pdPASS;
+    }
+    pthread_mutex_unlock(&timers_lock);
+    return ret;
+}
+
+BaseType_t xTimerPendFunctionCall(PendedFunction_t fn, void *arg1, uint32_t arg2, TickType_t wait) {
+    return xTimerPendFunctionCallFromISR(fn, arg1, arg2, NULL);
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer) {
+    return timer->id;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file sim_gpio.c
+ * @brief GPIO inputs and edge and level interrupts for the host simulator.
+ *
+ * A level interrupt fires when the pin reaches its level. On the chip it keeps firing
+ * while the pin stays there; the firmware re-arms it for the other level every time.
+ */
+
+#include <pthread.h>
+#include "driver/gpio.h"
+#include "hal/gpio_ll.h"
+#include "sim.h"
+
+typedef struct {
+    int level;
+    gpio_int_type_t intr_type;
+    bool intr_enabled;
+    gpio_isr_t handler;
+    void *arg;
+} sim_pin_t;
+
+static pthread_mutex_t pins_lock = PTHREAD_MUTEX_INITIALIZER;
+// Held while an ISR runs, so interrupts never nest or run in parallel
+static pthread_mutex_t isr_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_pin_t pins[GPIO_NUM_MAX];
+
+esp_err_t gpio_config(const gpio_config_t *config) {
+    pthread_mutex_lock(&pins_lock);
+    for (int gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+        if (config->pin_bit_mask & (1ULL << gpio)) {
+            pins[gpio].intr_type = config->intr_type;
+            pins[gpio].intr_enabled = config->intr_type != GPIO_INTR_DISABLE;
+            pins[gpio].level = config->pull_up_en == GPIO_PULLUP_ENABLE;
+        }
+    }
+    pthread_mutex_unlock(&pins_lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args) {
+    if (gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&pins_lock);
+    pins[gpio_num].handler = isr_handler;
+    pins[gpio_num].arg = args;
+    pthread_mutex_unlock(&pins_lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num) {
+    if (gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&pins_lock);
+    pins[gpio_num].intr_enabled = true;
+    pthread_mutex_unlock(&pins_lock);
+    return ESP_OK;
+}
+
+// As on the chip, this also sets the pin's interrupt type
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type) {
+    if (gpio_num < 0 || gpio_num >= GPIO_NUM_MAX ||
+        (intr_type != GPIO_INTR_LOW_LEVEL && intr_type != GPIO_INTR_HIGH_LEVEL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&pins_lock);
+    pins[gpio_num].intr_type = intr_type;
+    pthread_mutex_unlock(&pins_lock);
+    return ESP_OK;
+}
+
+// Called from the ISR, so only the type changes; the wakeup follows it as on the chip
+void gpio_ll_set_intr_type(gpio_dev_t *hw, uint32_t gpio_num, gpio_int_type_t intr_type) {
+    pthread_mutex_lock(&pins_lock);
+    pins[gpio_num].intr_type = intr_type;
+    pthread_mutex_unlock(&pins_lock);
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+    pthread_mutex_lock(&pins_lock);
+    int level = pins[gpio_num].level;
+    pthread_mutex_unlock(&pins_lock);
+    return level;
+}
+
+void sim_gpio_set_level(gpio_num_t gpio, int level) {
+    pthread_mutex_lock(&isr_lock);
+    pthread_mutex_lock(&pins_lock);
+    sim_pin_t pin = pins[gpio];
+    pins[gpio].level = level;
+    pthread_mutex_unlock(&pins_lock);
+
+    bool rising = !pin.level && level;
+    bool falling = pin.level && !level;
+    bool fire = (pin.intr_type == GPIO_INTR_ANYEDGE && (rising || falling)) ||
+                (pin.intr_type == GPIO_INTR_POSEDGE && rising) ||
+                (pin.intr_type == GPIO_INTR_NEGEDGE && falling) ||
+                (pin.intr_type == GPIO_INTR_HIGH_LEVEL && rising) ||
+                (pin.intr_type == GPIO_INTR_LOW_LEVEL && falling);
+    if (fire && pin.intr_enabled && pin.handler != NULL) {
+        sim_set_isr_context(true);
+        pin.handler(pin.arg);
+        sim_set_isr_context(false);
+    }
+    pthread_mutex_unlock(&isr_lock);
+}
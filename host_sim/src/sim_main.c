@@ -0,0 +1,51 @@
+/**
+ * @file sim_main.c
+ * @brief Entry point of the host simulator: boots the firmware and runs one scenario.
+ *
+ * Usage: bt_remote_sim <scenario>. The exit status is the number of failed checks.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+
+#define BOOT_TIMEOUT_MS 2000
+
+extern void app_main(void);
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s <scenario>\nscenarios:", prog);
+    for (size_t i = 0; i < sim_scenario_count; i++) {
+        fprintf(stderr, " %s", sim_scenarios[i].name);
+    }
+    fputc('\n', stderr);
+}
+
+int main(int argc, char **argv) {
+    const sim_scenario_t *scenario = NULL;
+
+    for (size_t i = 0; argc == 2 && i < sim_scenario_count; i++) {
+        if (strcmp(argv[1], sim_scenarios[i].name) == 0) {
+            scenario = &sim_scenarios[i];
+        }
+    }
+    if (!scenario) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    app_main();
+    if (!sim_ble_wait_advertising(BOOT_TIMEOUT_MS)) {
+        fprintf(stderr, "FAIL: firmware did not start advertising\n");
+        return 1;
+    }
+    if (scenario->connect) {
+        sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+        sim_phone_connect(&config);
+        sim_sleep_ms(100);
+    }
+
+    int failures = scenario->run();
+    printf("%s: %s (%d failed checks)\n", scenario->name, failures ? "FAIL" : "PASS", failures);
+    return failures;
+}
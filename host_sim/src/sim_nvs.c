@@ -0,0 +1,261 @@
+/**
+ * @file sim_nvs.c
+ * @brief In-memory NVS for the host simulator.
+ */
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "sim.h"
+
+#define NVS_KEY_NAME_MAX_SIZE   16
+#define NVS_MAX_HANDLES         16
+
+typedef enum {
+    ENTRY_INT,
+    ENTRY_STR,
+    ENTRY_BLOB,
+} entry_kind_t;
+
+typedef struct nvs_entry {
+    char ns[NVS_KEY_NAME_MAX_SIZE];
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    entry_kind_t kind;
+    int64_t number;
+    void *data;
+    size_t len;
+    struct nvs_entry *next;
+} nvs_entry_t;
+
+typedef struct {
+    bool open;
+    bool writable;
+    char ns[NVS_KEY_NAME_MAX_SIZE];
+} nvs_open_handle_t;
+
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+static nvs_entry_t *entries;
+static nvs_open_handle_t handles[NVS_MAX_HANDLES];
+static bool initialized;
+static uint32_t commits;
+static int sets_left = -1;          // Sets that succeed before the partition is full, -1 for no limit
+
+static nvs_open_handle_t *get_handle(nvs_handle_t handle) {
+    if (handle == 0 || handle > NVS_MAX_HANDLES || !handles[handle - 1].open) {
+        return NULL;
+    }
+    return &handles[handle - 1];
+}
+
+static nvs_entry_t *find(const char *ns, const char *key) {
+    for (nvs_entry_t *entry = entries; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->ns, ns) == 0 && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t set_entry(nvs_handle_t handle, const char *key, entry_kind_t kind, int64_t number,
+                           const void *data, size_t len) {
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&nvs_lock);
+    nvs_open_handle_t *h = get_handle(handle);
+    if (h == NULL || !h->writable) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (sets_left == 0) {
+        err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    } else {
+        if (sets_left > 0) {
+            sets_left--;
+        }
+        nvs_entry_t *entry = find(h->ns, key);
+        if (entry == NULL) {
+            entry = calloc(1, sizeof(*entry));
+            strcpy(entry->ns, h->ns);
+            strcpy(entry->key, key);
+            entry->next = entries;
+            entries = entry;
+        }
+        free(entry->data);
+        entry->kind = kind;
+        entry->number = number;
+        entry->data = NULL;
+        entry->len = len;
+        if (len > 0) {
+            entry->data = malloc(len);
+            memcpy(entry->data, data, len);
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+static esp_err_t get_entry(nvs_handle_t handle, const char *key, entry_kind_t kind, int64_t *number,
+                           void *data, size_t *len) {
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&nvs_lock);
+    nvs_open_handle_t *h = get_handle(handle);
+    nvs_entry_t *entry = h ? find(h->ns, key) : NULL;
+    if (h == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (entry == NULL || entry->kind != kind) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (kind == ENTRY_INT) {
+        *number = entry->number;
+    } else if (data == NULL) {
+        *len = entry->len;
+    } else if (*len < entry->len) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        memcpy(data, entry->data, entry->len);
+        *len = entry->len;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_flash_init(void) {
+    initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    pthread_mutex_lock(&nvs_lock);
+    while (entries != NULL) {
+        nvs_entry_t *next = entries->next;
+        free(entries->data);
+        free(entries);
+        entries = next;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+    esp_err_t err = ESP_ERR_NO_MEM;
+
+    if (!initialized) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&nvs_lock);
+    for (size_t i = 0; i < NVS_MAX_HANDLES; i++) {
+        if (!handles[i].open) {
+            handles[i].open = true;
+            handles[i].writable = open_mode == NVS_READWRITE;
+            strncpy(handles[i].ns, namespace_name, NVS_KEY_NAME_MAX_SIZE - 1);
+            *out_handle = i + 1;
+            err = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    pthread_mutex_lock(&nvs_lock);
+    nvs_open_handle_t *h = get_handle(handle);
+    if (h != NULL) {
+        h->open = false;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    pthread_mutex_lock(&nvs_lock);
+    bool ok = get_handle(handle) != NULL;
+    commits += ok;
+    pthread_mutex_unlock(&nvs_lock);
+    return ok ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+void sim_nvs_fail_sets_after(int sets) {
+    pthread_mutex_lock(&nvs_lock);
+    sets_left = sets;
+    pthread_mutex_unlock(&nvs_lock);
+}
+
+uint32_t sim_nvs_commit_count(void) {
+    pthread_mutex_lock(&nvs_lock);
+    uint32_t count = commits;
+    pthread_mutex_unlock(&nvs_lock);
+    return count;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    pthread_mutex_lock(&nvs_lock);
+    nvs_open_handle_t *h = get_handle(handle);
+    for (nvs_entry_t **link = &entries; h != NULL && *link != NULL; link = &(*link)->next) {
+        nvs_entry_t *entry = *link;
+        if (strcmp(entry->ns, h->ns) == 0 && strcmp(entry->key, key) == 0) {
+            *link = entry->next;
+            free(entry->data);
+            free(entry);
+            err = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return h ? err : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+    pthread_mutex_lock(&nvs_lock);
+    nvs_open_handle_t *h = get_handle(handle);
+    for (nvs_entry_t **link = &entries; h != NULL && *link != NULL;) {
+        nvs_entry_t *entry = *link;
+        if (strcmp(entry->ns, h->ns) == 0) {
+            *link = entry->next;
+            free(entry->data);
+            free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return h ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+#define NVS_INT_ACCESSORS(suffix, type) \
+    esp_err_t nvs_get_##suffix(nvs_handle_t handle, const char *key, type *out_value) { \
+        int64_t number; \
+        esp_err_t err = get_entry(handle, key, ENTRY_INT, &number, NULL, NULL); \
+        if (err == ESP_OK) { \
+            *out_value = (type)number; \
+        } \
+        return err; \
+    } \
+    esp_err_t nvs_set_##suffix(nvs_handle_t handle, const char *key, type value) { \
+        return set_entry(handle, key, ENTRY_INT, value, NULL, 0); \
+    }
+
+NVS_INT_ACCESSORS(i32, int32_t)
+NVS_INT_ACCESSORS(u8, uint8_t)
+NVS_INT_ACCESSORS(u16, uint16_t)
+NVS_INT_ACCESSORS(u32, uint32_t)
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length) {
+    return get_entry(handle, key, ENTRY_STR, NULL, out_value, length);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value) {
+    return set_entry(handle, key, ENTRY_STR, 0, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length) {
+    return get_entry(handle, key, ENTRY_BLOB, NULL, out_value, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    return set_entry(handle, key, ENTRY_BLOB, 0, value, length);
+}
@@ -0,0 +1,231 @@
+/**
+ * @file sim_phone.c
+ * @brief Simulated phone app for the host simulator.
+ *
+ * Behaves like the companion app: syncs its clock, subscribes, parses every record it
+ * receives, and acknowledges them with "ack:<seq>" writes or indication confirmations.
+ * Each of the SIM_PHONE_COUNT phones keeps its own records and counters.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_gatt_defs.h"
+#include "esp_timer.h"
+#include "sim.h"
+
+#define REMOTE_CHAR_UUID_TAIL   0x1234
+#define DUMP_CHAR_UUID_TAIL     0x1236
+// Phone wall clock at esp_timer time zero, an arbitrary date in 2025
+#define PHONE_EPOCH_OFFSET_MS   1750000000000LL
+
+typedef struct {
+    uint16_t remote_handle;
+    uint16_t dump_handle;
+    sim_record_t *records;
+    size_t record_count;
+    size_t record_cap;
+    uint8_t seen[65536 / 8];
+    bool have_highest;
+    uint16_t highest_seq;
+    sim_phone_stats_t stats;
+} sim_phone_t;
+
+static pthread_mutex_t phone_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_phone_t phones[SIM_PHONE_COUNT];
+
+int64_t sim_phone_clock_ms(int64_t at_us) {
+    return PHONE_EPOCH_OFFSET_MS + at_us / 1000;
+}
+
+bool sim_phone_connect_at(int phone, const sim_phone_config_t *config) {
+    char text[32];
+
+    phones[phone].remote_handle = sim_ble_char_handle(REMOTE_CHAR_UUID_TAIL);
+    phones[phone].dump_handle = sim_ble_char_handle(DUMP_CHAR_UUID_TAIL);
+    uint16_t cccd_handle = sim_ble_cccd_handle(REMOTE_CHAR_UUID_TAIL);
+
+    if (!sim_ble_link_up(phone, config)) {
+        return false;
+    }
+    sim_ble_mtu_exchange(phone, config->mtu);
+    if (config->sync_time) {
+        int len = snprintf(text, sizeof(text), "time:%lld", (long long)sim_phone_clock_ms(esp_timer_get_time()));
+        sim_ble_phone_write(phone, phones[phone].remote_handle, text, len);
+    }
+    if (config->subscribe) {
+        uint8_t cccd[2] = { config->indications ? 0x02 : 0x01, 0x00 };
+        sim_ble_phone_write(phone, cccd_handle, cccd, sizeof(cccd));
+    }
+    return true;
+}
+
+bool sim_phone_connect(const sim_phone_config_t *config) {
+    return sim_phone_connect_at(0, config);
+}
+
+void sim_phone_disconnect_at(int phone) {
+    sim_ble_link_down(phone);
+}
+
+void sim_phone_disconnect(void) {
+    sim_phone_disconnect_at(0);
+}
+
+void sim_phone_write_at(int phone, uint16_t uuid_tail, const void *data, uint16_t len) {
+    sim_ble_phone_write(phone, sim_ble_char_handle(uuid_tail), data, len);
+}
+
+void sim_phone_subscribe_at(int phone, uint16_t uuid_tail, uint16_t cccd) {
+    uint8_t value[2] = { cccd & 0xFF, cccd >> 8 };
+    sim_ble_phone_write(phone, sim_ble_cccd_handle(uuid_tail), value, sizeof(value));
+}
+
+esp_gatt_status_t sim_phone_long_write_at(int phone, uint16_t uuid_tail, const void *data, uint16_t len,
+                                          bool execute) {
+    uint16_t handle = sim_ble_char_handle(uuid_tail);
+    uint16_t part = sim_ble_mtu(phone) - 5;     // Prepare Write Request header is 5 bytes
+    esp_gatt_status_t status = ESP_GATT_OK;
+
+    for (uint16_t offset = 0; offset < len && status == ESP_GATT_OK; offset += part) {
+        uint16_t chunk = len - offset < part ? len - offset : part;
+        status = sim_ble_phone_prepare_write(phone, handle, offset, (const uint8_t *)data + offset, chunk);
+    }
+    esp_gatt_status_t exec_status = sim_ble_phone_execute_write(phone, execute && status == ESP_GATT_OK);
+    return status != ESP_GATT_OK ? status : exec_status;
+}
+
+int sim_phone_read_at(int phone, uint16_t uuid_tail, uint8_t *data, size_t max) {
+    uint16_t handle = sim_ble_char_handle(uuid_tail);
+    uint16_t part = sim_ble_mtu(phone) - 1;     // Read Response header is 1 byte
+    uint8_t chunk[ESP_GATT_MAX_ATTR_LEN];
+    size_t total = 0;
+    uint16_t len;
+
+    // Like a phone's GATT client, keep reading while the responses come back full
+    do {
+        if (sim_ble_phone_read(phone, handle, total, chunk, &len) != ESP_GATT_OK) {
+            return -1;
+        }
+        size_t copy = total + len <= max ? len : max - total;
+        memcpy(&data[total], chunk, copy);
+        total += copy;
+    } while (len == part && total < max);
+    return total;
+}
+
+static bool parse_record(char *line, sim_record_t *rec) {
+    char type[8];
+    unsigned button, seq;
+    long long ts_ms;
+
+    int n = sscanf(line, "%7[a-z]:%u:%u:%lld", type, &button, &seq, &ts_ms);
+    if (n < 3 || seq > UINT16_MAX) {
+        return false;
+    }
+    if (strcmp(type, "short") == 0) {
+        rec->long_press = false;
+    } else if (strcmp(type, "long") == 0) {
+        rec->long_press = true;
+    } else {
+        return false;
+    }
+    rec->button = button;
+    rec->seq = seq;
+    rec->ts_ms = n == 4 ? ts_ms : -1;
+    return true;
+}
+
+void sim_phone_receive(int phone, uint16_t handle, const uint8_t *data, uint16_t len, bool indicate, int64_t rx_us) {
+    sim_phone_t *p = &phones[phone];
+    char text[ESP_GATT_MAX_MTU_SIZE + 1];
+    char *save = NULL;
+    bool ack = false;
+    uint16_t ack_seq = 0;
+
+    if (handle == p->dump_handle) {
+        pthread_mutex_lock(&phone_lock);
+        p->stats.dump_bytes += len;
+        pthread_mutex_unlock(&phone_lock);
+        return;
+    }
+    if (handle != p->remote_handle) {
+        return;
+    }
+    memcpy(text, data, len);
+    text[len] = '\0';
+
+    pthread_mutex_lock(&phone_lock);
+    p->stats.pdus++;
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        sim_record_t rec = { .rx_us = rx_us };
+        if (!parse_record(line, &rec)) {
+            p->stats.malformed++;
+            continue;
+        }
+        p->stats.records++;
+        // Records arrive in order on one link, so the newest one acknowledges all before it
+        if (!p->have_highest || (int16_t)(rec.seq - p->highest_seq) > 0) {
+            p->highest_seq = rec.seq;
+            p->have_highest = true;
+        }
+        if (p->seen[rec.seq / 8] & (1 << (rec.seq % 8))) {
+            p->stats.duplicates++;
+            continue;
+        }
+        p->seen[rec.seq / 8] |= 1 << (rec.seq % 8);
+        if (p->record_count == p->record_cap) {
+            p->record_cap = p->record_cap ? p->record_cap * 2 : 256;
+            p->records = realloc(p->records, p->record_cap * sizeof(*p->records));
+        }
+        p->records[p->record_count++] = rec;
+    }
+    ack = p->have_highest;
+    ack_seq = p->highest_seq;
+    pthread_mutex_unlock(&phone_lock);
+
+    if (indicate) {
+        sim_ble_confirm(phone, handle);
+    } else if (ack) {
+        int n = snprintf(text, sizeof(text), "ack:%u", ack_seq);
+        sim_ble_phone_write(phone, p->remote_handle, text, n);
+    }
+}
+
+void sim_phone_count_link_event(int phone, bool oversize, bool rejected, bool congested) {
+    pthread_mutex_lock(&phone_lock);
+    phones[phone].stats.oversize += oversize;
+    phones[phone].stats.rejected += rejected;
+    phones[phone].stats.congestions += congested;
+    pthread_mutex_unlock(&phone_lock);
+}
+
+void sim_phone_count_conn_update(int phone, bool rejected) {
+    pthread_mutex_lock(&phone_lock);
+    phones[phone].stats.conn_updates++;
+    phones[phone].stats.conn_rejects += rejected;
+    pthread_mutex_unlock(&phone_lock);
+}
+
+size_t sim_phone_records_at(int phone, sim_record_t *out, size_t max) {
+    pthread_mutex_lock(&phone_lock);
+    size_t n = phones[phone].record_count < max ? phones[phone].record_count : max;
+    memcpy(out, phones[phone].records, n * sizeof(*out));
+    pthread_mutex_unlock(&phone_lock);
+    return n;
+}
+
+size_t sim_phone_records(sim_record_t *out, size_t max) {
+    return sim_phone_records_at(0, out, max);
+}
+
+void sim_phone_get_stats_at(int phone, sim_phone_stats_t *stats_out) {
+    pthread_mutex_lock(&phone_lock);
+    *stats_out = phones[phone].stats;
+    pthread_mutex_unlock(&phone_lock);
+}
+
+void sim_phone_get_stats(sim_phone_stats_t *stats_out) {
+    sim_phone_get_stats_at(0, stats_out);
+}
@@ -0,0 +1,1350 @@
+/**
+ * @file sim_scenarios.c
+ * @brief Scripted button and link scenarios with throughput, loss and latency checks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+#include "bt_latency.h"
+#include "ble_tx.h"
+#include "ble_adv.h"
+#include "data_storage.h"
+#include "bt_prov.h"
+#include "ble_transport.h"
+#include "ble_adv_payload.h"
+#include "ble_beacon.h"
+#include "ble_link.h"
+#include "ble_server.h"
+#include "bt_pm.h"
+#include "bt_siphash.h"
+#include "flight_rec.h"
+#include "esp_gap_ble_api.h"
+#include "sim.h"
+
+#define NUM_BUTTONS         4
+#define BUTTON_GPIO(n)      ((gpio_num_t)(43 - (n)))    // Button 1 is GPIO 42, as in bt_gpio.c
+#define DEBOUNCE_MS         20                          // Matches button_isr_handler()
+#define MAX_RECORDS         4096
+#define DELIVERY_TIMEOUT_MS 5000
+#define DUMP_CHAR_UUID_TAIL 0x1236
+#define PROV_CHAR_UUID_TAIL 0x1237
+#define LINK_PAGE_SLOT_LEN  7
+#define BULK_PDUS           8       // Below the link's congestion level
+#define BULK_PDU_LEN        244     // A full notification at an MTU of 247
+#define PM_PAGE_LEN         33
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            failures++; \
+        } \
+    } while (0)
+
+static sim_record_t records[MAX_RECORDS];
+
+static void press(int button, uint32_t hold_ms) {
+    sim_gpio_set_level(BUTTON_GPIO(button), 0);
+    sim_sleep_ms(hold_ms);
+    sim_gpio_set_level(BUTTON_GPIO(button), 1);
+}
+
+// Contact bounce: the edge is followed by a few 1 ms glitches that settle on the new level
+static void bounce_to(int button, int level) {
+    for (int i = 0; i < 3; i++) {
+        sim_gpio_set_level(BUTTON_GPIO(button), level);
+        sim_sleep_ms(1);
+        sim_gpio_set_level(BUTTON_GPIO(button), !level);
+        sim_sleep_ms(1);
+    }
+    sim_gpio_set_level(BUTTON_GPIO(button), level);
+}
+
+static size_t wait_records(size_t count, uint32_t timeout_ms) {
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    size_t n;
+
+    while ((n = sim_phone_records(records, MAX_RECORDS)) < count && esp_timer_get_time() < deadline) {
+        sim_sleep_ms(10);
+    }
+    return n;
+}
+
+// Returns how many records are not in consecutive sequence order
+static size_t count_gaps(size_t n) {
+    size_t gaps = 0;
+    for (size_t i = 1; i < n; i++) {
+        gaps += records[i].seq != (uint16_t)(records[i - 1].seq + 1);
+    }
+    return gaps;
+}
+
+static int cmp_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Edge-to-phone latency percentile in ms, measured on the phone clock
+static int64_t latency_ms(size_t n, int percentile) {
+    static int64_t samples[MAX_RECORDS];
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].ts_ms >= 0) {
+            samples[count++] = sim_phone_clock_ms(records[i].rx_us) - records[i].ts_ms;
+        }
+    }
+    if (count == 0) {
+        return -1;
+    }
+    qsort(samples, count, sizeof(samples[0]), cmp_i64);
+    return samples[(count - 1) * percentile / 100];
+}
+
+static void report(size_t n) {
+    sim_phone_stats_t phone;
+    ble_tx_stats_t tx;
+
+    sim_phone_get_stats(&phone);
+    ble_tx_get_stats(&tx);
+    printf("records %zu (%lu received, %lu duplicates) in %lu PDUs, latency p50 %lld ms p99 %lld ms\n",
+           n, (unsigned long)phone.records, (unsigned long)phone.duplicates, (unsigned long)phone.pdus,
+           (long long)latency_ms(n, 50), (long long)latency_ms(n, 99));
+    printf("tx: peak %lu, retransmits %lu, dropped %lu full %lu expired, %lu stalls (max %lu ms); "
+           "link: %lu congestions, %lu rejected\n",
+           (unsigned long)tx.queue_peak, (unsigned long)tx.retransmits, (unsigned long)tx.dropped_full,
+           (unsigned long)tx.dropped_expired, (unsigned long)tx.stalls, (unsigned long)tx.max_stall_ms,
+           (unsigned long)phone.congestions, (unsigned long)phone.rejected);
+}
+
+static int check_link_clean(void) {
+    sim_phone_stats_t phone;
+    int failures = 0;
+
+    sim_phone_get_stats(&phone);
+    CHECK(phone.malformed == 0, "%lu malformed records", (unsigned long)phone.malformed);
+    CHECK(phone.oversize == 0, "%lu PDUs longer than the MTU", (unsigned long)phone.oversize);
+    return failures;
+}
+
+/*
+ * Scenarios
+ */
+
+// One short and one long press, each reported once with an accurate phone timestamp
+static int scenario_single(void) {
+    int failures = 0;
+
+    int64_t short_edge_us = esp_timer_get_time() + 80000;
+    press(1, 80);
+    sim_sleep_ms(200);
+    press(2, 1200);
+    int64_t long_edge_us = esp_timer_get_time();
+
+    size_t n = wait_records(2, DELIVERY_TIMEOUT_MS);
+    sim_sleep_ms(300);
+    n = sim_phone_records(records, MAX_RECORDS);
+    report(n);
+    CHECK(n == 2, "expected 2 records, got %zu", n);
+    if (n == 2) {
+        CHECK(records[0].button == 1 && !records[0].long_press, "first record is not a short press of button 1");
+        CHECK(records[1].button == 2 && records[1].long_press, "second record is not a long press of button 2");
+        CHECK(records[1].seq == (uint16_t)(records[0].seq + 1), "sequence numbers not consecutive");
+        CHECK(llabs(records[0].ts_ms - sim_phone_clock_ms(short_edge_us)) <= 5 &&
+              llabs(records[1].ts_ms - sim_phone_clock_ms(long_edge_us)) <= 5,
+              "timestamps off: %lld and %lld ms", (long long)(records[0].ts_ms - sim_phone_clock_ms(short_edge_us)),
+              (long long)(records[1].ts_ms - sim_phone_clock_ms(long_edge_us)));
+        CHECK(latency_ms(n, 100) < 100, "latency %lld ms", (long long)latency_ms(n, 100));
+    }
+    return failures + check_link_clean();
+}
+
+// Bouncing contacts still produce exactly one event per press
+static int scenario_bounce(void) {
+    const int presses = 20;
+    int failures = 0;
+
+    for (int i = 0; i < presses; i++) {
+        int button = 1 + i % NUM_BUTTONS;
+        bounce_to(button, 0);
+        sim_sleep_ms(60);
+        bounce_to(button, 1);
+        sim_sleep_ms(60);
+    }
+    wait_records(presses, DELIVERY_TIMEOUT_MS);
+    sim_sleep_ms(500);
+    size_t n = sim_phone_records(records, MAX_RECORDS);
+    report(n);
+    CHECK(n == (size_t)presses, "expected %d records, got %zu", presses, n);
+    for (size_t i = 0; i < n; i++) {
+        CHECK(records[i].button == 1 + (int)i % NUM_BUTTONS && !records[i].long_press,
+              "record %zu is button %d %s", i, records[i].button, records[i].long_press ? "long" : "short");
+    }
+    return failures + check_link_clean();
+}
+
+// All four buttons at once: every event arrives and each chord shares a notification
+static int scenario_chord(void) {
+    const int chords = 10;
+    sim_phone_stats_t phone;
+    int failures = 0;
+
+    for (int i = 0; i < chords; i++) {
+        for (int button = 1; button <= NUM_BUTTONS; button++) {
+            sim_gpio_set_level(BUTTON_GPIO(button), 0);
+        }
+        sim_sleep_ms(50);
+        for (int button = 1; button <= NUM_BUTTONS; button++) {
+            sim_gpio_set_level(BUTTON_GPIO(button), 1);
+        }
+        sim_sleep_ms(150);
+    }
+    size_t n = wait_records(chords * NUM_BUTTONS, DELIVERY_TIMEOUT_MS);
+    report(n);
+    sim_phone_get_stats(&phone);
+    CHECK(n == (size_t)(chords * NUM_BUTTONS), "expected %d records, got %zu", chords * NUM_BUTTONS, n);
+    CHECK(count_gaps(n) == 0, "%zu sequence gaps", count_gaps(n));
+    CHECK(phone.pdus <= (uint32_t)chords + 2, "%lu notifications for %d chords", (unsigned long)phone.pdus, chords);
+    for (size_t i = 0; i + NUM_BUTTONS <= n; i += NUM_BUTTONS) {
+        CHECK(records[i].rx_us == records[i + NUM_BUTTONS - 1].rx_us, "chord at record %zu was split", i);
+    }
+    return failures + check_link_clean();
+}
+
+// The fastest presses the debounce accepts on all buttons: nothing is lost or reordered
+static int scenario_burst(void) {
+    const int duration_ms = 3000;
+    const int period_ms = 2 * (DEBOUNCE_MS + 10);
+    int64_t start = esp_timer_get_time();
+    bool pressed[NUM_BUTTONS + 1] = { false };
+    int expected = 0;
+    int failures = 0;
+
+    // Each button presses for 30 ms and releases for 30 ms, offset from its neighbours
+    for (int t = 0; t < duration_ms; t++) {
+        sim_sleep_until_us(start + (int64_t)t * 1000);
+        for (int button = 1; button <= NUM_BUTTONS; button++) {
+            int phase = (t + button * period_ms / NUM_BUTTONS) % period_ms;
+            if (phase == 0) {
+                sim_gpio_set_level(BUTTON_GPIO(button), 0);
+                pressed[button] = true;
+            } else if (phase == period_ms / 2 && pressed[button]) {
+                sim_gpio_set_level(BUTTON_GPIO(button), 1);
+                pressed[button] = false;
+                expected++;
+            }
+        }
+    }
+    size_t n = wait_records(expected, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == (size_t)expected, "expected %d records, got %zu", expected, n);
+    CHECK(count_gaps(n) == 0, "%zu sequence gaps", count_gaps(n));
+    CHECK(latency_ms(n, 99) < 150, "p99 latency %lld ms", (long long)latency_ms(n, 99));
+    return failures + check_link_clean();
+}
+
+// 1000 edges per second for two seconds: every debounced press is either delivered or
+// counted as dropped, and what is delivered keeps its order
+static int scenario_flood(void) {
+    const int duration_ms = 2000;
+    uint8_t hist[2 + BT_LATENCY_STAGE_COUNT * BT_LATENCY_BUCKETS * 4];
+    int64_t start = esp_timer_get_time();
+    int failures = 0;
+
+    // One edge per millisecond, rotating over the buttons
+    for (int t = 0; t < duration_ms; t++) {
+        sim_sleep_until_us(start + (int64_t)t * 1000);
+        int button = 1 + t % NUM_BUTTONS;
+        sim_gpio_set_level(BUTTON_GPIO(button), (t / NUM_BUTTONS) % 2);
+    }
+    for (int button = 1; button <= NUM_BUTTONS; button++) {
+        sim_gpio_set_level(BUTTON_GPIO(button), 1);
+    }
+    int64_t elapsed_ms = (esp_timer_get_time() - start) / 1000;
+    sim_sleep_ms(2000);
+    size_t n = sim_phone_records(records, MAX_RECORDS);
+    report(n);
+
+    // Events offered to the event queue and taken off it, from the latency histograms
+    uint32_t offered = 0, dequeued = 0;
+    bt_latency_serialize(hist, sizeof(hist));
+    for (int bucket = 0; bucket < BT_LATENCY_BUCKETS; bucket++) {
+        const uint8_t *p = &hist[2 + (BT_LATENCY_EDGE_TO_QUEUE * BT_LATENCY_BUCKETS + bucket) * 4];
+        offered += p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        p = &hist[2 + (BT_LATENCY_QUEUE_TO_DEQUEUE * BT_LATENCY_BUCKETS + bucket) * 4];
+        dequeued += p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+    ble_tx_stats_t tx;
+    ble_tx_get_stats(&tx);
+    uint32_t tx_dropped = tx.dropped_full + tx.dropped_expired;
+    printf("flood: %lu presses in %lld ms, %lu dequeued, %lu dropped in tx, %zu delivered\n",
+           (unsigned long)offered, (long long)elapsed_ms, (unsigned long)dequeued, (unsigned long)tx_dropped, n);
+
+    CHECK(offered >= (uint32_t)(duration_ms / (2 * DEBOUNCE_MS)), "only %lu presses got through the debounce",
+          (unsigned long)offered);
+    CHECK(dequeued == offered, "%lu events lost at the event queue", (unsigned long)(offered - dequeued));
+    CHECK(n + tx_dropped == dequeued, "%lu events dequeued but %zu delivered and %lu dropped",
+          (unsigned long)dequeued, n, (unsigned long)tx_dropped);
+    CHECK(count_gaps(n) <= tx_dropped, "%zu sequence gaps for %lu drops",
+          count_gaps(n), (unsigned long)tx_dropped);
+    CHECK(n * 1000 >= (size_t)offered * 1000 * 99 / 100, "throughput: %zu of %lu delivered", n, (unsigned long)offered);
+    CHECK(latency_ms(n, 99) < 150, "p99 latency %lld ms", (long long)latency_ms(n, 99));
+    return failures + check_link_clean();
+}
+
+// Presses made while no phone is connected are delivered in order once it connects
+static int scenario_offline(void) {
+    const int presses = 12;
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    int failures = 0;
+
+    for (int i = 0; i < presses; i++) {
+        press(1 + i % NUM_BUTTONS, 40);
+        sim_sleep_ms(40);
+    }
+    sim_sleep_ms(500);
+    CHECK(sim_phone_records(records, MAX_RECORDS) == 0, "records arrived while disconnected");
+
+    sim_phone_connect(&config);
+    size_t n = wait_records(presses, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == (size_t)presses, "expected %d records, got %zu", presses, n);
+    CHECK(count_gaps(n) == 0, "%zu sequence gaps", count_gaps(n));
+    for (size_t i = 0; i < n; i++) {
+        CHECK(records[i].ts_ms >= 0, "record %zu has no timestamp", i);
+        CHECK(i == 0 || records[i].ts_ms > records[i - 1].ts_ms, "record %zu timestamp out of order", i);
+    }
+    return failures + check_link_clean();
+}
+
+// Indications: one outstanding at a time, every event confirmed exactly once
+static int scenario_indicate(void) {
+    const int presses = 30;
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    sim_phone_stats_t phone;
+    int failures = 0;
+
+    config.indications = true;
+    sim_phone_connect(&config);
+    sim_sleep_ms(100);
+    for (int i = 0; i < presses; i++) {
+        press(1 + i % NUM_BUTTONS, 30);
+        sim_sleep_ms(30);
+    }
+    size_t n = wait_records(presses, DELIVERY_TIMEOUT_MS);
+    sim_sleep_ms(500);
+    report(n);
+    sim_phone_get_stats(&phone);
+    CHECK(n == (size_t)presses, "expected %d records, got %zu", presses, n);
+    CHECK(count_gaps(n) == 0, "%zu sequence gaps", count_gaps(n));
+    CHECK(phone.duplicates == 0, "%lu duplicates", (unsigned long)phone.duplicates);
+    return failures + check_link_clean();
+}
+
+// The stack refuses the send of a press; the confirmation or ack of the next one does not
+// cover it, and it is resent. Once with indications, once with notifications.
+static int scenario_refused(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    sim_phone_stats_t phone;
+    int failures = 0;
+
+    for (int round = 0; round < 2; round++) {
+        config.indications = round == 0;
+        sim_phone_connect(&config);
+        sim_sleep_ms(100);
+        sim_ble_refuse_sends(0, 1);
+        // The second press goes out while the first waits for its backoff
+        press(1, 30);
+        sim_sleep_ms(20);
+        press(2, 30);
+        size_t expected = 2 * (round + 1);
+        size_t n = wait_records(expected, DELIVERY_TIMEOUT_MS);
+        report(n);
+        CHECK(n == expected, "%s: expected %zu records, got %zu", config.indications ? "indications" : "notifications",
+              expected, n);
+        for (uint16_t seq = 0; seq < expected; seq++) {
+            bool found = false;
+            for (size_t i = 0; i < n && !found; i++) {
+                found = records[i].seq == seq;
+            }
+            CHECK(found, "seq %u never arrived", seq);
+        }
+        sim_phone_disconnect();
+        sim_sleep_ms(100);
+    }
+    sim_phone_get_stats(&phone);
+    CHECK(phone.rejected == 2, "%lu sends refused", (unsigned long)phone.rejected);
+    return failures + check_link_clean();
+}
+
+// The link drops mid-stream: events in flight are resent after reconnecting, none lost
+static int scenario_reconnect(void) {
+    const int presses = 40;
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    int failures = 0;
+
+    for (int i = 0; i < presses; i++) {
+        if (i == presses / 2) {
+            sim_phone_disconnect();
+        } else if (i == presses * 3 / 4) {
+            sim_phone_connect(&config);
+        }
+        press(1 + i % NUM_BUTTONS, 25);
+        sim_sleep_ms(25);
+    }
+    wait_records(presses, DELIVERY_TIMEOUT_MS);
+    sim_sleep_ms(500);
+    size_t n = sim_phone_records(records, MAX_RECORDS);
+    report(n);
+    CHECK(n == (size_t)presses, "expected %d records, got %zu", presses, n);
+    CHECK(count_gaps(n) == 0, "%zu sequence gaps", count_gaps(n));
+    return failures + check_link_clean();
+}
+
+// Idle links relax to the long interval; a press brings the fast one back
+static int scenario_connparams(void) {
+    sim_phone_stats_t phone;
+    int failures = 0;
+
+    sim_sleep_ms(CONFIG_BLE_CONN_IDLE_TIMEOUT_MS + 1000);
+    CHECK(sim_ble_conn_interval_us() == CONFIG_BLE_CONN_IDLE_MAX_INT * 1250,
+          "idle interval %lu us", (unsigned long)sim_ble_conn_interval_us());
+
+    press(1, 80);
+    size_t n = wait_records(1, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == 1, "expected 1 record, got %zu", n);
+    // The update takes effect a few long intervals after the press; the press must not wait for it
+    CHECK(latency_ms(n, 100) <= CONFIG_BLE_CONN_FAST_WAIT_MS + 2 * CONFIG_BLE_CONN_IDLE_MAX_INT * 5 / 4,
+          "latency %lld ms", (long long)latency_ms(n, 100));
+    sim_sleep_ms(4000);
+    CHECK(sim_ble_conn_interval_us() <= CONFIG_BLE_CONN_FAST_MAX_INT * 1250,
+          "interval %lu us after a press", (unsigned long)sim_ble_conn_interval_us());
+
+    // Presses while fast go straight out
+    press(2, 80);
+    n = wait_records(2, DELIVERY_TIMEOUT_MS);
+    CHECK(n == 2, "expected 2 records, got %zu", n);
+    if (n == 2) {
+        int64_t fast_ms = sim_phone_clock_ms(records[1].rx_us) - records[1].ts_ms;
+        CHECK(fast_ms < 100, "fast latency %lld ms", (long long)fast_ms);
+    }
+    sim_phone_get_stats(&phone);
+    CHECK(phone.conn_updates == 2, "%lu connection updates", (unsigned long)phone.conn_updates);
+    return failures + check_link_clean();
+}
+
+// A phone that refuses updates is asked again with backoff, not flooded
+static int scenario_connreject(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    sim_phone_stats_t phone;
+    int failures = 0;
+
+    config.reject_conn_params = true;
+    sim_phone_connect(&config);
+    sim_sleep_ms(CONFIG_BLE_CONN_IDLE_TIMEOUT_MS + 8000);
+    sim_phone_get_stats(&phone);
+    printf("%lu requests, %lu rejected\n", (unsigned long)phone.conn_updates, (unsigned long)phone.conn_rejects);
+    // Requests at 10 s, then 1, 2 and 4 s apart
+    CHECK(phone.conn_rejects >= 2 && phone.conn_rejects <= 4, "%lu rejected requests", (unsigned long)phone.conn_rejects);
+    CHECK(sim_ble_conn_interval_us() == config.conn_interval_us, "interval changed to %lu us",
+          (unsigned long)sim_ble_conn_interval_us());
+
+    press(1, 80);
+    size_t n = wait_records(1, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == 1 && latency_ms(n, 100) < 100, "latency %lld ms", (long long)latency_ms(n, 100));
+    return failures + check_link_clean();
+}
+
+static bool adv_tier_is(uint8_t type, uint16_t min_int) {
+    esp_ble_adv_params_t params;
+    return sim_ble_adv_params(&params) && params.adv_type == type &&
+           (type == ADV_TYPE_DIRECT_IND_HIGH || params.adv_int_min == min_int);
+}
+
+// Advertising steps down from a directed burst to fast and slow; a press jumps back up
+static int scenario_advtiers(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    uint8_t page[64];
+    int failures = 0;
+
+    sim_phone_disconnect();
+    sim_sleep_ms(100);
+    CHECK(adv_tier_is(ADV_TYPE_DIRECT_IND_HIGH, 0), "no directed advertising after disconnect");
+    sim_sleep_ms(1400);
+    CHECK(adv_tier_is(ADV_TYPE_IND, CONFIG_BLE_ADV_FAST_MIN_INT), "no fast advertising after the directed burst");
+    sim_sleep_ms(CONFIG_BLE_ADV_FAST_DURATION_MS);
+    CHECK(adv_tier_is(ADV_TYPE_IND, CONFIG_BLE_ADV_SLOW_MIN_INT), "no slow advertising after the fast tier");
+
+    sim_gpio_set_level(BUTTON_GPIO(1), 0);
+    sim_sleep_ms(20);
+    CHECK(adv_tier_is(ADV_TYPE_DIRECT_IND_HIGH, 0), "press did not restart directed advertising");
+    sim_gpio_set_level(BUTTON_GPIO(1), 1);
+
+    sim_phone_connect(&config);
+    size_t n = wait_records(1, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == 1, "expected 1 record, got %zu", n);
+
+    // Boot session connected in the fast tier, the one after the press in the directed tier
+    size_t len = ble_adv_serialize(page, sizeof(page));
+    CHECK(len == 1 + BLE_ADV_TIER_COUNT * 19, "stats page %zu bytes", len);
+    if (len > 0) {
+        const uint8_t *directed = &page[1 + BLE_ADV_TIER_DIRECTED * 19];
+        const uint8_t *fast = &page[1 + BLE_ADV_TIER_FAST * 19];
+        uint32_t directed_ms = directed[3] | directed[4] << 8 | directed[5] << 16 | (uint32_t)directed[6] << 24;
+        printf("time to connect: directed %lu ms\n", (unsigned long)directed_ms);
+        CHECK(fast[1] == 1 && directed[1] == 1, "connections: fast %u, directed %u", fast[1], directed[1]);
+        CHECK(directed_ms < 1280, "directed time to connect %lu ms", (unsigned long)directed_ms);
+    }
+    return failures + check_link_clean();
+}
+
+// Two phones: both get every press, and a slow phone does not hold back the fast one
+static int scenario_twophones(void) {
+    const int presses = 24;
+    sim_phone_config_t slow = SIM_PHONE_CONFIG_DEFAULT();
+    esp_ble_adv_params_t params;
+    sim_phone_stats_t phone;
+    ble_tx_stats_t tx;
+    int failures = 0;
+
+    sim_sleep_ms(100);
+    CHECK(sim_ble_adv_params(&params), "not advertising for a second phone");
+    slow.mtu = 64;
+    slow.conn_interval_us = 150000;
+    slow.pdus_per_event = 1;
+    slow.reject_conn_params = true;
+    sim_phone_connect_at(1, &slow);
+    sim_sleep_ms(200);
+    CHECK(!sim_ble_adv_params(&params), "still advertising with every slot in use");
+
+    for (int i = 0; i < presses; i++) {
+        press(1 + i % NUM_BUTTONS, 30);
+        sim_sleep_ms(30);
+    }
+    size_t n = wait_records(presses, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == (size_t)presses, "phone 0: expected %d records, got %zu", presses, n);
+    CHECK(count_gaps(n) == 0, "phone 0: %zu sequence gaps", count_gaps(n));
+    CHECK(latency_ms(n, 100) < 100, "phone 0: latency %lld ms", (long long)latency_ms(n, 100));
+
+    int64_t deadline = esp_timer_get_time() + (int64_t)DELIVERY_TIMEOUT_MS * 1000;
+    while ((n = sim_phone_records_at(1, records, MAX_RECORDS)) < (size_t)presses && esp_timer_get_time() < deadline) {
+        sim_sleep_ms(10);
+    }
+    sim_phone_get_stats_at(1, &phone);
+    printf("phone 1: records %zu in %lu PDUs, latency p50 %lld ms\n", n, (unsigned long)phone.pdus,
+           (long long)latency_ms(n, 50));
+    CHECK(n == (size_t)presses, "phone 1: expected %d records, got %zu", presses, n);
+    CHECK(count_gaps(n) == 0, "phone 1: %zu sequence gaps", count_gaps(n));
+    CHECK(phone.malformed == 0 && phone.oversize == 0, "phone 1: %lu malformed, %lu oversize",
+          (unsigned long)phone.malformed, (unsigned long)phone.oversize);
+
+    // Once the slow phone is gone, nothing waits for it
+    sim_phone_disconnect_at(1);
+    press(2, 30);
+    n = wait_records(presses + 1, DELIVERY_TIMEOUT_MS);
+    CHECK(n == (size_t)presses + 1, "phone 0: expected %d records after the disconnect, got %zu", presses + 1, n);
+    sim_sleep_ms(200);
+    ble_tx_get_stats(&tx);
+    CHECK(tx.queue_depth == 0, "%lu events still queued", (unsigned long)tx.queue_depth);
+    return failures + check_link_clean();
+}
+
+static bool adv_filter_is(esp_ble_adv_filter_t policy) {
+    esp_ble_adv_params_t params;
+    return sim_ble_adv_params(&params) && params.adv_filter_policy == policy;
+}
+
+static int scenario_acceptlist(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    esp_bd_addr_t paired;
+    esp_bd_addr_t others[2] = {
+        { 0xA0, 0x00, 0x00, 0x00, 0x00, 0x01 },
+        { 0xA0, 0x00, 0x00, 0x00, 0x00, 0x02 },
+    };
+    int failures = 0;
+
+    // Nothing paired: anyone may connect
+    sim_sleep_ms(100);
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY), "advertising filtered with no phone paired");
+
+    // Pairing phone 0 puts it into the controller and closes advertising to others
+    sim_ble_phone_bda(0, paired);
+    CHECK(save_bt_device(0, paired, "phone 0") == ESP_OK, "failed to save phone 0");
+    sim_sleep_ms(100);
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST), "advertising not filtered after pairing");
+    CHECK(!sim_phone_connect_at(1, &config), "stranger connected through the accept list");
+    CHECK(sim_phone_connect_at(0, &config), "paired phone could not connect");
+    press(1, 30);
+    size_t n = wait_records(1, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == 1, "expected 1 record, got %zu", n);
+
+    // Three phones do not fit into the controller: advertising opens and the host turns strangers away
+    CHECK(save_bt_device(1, others[0], "other 1") == ESP_OK, "failed to save other 1");
+    CHECK(save_bt_device(2, others[1], "other 2") == ESP_OK, "failed to save other 2");
+    CHECK(save_bt_count(3) == ESP_OK, "failed to save the phone count");
+    sim_sleep_ms(100);
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY), "advertising still filtered with the list overflowed");
+    sim_phone_connect_at(1, &config);
+    sim_sleep_ms(100);
+    CHECK(sim_ble_conn_interval_us_at(1) == 0, "stranger stayed connected with the list overflowed");
+
+    // Removing one lets the rest fit again
+    CHECK(delete_bt_device(others[1]) == ESP_OK, "failed to delete other 2");
+    sim_sleep_ms(100);
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST), "advertising not filtered after the list shrank");
+
+    // Forgetting every phone opens the remote again
+    CHECK(delete_all_bt_devices() == ESP_OK, "failed to delete all phones");
+    sim_sleep_ms(100);
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY), "advertising still filtered with no phone paired");
+    CHECK(sim_phone_connect_at(1, &config), "phone could not connect with no phone paired");
+    CHECK(sim_ble_conn_interval_us_at(0) != 0, "paired phone lost its connection");
+    return failures + check_link_clean();
+}
+
+// Appends a provisioning item; mac and name are left out when NULL
+static size_t put_item(uint8_t *buf, uint8_t op, const uint8_t *mac, const char *name) {
+    size_t len = 0;
+
+    buf[len++] = op;
+    if (mac != NULL) {
+        memcpy(&buf[len], mac, sizeof(esp_bd_addr_t));
+        len += sizeof(esp_bd_addr_t);
+    }
+    if (name != NULL) {
+        buf[len++] = strlen(name);
+        memcpy(&buf[len], name, strlen(name));
+        len += strlen(name);
+    }
+    return len;
+}
+
+// Writes a batch as a long write and reads the result once it is applied
+static int provision(const uint8_t *batch, size_t len, uint8_t *result, size_t max) {
+    int64_t deadline = esp_timer_get_time() + (int64_t)DELIVERY_TIMEOUT_MS * 1000;
+    int n;
+
+    if (sim_phone_long_write_at(0, PROV_CHAR_UUID_TAIL, batch, len, true) != ESP_GATT_OK) {
+        return -1;
+    }
+    do {
+        sim_sleep_ms(10);
+        n = sim_phone_read_at(0, PROV_CHAR_UUID_TAIL, result, max);
+    } while (n >= 1 && result[0] == BT_PROV_BATCH_PENDING && esp_timer_get_time() < deadline);
+    return n;
+}
+
+static int scenario_provision(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    esp_bd_addr_t phone;
+    const esp_bd_addr_t others[] = {
+        { 0xB0, 0x00, 0x00, 0x00, 0x00, 0x01 },
+        { 0xB0, 0x00, 0x00, 0x00, 0x00, 0x02 },
+        { 0xB0, 0x00, 0x00, 0x00, 0x00, 0x03 },
+        { 0xB0, 0x00, 0x00, 0x00, 0x00, 0x04 },
+        { 0xB0, 0x00, 0x00, 0x00, 0x00, 0x05 },
+    };
+    uint8_t batch[256];
+    uint8_t result[512];
+    size_t len;
+    int n;
+    int failures = 0;
+
+    // The smallest MTU, so the batches take several prepared writes and the results several reads
+    config.mtu = 23;
+    CHECK(sim_phone_connect(&config), "phone could not connect");
+    sim_ble_phone_bda(0, phone);
+    sim_sleep_ms(100);      // The remote saves the phone as its last peer
+
+    // Three phones and a list, in one batch with one commit
+    len = put_item(batch, BT_PROV_OP_ADD, phone, "phone 0");
+    len += put_item(&batch[len], BT_PROV_OP_ADD, others[0], "other 1");
+    len += put_item(&batch[len], BT_PROV_OP_ADD, others[1], "other 2");
+    len += put_item(&batch[len], BT_PROV_OP_LIST, NULL, NULL);
+    batch[len++] = 0;
+    uint32_t commits = sim_nvs_commit_count();
+    n = provision(batch, len, result, sizeof(result));
+    const uint8_t added[] = { BT_PROV_BATCH_DONE, 4, BT_PROV_OP_ADD, BT_PROV_ITEM_OK, BT_PROV_OP_ADD, BT_PROV_ITEM_OK,
+                              BT_PROV_OP_ADD, BT_PROV_ITEM_OK, BT_PROV_OP_LIST, BT_PROV_ITEM_OK, 3, 3 };
+    CHECK(n == (int)sizeof(added) + 3 * (6 + 1 + 7), "first batch: %d result bytes", n);
+    CHECK(n >= (int)sizeof(added) && memcmp(result, added, sizeof(added)) == 0, "first batch: wrong result");
+    CHECK(n >= 26 && memcmp(&result[12], phone, 6) == 0 && result[18] == 7 && memcmp(&result[19], "phone 0", 7) == 0,
+          "first batch: phone 0 not listed first");
+    CHECK(sim_nvs_commit_count() == commits + 1, "first batch: %lu commits",
+          (unsigned long)(sim_nvs_commit_count() - commits));
+    CHECK(get_device_count_cache() == 3, "first batch: %ld phones in the cache", (long)get_device_count_cache());
+    sim_sleep_ms(100);
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY), "advertising filtered with the list overflowed");
+
+    // Removing a phone leaves a hole in the registry; the other items still apply
+    len = put_item(batch, BT_PROV_OP_REMOVE, others[0], NULL);
+    len += put_item(&batch[len], BT_PROV_OP_RENAME, others[1], "renamed");
+    len += put_item(&batch[len], BT_PROV_OP_REMOVE, others[4], NULL);
+    len += put_item(&batch[len], BT_PROV_OP_LIST, NULL, NULL);
+    batch[len++] = 1;
+    n = provision(batch, len, result, sizeof(result));
+    const uint8_t changed[] = { BT_PROV_BATCH_DONE, 4, BT_PROV_OP_REMOVE, BT_PROV_ITEM_OK, BT_PROV_OP_RENAME,
+                                BT_PROV_ITEM_OK, BT_PROV_OP_REMOVE, BT_PROV_ITEM_NOT_FOUND, BT_PROV_OP_LIST,
+                                BT_PROV_ITEM_OK, 2, 1 };
+    CHECK(n == (int)sizeof(changed) + 6 + 1 + 7, "second batch: %d result bytes", n);
+    CHECK(n >= (int)sizeof(changed) && memcmp(result, changed, sizeof(changed)) == 0, "second batch: wrong result");
+    CHECK(n >= 26 && memcmp(&result[12], others[1], 6) == 0 && memcmp(&result[19], "renamed", 7) == 0,
+          "second batch: renamed phone not listed");
+    sim_sleep_ms(100);
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST), "advertising not filtered after the list shrank");
+    CHECK(load_all_bt_devices_to_cache() == ESP_OK, "registry with a hole failed to load");
+    CHECK(get_device_count_cache() == 2, "%ld phones loaded", (long)get_device_count_cache());
+
+    // A truncated item rejects the batch before anything is written
+    commits = sim_nvs_commit_count();
+    len = put_item(batch, BT_PROV_OP_ADD, others[2], "other 3");
+    len += put_item(&batch[len], BT_PROV_OP_REMOVE, NULL, NULL);
+    n = provision(batch, len, result, sizeof(result));
+    const uint8_t rejected[] = { BT_PROV_BATCH_REJECTED, 2, BT_PROV_OP_ADD, BT_PROV_ITEM_SKIPPED, BT_PROV_OP_REMOVE,
+                                 BT_PROV_ITEM_MALFORMED };
+    CHECK(n == (int)sizeof(rejected) && memcmp(result, rejected, sizeof(rejected)) == 0, "malformed batch not rejected");
+    CHECK(sim_nvs_commit_count() == commits, "malformed batch committed");
+    CHECK(get_device_count_cache() == 2, "malformed batch changed the cache");
+
+    // A cancelled long write is not applied
+    len = put_item(batch, BT_PROV_OP_CLEAR, NULL, NULL);
+    CHECK(sim_phone_long_write_at(0, PROV_CHAR_UUID_TAIL, batch, len, false) == ESP_GATT_OK, "cancel failed");
+    sim_sleep_ms(100);
+    CHECK(get_device_count_cache() == 2, "cancelled batch applied");
+
+    // An aborted batch leaves flash as it was
+    CHECK(bt_device_batch_begin(CONFIG_BT_PROV_MAX_DEVICES) == ESP_OK, "failed to open a batch");
+    bt_device_batch_clear();
+    CHECK(bt_device_batch_add(others[2], "other 3") == ESP_OK, "failed to stage an add");
+    bt_device_batch_abort();
+    CHECK(load_all_bt_devices_to_cache() == ESP_OK, "registry failed to load after an aborted batch");
+    CHECK(get_device_count_cache() == 2, "aborted batch reached flash: %ld phones", (long)get_device_count_cache());
+
+    // A commit that fails after its first write is reported as partial, and the cache
+    // holds what a reboot would load: the added phone, and the one to remove still there
+    sim_nvs_fail_sets_after(1);
+    len = put_item(batch, BT_PROV_OP_REMOVE, others[1], NULL);
+    len += put_item(&batch[len], BT_PROV_OP_ADD, others[2], "other 3");
+    n = provision(batch, len, result, sizeof(result));
+    sim_nvs_fail_sets_after(-1);
+    CHECK(n >= 1 && result[0] == BT_PROV_BATCH_PARTIAL, "partly written batch not reported");
+    CHECK(is_bt_device_exist_in_cache((uint8_t *)others[1]) && is_bt_device_exist_in_cache((uint8_t *)others[2]),
+          "cache does not match the partly written batch");
+    int32_t partial_count = get_device_count_cache();
+    CHECK(load_all_bt_devices_to_cache() == ESP_OK && get_device_count_cache() == partial_count,
+          "cache of %ld phones, flash of %ld", (long)partial_count, (long)get_device_count_cache());
+    len = put_item(batch, BT_PROV_OP_REMOVE, others[2], NULL);
+    n = provision(batch, len, result, sizeof(result));
+    CHECK(n >= 1 && result[0] == BT_PROV_BATCH_DONE && get_device_count_cache() == 2,
+          "partly written batch not undone: %ld phones", (long)get_device_count_cache());
+
+    // Adds fill the hole first and stop at CONFIG_BT_PROV_MAX_DEVICES
+    len = put_item(batch, BT_PROV_OP_ADD, others[2], "other 3");
+    len += put_item(&batch[len], BT_PROV_OP_ADD, others[3], "other 4");
+    len += put_item(&batch[len], BT_PROV_OP_ADD, others[4], "other 5");
+    n = provision(batch, len, result, sizeof(result));
+    const uint8_t full[] = { BT_PROV_BATCH_DONE, 3, BT_PROV_OP_ADD, BT_PROV_ITEM_OK, BT_PROV_OP_ADD, BT_PROV_ITEM_OK,
+                             BT_PROV_OP_ADD, BT_PROV_ITEM_FULL };
+    CHECK(n == (int)sizeof(full) && memcmp(result, full, sizeof(full)) == 0, "full registry not reported");
+    CHECK(get_device_count_cache() == CONFIG_BT_PROV_MAX_DEVICES, "%ld phones paired", (long)get_device_count_cache());
+
+    // Clearing opens the remote to every phone again
+    len = put_item(batch, BT_PROV_OP_CLEAR, NULL, NULL);
+    len += put_item(&batch[len], BT_PROV_OP_LIST, NULL, NULL);
+    batch[len++] = 0;
+    n = provision(batch, len, result, sizeof(result));
+    const uint8_t cleared[] = { BT_PROV_BATCH_DONE, 2, BT_PROV_OP_CLEAR, BT_PROV_ITEM_OK, BT_PROV_OP_LIST,
+                                BT_PROV_ITEM_OK, 0, 0 };
+    CHECK(n == (int)sizeof(cleared) && memcmp(result, cleared, sizeof(cleared)) == 0, "clear failed");
+    CHECK(get_device_count_cache() == 0, "%ld phones left after clear", (long)get_device_count_cache());
+    sim_sleep_ms(100);
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY), "advertising still filtered with no phone paired");
+    CHECK(sim_ble_conn_interval_us() != 0, "provisioning phone lost its connection");
+    return failures + check_link_clean();
+}
+
+// Returns the data of the first AD structure of the given type, or NULL
+static const uint8_t *find_ad(const uint8_t *data, size_t len, uint8_t type, size_t *field_len) {
+    for (size_t pos = 0; pos + 1 < len && data[pos] != 0; pos += 1 + data[pos]) {
+        if (data[pos + 1] == type && pos + 1 + data[pos] <= len) {
+            *field_len = data[pos] - 1;
+            return &data[pos + 2];
+        }
+    }
+    return NULL;
+}
+
+// A scanner finds the service UUID in the advertisement and the name in the scan response
+static int scenario_advdata(void) {
+    const uint8_t uuid[16] = { BLE_TRANSPORT_UUID128(BLE_TRANSPORT_SERVICE_UUID & 0xFF, BLE_TRANSPORT_SERVICE_UUID >> 8) };
+    uint8_t adv[31], scan_rsp[31];
+    size_t adv_len, scan_rsp_len, len;
+    const uint8_t *field;
+    int failures = 0;
+
+    sim_ble_adv_data(adv, &adv_len, scan_rsp, &scan_rsp_len);
+    printf("advertising data %zu bytes, scan response %zu bytes\n", adv_len, scan_rsp_len);
+
+    field = find_ad(adv, adv_len, 0x01, &len);
+    CHECK(field != NULL && len == 1 && field[0] == 0x06, "flags missing or not general discoverable, LE only");
+    field = find_ad(adv, adv_len, 0x07, &len);
+    CHECK(field != NULL && len == sizeof(uuid) && memcmp(field, uuid, sizeof(uuid)) == 0,
+          "service UUID missing from the advertisement");
+    field = find_ad(adv, adv_len, 0x12, &len);
+    CHECK(field != NULL && len == 4 && (field[0] | field[1] << 8) == CONFIG_BLE_CONN_FAST_MIN_INT &&
+          (field[2] | field[3] << 8) == CONFIG_BLE_CONN_FAST_MAX_INT, "connection interval range missing");
+    CHECK(find_ad(adv, adv_len, 0x09, &len) == NULL, "name in the advertisement");
+
+    field = find_ad(scan_rsp, scan_rsp_len, 0x09, &len);
+    CHECK(field != NULL && len == strlen(CONFIG_EXAMPLE_LOCAL_DEVICE_NAME) &&
+          memcmp(field, CONFIG_EXAMPLE_LOCAL_DEVICE_NAME, len) == 0, "name missing from the scan response");
+
+    // A malformed payload is refused and the one in use stays
+    const uint8_t bad[] = { 5, 0x09, 'x' };
+    esp_ble_gap_config_adv_data_raw((uint8_t *)bad, sizeof(bad));
+    sim_sleep_ms(50);
+    sim_ble_adv_data(adv, &len, scan_rsp, &scan_rsp_len);
+    CHECK(len == adv_len, "malformed advertising data accepted");
+    return failures;
+}
+
+// Checks a broadcast event against the keys it should carry tags for
+static int check_broadcast(const uint8_t *data, size_t len, uint32_t counter, int button,
+                           const uint8_t (*keys)[BT_SIPHASH_KEY_LEN], int key_count) {
+    size_t field_len;
+    int failures = 0;
+
+    const uint8_t *field = find_ad(data, len, 0xFF, &field_len);
+    CHECK(field != NULL && field_len == 2 + 6 + (size_t)key_count * BLE_BEACON_TAG_LEN,
+          "manufacturer data missing or %zu bytes", field != NULL ? field_len : 0);
+    if (failures > 0) {
+        return failures;
+    }
+    uint32_t got = field[2] | field[3] << 8 | field[4] << 16 | (uint32_t)field[5] << 24;
+    CHECK((field[0] | field[1] << 8) == CONFIG_BLE_BEACON_COMPANY_ID, "wrong company identifier");
+    CHECK(got == counter, "counter %lu, expected %lu", (unsigned long)got, (unsigned long)counter);
+    CHECK(field[6] == BUTTON_EVENT_SHORT && field[7] == button, "event %u of button %u", field[6], field[7]);
+    for (int i = 0; i < key_count; i++) {
+        uint64_t hash = bt_siphash24(keys[i], &field[2], 6);
+        const uint8_t *tag = &field[8 + i * BLE_BEACON_TAG_LEN];
+        CHECK(tag[0] == (uint8_t)hash && tag[1] == (uint8_t)(hash >> 8) && tag[2] == (uint8_t)(hash >> 16) &&
+              tag[3] == (uint8_t)(hash >> 24), "tag %d does not match its key", i);
+    }
+    return failures;
+}
+
+// A press reaches a scanning phone as an authenticated broadcast, without a connection
+static int scenario_beacon(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    const esp_bd_addr_t other = { 0xB0, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    const uint8_t keys[2][BT_SIPHASH_KEY_LEN] = {
+        { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF },
+        { 0xA5, 0xA5, 0xA5, 0xA5, 0xA5, 0xA5, 0xA5, 0xA5, 0x5A, 0x5A, 0x5A, 0x5A, 0x5A, 0x5A, 0x5A, 0x5A },
+    };
+    uint8_t key[BT_SIPHASH_KEY_LEN], message[15];
+    uint8_t data[31], adv[31], scan_rsp[31];
+    size_t len, adv_len, scan_rsp_len;
+    esp_bd_addr_t phone;
+    uint8_t batch[128];
+    uint8_t result[64];
+    uint32_t saved = 0;
+    int failures = 0;
+
+    // The test vector from the SipHash paper
+    for (int i = 0; i < (int)sizeof(key); i++) {
+        key[i] = i;
+    }
+    for (int i = 0; i < (int)sizeof(message); i++) {
+        message[i] = i;
+    }
+    CHECK(bt_siphash24(key, message, sizeof(message)) == 0xa129ca6149be45e5ULL, "SipHash-2-4 test vector");
+
+    // Without keys a press is not broadcast
+    press(1, 80);
+    sim_sleep_ms(100);
+    CHECK(sim_ble_broadcasts(data, &len) == 0, "broadcast with no key set");
+
+    // Two phones with keys, set while connected
+    CHECK(sim_phone_connect(&config), "phone could not connect");
+    sim_ble_phone_bda(0, phone);
+    sim_sleep_ms(100);
+    len = put_item(batch, BT_PROV_OP_ADD, phone, "phone 0");
+    len += put_item(&batch[len], BT_PROV_OP_ADD, other, "other");
+    len += put_item(&batch[len], BT_PROV_OP_KEY, phone, NULL);
+    memcpy(&batch[len], keys[0], BT_SIPHASH_KEY_LEN);
+    len += BT_SIPHASH_KEY_LEN;
+    len += put_item(&batch[len], BT_PROV_OP_KEY, other, NULL);
+    memcpy(&batch[len], keys[1], BT_SIPHASH_KEY_LEN);
+    len += BT_SIPHASH_KEY_LEN;
+    int n = provision(batch, len, result, sizeof(result));
+    CHECK(n >= 10 && result[0] == BT_PROV_BATCH_DONE && result[7] == BT_PROV_ITEM_OK && result[9] == BT_PROV_ITEM_OK,
+          "keys not set");
+    sim_phone_disconnect();
+    sim_sleep_ms(200);
+
+    // The press goes out at once, tagged for both phones
+    int64_t edge_us = esp_timer_get_time() + 80000;
+    press(2, 80);
+    uint32_t count = 0;
+    while ((count = sim_ble_broadcasts(data, &len)) == 0 && esp_timer_get_time() < edge_us + 1000000) {
+        sim_sleep_ms(1);
+    }
+    int64_t broadcast_ms = (esp_timer_get_time() - edge_us) / 1000;
+    printf("broadcast %lld ms after the press\n", (long long)broadcast_ms);
+    CHECK(count == 1, "%lu broadcasts after one press", (unsigned long)count);
+    CHECK(broadcast_ms < 50, "broadcast %lld ms after the press", (long long)broadcast_ms);
+    failures += check_broadcast(data, len, 0, 2, keys, 2);
+
+    // Connectable advertising comes back after the burst, with its own data
+    sim_sleep_ms(CONFIG_BLE_BEACON_BURST_MS + 100);
+    sim_ble_adv_data(adv, &adv_len, scan_rsp, &scan_rsp_len);
+    CHECK(adv_len == ble_adv_payload_len && memcmp(adv, ble_adv_payload, adv_len) == 0,
+          "advertising data not restored after the burst");
+    esp_ble_adv_params_t params;
+    CHECK(sim_ble_adv_params(&params) && params.adv_type != ADV_TYPE_NONCONN_IND,
+          "connectable advertising not resumed after the burst");
+
+    // Presses during a burst follow it, each with the next counter value
+    press(3, 40);
+    press(4, 40);
+    sim_sleep_ms(2 * CONFIG_BLE_BEACON_BURST_MS + 100);
+    count = sim_ble_broadcasts(data, &len);
+    CHECK(count == 3, "%lu broadcasts after three presses", (unsigned long)count);
+    failures += check_broadcast(data, len, 2, 4, keys, 2);
+    CHECK(load_beacon_counter(&saved) == ESP_OK && saved >= 3, "counter not reserved in NVS");
+
+    // A removed phone loses its tag
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    len = put_item(batch, BT_PROV_OP_REMOVE, other, NULL);
+    n = provision(batch, len, result, sizeof(result));
+    CHECK(n == 4 && result[0] == BT_PROV_BATCH_DONE && result[3] == BT_PROV_ITEM_OK, "phone not removed");
+    press(1, 80);
+    sim_sleep_ms(CONFIG_BLE_BEACON_BURST_MS);
+    CHECK(sim_ble_broadcasts(data, &len) == 4, "no broadcast while connected");
+    failures += check_broadcast(data, len, 3, 1, keys, 1);
+    return failures;
+}
+
+static bool link_is(int phone, uint8_t phy, uint16_t octets) {
+    sim_link_info_t info;
+    return sim_ble_link_info(phone, &info) && info.tx_phy == phy && info.rx_phy == phy && info.tx_octets == octets;
+}
+
+// Sends a bulk of full notifications and returns how long the link took to carry them
+static int64_t bulk_us(int phone, uint64_t *air_us) {
+    static const uint8_t data[BULK_PDU_LEN];
+    sim_link_info_t info;
+
+    sim_ble_link_info(phone, &info);
+    uint64_t air_before = info.air_us;
+    int64_t start_us = esp_timer_get_time();
+    for (int i = 0; i < BULK_PDUS; i++) {
+        ble_transport_send(phone, BLE_ATTR_DUMP_VAL, data, sizeof(data), false);
+    }
+    while (sim_ble_link_info(phone, &info) && info.queued > 0 && esp_timer_get_time() < start_us + 2000000) {
+        sim_sleep_ms(1);
+    }
+    *air_us = info.air_us - air_before;
+    return esp_timer_get_time() - start_us;
+}
+
+// Links move to 2M and long packets; old phones fall back, and bulk data is faster on the new link
+static int scenario_link(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    sim_phone_config_t old;
+    uint8_t page[64];
+    uint64_t fast_air_us, slow_air_us;
+    int failures = 0;
+
+    config.pdus_per_event = BULK_PDUS;     // Air time is what limits a connection event
+    config.event_air_us = config.conn_interval_us / 2;
+    old = config;
+    old.phy_2m = false;
+    old.max_data_len = BLE_TRANSPORT_MIN_DATA_LEN;
+
+    // The old phone leaves its data length request unanswered; the new one waits its turn
+    CHECK(sim_phone_connect_at(1, &old), "old phone could not connect");
+    sim_sleep_ms(500);
+    CHECK(sim_phone_connect_at(0, &config), "phone could not connect");
+    sim_sleep_ms(300);
+    CHECK(link_is(0, ESP_BLE_GAP_PHY_1M, BLE_TRANSPORT_MIN_DATA_LEN), "negotiated while another link was");
+
+    // Dropping the old phone lets the new one go ahead at once
+    sim_phone_disconnect_at(1);
+    sim_sleep_ms(500);
+    CHECK(link_is(0, ESP_BLE_GAP_PHY_2M, CONFIG_BLE_LINK_DATA_LEN), "not on 2M with long packets");
+
+    // Back again, the old phone stays on 1M and 27 octets once its requests time out
+    CHECK(sim_phone_connect_at(1, &old), "old phone could not reconnect");
+    sim_sleep_ms(3000);
+    CHECK(link_is(1, ESP_BLE_GAP_PHY_1M, BLE_TRANSPORT_MIN_DATA_LEN), "old phone link changed");
+
+    size_t len = ble_link_serialize(page, sizeof(page));
+    CHECK(len == 9 + BLE_SERVER_MAX_CONN * LINK_PAGE_SLOT_LEN, "link page %zu bytes", len);
+    if (len > 0) {
+        uint16_t phy_2m = page[0] | page[1] << 8;
+        uint16_t phy_1m = page[2] | page[3] << 8;
+        uint16_t data_len_long = page[4] | page[5] << 8;
+        uint16_t data_len_short = page[6] | page[7] << 8;
+        printf("links: %u on 2M, %u on 1M, %u with long packets, %u at 27 octets\n", phy_2m, phy_1m,
+               data_len_long, data_len_short);
+        // The old phone's first link ended its PHY step before it dropped
+        CHECK(phy_2m == 1 && phy_1m == 2 && data_len_long == 1 && data_len_short == 1, "link counters");
+        for (int i = 0; i < 2; i++) {
+            const uint8_t *slot = &page[9 + i * LINK_PAGE_SLOT_LEN];
+            CHECK(slot[0] == BLE_LINK_STATE_DONE, "slot %d in state %u", i, slot[0]);
+        }
+    }
+
+    int64_t fast_us = bulk_us(0, &fast_air_us);
+    int64_t slow_us = bulk_us(1, &slow_air_us);
+    printf("%d notifications of %d bytes: %lld ms and %llu us on air on 2M/%d, %lld ms and %llu us on 1M/27\n",
+           BULK_PDUS, BULK_PDU_LEN, (long long)(fast_us / 1000), (unsigned long long)fast_air_us,
+           CONFIG_BLE_LINK_DATA_LEN, (long long)(slow_us / 1000), (unsigned long long)slow_air_us);
+    CHECK(fast_air_us > 0 && slow_air_us >= 3 * fast_air_us, "air time %llu us against %llu us",
+          (unsigned long long)fast_air_us, (unsigned long long)slow_air_us);
+    CHECK(fast_us < slow_us, "bulk took %lld ms against %lld ms", (long long)(fast_us / 1000),
+          (long long)(slow_us / 1000));
+    return failures;
+}
+
+// The press and BLE holds keep the CPU up only while there is work: from the edge until the
+// event is handed to the stack, and briefly after BLE host events
+static int scenario_power(void) {
+    uint8_t page[64];
+    int failures = 0;
+
+    sim_sleep_ms(300);
+    bt_pm_reset();
+    CHECK(sim_pm_held(ESP_PM_CPU_FREQ_MAX) == 0 && sim_pm_held(ESP_PM_NO_LIGHT_SLEEP) == 0,
+          "locks held while idle");
+
+    for (int i = 0; i < 5; i++) {
+        sim_gpio_set_level(BUTTON_GPIO(1), 0);
+        sim_sleep_ms(100);
+        CHECK(sim_pm_held(ESP_PM_CPU_FREQ_MAX) > 0 && sim_pm_held(ESP_PM_NO_LIGHT_SLEEP) > 0,
+              "locks released while button 1 is down");
+        sim_gpio_set_level(BUTTON_GPIO(1), 1);
+        sim_sleep_ms(200);
+        CHECK(sim_pm_held(ESP_PM_CPU_FREQ_MAX) == 0 && sim_pm_held(ESP_PM_NO_LIGHT_SLEEP) == 0,
+              "locks still held 200 ms after press %d", i);
+        sim_sleep_ms(700);
+    }
+    size_t n = wait_records(5, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == 5, "expected 5 records, got %zu", n);
+
+    size_t len = bt_pm_serialize(page, sizeof(page));
+    CHECK(len == PM_PAGE_LEN, "power page %zu bytes", len);
+    if (len == PM_PAGE_LEN) {
+        uint32_t total_ms = page[1] | page[2] << 8 | page[3] << 16 | (uint32_t)page[4] << 24;
+        uint32_t held_ms = page[5] | page[6] << 8 | page[7] << 16 | (uint32_t)page[8] << 24;
+        uint32_t locked = page[9] | page[10] << 8 | page[11] << 16 | (uint32_t)page[12] << 24;
+        uint32_t mean_us = page[13] | page[14] << 8 | page[15] << 16 | (uint32_t)page[16] << 24;
+        printf("held %lu of %lu ms, %lu presses sent after %lu us on average\n", (unsigned long)held_ms,
+               (unsigned long)total_ms, (unsigned long)locked, (unsigned long)mean_us);
+        CHECK(page[0] & 1, "PM_ENABLE flag not set");
+        CHECK(held_ms > 0 && held_ms * 2 < total_ms, "held %lu of %lu ms", (unsigned long)held_ms,
+              (unsigned long)total_ms);
+        CHECK(locked >= 5, "%lu presses with the locks", (unsigned long)locked);
+    }
+    return failures + check_link_clean();
+}
+
+// A bonded phone that reconnects without writing the CCCD again is sent to at once,
+// until it is deleted from the registry. A phone that never bonds starts unsubscribed.
+static int scenario_resume(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    esp_bd_addr_t paired;
+    int failures = 0;
+
+    sim_ble_phone_bda(0, paired);
+    CHECK(save_bt_device(0, paired, "phone 0") == ESP_OK && save_bt_count(1) == ESP_OK, "failed to pair phone 0");
+    CHECK(sim_phone_connect(&config), "phone could not connect");
+    press(1, 30);
+    CHECK(wait_records(1, DELIVERY_TIMEOUT_MS) == 1, "first press not delivered");
+
+    sim_phone_disconnect();
+    config.subscribe = false;
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    int64_t edge_us = esp_timer_get_time() + 30000;
+    press(2, 30);
+    size_t n = wait_records(2, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == 2, "expected 2 records, got %zu", n);
+    if (n == 2) {
+        CHECK(records[1].button == 2, "second record is from button %d", records[1].button);
+        CHECK(records[1].rx_us - edge_us < 100000, "delivered %lld ms after the press",
+              (long long)((records[1].rx_us - edge_us) / 1000));
+    }
+
+    // Deleting the phone forgets its subscription; it pairs as a stranger on an open remote
+    sim_phone_disconnect();
+    CHECK(delete_bt_device(paired) == ESP_OK, "failed to delete phone 0");
+    CHECK(save_bt_device(0, paired, "phone 0") == ESP_OK && save_bt_count(1) == ESP_OK, "failed to pair phone 0");
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    press(3, 30);
+    sim_sleep_ms(500);
+    n = sim_phone_records(records, MAX_RECORDS);
+    CHECK(n == 2, "sent to a phone whose CCCD was deleted: %zu records", n);
+
+    // Its address alone is not enough to get a subscription back
+    sim_phone_disconnect();
+    CHECK(delete_bt_device(paired) == ESP_OK, "failed to delete phone 0");
+    sim_sleep_ms(100);      // The host drops its bond
+    CHECK(save_bt_device(0, paired, "phone 0") == ESP_OK && save_bt_count(1) == ESP_OK, "failed to pair phone 0");
+    config.ignore_security = true;
+    config.subscribe = true;
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    press(4, 30);
+    CHECK(wait_records(4, DELIVERY_TIMEOUT_MS) == 4, "presses not delivered to the phone without keys");
+    sim_phone_disconnect();
+    config.subscribe = false;
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    press(1, 30);
+    sim_sleep_ms(500);
+    n = sim_phone_records(records, MAX_RECORDS);
+    CHECK(n == 4, "restored the CCCD of a phone that is not bonded: %zu records", n);
+    config.subscribe = true;
+    sim_phone_disconnect();
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    CHECK(wait_records(5, DELIVERY_TIMEOUT_MS) == 5, "held press not delivered once subscribed");
+    return failures + check_link_clean();
+}
+
+static bool encrypted(int phone) {
+    sim_link_info_t info;
+    return sim_ble_link_info(phone, &info) && info.encrypted;
+}
+
+// A paired phone pairs on its first connection and its keys go into the registry; later
+// connections encrypt with them, and nothing is sent before. A device with the phone's
+// address but not its keys is turned away, and deleting the phone drops its bond.
+static int scenario_bond(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    esp_bd_addr_t paired;
+    bt_device_bond_t bond;
+    size_t n;
+    int failures = 0;
+
+    // An open remote asks no one to pair
+    CHECK(sim_phone_connect(&config), "phone could not connect");
+    sim_sleep_ms(100);
+    CHECK(sim_ble_pairings(0) == 0 && !encrypted(0), "paired with no phone in the registry");
+    sim_phone_disconnect();
+
+    sim_ble_phone_bda(0, paired);
+    CHECK(save_bt_device(0, paired, "phone 0") == ESP_OK && save_bt_count(1) == ESP_OK, "failed to add phone 0");
+    CHECK(sim_phone_connect(&config), "phone could not connect");
+    sim_sleep_ms(100);
+    CHECK(sim_ble_pairings(0) == 1 && encrypted(0), "phone did not pair on its first connection");
+    CHECK(load_bt_device_bond(paired, &bond) == ESP_OK && bond.key_size == 16, "keys not saved in the registry");
+    press(1, 30);
+    CHECK(wait_records(1, DELIVERY_TIMEOUT_MS) == 1, "press not delivered after pairing");
+
+    // Reconnecting encrypts with the stored keys, also after the cache is reloaded as at boot
+    sim_phone_disconnect();
+    CHECK(load_all_bt_devices_to_cache() == ESP_OK, "failed to reload the cache");
+    CHECK(load_bt_device_bond(paired, &bond) == ESP_OK && bond.key_size == 16, "keys not loaded into the cache");
+    config.subscribe = false;
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    int64_t edge_us = esp_timer_get_time() + 30000;
+    press(2, 30);
+    n = wait_records(2, DELIVERY_TIMEOUT_MS);
+    report(n);
+    CHECK(n == 2, "expected 2 records, got %zu", n);
+    CHECK(n < 2 || records[1].rx_us - edge_us < 100000, "delivered %lld ms after the press",
+          (long long)((records[1].rx_us - edge_us) / 1000));
+    CHECK(sim_ble_pairings(0) == 1 && encrypted(0), "phone paired again instead of encrypting");
+
+    // A link that is not encrypted is not sent to, and is closed after the timeout
+    sim_phone_disconnect();
+    config.ignore_security = true;
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    press(3, 30);
+    sim_sleep_ms(CONFIG_BLE_BOND_TIMEOUT_MS / 2);
+    CHECK(sim_phone_records(records, MAX_RECORDS) == 2, "sent before the link was encrypted");
+    sim_sleep_ms(CONFIG_BLE_BOND_TIMEOUT_MS);
+    CHECK(sim_ble_conn_interval_us() == 0, "unencrypted phone stayed connected");
+    config.ignore_security = false;
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    CHECK(wait_records(3, DELIVERY_TIMEOUT_MS) == 3, "held press not delivered once encrypted");
+
+    // Bluedroid cannot take the keys back after losing its bonds, so the phone pairs again
+    sim_ble_forget_bonds();
+    sim_phone_disconnect();
+    sim_sleep_ms(100);
+    CHECK(load_bt_device_bond(paired, &bond) == ESP_OK && bond.key_size == 0, "keys the host lost kept");
+    CHECK(sim_phone_connect(&config), "phone could not reconnect");
+    sim_sleep_ms(100);
+    CHECK(sim_ble_pairings(0) == 2 && encrypted(0), "phone did not pair again");
+    CHECK(load_bt_device_bond(paired, &bond) == ESP_OK && bond.key_size == 16, "new keys not saved");
+
+    // A device that only copies the address cannot encrypt, and may not pair over the bond
+    sim_phone_disconnect();
+    sim_ble_phone_forget_keys(0);
+    CHECK(sim_phone_connect(&config), "impostor could not connect");
+    sim_sleep_ms(100);
+    CHECK(sim_ble_conn_interval_us() == 0, "impostor stayed connected");
+    CHECK(sim_ble_pairings(0) == 2, "impostor paired");
+    CHECK(sim_ble_bonded(0), "impostor dropped the bond");
+
+    // Deleting the phone drops its keys, its bond and its accept list entry together
+    CHECK(delete_bt_device(paired) == ESP_OK, "failed to delete phone 0");
+    sim_sleep_ms(100);
+    CHECK(!sim_ble_bonded(0), "bond kept after delete");
+    CHECK(load_bt_device_bond(paired, &bond) == ESP_ERR_NVS_NOT_FOUND, "keys kept after delete");
+    CHECK(adv_filter_is(ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY), "accept list kept after delete");
+
+    // A connected phone keeps its link when deleted; the bond goes once it disconnects
+    CHECK(save_bt_device(0, paired, "phone 0") == ESP_OK && save_bt_count(1) == ESP_OK, "failed to add phone 0");
+    CHECK(sim_phone_connect(&config), "phone could not connect");
+    sim_sleep_ms(100);
+    CHECK(sim_ble_pairings(0) == 3 && sim_ble_bonded(0), "phone did not pair after being added again");
+    CHECK(delete_bt_device(paired) == ESP_OK, "failed to delete phone 0");
+    sim_sleep_ms(100);
+    CHECK(sim_ble_conn_interval_us() != 0, "deleted phone disconnected");
+    sim_phone_disconnect();
+    sim_sleep_ms(100);
+    CHECK(!sim_ble_bonded(0), "bond kept after the deleted phone disconnected");
+
+    // Removing and adding the phone in one batch drops its keys as well, and it pairs anew
+    CHECK(save_bt_device(0, paired, "phone 0") == ESP_OK && save_bt_count(1) == ESP_OK, "failed to add phone 0");
+    CHECK(sim_phone_connect(&config), "phone could not connect");
+    sim_sleep_ms(100);
+    CHECK(sim_ble_pairings(0) == 4 && sim_ble_bonded(0), "phone did not pair after being added again");
+    sim_phone_disconnect();
+    sim_sleep_ms(100);
+    CHECK(bt_device_batch_begin(CONFIG_BT_PROV_MAX_DEVICES) == ESP_OK, "failed to open a batch");
+    CHECK(bt_device_batch_remove(paired) == ESP_OK && bt_device_batch_add(paired, "phone 0") == ESP_OK,
+          "failed to stage the batch");
+    CHECK(bt_device_batch_commit(NULL) == ESP_OK, "failed to commit the batch");
+    CHECK(load_bt_device_bond(paired, &bond) == ESP_OK && bond.key_size == 0, "keys kept after the batch");
+    sim_sleep_ms(100);
+    CHECK(!sim_ble_bonded(0), "bond kept after the batch");
+    CHECK(sim_phone_connect(&config), "phone could not connect");
+    sim_sleep_ms(100);
+    CHECK(sim_ble_pairings(0) == 5 && encrypted(0), "phone did not pair anew after the batch");
+    return failures + check_link_clean();
+}
+
+// Returns the dump bytes a phone received once they stop coming
+static uint32_t wait_dump(int phone) {
+    sim_phone_stats_t stats;
+    uint32_t last;
+
+    sim_phone_get_stats_at(phone, &stats);
+    do {
+        last = stats.dump_bytes;
+        sim_sleep_ms(300);
+        sim_phone_get_stats_at(phone, &stats);
+    } while (stats.dump_bytes != last);
+    return stats.dump_bytes;
+}
+
+// Two phones ask for the flight recorder dump at once: the first takes it whole, the
+// second gets nothing until the dump is over, and then its own
+static int scenario_dump(void) {
+    sim_phone_config_t config = SIM_PHONE_CONFIG_DEFAULT();
+    const uint8_t start = 0x01;
+    int failures = 0;
+
+    CHECK(sim_phone_connect_at(0, &config) && sim_phone_connect_at(1, &config), "phones could not connect");
+    sim_phone_subscribe_at(0, DUMP_CHAR_UUID_TAIL, 0x0001);
+    sim_phone_subscribe_at(1, DUMP_CHAR_UUID_TAIL, 0x0001);
+    press(1, 30);
+    sim_sleep_ms(100);
+
+    sim_phone_write_at(0, DUMP_CHAR_UUID_TAIL, &start, 1);
+    sim_phone_write_at(1, DUMP_CHAR_UUID_TAIL, &start, 1);
+    uint32_t first = wait_dump(0);
+    uint32_t second = wait_dump(1);
+    printf("dump: phone 0 %lu bytes, phone 1 %lu bytes\n", (unsigned long)first, (unsigned long)second);
+    CHECK(first > 8 && (first - 8) % FLIGHT_REC_SECTOR_SIZE == 0, "phone 0: dump of %lu bytes", (unsigned long)first);
+    CHECK(second == 0, "phone 1 took over the dump: %lu bytes", (unsigned long)second);
+
+    sim_phone_write_at(1, DUMP_CHAR_UUID_TAIL, &start, 1);
+    second = wait_dump(1);
+    CHECK(second == first, "phone 1: dump of %lu bytes after it was free, phone 0 got %lu", (unsigned long)second,
+          (unsigned long)first);
+    return failures + check_link_clean();
+}
+
+// The flightrec partition, read out as with esptool.py, decodes to the boot, the
+// connection and the press, in the order they happened
+static int scenario_flightrec(void) {
+    static const char *const expected[] = {
+        "=== boot 1 ===", "boot 1, reset reason", "connected, conn_id", "button 1 short press, seq",
+    };
+    char path[] = "/tmp/flightrec-XXXXXX";
+    char command[512];
+    char line[256];
+    size_t found = 0;
+    int failures = 0;
+
+    press(1, 30);
+    CHECK(wait_records(1, DELIVERY_TIMEOUT_MS) == 1, "press not delivered");
+    sim_sleep_ms(CONFIG_FLIGHT_REC_FLUSH_MS + 500);    // The writer task flushes its batch
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        CHECK(false, "failed to create %s", path);
+        return failures;
+    }
+    close(fd);
+    CHECK(sim_partition_save(FLIGHT_REC_PARTITION_LABEL, path), "failed to save the partition");
+
+    snprintf(command, sizeof(command), "%s %s %s", SIM_PYTHON, SIM_FLIGHT_REC_DECODER, path);
+    FILE *out = popen(command, "r");
+    CHECK(out != NULL, "failed to run %s", command);
+    while (out != NULL && fgets(line, sizeof(line), out) != NULL) {
+        fputs(line, stdout);
+        if (found < sizeof(expected) / sizeof(expected[0]) && strstr(line, expected[found]) != NULL) {
+            found++;
+        }
+        CHECK(strstr(line, "integrity check") == NULL, "torn records in the partition");
+    }
+    int status = out != NULL ? pclose(out) : -1;
+    unlink(path);
+    CHECK(status == 0, "decoder exited with status %d", status);
+    CHECK(found == sizeof(expected) / sizeof(expected[0]), "decoder output lacks \"%s\"", expected[found]);
+    return failures + check_link_clean();
+}
+
+const sim_scenario_t sim_scenarios[] = {
+    { "single", true, scenario_single },
+    { "bounce", true, scenario_bounce },
+    { "chord", true, scenario_chord },
+    { "burst", true, scenario_burst },
+    { "flood", true, scenario_flood },
+    { "offline", false, scenario_offline },
+    { "indicate", false, scenario_indicate },
+    { "refused", false, scenario_refused },
+    { "reconnect", true, scenario_reconnect },
+    { "connparams", true, scenario_connparams },
+    { "connreject", false, scenario_connreject },
+    { "advtiers", true, scenario_advtiers },
+    { "twophones", true, scenario_twophones },
+    { "acceptlist", false, scenario_acceptlist },
+    { "provision", false, scenario_provision },
+    { "advdata", false, scenario_advdata },
+    { "beacon", false, scenario_beacon },
+    { "link", false, scenario_link },
+    { "power", true, scenario_power },
+    { "resume", false, scenario_resume },
+    { "bond", false, scenario_bond },
+    { "flightrec", true, scenario_flightrec },
+    { "dump", false, scenario_dump },
+};
+
+const size_t sim_scenario_count = sizeof(sim_scenarios) / sizeof(sim_scenarios[0]);
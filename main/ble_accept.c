@@ -0,0 +1,324 @@
+/**
+ * @file ble_accept.c
+ * @brief Controller accept list with a host-side fallback.
+ *
+ * The host keeps the full list of paired phones; the controller holds as many of them
+ * as fit. Changes are queued on the entries and applied one stack call at a time from
+ * the timer service task, with advertising paused, since the controller does not take
+ * changes to a list its advertising filter is using. Each change is completed by
+ * BLE_TRANSPORT_EVT_ACCEPT_LIST, in the host task or, on NimBLE, within the call.
+ *
+ * A phone that did not fit into the controller, or that the controller refused, stays
+ * on the host list only; advertising is then open to everyone and ble_accept_admit()
+ * turns away the phones that are not on the list when they connect.
+ */
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BLE_ACCEPT_LIST
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "ble_accept.h"
+#include "ble_adv.h"
+#include "ble_transport.h"
+#include "data_storage.h"
+
+#define TAG "BLE_ACCEPT"
+
+#define MAX_ENTRIES         CONFIG_BLE_ACCEPT_LIST_MAX
+#define PEND_TIMEOUT_TICKS  pdMS_TO_TICKS(100)
+
+typedef enum {
+    OP_NONE,
+    OP_ADD,         // Put into the controller
+    OP_REMOVE,      // Take out of the controller and drop
+} entry_op_t;
+
+typedef struct {
+    bool used;
+    esp_bd_addr_t bda;
+    esp_ble_addr_type_t type;
+    bool in_controller;
+    entry_op_t op;                  // Change still to be made
+} entry_t;
+
+static portMUX_TYPE accept_mux = portMUX_INITIALIZER_UNLOCKED;
+static entry_t entries[MAX_ENTRIES];
+static bool started;                // The stack is up
+static bool loaded;                 // The paired-device cache was read
+static bool paused;                 // Advertising is held back for a change
+static bool changed;                // The filter policy may differ from the one advertising uses
+static int in_flight = -1;          // Entry whose change the stack is making
+static bool in_flight_add;
+static uint16_t controller_size;
+static uint16_t controller_count;
+
+static int find_entry(const esp_bd_addr_t bda) {
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].used && memcmp(entries[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Call with accept_mux held
+static bool listed(const entry_t *e) {
+    return e->used && e->op != OP_REMOVE;
+}
+
+// Call with accept_mux held; returns false if the host list is full
+static bool queue_add(const esp_bd_addr_t bda, esp_ble_addr_type_t type) {
+    int i = find_entry(bda);
+    changed = true;
+    if (i >= 0) {
+        entries[i].op = entries[i].in_controller && i != in_flight ? OP_NONE : OP_ADD;
+        return true;
+    }
+    for (i = 0; i < MAX_ENTRIES; i++) {
+        if (!entries[i].used) {
+            entries[i] = (entry_t) { .used = true, .type = type, .op = OP_ADD };
+            memcpy(entries[i].bda, bda, sizeof(esp_bd_addr_t));
+            return true;
+        }
+    }
+    return false;
+}
+
+// Call with accept_mux held
+static void queue_remove(const esp_bd_addr_t bda) {
+    int i = find_entry(bda);
+    if (i < 0) {
+        return;
+    }
+    changed = true;
+    if (entries[i].in_controller || i == in_flight) {
+        entries[i].op = OP_REMOVE;
+    } else {
+        entries[i].used = false;
+    }
+}
+
+// Call with accept_mux held; gives the phones left on the host list another try at a freed slot
+static void requeue_host_only(void) {
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].used && !entries[i].in_controller && entries[i].op == OP_NONE) {
+            entries[i].op = OP_ADD;
+        }
+    }
+}
+
+// Makes the queued changes one at a time; runs in the timer service task
+static void apply(void *arg1, uint32_t arg2) {
+    while (1) {
+        portENTER_CRITICAL(&accept_mux);
+        if (!started || !loaded || in_flight >= 0) {
+            portEXIT_CRITICAL(&accept_mux);
+            return;
+        }
+        int i = 0;
+        while (i < MAX_ENTRIES && !(entries[i].used && entries[i].op != OP_NONE)) {
+            i++;
+        }
+        if (i == MAX_ENTRIES) {
+            bool resume = paused || changed;
+            bool held = paused;
+            paused = false;
+            changed = false;
+            portEXIT_CRITICAL(&accept_mux);
+            if (resume) {
+                ESP_LOGI(TAG, "%u phones in the controller accept list, filter %s", controller_count,
+                         ble_accept_filtering() ? "on" : "open");
+                // Pauses nest, so a restart for the new filter policy takes a pause of its own
+                if (!held) {
+                    ble_adv_pause();
+                }
+                ble_adv_resume();
+            }
+            return;
+        }
+
+        entry_t *e = &entries[i];
+        if (e->op == OP_ADD && controller_count >= controller_size) {
+            e->op = OP_NONE;
+            portEXIT_CRITICAL(&accept_mux);
+            ESP_LOGW(TAG, "Controller accept list full, checking "ESP_BD_ADDR_STR" on connect", ESP_BD_ADDR_HEX(e->bda));
+            continue;
+        }
+        if (e->op == OP_REMOVE && !e->in_controller) {
+            e->used = false;
+            portEXIT_CRITICAL(&accept_mux);
+            continue;
+        }
+        esp_bd_addr_t bda;
+        memcpy(bda, e->bda, sizeof(bda));
+        esp_ble_addr_type_t type = e->type;
+        bool add = e->op == OP_ADD;
+        bool pause = !paused;
+        in_flight = i;
+        in_flight_add = add;
+        paused = true;
+        portEXIT_CRITICAL(&accept_mux);
+
+        if (pause) {
+            ble_adv_pause();
+        }
+        esp_err_t err = ble_transport_accept_list_update(add, bda, type);
+        if (err == ESP_OK) {
+            return;     // Continued by ble_accept_on_update_complete()
+        }
+        ESP_LOGW(TAG, "Failed to update the accept list: %s", esp_err_to_name(err));
+        ble_accept_on_update_complete(UINT8_MAX);
+        return;
+    }
+}
+
+static void pend_apply(void) {
+    if (xTimerPendFunctionCall(apply, NULL, 0, PEND_TIMEOUT_TICKS) != pdPASS) {
+        ESP_LOGE(TAG, "Timer queue full, accept list not updated");
+    }
+}
+
+// The host puts the IRK of every bond into the controller's resolving list, so a phone
+// that uses resolvable private addresses matches the identity address saved with its keys
+static esp_ble_addr_type_t addr_type(const esp_bd_addr_t mac) {
+    bt_device_bond_t bond;
+
+    if (load_bt_device_bond(mac, &bond) == ESP_OK && bond.key_size > 0 && bond.addr_type == BLE_ADDR_TYPE_RANDOM) {
+        return BLE_ADDR_TYPE_RANDOM;
+    }
+    return BLE_ADDR_TYPE_PUBLIC;
+}
+
+static void on_device_change(const esp_bd_addr_t mac, bool added) {
+    esp_ble_addr_type_t type = added ? addr_type(mac) : BLE_ADDR_TYPE_PUBLIC;
+
+    portENTER_CRITICAL(&accept_mux);
+    bool ok = true;
+    if (added) {
+        ok = queue_add(mac, type);
+    } else {
+        queue_remove(mac);
+    }
+    portEXIT_CRITICAL(&accept_mux);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Accept list full, "ESP_BD_ADDR_STR" cannot connect", ESP_BD_ADDR_HEX(mac));
+        return;
+    }
+    pend_apply();
+}
+
+void ble_accept_start(void) {
+    uint16_t size = 0;
+
+    if (ble_transport_accept_list_size(&size) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to read the accept list size, checking phones on connect");
+    }
+    ble_adv_pause();
+    portENTER_CRITICAL(&accept_mux);
+    controller_size = size;
+    started = true;
+    paused = true;
+    portEXIT_CRITICAL(&accept_mux);
+    pend_apply();
+}
+
+void ble_accept_load_cache(void) {
+    int32_t count = get_device_count_cache();
+    esp_bd_addr_t mac;
+
+    for (int32_t i = 0; i < count; i++) {
+        if (get_bt_device_mac_from_cache(i, &mac) != ESP_OK) {
+            continue;
+        }
+        esp_ble_addr_type_t type = addr_type(mac);
+        portENTER_CRITICAL(&accept_mux);
+        bool ok = queue_add(mac, type);
+        portEXIT_CRITICAL(&accept_mux);
+        if (!ok) {
+            ESP_LOGE(TAG, "Accept list full, "ESP_BD_ADDR_STR" cannot connect", ESP_BD_ADDR_HEX(mac));
+        }
+    }
+    if (add_bt_device_change_callback(on_device_change) != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot follow the paired-device cache, the accept list stays as loaded");
+    }
+
+    portENTER_CRITICAL(&accept_mux);
+    loaded = true;
+    portEXIT_CRITICAL(&accept_mux);
+    pend_apply();
+}
+
+void ble_accept_on_update_complete(uint8_t status) {
+    bool ok = status == 0;
+
+    portENTER_CRITICAL(&accept_mux);
+    if (in_flight < 0) {
+        portEXIT_CRITICAL(&accept_mux);
+        return;
+    }
+    entry_t *e = &entries[in_flight];
+    in_flight = -1;
+    if (in_flight_add) {
+        if (ok) {
+            e->in_controller = true;
+            controller_count++;
+        }
+        // A refused phone stays on the host list; a removal queued meanwhile is kept
+        if (e->op == OP_ADD) {
+            e->op = OP_NONE;
+        }
+    } else {
+        if (ok && e->in_controller) {
+            e->in_controller = false;
+            controller_count--;
+            requeue_host_only();
+        }
+        if (e->op == OP_REMOVE) {
+            e->used = false;
+            e->op = OP_NONE;
+        }
+    }
+    portEXIT_CRITICAL(&accept_mux);
+
+    if (!ok) {
+        ESP_LOGW(TAG, "Controller refused accept list %s, status 0x%x", in_flight_add ? "add" : "remove", status);
+    }
+    pend_apply();
+}
+
+bool ble_accept_admit(const esp_bd_addr_t bda) {
+    bool any = false;
+    bool found = false;
+
+    portENTER_CRITICAL(&accept_mux);
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (listed(&entries[i])) {
+            any = true;
+            found = found || memcmp(entries[i].bda, bda, sizeof(esp_bd_addr_t)) == 0;
+        }
+    }
+    portEXIT_CRITICAL(&accept_mux);
+    return !any || found;
+}
+
+bool ble_accept_filtering(void) {
+    uint16_t count = 0;
+    bool all_in_controller = true;
+
+    portENTER_CRITICAL(&accept_mux);
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (listed(&entries[i])) {
+            count++;
+            all_in_controller = all_in_controller && entries[i].in_controller;
+        }
+    }
+    portEXIT_CRITICAL(&accept_mux);
+    return count > 0 && all_in_controller;
+}
+
+#endif // CONFIG_BLE_ACCEPT_LIST
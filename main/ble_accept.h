@@ -0,0 +1,86 @@
+#ifndef BLE_ACCEPT_H
+#define BLE_ACCEPT_H
+
+// ble_accept.h - Controller accept list of the paired phones (CONFIG_BLE_ACCEPT_LIST)
+//
+// The addresses in the paired-device cache are loaded into the controller's accept list
+// (white list), and advertising only takes connections from it. Phones that use
+// resolvable private addresses are matched through the IRK of their bond, kept with
+// their registry entry (ble_bond.h). Addresses that do not fit into the controller are
+// checked by the host on connect instead, with advertising open to everyone. While no
+// phone is paired the remote takes connections from any phone.
+
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include <stdint.h>
+#include "ble_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_BLE_ACCEPT_LIST
+
+/**
+ * @brief Reads the controller's accept list size.
+ *
+ * Call from the server once the host is ready and before advertising starts.
+ * Advertising is held back until the list is in the controller.
+ */
+void ble_accept_start(void);
+
+/**
+ * @brief Adds the phones in the paired-device cache and follows later changes to it.
+ *
+ * Call once load_all_bt_devices_to_cache() has run; may run before or after ble_accept_start().
+ */
+void ble_accept_load_cache(void);
+
+/**
+ * @brief Handles BLE_TRANSPORT_EVT_ACCEPT_LIST.
+ *
+ * @param status Status reported by the host, 0 on success.
+ */
+void ble_accept_on_update_complete(uint8_t status);
+
+/**
+ * @brief Returns true if a phone with the given address may stay connected.
+ *
+ * Always true while no phone is paired.
+ */
+bool ble_accept_admit(const esp_bd_addr_t bda);
+
+/**
+ * @brief Returns true if advertising should only take connections from the controller's list.
+ *
+ * True when every paired phone is in the controller's list, false while none is paired
+ * or some are only on the host list.
+ */
+bool ble_accept_filtering(void);
+
+#else
+
+static inline void ble_accept_start(void) {
+}
+
+static inline void ble_accept_load_cache(void) {
+}
+
+static inline void ble_accept_on_update_complete(uint8_t status) {
+}
+
+static inline bool ble_accept_admit(const esp_bd_addr_t bda) {
+    return true;
+}
+
+static inline bool ble_accept_filtering(void) {
+    return false;
+}
+
+#endif // CONFIG_BLE_ACCEPT_LIST
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_ACCEPT_H
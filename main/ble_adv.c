@@ -0,0 +1,362 @@
+/**
+ * @file ble_adv.c
+ * @brief Advertising tier scheduler and time-to-connect statistics.
+ *
+ * A session runs from a disconnect, the first advertising start or a button press
+ * until the next connection. Its tiers trade radio duty cycle for discovery speed:
+ * a phone that knows the remote reconnects during the directed burst or the fast tier,
+ * and the slow tier only keeps the remote findable.
+ *
+ * Tier changes run in the timer service task, so they never race each other. The host
+ * task reports connections and advertising results; a start that completes after a
+ * phone connected is stopped again.
+ *
+ * While a connection slot is free the remote keeps advertising after a connection, so
+ * a second phone can join; the directed burst is skipped while its target is connected.
+ *
+ * The accept list pauses advertising while it changes the controller's list, and the
+ * event broadcast while it sends a burst; a session that reaches a tier during a pause
+ * starts advertising once every pause is resumed.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "ble_accept.h"
+#include "ble_adv.h"
+#include "ble_server.h"
+#include "ble_transport.h"
+#include "bt_trace.h"
+#include "data_storage.h"
+#include "flight_rec.h"
+
+#define TAG "BLE_ADV"
+
+#define DIRECTED_MS         1280    // Longest high duty cycle directed advertising allowed by the spec
+#define PEND_TIMEOUT_TICKS  pdMS_TO_TICKS(100)
+
+typedef struct {
+    uint16_t connects;
+    uint32_t last_ms;
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint32_t total_ms;
+} tier_stats_t;
+
+static const char *const tier_names[BLE_ADV_TIER_COUNT] = {
+    [BLE_ADV_TIER_DIRECTED] = "directed",
+    [BLE_ADV_TIER_FAST] = "fast",
+    [BLE_ADV_TIER_SLOW] = "slow",
+};
+
+static portMUX_TYPE adv_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool connected;
+static volatile bool active;                // A session is running
+static volatile ble_adv_tier_t tier;        // Tier in use while active
+static volatile ble_adv_tier_t top_tier;    // Tier the session started at
+static volatile bool restart_pending;
+static bool advertising;                    // Advertising was started and not stopped since
+static uint8_t pause_count;                 // ble_adv_pause() calls not resumed yet
+static int64_t session_start_us;
+static bool have_peer;
+static esp_bd_addr_t peer_bda;
+static uint8_t peer_addr_type;
+static tier_stats_t stats[BLE_ADV_TIER_COUNT];
+static TimerHandle_t tier_timer;
+
+// A resolvable private address changes every few minutes
+static bool is_rpa(const esp_bd_addr_t bda, uint8_t addr_type) {
+    return addr_type == BLE_ADDR_TYPE_RANDOM && (bda[0] & 0xC0) == 0x40;
+}
+
+// Directed advertising to a resolvable private address goes nowhere
+static bool peer_is_directable(void) {
+    return have_peer && !is_rpa(peer_bda, peer_addr_type) && peer_addr_type <= BLE_ADDR_TYPE_RANDOM;
+}
+
+static void enter_tier(ble_adv_tier_t next) {
+    ble_transport_adv_t params = {
+        .accept_list = ble_accept_filtering(),
+    };
+    uint32_t duration_ms = 0;
+
+    portENTER_CRITICAL(&adv_mux);
+    if (!active) {
+        portEXIT_CRITICAL(&adv_mux);
+        return;
+    }
+    tier = next;
+    if (pause_count > 0) {
+        portEXIT_CRITICAL(&adv_mux);
+        return;
+    }
+    bool restart = advertising;
+    advertising = true;
+    memcpy(params.peer, peer_bda, sizeof(params.peer));
+    params.peer_type = peer_addr_type;
+    portEXIT_CRITICAL(&adv_mux);
+
+    switch (next) {
+        case BLE_ADV_TIER_DIRECTED:
+            params.directed = true;
+            duration_ms = DIRECTED_MS;
+            break;
+        case BLE_ADV_TIER_FAST:
+            params.int_min = CONFIG_BLE_ADV_FAST_MIN_INT;
+            params.int_max = CONFIG_BLE_ADV_FAST_MAX_INT;
+            duration_ms = CONFIG_BLE_ADV_FAST_DURATION_MS;
+            break;
+        default:
+            params.int_min = CONFIG_BLE_ADV_SLOW_MIN_INT;
+            params.int_max = CONFIG_BLE_ADV_SLOW_MAX_INT;
+            break;
+    }
+
+    ESP_LOGD(TAG, "Advertising tier %s", tier_names[next]);
+    if (restart) {
+        ble_transport_adv_stop();
+    }
+    esp_err_t err = ble_transport_adv_start(&params);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start %s advertising: %s", tier_names[next], esp_err_to_name(err));
+    }
+    if (duration_ms > 0) {
+        xTimerChangePeriod(tier_timer, pdMS_TO_TICKS(duration_ms), 0);
+    } else {
+        xTimerStop(tier_timer, 0);
+    }
+}
+
+static ble_adv_tier_t first_tier(void) {
+#ifdef CONFIG_BLE_ADV_DIRECTED
+    // While the last phone is still connected, advertising is for another one
+    if (peer_is_directable() && !ble_server_is_peer_connected(peer_bda)) {
+        return BLE_ADV_TIER_DIRECTED;
+    }
+#endif
+    return BLE_ADV_TIER_FAST;
+}
+
+static void start_session(void *arg1, uint32_t arg2) {
+    portENTER_CRITICAL(&adv_mux);
+    restart_pending = false;
+    active = !connected;
+    session_start_us = esp_timer_get_time();
+    top_tier = first_tier();
+    portEXIT_CRITICAL(&adv_mux);
+    enter_tier(top_tier);
+}
+
+// Moves on from the given tier, unless the session has moved on already
+static void advance(void *arg1, uint32_t from) {
+    if (active && tier == from && from + 1 < BLE_ADV_TIER_COUNT) {
+        enter_tier(from + 1);
+    }
+}
+
+static void tier_timer_callback(TimerHandle_t timer) {
+    advance(NULL, tier);
+}
+
+void ble_adv_pause(void) {
+    portENTER_CRITICAL(&adv_mux);
+    bool stop = advertising;
+    pause_count++;
+    advertising = false;
+    portEXIT_CRITICAL(&adv_mux);
+
+    xTimerStop(tier_timer, 0);
+    if (stop) {
+        ble_transport_adv_stop();
+    }
+}
+
+void ble_adv_resume(void) {
+    portENTER_CRITICAL(&adv_mux);
+    if (pause_count > 0) {
+        pause_count--;
+    }
+    bool resume = active && pause_count == 0;
+    ble_adv_tier_t t = tier;
+    portEXIT_CRITICAL(&adv_mux);
+
+    if (resume) {
+        enter_tier(t);
+    }
+}
+
+esp_err_t ble_adv_init(void) {
+    tier_timer = xTimerCreate("adv_tier", pdMS_TO_TICKS(DIRECTED_MS), pdFALSE, NULL, tier_timer_callback);
+    if (tier_timer == NULL) {
+        ESP_LOGE(TAG, "Failed to create advertising timer");
+        return ESP_ERR_NO_MEM;
+    }
+#ifdef CONFIG_NVS_ENABLE
+    have_peer = load_last_peer(peer_bda, &peer_addr_type) == ESP_OK;
+#endif
+    return ESP_OK;
+}
+
+void ble_adv_start(void) {
+    portENTER_CRITICAL(&adv_mux);
+    connected = false;
+    restart_pending = true;
+    portEXIT_CRITICAL(&adv_mux);
+    if (xTimerPendFunctionCall(start_session, NULL, 0, PEND_TIMEOUT_TICKS) != pdPASS) {
+        ESP_LOGE(TAG, "Timer queue full, advertising not started");
+    }
+}
+
+#ifdef CONFIG_NVS_ENABLE
+// Saves the peer for the directed tier after a reboot; runs in the timer service task, off the host
+static void save_peer(void *arg1, uint32_t arg2) {
+    esp_bd_addr_t bda;
+
+    portENTER_CRITICAL(&adv_mux);
+    memcpy(bda, peer_bda, sizeof(bda));
+    uint8_t addr_type = peer_addr_type;
+    portEXIT_CRITICAL(&adv_mux);
+
+    if (save_last_peer(bda, addr_type) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save the phone's address");
+    }
+}
+#endif
+
+void ble_adv_on_connect(const esp_bd_addr_t bda, esp_ble_addr_type_t addr_type) {
+    uint32_t elapsed_ms = 0;
+
+    portENTER_CRITICAL(&adv_mux);
+    bool was_active = active;
+    ble_adv_tier_t t = tier;
+    connected = true;
+    active = false;
+    advertising = false;    // The controller stops advertising on connect
+    if (was_active) {
+        elapsed_ms = (esp_timer_get_time() - session_start_us) / 1000;
+        tier_stats_t *s = &stats[t];
+        if (s->connects == 0 || elapsed_ms < s->min_ms) {
+            s->min_ms = elapsed_ms;
+        }
+        if (elapsed_ms > s->max_ms) {
+            s->max_ms = elapsed_ms;
+        }
+        s->connects++;
+        s->last_ms = elapsed_ms;
+        s->total_ms += elapsed_ms;
+    }
+    bool new_peer = !have_peer || peer_addr_type != addr_type || memcmp(peer_bda, bda, sizeof(peer_bda)) != 0;
+    memcpy(peer_bda, bda, sizeof(peer_bda));
+    peer_addr_type = addr_type;
+    have_peer = true;
+    portEXIT_CRITICAL(&adv_mux);
+
+    xTimerStop(tier_timer, 0);
+    if (was_active) {
+        BT_TRACE(BLE, INFO, BLE_ADV_CONNECT, t, elapsed_ms);
+        flight_rec_log(FLIGHT_REC_ADV_CONNECT, t, elapsed_ms, 0);
+    }
+#ifdef CONFIG_NVS_ENABLE
+    // Not for a resolvable private address: the directed tier skips it, and it would be
+    // written on almost every connection
+    if (new_peer && !is_rpa(bda, addr_type) &&
+        xTimerPendFunctionCall(save_peer, NULL, 0, PEND_TIMEOUT_TICKS) != pdPASS) {
+        ESP_LOGW(TAG, "Timer queue full, the phone's address not saved");
+    }
+#endif
+}
+
+void ble_adv_on_start_complete(uint8_t status) {
+    portENTER_CRITICAL(&adv_mux);
+    bool stale = !active && !restart_pending;
+    ble_adv_tier_t t = tier;
+    portEXIT_CRITICAL(&adv_mux);
+
+    if (status == 0) {
+        if (stale) {
+            ble_transport_adv_stop();
+        }
+        return;
+    }
+    ESP_LOGW(TAG, "Controller refused %s advertising, status 0x%x", tier_names[t], status);
+    if (!stale) {
+        xTimerPendFunctionCall(advance, NULL, t, PEND_TIMEOUT_TICKS);
+    }
+}
+
+void IRAM_ATTR ble_adv_on_activity_from_isr(void) {
+    BaseType_t woken = pdFALSE;
+
+    if (!active || tier == top_tier || restart_pending) {
+        return;
+    }
+    restart_pending = true;
+    if (xTimerPendFunctionCallFromISR(start_session, NULL, 0, &woken) != pdPASS) {
+        restart_pending = false;
+    }
+    if (woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v) {
+    *p++ = v & 0xFF;
+    *p++ = v >> 8;
+    return p;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+    p = put_u16(p, v & 0xFFFF);
+    return put_u16(p, v >> 16);
+}
+
+size_t ble_adv_serialize(uint8_t *buf, size_t len) {
+    size_t needed = 1 + BLE_ADV_TIER_COUNT * 19;
+    tier_stats_t copy[BLE_ADV_TIER_COUNT];
+
+    if (len < needed) {
+        return 0;
+    }
+    portENTER_CRITICAL(&adv_mux);
+    memcpy(copy, stats, sizeof(copy));
+    portEXIT_CRITICAL(&adv_mux);
+
+    uint8_t *p = buf;
+    *p++ = BLE_ADV_TIER_COUNT;
+    for (size_t i = 0; i < BLE_ADV_TIER_COUNT; i++) {
+        *p++ = i;
+        p = put_u16(p, copy[i].connects);
+        p = put_u32(p, copy[i].last_ms);
+        p = put_u32(p, copy[i].min_ms);
+        p = put_u32(p, copy[i].max_ms);
+        p = put_u32(p, copy[i].total_ms);
+    }
+    return p - buf;
+}
+
+void ble_adv_dump(void) {
+    tier_stats_t copy[BLE_ADV_TIER_COUNT];
+
+    portENTER_CRITICAL(&adv_mux);
+    memcpy(copy, stats, sizeof(copy));
+    portEXIT_CRITICAL(&adv_mux);
+
+    for (size_t i = 0; i < BLE_ADV_TIER_COUNT; i++) {
+        if (copy[i].connects == 0) {
+            ESP_LOGI(TAG, "Tier %-8s no connections", tier_names[i]);
+            continue;
+        }
+        ESP_LOGI(TAG, "Tier %-8s %u connections, time to connect last %lu ms, min %lu, avg %lu, max %lu",
+                 tier_names[i], copy[i].connects, (unsigned long)copy[i].last_ms, (unsigned long)copy[i].min_ms,
+                 (unsigned long)(copy[i].total_ms / copy[i].connects), (unsigned long)copy[i].max_ms);
+    }
+}
+
+void ble_adv_reset(void) {
+    portENTER_CRITICAL(&adv_mux);
+    memset(stats, 0, sizeof(stats));
+    portEXIT_CRITICAL(&adv_mux);
+}
@@ -0,0 +1,116 @@
+#ifndef BLE_ADV_H
+#define BLE_ADV_H
+
+// ble_adv.h - Tiered advertising: directed burst to the last phone, then fast, then slow
+//
+// Every advertising session starts at the top tier: 1.28 s of high duty cycle directed
+// advertising to the last connected phone (CONFIG_BLE_ADV_DIRECTED), then
+// CONFIG_BLE_ADV_FAST_DURATION_MS of fast undirected advertising, then slow undirected
+// advertising until a phone connects. A button press while disconnected starts a new
+// session. The time from the start of a session to the connection is recorded per tier.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "ble_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    BLE_ADV_TIER_DIRECTED,
+    BLE_ADV_TIER_FAST,
+    BLE_ADV_TIER_SLOW,
+    BLE_ADV_TIER_COUNT,
+} ble_adv_tier_t;
+
+/**
+ * @brief Creates the tier timer and loads the last phone's address from NVS.
+ *
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NO_MEM: If the timer could not be created.
+ */
+esp_err_t ble_adv_init(void);
+
+/**
+ * @brief Starts an advertising session at the top tier.
+ *
+ * Called once the advertising data is set and after every disconnect. The tier
+ * changes are made from the timer service task.
+ */
+void ble_adv_start(void);
+
+/**
+ * @brief Ends the session and records its time to connect.
+ *
+ * Saves the phone's address for directed advertising if it changed.
+ *
+ * @param bda       Peer address.
+ * @param addr_type Peer address type.
+ */
+void ble_adv_on_connect(const esp_bd_addr_t bda, esp_ble_addr_type_t addr_type);
+
+/**
+ * @brief Handles BLE_TRANSPORT_EVT_ADV_STARTED.
+ *
+ * Moves on to the next tier if the controller refused the current one, and stops
+ * advertising that started after a phone connected.
+ *
+ * @param status Status reported by the host, 0 on success.
+ */
+void ble_adv_on_start_complete(uint8_t status);
+
+/**
+ * @brief Reports button activity: restarts the session at the top tier if it has
+ *        dropped to a lower one.
+ *
+ * Called from the button ISR on a press edge. Does nothing while connected.
+ */
+void ble_adv_on_activity_from_isr(void);
+
+/**
+ * @brief Stops advertising without ending the session.
+ *
+ * Tier changes during the pause take effect on ble_adv_resume(). Pauses nest, so
+ * advertising restarts on the ble_adv_resume() that matches the first pause. Call from
+ * the timer service task, or before advertising has started.
+ */
+void ble_adv_pause(void);
+
+/**
+ * @brief Ends a pause and, if no other pause holds advertising, restarts it at the
+ *        session's current tier, with the filter policy of the accept list as it is
+ *        now. Call from the timer service task.
+ */
+void ble_adv_resume(void);
+
+/**
+ * @brief Serializes the time-to-connect statistics for the diagnostics characteristic.
+ *
+ * Layout (little-endian):
+ *   u8  tier count, then per tier: u8 tier ID (ble_adv_tier_t), u16 connections,
+ *       u32 last, u32 min, u32 max and u32 total time to connect in ms
+ *
+ * @param buf Output buffer.
+ * @param len Size of the output buffer.
+ * @return Number of bytes written, or 0 if the buffer is too small.
+ */
+size_t ble_adv_serialize(uint8_t *buf, size_t len);
+
+/**
+ * @brief Logs the time-to-connect statistics to the console.
+ */
+void ble_adv_dump(void);
+
+/**
+ * @brief Clears the time-to-connect statistics.
+ */
+void ble_adv_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_ADV_H
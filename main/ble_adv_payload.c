@@ -0,0 +1,46 @@
+/**
+ * @file ble_adv_payload.c
+ * @brief Advertising and scan response data as advertising data (AD) structures.
+ *
+ * Each AD structure is a length byte covering the type and the data, a type byte and
+ * the data, multi-byte values least significant byte first.
+ */
+
+#include "sdkconfig.h"
+#include "ble_adv_payload.h"
+#include "ble_transport.h"
+
+#define AD_FLAGS                0x01
+#define AD_UUID128_COMPLETE     0x07
+#define AD_NAME_COMPLETE        0x09
+#define AD_CONN_INTERVAL_RANGE  0x12
+
+#define AD_FLAG_GEN_DISC        0x02
+#define AD_FLAG_BREDR_NOT_SPT   0x04
+
+#define LE16(v)                 ((v) & 0xFF), (((v) >> 8) & 0xFF)
+
+const uint8_t ble_adv_payload[] = {
+    2, AD_FLAGS, AD_FLAG_GEN_DISC | AD_FLAG_BREDR_NOT_SPT,
+    17, AD_UUID128_COMPLETE, BLE_TRANSPORT_UUID128(BLE_TRANSPORT_SERVICE_UUID & 0xFF, BLE_TRANSPORT_SERVICE_UUID >> 8),
+    5, AD_CONN_INTERVAL_RANGE, LE16(CONFIG_BLE_CONN_FAST_MIN_INT), LE16(CONFIG_BLE_CONN_FAST_MAX_INT),
+};
+const size_t ble_adv_payload_len = sizeof(ble_adv_payload);
+
+_Static_assert(sizeof(ble_adv_payload) <= BLE_ADV_PAYLOAD_MAX_LEN, "advertising data does not fit a legacy advertisement");
+
+// The name is copied without its terminating NUL
+static const struct __attribute__((packed)) {
+    uint8_t len;
+    uint8_t type;
+    char name[sizeof(BLE_TRANSPORT_DEVICE_NAME) - 1];
+} scan_rsp = {
+    sizeof(BLE_TRANSPORT_DEVICE_NAME), AD_NAME_COMPLETE, BLE_TRANSPORT_DEVICE_NAME,
+};
+
+const uint8_t *const ble_scan_rsp_payload = (const uint8_t *)&scan_rsp;
+const size_t ble_scan_rsp_payload_len = sizeof(scan_rsp);
+
+_Static_assert(sizeof(scan_rsp) <= BLE_ADV_PAYLOAD_MAX_LEN,
+               "CONFIG_EXAMPLE_LOCAL_DEVICE_NAME is longer than the 29 bytes a scan response holds");
+_Static_assert(sizeof(BLE_TRANSPORT_DEVICE_NAME) > 1, "CONFIG_EXAMPLE_LOCAL_DEVICE_NAME is empty");
@@ -0,0 +1,30 @@
+#ifndef BLE_ADV_PAYLOAD_H
+#define BLE_ADV_PAYLOAD_H
+
+// ble_adv_payload.h - Advertising and scan response data, built at compile time
+//
+// The advertisement carries the flags, the 128-bit service UUID phones filter their scan
+// on and the preferred connection interval range; the scan response carries the complete
+// device name (CONFIG_EXAMPLE_LOCAL_DEVICE_NAME). Both are legacy payloads of at most
+// 31 bytes, checked when the firmware is built, and handed to the host as they are.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLE_ADV_PAYLOAD_MAX_LEN     31
+
+extern const uint8_t ble_adv_payload[];
+extern const size_t ble_adv_payload_len;
+
+extern const uint8_t *const ble_scan_rsp_payload;
+extern const size_t ble_scan_rsp_payload_len;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_ADV_PAYLOAD_H
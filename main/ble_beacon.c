@@ -0,0 +1,232 @@
+/**
+ * @file ble_beacon.c
+ * @brief Event broadcast: a burst of non-connectable advertisements per button event.
+ *
+ * Bursts run in the timer service task, like the advertising tiers they pause. A burst
+ * replaces the advertising data and advertises at CONFIG_BLE_BEACON_INT for
+ * CONFIG_BLE_BEACON_BURST_MS; the next waiting event follows straight on. After the
+ * last one the compiled-in advertising data is put back and the tiers resume.
+ *
+ * The counter is reserved in NVS a block at a time, so after a reset it skips ahead
+ * instead of repeating values a phone has already seen, without a flash write per press.
+ */
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BLE_BEACON
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "ble_adv.h"
+#include "ble_beacon.h"
+#include "ble_transport.h"
+#include "bt_siphash.h"
+#include "data_storage.h"
+
+#define TAG "BLE_BEACON"
+
+#define QUEUE_LEN           4
+#define COUNTER_BLOCK       64      // Counter values reserved per NVS write
+#define PEND_TIMEOUT_TICKS  pdMS_TO_TICKS(100)
+
+#define AD_FLAGS            0x01
+#define AD_MANUFACTURER     0xFF
+#define AD_FLAG_GEN_DISC    0x02
+#define AD_FLAG_BREDR_NOT_SPT 0x04
+#define MSG_LEN             6       // Counter, event type and button: the tagged bytes
+#define PAYLOAD_MAX_LEN     (3 + 4 + MSG_LEN + BLE_BEACON_MAX_KEYS * BLE_BEACON_TAG_LEN)
+
+_Static_assert(PAYLOAD_MAX_LEN <= 31, "event broadcast does not fit a legacy advertisement");
+
+typedef struct {
+    uint8_t type;
+    uint8_t button;
+} beacon_event_t;
+
+static portMUX_TYPE beacon_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t keys[BLE_BEACON_MAX_KEYS][BT_DEVICE_KEY_LEN];
+static int key_count;
+static beacon_event_t queue[QUEUE_LEN];
+static int queue_head;
+static int queue_len;
+static bool starting;               // A burst's start is waiting for BLE_TRANSPORT_EVT_ADV_STARTED
+
+// Timer service task only
+static bool bursting;               // Advertising is paused for a burst
+static uint32_t counter;            // Next value to send
+static uint32_t reserved;           // First value not reserved in NVS
+static TimerHandle_t burst_timer;
+
+static bool reserve_counter(void) {
+    if (counter != reserved) {
+        return true;
+    }
+    esp_err_t err = save_beacon_counter(counter + COUNTER_BLOCK);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to reserve counter values, not broadcasting: %s", esp_err_to_name(err));
+        return false;
+    }
+    reserved = counter + COUNTER_BLOCK;
+    return true;
+}
+
+static size_t build_payload(uint8_t *p, const beacon_event_t *evt, uint8_t (*tag_keys)[BT_DEVICE_KEY_LEN], int n) {
+    const uint8_t msg[MSG_LEN] = {
+        counter & 0xFF, (counter >> 8) & 0xFF, (counter >> 16) & 0xFF, counter >> 24, evt->type, evt->button,
+    };
+    size_t len = 0;
+
+    p[len++] = 2;
+    p[len++] = AD_FLAGS;
+    p[len++] = AD_FLAG_GEN_DISC | AD_FLAG_BREDR_NOT_SPT;
+    p[len++] = 3 + MSG_LEN + n * BLE_BEACON_TAG_LEN;
+    p[len++] = AD_MANUFACTURER;
+    p[len++] = CONFIG_BLE_BEACON_COMPANY_ID & 0xFF;
+    p[len++] = CONFIG_BLE_BEACON_COMPANY_ID >> 8;
+    memcpy(&p[len], msg, MSG_LEN);
+    len += MSG_LEN;
+    for (int i = 0; i < n; i++) {
+        uint64_t hash = bt_siphash24(tag_keys[i], msg, MSG_LEN);
+        for (int b = 0; b < BLE_BEACON_TAG_LEN; b++) {
+            p[len++] = hash >> (8 * b);
+        }
+    }
+    return len;
+}
+
+// Starts the burst of the next waiting event, or ends the broadcast if none is left
+static void next_burst(void) {
+    uint8_t tag_keys[BLE_BEACON_MAX_KEYS][BT_DEVICE_KEY_LEN];
+    beacon_event_t evt = {};
+
+    portENTER_CRITICAL(&beacon_mux);
+    bool have = queue_len > 0;
+    if (have) {
+        evt = queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_LEN;
+        queue_len--;
+    }
+    int n = key_count;
+    memcpy(tag_keys, keys, sizeof(tag_keys));
+    portEXIT_CRITICAL(&beacon_mux);
+
+    if (!have || n == 0 || !reserve_counter()) {
+        xTimerStop(burst_timer, 0);
+        if (bursting) {
+            bursting = false;
+            ble_transport_adv_stop();
+            ble_transport_adv_set_data(NULL, 0);
+            ble_adv_resume();
+        }
+        return;
+    }
+
+    uint8_t payload[PAYLOAD_MAX_LEN];
+    size_t len = build_payload(payload, &evt, tag_keys, n);
+    uint32_t sent = counter++;
+    if (bursting) {
+        ble_transport_adv_stop();
+    } else {
+        bursting = true;
+        ble_adv_pause();
+    }
+
+    ble_transport_adv_t params = {
+        .broadcast = true,
+        .int_min = CONFIG_BLE_BEACON_INT,
+        .int_max = CONFIG_BLE_BEACON_INT,
+    };
+    esp_err_t err = ble_transport_adv_set_data(payload, len);
+    if (err == ESP_OK) {
+        portENTER_CRITICAL(&beacon_mux);
+        starting = true;
+        portEXIT_CRITICAL(&beacon_mux);
+        err = ble_transport_adv_start(&params);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to broadcast event %lu: %s", (unsigned long)sent, esp_err_to_name(err));
+        portENTER_CRITICAL(&beacon_mux);
+        starting = false;
+        portEXIT_CRITICAL(&beacon_mux);
+    } else {
+        ESP_LOGD(TAG, "Broadcasting event %lu, button %u, %d tags", (unsigned long)sent, evt.button, n);
+    }
+    xTimerChangePeriod(burst_timer, pdMS_TO_TICKS(CONFIG_BLE_BEACON_BURST_MS), 0);
+}
+
+static void burst_timer_callback(TimerHandle_t timer) {
+    next_burst();
+}
+
+static void start_broadcast(void *arg1, uint32_t arg2) {
+    // A running burst hands over to the waiting events when it ends
+    if (!bursting) {
+        next_burst();
+    }
+}
+
+esp_err_t ble_beacon_init(void) {
+    burst_timer = xTimerCreate("beacon", pdMS_TO_TICKS(CONFIG_BLE_BEACON_BURST_MS), pdFALSE, NULL,
+                               burst_timer_callback);
+    if (burst_timer == NULL) {
+        ESP_LOGE(TAG, "Failed to create burst timer");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = load_beacon_counter(&counter);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        // Starting over could repeat values; reserving fails the same way and keeps it off
+        ESP_LOGE(TAG, "Failed to load the counter: %s", esp_err_to_name(err));
+    }
+    reserved = counter;
+    return ESP_OK;
+}
+
+void ble_beacon_load_keys(void) {
+    uint8_t loaded[BLE_BEACON_MAX_KEYS][BT_DEVICE_KEY_LEN];
+    int n = load_bt_device_keys(loaded, BLE_BEACON_MAX_KEYS);
+
+    portENTER_CRITICAL(&beacon_mux);
+    memcpy(keys, loaded, sizeof(keys));
+    key_count = n;
+    portEXIT_CRITICAL(&beacon_mux);
+    ESP_LOGI(TAG, "Broadcasting events to %d phones", n);
+}
+
+void ble_beacon_send(button_event_type_t type, int button) {
+    portENTER_CRITICAL(&beacon_mux);
+    if (key_count == 0) {
+        portEXIT_CRITICAL(&beacon_mux);
+        return;
+    }
+    bool dropped = queue_len == QUEUE_LEN;
+    if (dropped) {
+        queue_head = (queue_head + 1) % QUEUE_LEN;
+        queue_len--;
+    }
+    queue[(queue_head + queue_len) % QUEUE_LEN] = (beacon_event_t) { .type = type, .button = button };
+    queue_len++;
+    portEXIT_CRITICAL(&beacon_mux);
+
+    if (dropped) {
+        ESP_LOGW(TAG, "Broadcast queue full, oldest event dropped");
+    }
+    if (xTimerPendFunctionCall(start_broadcast, NULL, 0, PEND_TIMEOUT_TICKS) != pdPASS) {
+        ESP_LOGE(TAG, "Timer queue full, event waits for the next one");
+    }
+}
+
+bool ble_beacon_on_start_complete(uint8_t status) {
+    portENTER_CRITICAL(&beacon_mux);
+    bool mine = starting;
+    starting = false;
+    portEXIT_CRITICAL(&beacon_mux);
+
+    if (mine && status != 0) {
+        ESP_LOGW(TAG, "Controller refused the broadcast, status 0x%x", status);
+    }
+    return mine;
+}
+
+#endif // CONFIG_BLE_BEACON
@@ -0,0 +1,91 @@
+#ifndef BLE_BEACON_H
+#define BLE_BEACON_H
+
+// ble_beacon.h - Button events broadcast in advertisements (CONFIG_BLE_BEACON)
+//
+// Each press is sent as a short burst of non-connectable advertisements, so a phone
+// that is scanning can act on it without connecting. The event is carried in
+// manufacturer-specific data with a counter that never repeats, and one authentication
+// tag per phone that has a broadcast key. Keys are set through provisioning and kept in
+// the paired-device registry. Events are still delivered over GATT as well.
+//
+// Manufacturer-specific data (little-endian):
+//   u16 company ID (CONFIG_BLE_BEACON_COMPANY_ID), u32 counter, u8 event type
+//   (button_event_type_t), u8 button (1-based), then per key a 4-byte tag: the first
+//   4 bytes of SipHash-2-4 of the counter, event type and button under that key.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "bt_event.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLE_BEACON_MAX_KEYS 4       // Tags that fit into one advertisement
+#define BLE_BEACON_TAG_LEN  4
+
+#ifdef CONFIG_BLE_BEACON
+
+/**
+ * @brief Creates the burst timer and loads the counter and the keys from NVS.
+ *
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NO_MEM: If the timer could not be created.
+ */
+esp_err_t ble_beacon_init(void);
+
+/**
+ * @brief Reloads the keys after the paired-device registry changed.
+ *
+ * Only the first BLE_BEACON_MAX_KEYS phones with a key get a tag. Nothing is broadcast
+ * while no phone has one.
+ */
+void ble_beacon_load_keys(void);
+
+/**
+ * @brief Broadcasts a button event. Called from the event task.
+ *
+ * Bursts are sent one after another, each for CONFIG_BLE_BEACON_BURST_MS, from the
+ * timer service task; connectable advertising is paused meanwhile. If events come in
+ * faster than that, the oldest waiting one is dropped.
+ *
+ * @param type   Short or long press.
+ * @param button 1-based button number.
+ */
+void ble_beacon_send(button_event_type_t type, int button);
+
+/**
+ * @brief Handles BLE_TRANSPORT_EVT_ADV_STARTED if it belongs to a burst.
+ *
+ * @param status Status reported by the host, 0 on success.
+ * @return true if the event was for a burst, false if it is for ble_adv.
+ */
+bool ble_beacon_on_start_complete(uint8_t status);
+
+#else
+
+static inline esp_err_t ble_beacon_init(void) {
+    return ESP_OK;
+}
+
+static inline void ble_beacon_load_keys(void) {
+}
+
+static inline void ble_beacon_send(button_event_type_t type, int button) {
+}
+
+static inline bool ble_beacon_on_start_complete(uint8_t status) {
+    return false;
+}
+
+#endif // CONFIG_BLE_BEACON
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_BEACON_H
@@ -0,0 +1,273 @@
+/**
+ * @file ble_bond.c
+ * @brief Bonds with the paired phones, kept in the paired-device registry.
+ *
+ * The registry is the one list of phones that may connect; the accept list is loaded
+ * from it and the host's bonds follow it. After pairing, the keys the host made are
+ * copied into the registry entry of the phone. Bonds the host does not have are handed
+ * back from the registry, and bonds of phones that are not in it are dropped once the
+ * phone is not connected, so deleting a connected phone does not cut it off, as with
+ * the accept list. Bluedroid cannot take keys back; a phone whose bond it lost has its
+ * keys erased from the registry and pairs again.
+ *
+ * A phone with keys in the registry is not served until its link is encrypted. Anyone
+ * can claim its address, but only the phone holding the LTK can encrypt; a phone that
+ * fails, or does not within CONFIG_BLE_BOND_TIMEOUT_MS, is disconnected, and is not let
+ * pair over the existing bond.
+ *
+ * Runs from the host task (connection and security events) and the timer service task
+ * (timeouts and syncing the bonds); state is kept under a spinlock and stack calls are
+ * made outside it.
+ */
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BLE_BOND
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "ble_bond.h"
+#include "ble_server.h"
+#include "ble_transport.h"
+#include "data_storage.h"
+
+#define TAG "BLE_BOND"
+
+#define TIMEOUT_TICKS       pdMS_TO_TICKS(CONFIG_BLE_BOND_TIMEOUT_MS)
+#define PEND_TIMEOUT_TICKS  pdMS_TO_TICKS(100)
+
+typedef struct {
+    bool waiting;                   // Has keys in the registry, the link is not encrypted yet
+    uint16_t conn_id;
+    TimerHandle_t timer;
+} slot_t;
+
+static portMUX_TYPE bond_mux = portMUX_INITIALIZER_UNLOCKED;
+static slot_t slots[BLE_SERVER_MAX_CONN];
+static bool started;                // The stack is up
+static bool loaded;                 // The paired-device cache was read
+// Only used by sync(), in the timer service task
+static ble_transport_bond_t host_bonds[BLE_TRANSPORT_MAX_BONDS];
+
+static bool same_keys(const bt_device_bond_t *stored, const ble_transport_bond_t *b) {
+    return stored->key_size == b->key_size && stored->addr_type == b->type &&
+           stored->has_irk == b->has_irk && memcmp(stored->ltk, b->ltk, BT_DEVICE_LTK_LEN) == 0 &&
+           (!b->has_irk || memcmp(stored->irk, b->irk, BT_DEVICE_IRK_LEN) == 0);
+}
+
+static int find_host_bond(const esp_bd_addr_t bda, int count) {
+    for (int i = 0; i < count; i++) {
+        if (memcmp(host_bonds[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Hands the host the keys of a phone it has no bond with
+static void restore(const esp_bd_addr_t mac, const bt_device_bond_t *stored) {
+    ble_transport_bond_t b = {
+        .type = stored->addr_type,
+        .key_size = stored->key_size,
+        .has_irk = stored->has_irk,
+    };
+
+    memcpy(b.bda, mac, sizeof(esp_bd_addr_t));
+    memcpy(b.ltk, stored->ltk, BLE_TRANSPORT_KEY_LEN);
+    memcpy(b.irk, stored->irk, BLE_TRANSPORT_KEY_LEN);
+    esp_err_t err = ble_transport_bond_add(&b);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Restored the bond of "ESP_BD_ADDR_STR, ESP_BD_ADDR_HEX(mac));
+    } else if (err == ESP_ERR_NOT_SUPPORTED) {
+        ESP_LOGW(TAG, "Host lost the bond of "ESP_BD_ADDR_STR", it has to pair again", ESP_BD_ADDR_HEX(mac));
+        erase_bt_device_bond(mac);
+    } else {
+        ESP_LOGW(TAG, "Failed to restore the bond of "ESP_BD_ADDR_STR": %s", ESP_BD_ADDR_HEX(mac),
+                 esp_err_to_name(err));
+    }
+}
+
+// Brings the host's bonds and the registry in line; runs in the timer service task
+static void sync(void *arg1, uint32_t arg2) {
+    portENTER_CRITICAL(&bond_mux);
+    bool ready = started && loaded;
+    portEXIT_CRITICAL(&bond_mux);
+    if (!ready) {
+        return;
+    }
+
+    int count = ble_transport_bonds(host_bonds, BLE_TRANSPORT_MAX_BONDS);
+    int32_t paired = get_device_count_cache();
+    bt_device_bond_t stored;
+
+    for (int i = 0; i < count; i++) {
+        const ble_transport_bond_t *b = &host_bonds[i];
+        if (load_bt_device_bond(b->bda, &stored) != ESP_OK) {
+            // Deleted, or paired on an open remote; kept while connected, so it can still be added
+            if (!ble_server_is_peer_connected(b->bda)) {
+                ESP_LOGI(TAG, "Dropping the bond of "ESP_BD_ADDR_STR", not paired", ESP_BD_ADDR_HEX(b->bda));
+                ble_transport_bond_remove(b->bda);
+            }
+            continue;
+        }
+        if (same_keys(&stored, b)) {
+            continue;
+        }
+        stored = (bt_device_bond_t) {
+            .addr_type = b->type,
+            .key_size = b->key_size,
+            .has_irk = b->has_irk,
+        };
+        memcpy(stored.ltk, b->ltk, BT_DEVICE_LTK_LEN);
+        memcpy(stored.irk, b->irk, BT_DEVICE_IRK_LEN);
+        // In a batch the registry is busy; its commit runs the sync again
+        esp_err_t err = save_bt_device_bond(b->bda, &stored);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "Saved the bond of "ESP_BD_ADDR_STR, ESP_BD_ADDR_HEX(b->bda));
+        } else if (err != ESP_ERR_INVALID_STATE) {
+            ESP_LOGW(TAG, "Failed to save the bond of "ESP_BD_ADDR_STR": %s", ESP_BD_ADDR_HEX(b->bda),
+                     esp_err_to_name(err));
+        }
+    }
+
+    for (int32_t i = 0; i < paired; i++) {
+        esp_bd_addr_t mac;
+        if (get_bt_device_mac_from_cache(i, &mac) != ESP_OK || load_bt_device_bond(mac, &stored) != ESP_OK ||
+            stored.key_size == 0 || find_host_bond(mac, count) >= 0) {
+            continue;
+        }
+        restore(mac, &stored);
+    }
+}
+
+static void pend_sync(void) {
+    if (xTimerPendFunctionCall(sync, NULL, 0, PEND_TIMEOUT_TICKS) != pdPASS) {
+        ESP_LOGE(TAG, "Timer queue full, bonds not synced");
+    }
+}
+
+static void on_device_change(const esp_bd_addr_t mac, bool added) {
+    // Bluedroid would disconnect a connected phone; its bond goes when it disconnects
+    if (!added && !ble_server_is_peer_connected(mac)) {
+        esp_err_t err = ble_transport_bond_remove(mac);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to drop the bond of "ESP_BD_ADDR_STR": %s", ESP_BD_ADDR_HEX(mac),
+                     esp_err_to_name(err));
+        }
+    }
+    pend_sync();
+}
+
+static void timeout_callback(TimerHandle_t timer) {
+    int conn = (int)(intptr_t)pvTimerGetTimerID(timer);
+
+    portENTER_CRITICAL(&bond_mux);
+    bool waiting = slots[conn].waiting;
+    uint16_t conn_id = slots[conn].conn_id;
+    slots[conn].waiting = false;
+    portEXIT_CRITICAL(&bond_mux);
+
+    if (waiting) {
+        ESP_LOGW(TAG, "conn_id %u did not encrypt with its bond, disconnecting", conn_id);
+        ble_transport_close(conn_id);
+    }
+}
+
+esp_err_t ble_bond_init(void) {
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        slots[i].timer = xTimerCreate("bond_enc", TIMEOUT_TICKS, pdFALSE, (void *)(intptr_t)i, timeout_callback);
+        if (slots[i].timer == NULL) {
+            ESP_LOGE(TAG, "Failed to create the encryption timers");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+void ble_bond_start(void) {
+    portENTER_CRITICAL(&bond_mux);
+    started = true;
+    portEXIT_CRITICAL(&bond_mux);
+    pend_sync();
+}
+
+void ble_bond_load_cache(void) {
+    if (add_bt_device_change_callback(on_device_change) != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot follow the paired-device cache, deleted phones keep their bonds");
+    }
+    portENTER_CRITICAL(&bond_mux);
+    loaded = true;
+    portEXIT_CRITICAL(&bond_mux);
+    pend_sync();
+}
+
+bool ble_bond_on_connect(int conn, uint16_t conn_id, const esp_bd_addr_t bda) {
+    bt_device_bond_t stored;
+
+    if (load_bt_device_bond(bda, &stored) != ESP_OK) {
+        return false;       // Not paired; only while no phone is, or without the accept list
+    }
+    bool waiting = stored.key_size > 0;
+    portENTER_CRITICAL(&bond_mux);
+    slots[conn].waiting = waiting;
+    slots[conn].conn_id = conn_id;
+    portEXIT_CRITICAL(&bond_mux);
+
+    if (waiting) {
+        xTimerStart(slots[conn].timer, 0);
+    }
+    esp_err_t err = ble_transport_secure(bda);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to ask conn_id %u to encrypt: %s", conn_id, esp_err_to_name(err));
+    }
+    return waiting;
+}
+
+bool ble_bond_on_auth(int conn, uint8_t status) {
+    portENTER_CRITICAL(&bond_mux);
+    bool waiting = slots[conn].waiting;
+    uint16_t conn_id = slots[conn].conn_id;
+    slots[conn].waiting = false;
+    portEXIT_CRITICAL(&bond_mux);
+
+    xTimerStop(slots[conn].timer, 0);
+    if (status == 0) {
+        pend_sync();        // Keys made by pairing go into the registry
+        return true;
+    }
+    if (!waiting) {
+        ESP_LOGW(TAG, "conn_id %u not encrypted, status 0x%x", conn_id, status);
+        return true;
+    }
+    ESP_LOGW(TAG, "conn_id %u failed to encrypt with its bond, status 0x%x, disconnecting", conn_id, status);
+    return false;
+}
+
+void ble_bond_on_disconnect(int conn) {
+    portENTER_CRITICAL(&bond_mux);
+    slots[conn].waiting = false;
+    portEXIT_CRITICAL(&bond_mux);
+    xTimerStop(slots[conn].timer, 0);
+    pend_sync();            // A bond kept while the phone was connected may go now
+}
+
+bool ble_bond_may_pair(const esp_bd_addr_t bda) {
+    bt_device_bond_t stored;
+
+    if (get_device_count_cache() == 0) {
+        return true;
+    }
+    if (load_bt_device_bond(bda, &stored) != ESP_OK) {
+        ESP_LOGW(TAG, "Refusing to pair with "ESP_BD_ADDR_STR", not paired", ESP_BD_ADDR_HEX(bda));
+        return false;
+    }
+    if (stored.key_size > 0) {
+        ESP_LOGW(TAG, "Refusing to pair with "ESP_BD_ADDR_STR" again, it has a bond", ESP_BD_ADDR_HEX(bda));
+        return false;
+    }
+    return true;
+}
+
+#endif // CONFIG_BLE_BOND
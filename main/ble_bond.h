@@ -0,0 +1,119 @@
+#ifndef BLE_BOND_H
+#define BLE_BOND_H
+
+// ble_bond.h - Bonding with the paired phones, with the keys kept in the device registry (CONFIG_BLE_BOND)
+//
+// A phone in the paired-device registry is asked to pair with LE Secure Connections the
+// first time it connects, and the keys of the bond are saved with its registry entry.
+// They are loaded into the device cache at boot, and later connections are encrypted
+// with them without pairing again. Until the link is encrypted the server neither sends
+// to the phone nor takes its writes; a phone that fails to encrypt with its bond, or
+// does not within CONFIG_BLE_BOND_TIMEOUT_MS, is disconnected.
+//
+// The registry decides who may connect and pair; the host's own bonds follow it.
+// Deleting a device erases its keys, and the host drops the bond once the phone is not
+// connected. While no phone is paired any phone may pair; the bond is kept only if the
+// phone is added while it is still connected.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "ble_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_BLE_BOND
+
+/**
+ * @brief Creates the encryption timers. Call once before the BLE stack starts.
+ *
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NO_MEM: If a timer could not be created.
+ */
+esp_err_t ble_bond_init(void);
+
+/**
+ * @brief Brings the host's bonds in line with the registry. Call once the host is ready.
+ */
+void ble_bond_start(void);
+
+/**
+ * @brief Follows changes to the paired-device cache.
+ *
+ * Call once load_all_bt_devices_to_cache() has run; may run before or after ble_bond_start().
+ */
+void ble_bond_load_cache(void);
+
+/**
+ * @brief Asks a new connection to encrypt.
+ *
+ * @param conn    Connection slot.
+ * @param conn_id GATT connection ID.
+ * @param bda     Peer address.
+ * @return True if the phone has keys in the registry, and must not be served before
+ *         the link is encrypted with them.
+ */
+bool ble_bond_on_connect(int conn, uint16_t conn_id, const esp_bd_addr_t bda);
+
+/**
+ * @brief Handles BLE_TRANSPORT_EVT_AUTH for a connection.
+ *
+ * @param conn   Connection slot.
+ * @param status Status reported by the host, 0 if the link is encrypted.
+ * @return False if the phone failed to encrypt with its bond and has to be disconnected.
+ */
+bool ble_bond_on_auth(int conn, uint8_t status);
+
+/**
+ * @brief Forgets the connection.
+ *
+ * @param conn Connection slot.
+ */
+void ble_bond_on_disconnect(int conn);
+
+/**
+ * @brief Returns true if a phone may pair.
+ *
+ * True for any phone while none is paired, and for a phone in the registry that has no
+ * keys yet. A phone with keys has to be deleted and added again to pair anew.
+ */
+bool ble_bond_may_pair(const esp_bd_addr_t bda);
+
+#else
+
+static inline esp_err_t ble_bond_init(void) {
+    return ESP_OK;
+}
+
+static inline void ble_bond_start(void) {
+}
+
+static inline void ble_bond_load_cache(void) {
+}
+
+static inline bool ble_bond_on_connect(int conn, uint16_t conn_id, const esp_bd_addr_t bda) {
+    return false;
+}
+
+static inline bool ble_bond_on_auth(int conn, uint8_t status) {
+    return true;
+}
+
+static inline void ble_bond_on_disconnect(int conn) {
+}
+
+static inline bool ble_bond_may_pair(const esp_bd_addr_t bda) {
+    return true;
+}
+
+#endif // CONFIG_BLE_BOND
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_BOND_H
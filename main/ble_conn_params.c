@@ -0,0 +1,304 @@
+/**
+ * @file ble_conn_params.c
+ * @brief Connection parameter state machine.
+ *
+ * The remote is either in the fast mode, where a press reaches the phone within one
+ * short interval, or in the idle mode, where a long interval with peripheral latency
+ * keeps the radio mostly off while the car is parked. At most one update request is
+ * outstanding per connection. The mode wanted at any time is tracked separately from the mode in use,
+ * so a press during a pending switch to idle is followed by a switch back to fast.
+ *
+ * Runs from the host task (connection events), the timer service task (timeouts and
+ * pended button activity) and the event task (hold checks); state is kept under a
+ * spinlock and stack calls are made outside it.
+ *
+ * Every connected phone is managed separately; a press asks all of them for the fast
+ * interval and one phone's rejections do not delay requests to the others.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "ble_conn_params.h"
+#include "ble_server.h"
+#include "ble_transport.h"
+#include "bt_event.h"
+#include "bt_trace.h"
+#include "flight_rec.h"
+
+#define TAG "BLE_CONN"
+
+#define FAST_WAIT_TICKS     pdMS_TO_TICKS(CONFIG_BLE_CONN_FAST_WAIT_MS)
+#define RETRY_MS            CONFIG_BLE_CONN_RETRY_MS
+#define RETRY_MAX_SHIFT     5       // Backoff stops doubling at 32 * CONFIG_BLE_CONN_RETRY_MS
+#define RESPONSE_TIMEOUT_MS 5000    // An unanswered request counts as rejected
+
+typedef enum {
+    CONN_MODE_NONE,
+    CONN_MODE_FAST,
+    CONN_MODE_IDLE,
+} conn_mode_t;
+
+typedef struct {
+    uint16_t min_int;   // 1.25 ms units
+    uint16_t max_int;
+    uint16_t latency;   // Connection events the peripheral may skip
+} conn_profile_t;
+
+static const conn_profile_t profiles[] = {
+    [CONN_MODE_FAST] = { CONFIG_BLE_CONN_FAST_MIN_INT, CONFIG_BLE_CONN_FAST_MAX_INT, 0 },
+    [CONN_MODE_IDLE] = { CONFIG_BLE_CONN_IDLE_MIN_INT, CONFIG_BLE_CONN_IDLE_MAX_INT, CONFIG_BLE_CONN_IDLE_LATENCY },
+};
+
+typedef struct {
+    bool connected;
+    esp_bd_addr_t bda;
+    conn_mode_t current;            // Mode of the interval in use
+    conn_mode_t wanted;             // Mode the remote should be in
+    conn_mode_t pending;            // Mode requested and not yet answered, or CONN_MODE_NONE
+    TickType_t pending_since;
+    bool backing_off;
+    uint8_t rejects;                // Consecutive rejected requests
+    TimerHandle_t retry_timer;      // Timer ID is the connection slot
+} link_t;
+
+static portMUX_TYPE params_mux = portMUX_INITIALIZER_UNLOCKED;
+static link_t links[BLE_SERVER_MAX_CONN];
+static volatile uint8_t connections;
+static volatile bool activity_pending;
+static TimerHandle_t idle_timer;
+
+static conn_mode_t classify(uint16_t interval) {
+    return interval <= CONFIG_BLE_CONN_FAST_MAX_INT ? CONN_MODE_FAST : CONN_MODE_IDLE;
+}
+
+static void start_backoff(int conn) {
+    link_t *l = &links[conn];
+
+    portENTER_CRITICAL(&params_mux);
+    uint8_t shift = l->rejects;
+    if (l->rejects < UINT8_MAX) {
+        l->rejects++;
+    }
+    l->backing_off = true;
+    portEXIT_CRITICAL(&params_mux);
+
+    uint32_t delay_ms = RETRY_MS << (shift < RETRY_MAX_SHIFT ? shift : RETRY_MAX_SHIFT);
+    ESP_LOGW(TAG, "Connection parameter request rejected on slot %d, retrying in %lu ms", conn,
+             (unsigned long)delay_ms);
+    xTimerChangePeriod(l->retry_timer, pdMS_TO_TICKS(delay_ms), 0);
+}
+
+// Sends an update request if the wanted mode differs from the one in use and nothing blocks it
+static void try_request(int conn) {
+    link_t *l = &links[conn];
+    esp_bd_addr_t bda;
+
+    portENTER_CRITICAL(&params_mux);
+    conn_mode_t mode = l->wanted;
+    if (!l->connected || l->pending != CONN_MODE_NONE || l->backing_off || mode == l->current ||
+        mode == CONN_MODE_NONE) {
+        portEXIT_CRITICAL(&params_mux);
+        return;
+    }
+    l->pending = mode;
+    l->pending_since = xTaskGetTickCount();
+    memcpy(bda, l->bda, sizeof(bda));
+    portEXIT_CRITICAL(&params_mux);
+
+    ESP_LOGD(TAG, "Requesting %s interval on slot %d", mode == CONN_MODE_FAST ? "fast" : "idle", conn);
+    esp_err_t err = ble_transport_update_conn_params(bda, profiles[mode].min_int, profiles[mode].max_int,
+                                                     profiles[mode].latency, CONFIG_BLE_CONN_SUPERVISION_TIMEOUT);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Connection parameter request failed: %s", esp_err_to_name(err));
+        portENTER_CRITICAL(&params_mux);
+        l->pending = CONN_MODE_NONE;
+        portEXIT_CRITICAL(&params_mux);
+        start_backoff(conn);
+        return;
+    }
+    xTimerChangePeriod(l->retry_timer, pdMS_TO_TICKS(RESPONSE_TIMEOUT_MS), 0);
+}
+
+// Sets the wanted mode on every connection and requests it where needed
+static void want_all(conn_mode_t mode) {
+    portENTER_CRITICAL(&params_mux);
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        if (links[i].connected) {
+            links[i].wanted = mode;
+        }
+    }
+    portEXIT_CRITICAL(&params_mux);
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        try_request(i);
+    }
+}
+
+static void retry_timer_callback(TimerHandle_t timer) {
+    int conn = (int)(intptr_t)pvTimerGetTimerID(timer);
+    link_t *l = &links[conn];
+
+    portENTER_CRITICAL(&params_mux);
+    conn_mode_t timed_out = l->pending;
+    l->pending = CONN_MODE_NONE;
+    l->backing_off = false;
+    portEXIT_CRITICAL(&params_mux);
+
+    if (timed_out != CONN_MODE_NONE) {
+        start_backoff(conn);
+        if (timed_out == CONN_MODE_FAST) {
+            bt_event_wake();    // Stop holding presses for it
+        }
+        return;
+    }
+    try_request(conn);
+}
+
+static void idle_timer_callback(TimerHandle_t timer) {
+    want_all(CONN_MODE_IDLE);
+}
+
+static void on_activity(void *arg1, uint32_t arg2) {
+    activity_pending = false;
+    if (connections > 0) {
+        xTimerReset(idle_timer, 0);
+        want_all(CONN_MODE_FAST);
+    }
+}
+
+esp_err_t ble_conn_params_init(void) {
+    idle_timer = xTimerCreate("conn_idle", pdMS_TO_TICKS(CONFIG_BLE_CONN_IDLE_TIMEOUT_MS), pdFALSE, NULL,
+                              idle_timer_callback);
+    if (idle_timer == NULL) {
+        ESP_LOGE(TAG, "Failed to create connection parameter timers");
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        links[i].retry_timer = xTimerCreate("conn_retry", pdMS_TO_TICKS(RETRY_MS), pdFALSE, (void *)(intptr_t)i,
+                                            retry_timer_callback);
+        if (links[i].retry_timer == NULL) {
+            ESP_LOGE(TAG, "Failed to create connection parameter timers");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+void ble_conn_params_on_connect(int conn, const esp_bd_addr_t bda, uint16_t interval) {
+    link_t *l = &links[conn];
+
+    portENTER_CRITICAL(&params_mux);
+    l->connected = true;
+    memcpy(l->bda, bda, sizeof(l->bda));
+    l->current = classify(interval);
+    l->wanted = CONN_MODE_FAST;
+    l->pending = CONN_MODE_NONE;
+    l->backing_off = false;
+    l->rejects = 0;
+    connections++;
+    portEXIT_CRITICAL(&params_mux);
+
+    // A new phone counts as activity for all of them
+    xTimerReset(idle_timer, 0);
+    try_request(conn);
+}
+
+void ble_conn_params_on_disconnect(int conn) {
+    link_t *l = &links[conn];
+
+    portENTER_CRITICAL(&params_mux);
+    bool was_connected = l->connected;
+    l->connected = false;
+    l->current = CONN_MODE_NONE;
+    l->wanted = CONN_MODE_NONE;
+    l->pending = CONN_MODE_NONE;
+    l->backing_off = false;
+    if (was_connected) {
+        connections--;
+    }
+    bool none_left = connections == 0;
+    portEXIT_CRITICAL(&params_mux);
+
+    if (none_left) {
+        xTimerStop(idle_timer, 0);
+    }
+    xTimerStop(l->retry_timer, 0);
+}
+
+void ble_conn_params_on_update(const esp_bd_addr_t bda, uint8_t status, uint16_t interval, uint16_t latency) {
+    int conn = -1;
+
+    BT_TRACE(BLE, INFO, BLE_CONN_PARAMS, interval, latency);
+    flight_rec_log(FLIGHT_REC_CONN_PARAMS, status, interval, latency);
+
+    portENTER_CRITICAL(&params_mux);
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        if (links[i].connected && memcmp(links[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            conn = i;
+            break;
+        }
+    }
+    if (conn < 0) {
+        portEXIT_CRITICAL(&params_mux);
+        return;
+    }
+    link_t *l = &links[conn];
+    conn_mode_t requested = l->pending;
+    l->pending = CONN_MODE_NONE;
+    if (status == 0) {
+        l->current = classify(interval);
+    }
+    bool accepted = status == 0 && l->current == requested;
+    if (accepted) {
+        l->rejects = 0;
+    }
+    portEXIT_CRITICAL(&params_mux);
+
+    if (requested == CONN_MODE_NONE) {
+        // Update started by the phone; follow up if it moved us away from the wanted mode
+        try_request(conn);
+        return;
+    }
+    xTimerStop(l->retry_timer, 0);
+    if (accepted) {
+        ESP_LOGI(TAG, "Slot %d connection interval %u.%02u ms, latency %u", conn, interval * 125 / 100,
+                 interval * 125 % 100, latency);
+        try_request(conn);
+    } else {
+        start_backoff(conn);
+    }
+    if (requested == CONN_MODE_FAST) {
+        bt_event_wake();    // Presses held for the fast interval go out now
+    }
+}
+
+void IRAM_ATTR ble_conn_params_on_activity_from_isr(void) {
+    BaseType_t woken = pdFALSE;
+
+    // One pended call per burst of edges is enough
+    if (connections == 0 || activity_pending) {
+        return;
+    }
+    activity_pending = true;
+    if (xTimerPendFunctionCallFromISR(on_activity, NULL, 0, &woken) != pdPASS) {
+        activity_pending = false;
+    }
+    if (woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+TickType_t ble_conn_params_hold_ticks(int conn) {
+    TickType_t remaining = 0;
+
+    portENTER_CRITICAL(&params_mux);
+    if (links[conn].pending == CONN_MODE_FAST) {
+        TickType_t elapsed = xTaskGetTickCount() - links[conn].pending_since;
+        remaining = elapsed < FAST_WAIT_TICKS ? FAST_WAIT_TICKS - elapsed : 0;
+    }
+    portEXIT_CRITICAL(&params_mux);
+    return remaining;
+}
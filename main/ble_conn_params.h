@@ -0,0 +1,84 @@
+#ifndef BLE_CONN_PARAMS_H
+#define BLE_CONN_PARAMS_H
+
+// ble_conn_params.h - Connection interval management: fast while buttons are in use, relaxed when idle
+//
+// On connect and on every button press the remote asks the phone for the fast
+// interval (CONFIG_BLE_CONN_FAST_MIN_INT..MAX_INT, no peripheral latency). After
+// CONFIG_BLE_CONN_IDLE_TIMEOUT_MS without a press it asks for the idle interval with
+// peripheral latency. Rejected or unanswered requests are retried with exponential
+// backoff starting at CONFIG_BLE_CONN_RETRY_MS.
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "ble_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Creates the idle timer and one retry timer per connection slot. Call once before the BLE stack starts.
+ *
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NO_MEM: If a timer could not be created.
+ */
+esp_err_t ble_conn_params_init(void);
+
+/**
+ * @brief Starts managing a new connection and requests the fast interval.
+ *
+ * @param conn      Connection slot.
+ * @param bda       Peer address.
+ * @param interval  Interval the connection started with, in 1.25 ms units.
+ */
+void ble_conn_params_on_connect(int conn, const esp_bd_addr_t bda, uint16_t interval);
+
+/**
+ * @brief Stops managing the connection.
+ *
+ * @param conn Connection slot.
+ */
+void ble_conn_params_on_disconnect(int conn);
+
+/**
+ * @brief Handles BLE_TRANSPORT_EVT_CONN_PARAMS.
+ *
+ * Finds the connection by peer address and records the interval in use. A failed update, or one that did not land in the
+ * requested range, counts as a rejection and starts the backoff.
+ *
+ * @param bda      Peer address.
+ * @param status   Status reported by the host, 0 on success.
+ * @param interval Interval in use, in 1.25 ms units.
+ * @param latency  Peripheral latency in use.
+ */
+void ble_conn_params_on_update(const esp_bd_addr_t bda, uint8_t status, uint16_t interval, uint16_t latency);
+
+/**
+ * @brief Reports button activity: requests the fast interval on every connection and
+ *        restarts the idle timeout.
+ *
+ * Called from the button ISR on a press edge. The request itself is made from the
+ * timer service task.
+ */
+void ble_conn_params_on_activity_from_isr(void);
+
+/**
+ * @brief Returns how long sending should wait for a fast-interval request to complete.
+ *
+ * While a switch to the fast interval is pending, presses are held for at most
+ * CONFIG_BLE_CONN_FAST_WAIT_MS so they leave on the fast interval. The event task is
+ * woken as soon as the request completes or is rejected.
+ *
+ * @param conn Connection slot.
+ * @return Ticks left to wait, or 0 to send now.
+ */
+TickType_t ble_conn_params_hold_ticks(int conn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_CONN_PARAMS_H
@@ -0,0 +1,382 @@
+/**
+ * @file ble_link.c
+ * @brief Asks each new connection for the 2M PHY and longer link-layer packets.
+ *
+ * A full-MTU notification is 251 octets on air with its headers. On 27-octet packets
+ * at 1M it takes ten packets and about 6.8 ms of a connection event; on one 251-octet
+ * packet at 2M it takes about 1.4 ms. Flight recorder dumps and batched events finish
+ * that much sooner and the radio is on for less of every connection event.
+ *
+ * Each link goes through the PHY step and then the data length step. One request is
+ * outstanding at a time across all links: Bluedroid reports a failed PHY request and
+ * every data length answer without the peer address. A step ends with the answer,
+ * with the host rejecting the request, or after STEP_TIMEOUT_MS; a phone that does
+ * not support data length extension never answers. Steps already satisfied, e.g. by
+ * a phone that asked first, are skipped.
+ *
+ * Runs from the host task (connection and link events) and the timer service task
+ * (timeouts); state is kept under a spinlock and stack calls are made outside it.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "ble_link.h"
+#include "ble_server.h"
+#include "ble_transport.h"
+#include "bt_trace.h"
+#include "flight_rec.h"
+
+#define TAG "BLE_LINK"
+
+#define STEP_TIMEOUT_MS     2000    // An unanswered request leaves the link as it is
+#define STEP_TIMEOUT_TICKS  pdMS_TO_TICKS(STEP_TIMEOUT_MS)
+#define DATA_LEN            CONFIG_BLE_LINK_DATA_LEN
+#ifdef CONFIG_BLE_LINK_2M_PHY
+#define ASK_2M              true
+#else
+#define ASK_2M              false
+#endif
+#define ASK_DATA_LEN        (DATA_LEN > BLE_TRANSPORT_MIN_DATA_LEN)
+
+typedef enum {
+    STEP_PHY,
+    STEP_DATA_LEN,
+    STEP_DONE,
+} step_t;
+
+typedef struct {
+    bool connected;
+    esp_bd_addr_t bda;
+    step_t step;                // Next step, or the outstanding one on the active slot
+    uint8_t tx_phy;             // BLE_TRANSPORT_PHY_*
+    uint8_t rx_phy;
+    uint16_t tx_octets;
+    uint16_t rx_octets;
+} link_t;
+
+typedef struct {
+    uint16_t phy_2m;            // Links that ended the PHY step on 2M
+    uint16_t phy_1m;
+    uint16_t data_len_long;     // Links that ended the data length step above 27 octets
+    uint16_t data_len_short;
+} link_stats_t;
+
+static const char *const step_names[] = {
+    [STEP_PHY] = "PHY",
+    [STEP_DATA_LEN] = "data length",
+};
+
+static portMUX_TYPE link_mux = portMUX_INITIALIZER_UNLOCKED;
+static link_t links[BLE_SERVER_MAX_CONN];
+static link_stats_t stats;
+static int active = -1;         // Slot with a request outstanding, or -1
+static TickType_t requested_at;
+static TimerHandle_t response_timer;
+
+static const char *phy_name(uint8_t phy) {
+    switch (phy) {
+        case BLE_TRANSPORT_PHY_1M:
+            return "1M";
+        case BLE_TRANSPORT_PHY_2M:
+            return "2M";
+        case BLE_TRANSPORT_PHY_CODED:
+            return "coded";
+        default:
+            return "?";
+    }
+}
+
+// Returns the first step from step on that is turned on
+static step_t enabled_from(step_t step) {
+    if (step == STEP_PHY && !ASK_2M) {
+        step = STEP_DATA_LEN;
+    }
+    if (step == STEP_DATA_LEN && !ASK_DATA_LEN) {
+        step = STEP_DONE;
+    }
+    return step;
+}
+
+// Call with link_mux held
+static int find_link(const esp_bd_addr_t bda) {
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        if (links[i].connected && memcmp(links[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Call with link_mux held
+static bool satisfied(const link_t *l, step_t step) {
+    if (step == STEP_PHY) {
+        return l->tx_phy == BLE_TRANSPORT_PHY_2M && l->rx_phy == BLE_TRANSPORT_PHY_2M;
+    }
+    return l->tx_octets >= DATA_LEN;
+}
+
+// Ends the outstanding step of a slot and counts its outcome. Returns false if that step
+// is not outstanding, e.g. because it already timed out. Call with link_mux held.
+static bool end_step(int conn, step_t step) {
+    link_t *l = &links[conn];
+
+    if (active != conn || l->step != step) {
+        return false;
+    }
+    if (step == STEP_PHY) {
+        if (l->tx_phy == BLE_TRANSPORT_PHY_2M) {
+            stats.phy_2m++;
+        } else {
+            stats.phy_1m++;
+        }
+    } else {
+        if (l->tx_octets > BLE_TRANSPORT_MIN_DATA_LEN) {
+            stats.data_len_long++;
+        } else {
+            stats.data_len_short++;
+        }
+    }
+    l->step = enabled_from(step + 1);
+    active = -1;
+    return true;
+}
+
+static void log_if_done(int conn) {
+    portENTER_CRITICAL(&link_mux);
+    link_t copy = links[conn];
+    portEXIT_CRITICAL(&link_mux);
+
+    if (copy.connected && copy.step == STEP_DONE) {
+        ESP_LOGI(TAG, "Slot %d on the %s PHY, packets of %u octets out and %u in", conn, phy_name(copy.tx_phy),
+                 copy.tx_octets, copy.rx_octets);
+    }
+}
+
+// Sends the next request if none is outstanding; steps the host rejects end at once
+static void run(void) {
+    while (true) {
+        esp_bd_addr_t bda;
+        int conn = -1;
+        step_t step = STEP_DONE;
+
+        portENTER_CRITICAL(&link_mux);
+        for (int i = 0; i < BLE_SERVER_MAX_CONN && active < 0 && conn < 0; i++) {
+            if (links[i].connected && links[i].step != STEP_DONE) {
+                conn = i;
+            }
+        }
+        if (conn < 0) {
+            portEXIT_CRITICAL(&link_mux);
+            return;
+        }
+        active = conn;
+        step = links[conn].step;
+        if (satisfied(&links[conn], step)) {
+            end_step(conn, step);
+            portEXIT_CRITICAL(&link_mux);
+            log_if_done(conn);
+            continue;
+        }
+        requested_at = xTaskGetTickCount();
+        memcpy(bda, links[conn].bda, sizeof(bda));
+        portEXIT_CRITICAL(&link_mux);
+
+        ESP_LOGD(TAG, "Requesting %s on slot %d", step_names[step], conn);
+        esp_err_t err = step == STEP_PHY ? ble_transport_set_phy_2m(bda) : ble_transport_set_data_len(bda, DATA_LEN);
+        if (err == ESP_OK) {
+            xTimerChangePeriod(response_timer, STEP_TIMEOUT_TICKS, 0);
+            return;
+        }
+        ESP_LOGW(TAG, "%s request on slot %d failed: %s", step_names[step], conn, esp_err_to_name(err));
+        portENTER_CRITICAL(&link_mux);
+        bool ended = end_step(conn, step);
+        portEXIT_CRITICAL(&link_mux);
+        if (ended) {
+            log_if_done(conn);
+        }
+    }
+}
+
+static void response_timer_callback(TimerHandle_t timer) {
+    portENTER_CRITICAL(&link_mux);
+    int conn = active;
+    bool expired = conn >= 0 && xTaskGetTickCount() - requested_at >= STEP_TIMEOUT_TICKS;
+    step_t step = expired ? links[conn].step : STEP_DONE;
+    if (expired) {
+        end_step(conn, step);
+    }
+    portEXIT_CRITICAL(&link_mux);
+
+    if (!expired) {
+        return;
+    }
+    ESP_LOGW(TAG, "No answer to the %s request on slot %d, keeping the link as it is", step_names[step], conn);
+    log_if_done(conn);
+    run();
+}
+
+esp_err_t ble_link_init(void) {
+    response_timer = xTimerCreate("link_resp", STEP_TIMEOUT_TICKS, pdFALSE, NULL, response_timer_callback);
+    if (response_timer == NULL) {
+        ESP_LOGE(TAG, "Failed to create the link response timer");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void ble_link_on_connect(int conn, const esp_bd_addr_t bda) {
+    portENTER_CRITICAL(&link_mux);
+    links[conn] = (link_t) {
+        .connected = true,
+        .step = enabled_from(STEP_PHY),
+        .tx_phy = BLE_TRANSPORT_PHY_1M,
+        .rx_phy = BLE_TRANSPORT_PHY_1M,
+        .tx_octets = BLE_TRANSPORT_MIN_DATA_LEN,
+        .rx_octets = BLE_TRANSPORT_MIN_DATA_LEN,
+    };
+    memcpy(links[conn].bda, bda, sizeof(esp_bd_addr_t));
+    portEXIT_CRITICAL(&link_mux);
+    run();
+}
+
+void ble_link_on_disconnect(int conn) {
+    portENTER_CRITICAL(&link_mux);
+    links[conn].connected = false;
+    links[conn].step = STEP_DONE;
+    bool was_active = active == conn;
+    if (was_active) {
+        active = -1;
+    }
+    portEXIT_CRITICAL(&link_mux);
+
+    if (was_active) {
+        xTimerStop(response_timer, 0);
+        run();
+    }
+}
+
+void ble_link_on_phy(const esp_bd_addr_t bda, uint8_t status, uint8_t tx_phy, uint8_t rx_phy) {
+    BT_TRACE(BLE, INFO, BLE_PHY, tx_phy, rx_phy);
+    flight_rec_log(FLIGHT_REC_LINK_PHY, status, tx_phy, rx_phy);
+
+    portENTER_CRITICAL(&link_mux);
+    int conn = find_link(bda);
+    if (conn < 0) {
+        portEXIT_CRITICAL(&link_mux);
+        return;
+    }
+    if (status == 0) {
+        links[conn].tx_phy = tx_phy;
+        links[conn].rx_phy = rx_phy;
+    }
+    bool ended = end_step(conn, STEP_PHY);
+    portEXIT_CRITICAL(&link_mux);
+
+    if (ended) {
+        if (status != 0) {
+            ESP_LOGW(TAG, "Slot %d stays on the 1M PHY, status 0x%02x", conn, status);
+        }
+        xTimerStop(response_timer, 0);
+        log_if_done(conn);
+        run();
+    }
+}
+
+void ble_link_on_data_len(const esp_bd_addr_t bda, uint8_t status, uint16_t tx_octets, uint16_t rx_octets) {
+    BT_TRACE(BLE, INFO, BLE_DATA_LEN, tx_octets, rx_octets);
+    flight_rec_log(FLIGHT_REC_LINK_DATA_LEN, status, tx_octets, rx_octets);
+
+    portENTER_CRITICAL(&link_mux);
+    int conn = find_link(bda);
+    if (conn < 0) {
+        portEXIT_CRITICAL(&link_mux);
+        return;
+    }
+    if (status == 0) {
+        links[conn].tx_octets = tx_octets;
+        links[conn].rx_octets = rx_octets;
+    }
+    bool ended = end_step(conn, STEP_DATA_LEN);
+    portEXIT_CRITICAL(&link_mux);
+
+    if (ended) {
+        if (status != 0) {
+            ESP_LOGW(TAG, "Slot %d keeps packets of %u octets, status 0x%02x", conn, BLE_TRANSPORT_MIN_DATA_LEN,
+                     status);
+        }
+        xTimerStop(response_timer, 0);
+        log_if_done(conn);
+        run();
+    }
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v) {
+    *p++ = v & 0xFF;
+    *p++ = v >> 8;
+    return p;
+}
+
+size_t ble_link_serialize(uint8_t *buf, size_t len) {
+    size_t needed = 8 + 1 + BLE_SERVER_MAX_CONN * 7;
+    link_t copy[BLE_SERVER_MAX_CONN];
+    link_stats_t counters;
+
+    if (len < needed) {
+        return 0;
+    }
+    portENTER_CRITICAL(&link_mux);
+    memcpy(copy, links, sizeof(copy));
+    counters = stats;
+    int negotiating = active;
+    portEXIT_CRITICAL(&link_mux);
+
+    uint8_t *p = buf;
+    p = put_u16(p, counters.phy_2m);
+    p = put_u16(p, counters.phy_1m);
+    p = put_u16(p, counters.data_len_long);
+    p = put_u16(p, counters.data_len_short);
+    *p++ = BLE_SERVER_MAX_CONN;
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        if (!copy[i].connected) {
+            *p++ = BLE_LINK_STATE_IDLE;
+        } else if (copy[i].step != STEP_DONE || negotiating == i) {
+            *p++ = BLE_LINK_STATE_NEGOTIATING;
+        } else {
+            *p++ = BLE_LINK_STATE_DONE;
+        }
+        *p++ = copy[i].connected ? copy[i].tx_phy : 0;
+        *p++ = copy[i].connected ? copy[i].rx_phy : 0;
+        p = put_u16(p, copy[i].connected ? copy[i].tx_octets : 0);
+        p = put_u16(p, copy[i].connected ? copy[i].rx_octets : 0);
+    }
+    return p - buf;
+}
+
+void ble_link_dump(void) {
+    link_t copy[BLE_SERVER_MAX_CONN];
+    link_stats_t counters;
+
+    portENTER_CRITICAL(&link_mux);
+    memcpy(copy, links, sizeof(copy));
+    counters = stats;
+    portEXIT_CRITICAL(&link_mux);
+
+    ESP_LOGI(TAG, "PHY: %u links on 2M, %u left on 1M; data length: %u links extended, %u left at %u octets",
+             counters.phy_2m, counters.phy_1m, counters.data_len_long, counters.data_len_short,
+             BLE_TRANSPORT_MIN_DATA_LEN);
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        if (copy[i].connected) {
+            ESP_LOGI(TAG, "Slot %d: %s/%s PHY, %u/%u octets%s", i, phy_name(copy[i].tx_phy), phy_name(copy[i].rx_phy),
+                     copy[i].tx_octets, copy[i].rx_octets, copy[i].step == STEP_DONE ? "" : ", negotiating");
+        }
+    }
+}
+
+void ble_link_reset(void) {
+    portENTER_CRITICAL(&link_mux);
+    memset(&stats, 0, sizeof(stats));
+    portEXIT_CRITICAL(&link_mux);
+}
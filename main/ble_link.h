@@ -0,0 +1,101 @@
+#ifndef BLE_LINK_H
+#define BLE_LINK_H
+
+// ble_link.h - Link optimization after connect: 2M PHY and data length extension
+//
+// Once a phone connects, the remote asks for the 2M PHY (CONFIG_BLE_LINK_2M_PHY) and
+// then for link-layer packets of up to CONFIG_BLE_LINK_DATA_LEN octets.
+// A phone that does not support one of them, or does not answer within a few seconds,
+// keeps the 27-octet packets or the 1M PHY; the connection is used either way. Links
+// are negotiated one at a time, as Bluedroid does not say which link some of the
+// answers are for. The outcome is on diagnostics page 5.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "ble_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    BLE_LINK_STATE_IDLE = 0,        // Slot not connected
+    BLE_LINK_STATE_NEGOTIATING = 1,
+    BLE_LINK_STATE_DONE = 2,
+} ble_link_state_t;
+
+/**
+ * @brief Creates the response timer. Call once before the BLE stack starts.
+ *
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NO_MEM: If the timer could not be created.
+ */
+esp_err_t ble_link_init(void);
+
+/**
+ * @brief Starts negotiating a new connection, or queues it behind the one in progress.
+ *
+ * @param conn Connection slot.
+ * @param bda  Peer address.
+ */
+void ble_link_on_connect(int conn, const esp_bd_addr_t bda);
+
+/**
+ * @brief Forgets the connection and moves on to the next one waiting.
+ *
+ * @param conn Connection slot.
+ */
+void ble_link_on_disconnect(int conn);
+
+/**
+ * @brief Handles BLE_TRANSPORT_EVT_PHY, for requests of the remote and of the phone.
+ *
+ * @param bda    Peer address.
+ * @param status Status reported by the host, 0 on success.
+ * @param tx_phy PHY in use from the remote to the phone (BLE_TRANSPORT_PHY_*).
+ * @param rx_phy PHY in use from the phone to the remote.
+ */
+void ble_link_on_phy(const esp_bd_addr_t bda, uint8_t status, uint8_t tx_phy, uint8_t rx_phy);
+
+/**
+ * @brief Handles BLE_TRANSPORT_EVT_DATA_LEN, for requests of the remote and of the phone.
+ *
+ * @param bda       Peer address.
+ * @param status    Status reported by the host, 0 on success.
+ * @param tx_octets Longest link-layer payload from the remote to the phone.
+ * @param rx_octets Longest link-layer payload from the phone to the remote.
+ */
+void ble_link_on_data_len(const esp_bd_addr_t bda, uint8_t status, uint16_t tx_octets, uint16_t rx_octets);
+
+/**
+ * @brief Serializes the negotiated links for the diagnostics characteristic.
+ *
+ * Layout (little-endian):
+ *   u16 links moved to 2M, u16 links left on 1M,
+ *   u16 links with longer packets, u16 links left at 27 octets,
+ *   u8  slot count, then per slot: u8 state (ble_link_state_t), u8 tx PHY, u8 rx PHY,
+ *       u16 tx octets, u16 rx octets
+ *
+ * @param buf Output buffer.
+ * @param len Size of the output buffer.
+ * @return Number of bytes written, or 0 if the buffer is too small.
+ */
+size_t ble_link_serialize(uint8_t *buf, size_t len);
+
+/**
+ * @brief Logs the negotiated links to the console.
+ */
+void ble_link_dump(void);
+
+/**
+ * @brief Clears the link counters; the state of connected links is kept.
+ */
+void ble_link_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_LINK_H
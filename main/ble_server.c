@@ -4,226 +4,571 @@
  */
 
 #include "ble_server.h"
-#include "esp_bt.h"
-#include "esp_bt_main.h"
-#include "esp_bt_device.h"
-#include "esp_gatts_api.h"
-#include "esp_gap_ble_api.h"
-#include "esp_gatt_common_api.h"
+#include "ble_transport.h"
 #include "esp_log.h"
+#include "ble_tx.h"
+#include "ble_conn_params.h"
+#include "ble_link.h"
+#include "ble_accept.h"
+#include "ble_bond.h"
+#include "ble_adv.h"
+#include "ble_beacon.h"
+#include "bt_event.h"
+#include "bt_trace.h"
+#include "bt_boot.h"
+#include "bt_diag.h"
+#include "bt_pm.h"
+#include "bt_prov.h"
+#include "bt_timesync.h"
+#include "data_storage.h"
+#include "flight_rec.h"
+#include "esp_timer.h"
+#include <stdlib.h>
 #include <string.h>
 
 #define TAG "BLE_SERVER"
 
-#define SERVICE_UUID        0x00FF
-#define NUM_HANDLES         8
-
-static esp_gatt_if_t gatt_if;
-static uint16_t service_handle;
-static uint16_t char_handle;
-static uint16_t descr_handle;
-static uint16_t conn_id;
-
-static const uint8_t adv_service_uuid128[16] = {
-    0xFB, 0x34, 0x9B, 0x5F,
-    0x80, 0x00,
-    0x00, 0x80,
-    0x00, 0x10,
-    0x00, 0x00,
-    0x01, 0xFF, 0x00, 0x00
-};
+#define CCCD_NOTIFY         0x0001
+#define CCCD_INDICATE       0x0002
+#define ACK_PREFIX          "ack:"
+#define TIME_PREFIX         "time:"
+#define DUMP_CMD_START      0x01
+
+typedef struct {
+    bool in_use;
+    uint16_t conn_id;
+    esp_bd_addr_t bda;
+    uint16_t mtu;
+    uint16_t cccd_value;
+    uint16_t dump_cccd_value;
+    bool encrypted;             // With keys in the registry, its CCCDs are kept across connections
+    uint16_t saved_cccd;        // CCCD values as last saved to or loaded from NVS
+    uint16_t saved_dump_cccd;
+    bool locked;                // Has keys in the registry and the link is not encrypted yet
+} conn_t;
+
+// The host task changes the slots under conns_mux; other tasks read them under it too
+static portMUX_TYPE conns_mux = portMUX_INITIALIZER_UNLOCKED;
+static conn_t conns[BLE_SERVER_MAX_CONN];
+static int dump_conn = -1;      // Slot taking the flight recorder dump, until it ends or the phone disconnects
+
+static const uint8_t remote_init_value[] = { 'i', 'n', 'i', 't' };
+
+// Serialized diagnostics page, captured on the first read so long reads see one consistent snapshot
+static uint8_t diag_buf[BLE_TRANSPORT_MAX_ATTR_LEN];
+static size_t diag_len;
+static uint8_t prov_buf[BLE_TRANSPORT_MAX_ATTR_LEN];    // Provisioning result, captured the same way
+static size_t prov_len;
+static uint8_t cccd_buf[2];
+
+// Returns the slot of a GATT connection, or -1
+static int find_conn(uint16_t conn_id) {
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        if (conns[i].in_use && conns[i].conn_id == conn_id) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-static esp_bt_uuid_t char_uuid = {
-    .len = ESP_UUID_LEN_128,
-    .uuid = {.uuid128 = {
-        0xfb, 0x34, 0x9b, 0x5f,
-        0x80, 0x00,
-        0x00, 0x80,
-        0x00, 0x10,
-        0x00, 0x00,
-        0x34, 0x12, 0x00, 0x00
-    }},
-};
+// Returns the slot of a phone, or -1
+static int find_conn_by_bda(const esp_bd_addr_t bda) {
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        if (conns[i].in_use && memcmp(conns[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-static esp_ble_adv_params_t adv_params = {
-    .adv_int_min        = 0x20,
-    .adv_int_max        = 0x40,
-    .adv_type           = ADV_TYPE_IND,
-    .own_addr_type      = BLE_ADDR_TYPE_PUBLIC,
-    .channel_map        = ADV_CHNL_ALL,
-    .adv_filter_policy  = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
-};
+static bool has_free_slot(void) {
+    for (int i = 0; i < BLE_SERVER_MAX_CONN; i++) {
+        if (!conns[i].in_use) {
+            return true;
+        }
+    }
+    return false;
+}
 
-const char* device_name = "BLE Remote controller";
-
-esp_ble_adv_data_t adv_data = {
-    .set_scan_rsp = false,
-    .include_name = true,                 // ✅ This shows the name
-    .include_txpower = false,
-    .min_interval = 0x0006,              // Optional
-    .max_interval = 0x0010,              // Optional
-    .appearance = 0x00,
-    .manufacturer_len = 0,               // Optional
-    .p_manufacturer_data = NULL,
-    .service_data_len = 0,
-    .p_service_data = NULL,
-    .service_uuid_len = sizeof(adv_service_uuid128),
-    .p_service_uuid = adv_service_uuid128,
-    .flag = (ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT),
-};
+uint16_t ble_server_get_max_payload(int conn) {
+    portENTER_CRITICAL(&conns_mux);
+    uint16_t mtu = conns[conn].in_use ? conns[conn].mtu : BLE_TRANSPORT_DEFAULT_MTU;
+    portEXIT_CRITICAL(&conns_mux);
+    return mtu - 3;
+}
+
+bool ble_server_is_connected(void) {
+    bool connected = false;
 
-void send_ble_message(const char* msg) {
-    esp_ble_gatts_send_indicate(gatt_if, conn_id, char_handle,
-                                strlen(msg), (uint8_t*)msg, false);
+    portENTER_CRITICAL(&conns_mux);
+    for (int i = 0; i < BLE_SERVER_MAX_CONN && !connected; i++) {
+        connected = conns[i].in_use;
+    }
+    portEXIT_CRITICAL(&conns_mux);
+    return connected;
 }
 
-static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
-    switch (event) {
-        case ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT:
-            ESP_LOGI(TAG, "Advertising data set complete, starting advertising...");
-            esp_ble_gap_start_advertising(&adv_params);
-            break;         
-        case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
-            ESP_LOGI(TAG, "Advertising started");
-            break;
-        default:
-            break;
+bool ble_server_is_peer_connected(const esp_bd_addr_t bda) {
+    bool found = false;
+
+    portENTER_CRITICAL(&conns_mux);
+    for (int i = 0; i < BLE_SERVER_MAX_CONN && !found; i++) {
+        found = conns[i].in_use && memcmp(conns[i].bda, bda, sizeof(esp_bd_addr_t)) == 0;
     }
+    portEXIT_CRITICAL(&conns_mux);
+    return found;
+}
+
+bool ble_server_is_subscribed(int conn) {
+    portENTER_CRITICAL(&conns_mux);
+    bool subscribed = conns[conn].in_use && !conns[conn].locked &&
+                      (conns[conn].cccd_value & (CCCD_NOTIFY | CCCD_INDICATE)) != 0;
+    portEXIT_CRITICAL(&conns_mux);
+    return subscribed;
 }
 
-static void gatts_event_handler(esp_gatts_cb_event_t event,
-                                esp_gatt_if_t gatts_if_param,
-                                esp_ble_gatts_cb_param_t *param) {
-    switch (event) {
-        case ESP_GATTS_REG_EVT: {
-            ESP_LOGI(TAG, "ESP_GATTS_REG_EVT");
-            gatt_if = gatts_if_param;
+bool ble_server_indications_enabled(int conn) {
+    portENTER_CRITICAL(&conns_mux);
+    bool enabled = (conns[conn].cccd_value & CCCD_INDICATE) != 0;
+    portEXIT_CRITICAL(&conns_mux);
+    return enabled;
+}
 
-            esp_gatt_srvc_id_t service_id = {
-                .is_primary = true,
-                .id.inst_id = 0,
-                .id.uuid.len = ESP_UUID_LEN_16,
-                .id.uuid.uuid.uuid16 = SERVICE_UUID
-            };
-            esp_ble_gatts_create_service(gatt_if, &service_id, NUM_HANDLES);
-            break;
-        }
+// Call with conns_mux held
+static bool dump_ready(void) {
+    int conn = dump_conn;
+    return conn >= 0 && conns[conn].in_use && !conns[conn].locked && (conns[conn].dump_cccd_value & CCCD_NOTIFY) != 0;
+}
+
+bool ble_server_dump_subscribed(void) {
+    portENTER_CRITICAL(&conns_mux);
+    bool ready = dump_ready();
+    portEXIT_CRITICAL(&conns_mux);
+    return ready;
+}
 
-        case ESP_GATTS_CREATE_EVT: {
-            ESP_LOGI(TAG, "Service created");
-            service_handle = param->create.service_handle;
-            esp_ble_gatts_start_service(service_handle);
+uint16_t ble_server_dump_max_payload(void) {
+    portENTER_CRITICAL(&conns_mux);
+    int conn = dump_conn;
+    portEXIT_CRITICAL(&conns_mux);
+    return conn >= 0 ? ble_server_get_max_payload(conn) : BLE_TRANSPORT_DEFAULT_MTU - 3;
+}
 
-            esp_gatt_char_prop_t props = ESP_GATT_CHAR_PROP_BIT_READ |
-                                         ESP_GATT_CHAR_PROP_BIT_WRITE |
-                                         ESP_GATT_CHAR_PROP_BIT_NOTIFY;
+esp_err_t ble_server_send_dump(const void *data, uint16_t len) {
+    portENTER_CRITICAL(&conns_mux);
+    bool ready = dump_ready();
+    uint16_t conn_id = ready ? conns[dump_conn].conn_id : 0;
+    portEXIT_CRITICAL(&conns_mux);
+    if (!ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ble_transport_send(conn_id, BLE_ATTR_DUMP_VAL, data, len, false);
+}
 
-            esp_attr_value_t char_val = {
-                .attr_max_len = 20,
-                .attr_len = 4,
-                .attr_value = (uint8_t *)"init"
-            };
+static bool is_dump_conn(int conn) {
+    portENTER_CRITICAL(&conns_mux);
+    bool dumping = dump_conn == conn;
+    portEXIT_CRITICAL(&conns_mux);
+    return dumping;
+}
 
-            esp_ble_gatts_add_char(service_handle, &char_uuid,
-                                   ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
-                                   props, &char_val, NULL);
-            break;
+void ble_server_dump_end(void) {
+    portENTER_CRITICAL(&conns_mux);
+    dump_conn = -1;
+    portEXIT_CRITICAL(&conns_mux);
+}
+
+esp_err_t send_ble_message(int conn, const char* msg, bool need_confirm) {
+    portENTER_CRITICAL(&conns_mux);
+    bool in_use = conns[conn].in_use;
+    uint16_t conn_id = conns[conn].conn_id;
+    portEXIT_CRITICAL(&conns_mux);
+    if (!in_use) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ble_transport_send(conn_id, BLE_ATTR_REMOTE_VAL, msg, strlen(msg), need_confirm);
+}
+
+/**
+ * Parses a command written by the phone to the remote characteristic:
+ * "ack:<seq>" confirms events, "time:<epoch_ms>" syncs the clock.
+ * Returns true if the write was a recognized command.
+ */
+static bool handle_char_write(int conn, const uint8_t *value, uint16_t len) {
+    int64_t received_us = esp_timer_get_time();
+    char buf[24];
+    char *end;
+
+    if (len == 0 || len >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+
+    if (strncmp(buf, ACK_PREFIX, strlen(ACK_PREFIX)) == 0) {
+        unsigned long seq = strtoul(&buf[strlen(ACK_PREFIX)], &end, 10);
+        if (end == &buf[strlen(ACK_PREFIX)] || *end != '\0' || seq > UINT16_MAX) {
+            return false;
+        }
+        ble_tx_on_ack(conn, (uint16_t)seq);
+        return true;
+    }
+    if (strncmp(buf, TIME_PREFIX, strlen(TIME_PREFIX)) == 0) {
+        long long phone_ms = strtoll(&buf[strlen(TIME_PREFIX)], &end, 10);
+        if (end == &buf[strlen(TIME_PREFIX)] || *end != '\0' || phone_ms <= 0) {
+            return false;
         }
+        bt_timesync_update(phone_ms, received_us);
+        return true;
+    }
+    return false;
+}
 
-        case ESP_GATTS_ADD_CHAR_EVT: {
-            ESP_LOGI(TAG, "Characteristic added, handle: %d", param->add_char.attr_handle);
-            char_handle = param->add_char.attr_handle;
 
-            esp_bt_uuid_t descr_uuid = {
-                .len = ESP_UUID_LEN_16,
-                .uuid.uuid16 = ESP_GATT_UUID_CHAR_CLIENT_CONFIG
-            };
-            esp_ble_gatts_add_char_descr(service_handle, &descr_uuid,
-                                         ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
-                                         NULL, NULL);
-            break;
+static const uint8_t *on_read(uint16_t conn_id, ble_attr_t attr, bool refresh, size_t *len) {
+    int conn = find_conn(conn_id);
+    uint16_t cccd;
+
+    if (conn >= 0 && conns[conn].locked) {
+        return NULL;
+    }
+    switch (attr) {
+        case BLE_ATTR_REMOTE_VAL:
+            *len = sizeof(remote_init_value);
+            return remote_init_value;
+        case BLE_ATTR_DIAG_VAL:
+            if (refresh) {
+                diag_len = bt_diag_read(diag_buf, sizeof(diag_buf));
+            }
+            *len = diag_len;
+            return diag_buf;
+        case BLE_ATTR_PROV_VAL:
+            if (refresh) {
+                prov_len = bt_prov_read(prov_buf, sizeof(prov_buf));
+            }
+            *len = prov_len;
+            return prov_buf;
+        case BLE_ATTR_REMOTE_CCCD:
+        case BLE_ATTR_DUMP_CCCD:
+            cccd = conn < 0 ? 0 : attr == BLE_ATTR_REMOTE_CCCD ? conns[conn].cccd_value : conns[conn].dump_cccd_value;
+            cccd_buf[0] = cccd & 0xFF;
+            cccd_buf[1] = cccd >> 8;
+            *len = sizeof(cccd_buf);
+            return cccd_buf;
+        default:
+            return NULL;
+    }
+}
+
+#ifdef CONFIG_NVS_ENABLE
+/*
+ * A bonded phone's CCCDs are kept in the registry, as the spec asks of a server for its
+ * bonded clients. The phone can then be sent to as soon as its link is encrypted again,
+ * instead of after it has discovered the service and subscribed again. A phone without
+ * keys, or on a link not encrypted with them, could be a device that copied its address,
+ * so its CCCDs are neither restored nor saved. On NimBLE the stack keeps them as well,
+ * and reports them as writes once the link is encrypted.
+ */
+static bool is_bonded(int conn) {
+    bt_device_bond_t bond;
+
+    return conns[conn].encrypted && load_bt_device_bond(conns[conn].bda, &bond) == ESP_OK && bond.key_size > 0;
+}
+
+static void restore_cccds(int conn) {
+    uint16_t cccd, dump_cccd;
+
+    if (!is_bonded(conn) || load_bt_device_cccd(conns[conn].bda, &cccd, &dump_cccd) != ESP_OK) {
+        return;
+    }
+    portENTER_CRITICAL(&conns_mux);
+    conns[conn].cccd_value = conns[conn].saved_cccd = cccd;
+    conns[conn].dump_cccd_value = conns[conn].saved_dump_cccd = dump_cccd;
+    portEXIT_CRITICAL(&conns_mux);
+    if (cccd != 0) {
+        ESP_LOGI(TAG, "Restored CCCD 0x%04x for conn_id %u", cccd, conns[conn].conn_id);
+        BT_TRACE(BLE, INFO, BLE_CCCD, cccd, conns[conn].conn_id);
+        bt_event_wake();
+    }
+}
+
+static void save_cccds(int conn) {
+    uint16_t cccd = conns[conn].cccd_value;
+    uint16_t dump_cccd = conns[conn].dump_cccd_value;
+
+    // Most phones write the same values on every connection
+    if ((cccd == conns[conn].saved_cccd && dump_cccd == conns[conn].saved_dump_cccd) || !is_bonded(conn)) {
+        return;
+    }
+    if (save_bt_device_cccd(conns[conn].bda, cccd, dump_cccd) == ESP_OK) {
+        conns[conn].saved_cccd = cccd;
+        conns[conn].saved_dump_cccd = dump_cccd;
+    } else {
+        ESP_LOGW(TAG, "Failed to save the CCCDs of conn_id %u", conns[conn].conn_id);
+    }
+}
+#else
+static void restore_cccds(int conn) {
+}
+
+static void save_cccds(int conn) {
+}
+#endif // CONFIG_NVS_ENABLE
+
+static void on_connect(const ble_transport_evt_t *evt) {
+    int conn;
+
+    BT_TRACE(BLE, INFO, BLE_CONNECT, evt->conn_id, 0);
+    flight_rec_log(FLIGHT_REC_BLE_CONNECT, evt->conn_id, 0, 0);
+    if (!ble_accept_admit(evt->connect.bda)) {
+        // Got in while advertising was open because the controller's list overflowed
+        ESP_LOGW(TAG, "Closing conn_id %u from "ESP_BD_ADDR_STR", not paired", evt->conn_id,
+                 ESP_BD_ADDR_HEX(evt->connect.bda));
+        ble_transport_close(evt->conn_id);
+        if (has_free_slot()) {
+            ble_adv_start();
         }
+        return;
+    }
+    bt_boot_mark(BT_BOOT_FIRST_CONNECT);
+    conn = find_conn(evt->conn_id);
+    for (int i = 0; i < BLE_SERVER_MAX_CONN && conn < 0; i++) {
+        conn = conns[i].in_use ? -1 : i;
+    }
+    if (conn < 0) {
+        // Another phone got in before advertising stopped
+        ESP_LOGW(TAG, "No free connection slot, closing conn_id %u", evt->conn_id);
+        ble_transport_close(evt->conn_id);
+        return;
+    }
+    portENTER_CRITICAL(&conns_mux);
+    conns[conn] = (conn_t) {
+        .in_use = true,
+        .conn_id = evt->conn_id,
+        .mtu = BLE_TRANSPORT_DEFAULT_MTU,
+    };
+    memcpy(conns[conn].bda, evt->connect.bda, sizeof(esp_bd_addr_t));
+    portEXIT_CRITICAL(&conns_mux);
+    bool locked = ble_bond_on_connect(conn, evt->conn_id, evt->connect.bda);
+    portENTER_CRITICAL(&conns_mux);
+    conns[conn].locked = locked;
+    portEXIT_CRITICAL(&conns_mux);
+    ble_conn_params_on_connect(conn, evt->connect.bda, evt->connect.interval);
+    ble_link_on_connect(conn, evt->connect.bda);
+    ble_adv_on_connect(evt->connect.bda, evt->connect.addr_type);
+    if (has_free_slot()) {
+        ble_adv_start();    // Stay reachable for the next phone
+    }
+}
 
-        case ESP_GATTS_ADD_CHAR_DESCR_EVT:
-            descr_handle = param->add_char_descr.attr_handle;
-            ESP_LOGI(TAG, "Descriptor added, handle: %d", descr_handle);
-
-            // esp_ble_gap_config_adv_data_raw((uint8_t*)adv_service_uuid128, sizeof(adv_service_uuid128));
-            esp_err_t ret = esp_ble_gap_config_adv_data(&adv_data);
-            if (ret) {
-                ESP_LOGE(TAG, "Failed to configure advertising data: %s", esp_err_to_name(ret));
-            }            
-
-            // esp_ble_gap_start_advertising(&adv_params);
-            break;
-
-        case ESP_GATTS_CONNECT_EVT:
-            ESP_LOGI(TAG, "Device connected");
-            conn_id = param->connect.conn_id;
-            esp_ble_conn_update_params_t conn_params = {
-                .min_int = 0x10,  // 20ms
-                .max_int = 0x20,  // 40ms
-                .latency = 0,
-                .timeout = 400,   // 4s supervision timeout
-            };
-            memcpy(conn_params.bda, param->connect.remote_bda, sizeof(conn_params.bda));
-            ESP_ERROR_CHECK(esp_ble_gap_update_conn_params(&conn_params));
-            break;
-
-        case ESP_GATTS_DISCONNECT_EVT:
-            ESP_LOGI(TAG, "Device disconnected, restarting advertising...");
-            esp_ble_gap_start_advertising(&adv_params);
-            break;
-
-        case ESP_GATTS_WRITE_EVT:
-            ESP_LOGI(TAG, "Write event, handle: %d", param->write.handle);
-            esp_gatt_rsp_t rsp = {};
-            rsp.attr_value.handle = param->write.handle;
-            rsp.attr_value.len = param->write.len;
-            memcpy(rsp.attr_value.value, param->write.value, param->write.len);
-            esp_ble_gatts_send_response(gatts_if_param, param->write.conn_id, param->write.trans_id,
-                                        ESP_GATT_OK, &rsp);
-
-            if (param->write.handle == descr_handle && param->write.len == 2) {
-                uint16_t value = param->write.value[1] << 8 | param->write.value[0];
-                if (value == 0x0001) {
-                    ESP_LOGI(TAG, "Client enabled notifications");
-                    // send_ble_message("short:1");  // Sample notification
-                } else if (value == 0x0000) {
-                    ESP_LOGI(TAG, "Client disabled notifications");
-                }
+static void on_disconnect(const ble_transport_evt_t *evt) {
+    BT_TRACE(BLE, INFO, BLE_DISCONNECT, evt->conn_id, evt->disconnect.reason);
+    flight_rec_log(FLIGHT_REC_BLE_DISCONNECT, evt->conn_id, evt->disconnect.reason, 0);
+    int conn = find_conn(evt->conn_id);
+    if (conn < 0) {
+        return;
+    }
+    save_cccds(conn);       // A phone that paired on this link has its keys stored by now
+    portENTER_CRITICAL(&conns_mux);
+    conns[conn].in_use = false;
+    conns[conn].cccd_value = 0;
+    conns[conn].dump_cccd_value = 0;
+    bool dumping = dump_conn == conn;
+    if (dumping) {
+        dump_conn = -1;
+    }
+    portEXIT_CRITICAL(&conns_mux);
+    if (dumping) {
+        flight_rec_on_dump_disconnect();
+    }
+    ble_conn_params_on_disconnect(conn);
+    ble_link_on_disconnect(conn);
+    ble_bond_on_disconnect(conn);
+    ble_tx_on_disconnect(conn);
+    ble_adv_start();
+}
+
+// One phone at a time takes the dump; a request from another while it runs is ignored
+static void on_dump_request(int conn) {
+    portENTER_CRITICAL(&conns_mux);
+    int owner = dump_conn;
+    if (owner < 0) {
+        dump_conn = conn;
+    }
+    portEXIT_CRITICAL(&conns_mux);
+
+    if (owner >= 0) {
+        ESP_LOGW(TAG, "conn_id %u asked for a dump while conn_id %u takes one", conns[conn].conn_id,
+                 conns[owner].conn_id);
+        return;
+    }
+    if (!flight_rec_dump_start()) {
+        ble_server_dump_end();
+    }
+}
+
+static void on_write(const ble_transport_evt_t *evt) {
+    const uint8_t *value = evt->write.value;
+    uint16_t len = evt->write.len;
+
+    BT_TRACE(BLE, DEBUG, BLE_WRITE, evt->write.attr, len);
+    int conn = find_conn(evt->conn_id);
+    if (conn < 0 || conns[conn].locked) {
+        return;
+    }
+    switch (evt->write.attr) {
+        case BLE_ATTR_REMOTE_CCCD:
+            if (len == 2) {
+                portENTER_CRITICAL(&conns_mux);
+                conns[conn].cccd_value = value[1] << 8 | value[0];
+                portEXIT_CRITICAL(&conns_mux);
+                BT_TRACE(BLE, INFO, BLE_CCCD, conns[conn].cccd_value, evt->conn_id);
+                bt_event_wake();
+                save_cccds(conn);
             }
             break;
-        case ESP_GATTS_CONF_EVT:
-            if (param->conf.status == ESP_GATT_OK) {
-                ESP_LOGI(TAG, "Notification/Indication confirmed by client");
-            } else {
-                ESP_LOGW(TAG, "Notification confirmation failed, status: %d", param->conf.status);
+        case BLE_ATTR_REMOTE_VAL:
+            handle_char_write(conn, value, len);
+            break;
+        case BLE_ATTR_DIAG_VAL:
+            if (len >= 1) {
+                bt_diag_command(value[0]);
+            }
+            break;
+        case BLE_ATTR_DUMP_CCCD:
+            if (len == 2) {
+                portENTER_CRITICAL(&conns_mux);
+                conns[conn].dump_cccd_value = value[1] << 8 | value[0];
+                portEXIT_CRITICAL(&conns_mux);
+                save_cccds(conn);
+            }
+            break;
+        case BLE_ATTR_DUMP_VAL:
+            if (len == 1 && value[0] == DUMP_CMD_START) {
+                on_dump_request(conn);
             }
             break;
+        case BLE_ATTR_PROV_VAL:
+            bt_prov_write(value, len);
+            break;
         default:
-            ESP_LOGI(TAG, "Unhandled GATT Event: %d", event);
             break;
     }
 }
 
-void ble_server_init() {
-    esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT);
-    esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_bt_controller_init(&bt_cfg));
-    ESP_ERROR_CHECK(esp_bt_controller_enable(ESP_BT_MODE_BLE));
-    ESP_ERROR_CHECK(esp_bluedroid_init());
-    ESP_ERROR_CHECK(esp_bluedroid_enable());
-
-
-    // ✅ 1. Set device name before starting GAP
-    ESP_ERROR_CHECK(esp_bt_dev_set_device_name(device_name));
+static void on_event(const ble_transport_evt_t *evt) {
+    int conn;
+
+    bt_pm_on_ble_activity();
+    switch (evt->type) {
+        case BLE_TRANSPORT_EVT_READY:
+            ESP_LOGI(TAG, "Service and advertising data ready, starting advertising...");
+            ble_accept_start();
+            ble_bond_start();
+            ble_beacon_load_keys();
+            ble_adv_start();
+            break;
+        case BLE_TRANSPORT_EVT_ADV_STARTED:
+            BT_TRACE(BLE, INFO, BLE_ADV_STARTED, evt->adv_started.status, 0);
+            if (ble_beacon_on_start_complete(evt->adv_started.status)) {
+                break;
+            }
+            ble_adv_on_start_complete(evt->adv_started.status);
+            if (evt->adv_started.status == 0 && bt_boot_mark(BT_BOOT_FIRST_ADV)) {
+                ESP_LOGI(TAG, "First advertisement %lld ms after boot",
+                         (long long)(bt_boot_time_us(BT_BOOT_FIRST_ADV) / 1000));
+                bt_boot_dump();
+            }
+            break;
+        case BLE_TRANSPORT_EVT_CONNECT:
+            on_connect(evt);
+            break;
+        case BLE_TRANSPORT_EVT_DISCONNECT:
+            on_disconnect(evt);
+            break;
+        case BLE_TRANSPORT_EVT_WRITE:
+            on_write(evt);
+            break;
+        case BLE_TRANSPORT_EVT_MTU:
+            BT_TRACE(BLE, INFO, BLE_MTU, evt->mtu.mtu, evt->conn_id);
+            conn = find_conn(evt->conn_id);
+            if (conn >= 0) {
+                portENTER_CRITICAL(&conns_mux);
+                conns[conn].mtu = evt->mtu.mtu;
+                portEXIT_CRITICAL(&conns_mux);
+            }
+            break;
+        case BLE_TRANSPORT_EVT_CONGEST:
+            BT_TRACE(BLE, INFO, BLE_CONGEST, evt->congest.congested, evt->conn_id);
+            flight_rec_log(FLIGHT_REC_BLE_CONGEST, evt->conn_id, evt->congest.congested, 0);
+            conn = find_conn(evt->conn_id);
+            if (conn >= 0) {
+                ble_tx_on_congest(conn, evt->congest.congested);
+            }
+            break;
+        case BLE_TRANSPORT_EVT_SENT:
+            if (evt->sent.ok) {
+                BT_TRACE(BLE, DEBUG, BLE_CONF, 0, evt->conn_id);
+            } else {
+                BT_TRACE(BLE, WARN, BLE_CONF, 1, evt->conn_id);
+            }
+            conn = find_conn(evt->conn_id);
+            if (evt->sent.attr == BLE_ATTR_REMOTE_VAL && conn >= 0) {
+                ble_tx_on_confirm(conn, evt->sent.ok);
+            } else if (evt->sent.attr == BLE_ATTR_DUMP_VAL && conn >= 0 && is_dump_conn(conn)) {
+                flight_rec_on_dump_confirm();
+            }
+            break;
+        case BLE_TRANSPORT_EVT_CONN_PARAMS:
+            ble_conn_params_on_update(evt->conn_params.bda, evt->conn_params.status, evt->conn_params.interval,
+                                      evt->conn_params.latency);
+            break;
+        case BLE_TRANSPORT_EVT_PHY:
+            ble_link_on_phy(evt->phy.bda, evt->phy.status, evt->phy.tx_phy, evt->phy.rx_phy);
+            break;
+        case BLE_TRANSPORT_EVT_DATA_LEN:
+            ble_link_on_data_len(evt->data_len.bda, evt->data_len.status, evt->data_len.tx_octets,
+                                 evt->data_len.rx_octets);
+            break;
+        case BLE_TRANSPORT_EVT_ACCEPT_LIST:
+            ble_accept_on_update_complete(evt->accept_list.status);
+            break;
+        case BLE_TRANSPORT_EVT_AUTH:
+            conn = find_conn_by_bda(evt->auth.bda);
+            if (conn < 0) {
+                break;
+            }
+            BT_TRACE(BLE, INFO, BLE_AUTH, evt->auth.status, conns[conn].conn_id);
+            if (!ble_bond_on_auth(conn, evt->auth.status)) {
+                ble_transport_close(conns[conn].conn_id);
+            } else if (evt->auth.status == 0) {
+                bool resumed = conns[conn].locked;
+                portENTER_CRITICAL(&conns_mux);
+                conns[conn].encrypted = true;
+                conns[conn].locked = false;
+                portEXIT_CRITICAL(&conns_mux);
+                // A phone that has just paired keeps what it wrote; its keys are saved later
+                if (resumed) {
+                    ESP_LOGI(TAG, "conn_id %u encrypted with its bond", conns[conn].conn_id);
+                    restore_cccds(conn);
+                    bt_event_wake();
+                }
+            }
+            break;
+    }
+}
 
-    // ✅ 2. Configure advertising data to include the name
-    ESP_ERROR_CHECK(esp_ble_gap_config_adv_data(&adv_data));
+static const ble_transport_callbacks_t callbacks = {
+    .on_event = on_event,
+    .on_read = on_read,
+    .on_pair = ble_bond_may_pair,
+};
 
-    ESP_ERROR_CHECK(esp_ble_gatts_register_callback(gatts_event_handler));
-    ESP_ERROR_CHECK(esp_ble_gap_register_callback(gap_event_handler));
-    ESP_ERROR_CHECK(esp_ble_gatts_app_register(0));
+void ble_server_init() {
+    ESP_ERROR_CHECK(ble_conn_params_init());
+    ESP_ERROR_CHECK(ble_link_init());
+    ESP_ERROR_CHECK(ble_bond_init());
+    ESP_ERROR_CHECK(ble_adv_init());
+    ESP_ERROR_CHECK(ble_beacon_init());
+    ble_transport_init(&callbacks);
 }
-
@@ -3,10 +3,22 @@
 
 // BLE Server header file
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "ble_types.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * Connections are kept in a table of BLE_SERVER_MAX_CONN slots. Functions that take a
+ * "conn" argument expect a slot index, 0 to BLE_SERVER_MAX_CONN - 1, not a GATT conn_id.
+ */
+#define BLE_SERVER_MAX_CONN CONFIG_BLE_MAX_CONNECTIONS
+
 /**
  * @brief Notifies the application of a button event via BLE.
  *
@@ -23,9 +35,9 @@ void app_notify_button_event(const char* type, int button_num);
  * 
  * Initializes the BLE server and registers necessary callbacks.
  *
- * This function releases memory used by classic Bluetooth, initializes and enables the Bluetooth controller in BLE mode,
- * initializes and enables the Bluedroid stack, and registers the GATT server and GAP event handlers.
- * It also registers the GATT application with app ID 0.
+ * This function creates the advertising and connection parameter timers and starts the
+ * BLE host chosen in the ESP-IDF configuration through ble_transport_init(), which
+ * registers the service. Advertising starts once the service and advertising data are set.
  *
  * All initialization steps are checked for errors and will abort if any step fails.
  */
@@ -34,11 +46,88 @@ void ble_server_init(void);
 /**
  * @brief Sends a message over BLE (Bluetooth Low Energy).
  *
- * This function transmits the specified message string using the BLE interface.
+ * This function transmits the specified message string to one connected phone.
  *
+ * @param conn Connection slot to send on.
  * @param msg Pointer to a null-terminated string containing the message to send.
+ * @param need_confirm true to send as an indication that the phone must confirm,
+ *                     false to send as a notification.
+ * @return
+ *     - ESP_OK: If the message was handed to the BLE stack.
+ *     - ESP_ERR_INVALID_STATE: If no phone is connected in that slot.
+ *     - Other error codes if the stack rejected the message.
+ */
+esp_err_t send_ble_message(int conn, const char* msg, bool need_confirm);
+
+/**
+ * @brief Returns true while at least one phone is connected.
+ */
+bool ble_server_is_connected(void);
+
+/**
+ * @brief Returns true if a phone with the given address is connected.
+ */
+bool ble_server_is_peer_connected(const esp_bd_addr_t bda);
+
+/**
+ * @brief Returns true while the phone in the given slot has enabled notifications or indications.
+ *
+ * Events are only sent to subscribed phones; while there are none they are buffered.
+ *
+ * @param conn Connection slot.
+ */
+bool ble_server_is_subscribed(int conn);
+
+/**
+ * @brief Returns true if the phone in the given slot enabled indications in the CCCD.
+ *
+ * When indications are enabled, events are confirmed by the GATT layer. Otherwise
+ * the phone acknowledges them by writing "ack:<seq>" to the characteristic.
+ *
+ * @param conn Connection slot.
+ */
+bool ble_server_indications_enabled(int conn);
+
+/**
+ * @brief Returns the largest notification payload the connection in the given slot can carry.
+ *
+ * The value follows the ATT MTU negotiated with the phone and falls back to the
+ * default 20 bytes until the phone has exchanged MTUs or after a disconnect.
+ *
+ * @param conn Connection slot.
+ * @return Maximum payload length in bytes for a single notification.
+ */
+uint16_t ble_server_get_max_payload(int conn);
+
+/**
+ * @brief Returns true while the phone that requested the flight recorder dump is
+ *        connected and has enabled notifications on the dump characteristic.
+ */
+bool ble_server_dump_subscribed(void);
+
+/**
+ * @brief Returns the largest notification payload of the connection receiving the dump.
+ */
+uint16_t ble_server_dump_max_payload(void);
+
+/**
+ * @brief Sends one chunk of a flight recorder dump as a notification to the phone that
+ *        requested it.
+ *
+ * @param data Chunk to send.
+ * @param len  Chunk length, at most ble_server_dump_max_payload() bytes.
+ * @return
+ *     - ESP_OK: If the chunk was handed to the BLE stack.
+ *     - ESP_ERR_INVALID_STATE: If no phone is subscribed to the dump characteristic.
+ *     - Other error codes if the stack rejected the chunk.
+ */
+esp_err_t ble_server_send_dump(const void *data, uint16_t len);
+
+/**
+ * @brief Frees the dump for the next request. Called by the flight recorder once a
+ *        dump stream is over.
  */
-void send_ble_message(const char* msg);
+void ble_server_dump_end(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,362 @@
+#ifndef BLE_TRANSPORT_H
+#define BLE_TRANSPORT_H
+
+// ble_transport.h - The BLE host under the server: GATT service, advertising and connections
+//
+// ble_server, ble_adv, ble_conn_params, ble_link, ble_accept, ble_beacon and ble_bond
+// only talk to the host through this interface. ble_transport_bluedroid.c implements
+// it on Bluedroid and ble_transport_nimble.c on NimBLE; the host is picked with the
+// ESP-IDF Bluetooth host option (CONFIG_BT_BLUEDROID_ENABLED or CONFIG_BT_NIMBLE_ENABLED).
+// Both build the same service, in the same handle order, and report the same events.
+//
+// Events are delivered on the host's task (BTC_TASK or nimble_host). Some of them are
+// also delivered from inside the call that caused them, see ble_transport_adv_start()
+// and ble_transport_accept_list_update().
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "ble_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLE_TRANSPORT_DEVICE_NAME   CONFIG_EXAMPLE_LOCAL_DEVICE_NAME
+#define BLE_TRANSPORT_SERVICE_UUID  0x00FF
+#define BLE_TRANSPORT_DEFAULT_MTU   23
+#define BLE_TRANSPORT_MAX_ATTR_LEN  512
+
+// PHYs, as HCI numbers them
+#define BLE_TRANSPORT_PHY_1M        1
+#define BLE_TRANSPORT_PHY_2M        2
+#define BLE_TRANSPORT_PHY_CODED     3
+
+// Bonds the host keeps
+#if defined(CONFIG_BT_SMP_MAX_BONDS)
+#define BLE_TRANSPORT_MAX_BONDS     CONFIG_BT_SMP_MAX_BONDS
+#elif defined(CONFIG_BT_NIMBLE_MAX_BONDS)
+#define BLE_TRANSPORT_MAX_BONDS     CONFIG_BT_NIMBLE_MAX_BONDS
+#else
+#define BLE_TRANSPORT_MAX_BONDS     8
+#endif
+
+#define BLE_TRANSPORT_KEY_LEN       16  // LTK and IRK
+
+// Link-layer payload lengths, in octets
+#define BLE_TRANSPORT_MIN_DATA_LEN  27
+#define BLE_TRANSPORT_MAX_DATA_LEN  251
+
+// Bytes of a 128-bit UUID on the Bluetooth base, least significant first
+#define BLE_TRANSPORT_UUID128(lo, hi) \
+    0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, (lo), (hi), 0x00, 0x00
+
+// Attributes of the service the server reads and writes
+typedef enum {
+    BLE_ATTR_REMOTE_VAL,    // Button events out, "ack:" and "time:" commands in
+    BLE_ATTR_REMOTE_CCCD,
+    BLE_ATTR_DIAG_VAL,      // Write a page selector, then read the page
+    BLE_ATTR_DUMP_VAL,      // Write 0x01, receive the flight recorder as notifications
+    BLE_ATTR_DUMP_CCCD,
+    BLE_ATTR_PROV_VAL,      // Write a batch of paired-phone changes, then read the result
+    BLE_ATTR_COUNT,
+} ble_attr_t;
+
+typedef enum {
+    BLE_TRANSPORT_EVT_READY,        // Service registered and advertising data set
+    BLE_TRANSPORT_EVT_ADV_STARTED,
+    BLE_TRANSPORT_EVT_CONNECT,
+    BLE_TRANSPORT_EVT_DISCONNECT,
+    BLE_TRANSPORT_EVT_MTU,
+    BLE_TRANSPORT_EVT_WRITE,        // Also reported for CCCD changes; long writes arrive whole
+    BLE_TRANSPORT_EVT_SENT,         // Notification sent or indication confirmed
+    BLE_TRANSPORT_EVT_CONGEST,
+    BLE_TRANSPORT_EVT_CONN_PARAMS,
+    BLE_TRANSPORT_EVT_ACCEPT_LIST,
+    BLE_TRANSPORT_EVT_PHY,
+    BLE_TRANSPORT_EVT_DATA_LEN,
+    BLE_TRANSPORT_EVT_AUTH,         // Link encrypted, after pairing or with a bond's keys, or that failed
+} ble_transport_evt_type_t;
+
+typedef struct {
+    ble_transport_evt_type_t type;
+    uint16_t conn_id;                   // Host's connection ID, for connection events
+    union {
+        struct {
+            uint8_t status;             // 0 on success
+        } adv_started;
+        struct {
+            esp_bd_addr_t bda;
+            esp_ble_addr_type_t addr_type;
+            uint16_t interval;          // 1.25 ms units
+        } connect;
+        struct {
+            uint16_t reason;
+        } disconnect;
+        struct {
+            uint16_t mtu;
+        } mtu;
+        struct {
+            ble_attr_t attr;
+            const uint8_t *value;
+            uint16_t len;
+        } write;
+        struct {
+            ble_attr_t attr;
+            bool ok;
+        } sent;
+        struct {
+            bool congested;
+        } congest;
+        struct {
+            uint8_t status;             // 0 on success
+            esp_bd_addr_t bda;
+            uint16_t interval;          // 1.25 ms units
+            uint16_t latency;
+        } conn_params;
+        struct {
+            uint8_t status;             // 0 on success
+        } accept_list;
+        struct {
+            uint8_t status;             // 0 on success
+            esp_bd_addr_t bda;
+            uint8_t tx_phy;             // BLE_TRANSPORT_PHY_*
+            uint8_t rx_phy;
+        } phy;
+        struct {
+            uint8_t status;             // 0 on success
+            esp_bd_addr_t bda;
+            uint16_t tx_octets;         // Longest link-layer payload each way
+            uint16_t rx_octets;
+        } data_len;
+        struct {
+            uint8_t status;             // 0 on success
+            esp_bd_addr_t bda;
+        } auth;
+    };
+} ble_transport_evt_t;
+
+typedef struct {
+    // Called for every event, on the host's task
+    void (*on_event)(const ble_transport_evt_t *evt);
+    // Returns the value of an attribute the phone reads and sets its length. With
+    // refresh false, the value returned by the last call is wanted again, for the next
+    // part of a long read.
+    const uint8_t *(*on_read)(uint16_t conn_id, ble_attr_t attr, bool refresh, size_t *len);
+    // Returns true if a phone may pair. Bluedroid asks on every pairing request, NimBLE
+    // only when a bonded phone pairs again; its old bond is dropped if the answer is yes.
+    bool (*on_pair)(const esp_bd_addr_t bda);
+} ble_transport_callbacks_t;
+
+typedef struct {
+    bool directed;                      // High duty cycle directed advertising to peer
+    bool broadcast;                     // Non-connectable undirected advertising
+    uint16_t int_min;                   // 0.625 ms units, undirected only
+    uint16_t int_max;
+    bool accept_list;                   // Only take connections from the accept list
+    esp_bd_addr_t peer;
+    esp_ble_addr_type_t peer_type;
+} ble_transport_adv_t;
+
+// Keys of a bond made with LE Secure Connections
+typedef struct {
+    esp_bd_addr_t bda;                  // Identity address
+    esp_ble_addr_type_t type;
+    uint8_t key_size;                   // Encryption key size in octets
+    uint8_t ltk[BLE_TRANSPORT_KEY_LEN];
+    bool has_irk;
+    uint8_t irk[BLE_TRANSPORT_KEY_LEN]; // The phone's identity resolving key
+} ble_transport_bond_t;
+
+/**
+ * @brief Starts the controller and the host, and registers the service.
+ *
+ * Pairing is set up for bonding with LE Secure Connections only, Just Works, and both
+ * sides hand out their encryption and identity keys. BLE_TRANSPORT_EVT_READY follows
+ * once the service is registered and the advertising data is set. Aborts if the stack
+ * cannot be started.
+ *
+ * @param cbs Callbacks, kept for the lifetime of the stack.
+ */
+void ble_transport_init(const ble_transport_callbacks_t *cbs);
+
+/**
+ * @brief Starts advertising.
+ *
+ * BLE_TRANSPORT_EVT_ADV_STARTED reports whether the controller took it; on NimBLE it
+ * is delivered before this function returns.
+ *
+ * @param adv Advertising parameters.
+ * @return
+ *     - ESP_OK: If the request was handed to the host.
+ *     - Other error codes if the host rejected it; no event follows.
+ */
+esp_err_t ble_transport_adv_start(const ble_transport_adv_t *adv);
+
+/**
+ * @brief Stops advertising. Does nothing if it is not running.
+ */
+void ble_transport_adv_stop(void);
+
+/**
+ * @brief Replaces the advertising data.
+ *
+ * Call with advertising stopped. The data is copied, and used by the next
+ * ble_transport_adv_start().
+ *
+ * @param data AD structures, at most 31 bytes, or NULL for the data built at compile
+ *             time (ble_adv_payload.h).
+ * @param len  Data length.
+ * @return
+ *     - ESP_OK: If the data was handed to the host.
+ *     - Other error codes if the host rejected it.
+ */
+esp_err_t ble_transport_adv_set_data(const uint8_t *data, size_t len);
+
+/**
+ * @brief Sends a value of an attribute as a notification or an indication.
+ *
+ * @param conn_id  Host's connection ID.
+ * @param attr     BLE_ATTR_REMOTE_VAL or BLE_ATTR_DUMP_VAL.
+ * @param data     Value to send.
+ * @param len      Value length, at most the connection's MTU - 3.
+ * @param indicate true for an indication, false for a notification.
+ * @return
+ *     - ESP_OK: If the value was handed to the host.
+ *     - ESP_ERR_NO_MEM: If the host is out of buffers; try again later.
+ *     - Other error codes if the host rejected it.
+ */
+esp_err_t ble_transport_send(uint16_t conn_id, ble_attr_t attr, const void *data, uint16_t len, bool indicate);
+
+/**
+ * @brief Disconnects a phone.
+ *
+ * @param conn_id Host's connection ID.
+ */
+void ble_transport_close(uint16_t conn_id);
+
+/**
+ * @brief Asks a connected phone for new connection parameters.
+ *
+ * BLE_TRANSPORT_EVT_CONN_PARAMS reports the outcome.
+ *
+ * @param bda      Peer address.
+ * @param min_int  Interval range in 1.25 ms units.
+ * @param max_int
+ * @param latency  Connection events the remote may skip.
+ * @param timeout  Supervision timeout in 10 ms units.
+ * @return
+ *     - ESP_OK: If the request was sent.
+ *     - Other error codes if the host rejected it.
+ */
+esp_err_t ble_transport_update_conn_params(const esp_bd_addr_t bda, uint16_t min_int, uint16_t max_int,
+                                           uint16_t latency, uint16_t timeout);
+
+/**
+ * @brief Asks for the 2M PHY on a connection, both ways.
+ *
+ * BLE_TRANSPORT_EVT_PHY reports the PHYs in use afterwards; they stay 1M if the phone
+ * does not take 2M. Bluedroid does not say which connection a failed request was for,
+ * so make one PHY request at a time.
+ *
+ * @param bda Peer address.
+ * @return
+ *     - ESP_OK: If the request was sent.
+ *     - Other error codes if the host rejected it; no event follows.
+ */
+esp_err_t ble_transport_set_phy_2m(const esp_bd_addr_t bda);
+
+/**
+ * @brief Asks for longer link-layer packets on a connection (data length extension).
+ *
+ * BLE_TRANSPORT_EVT_DATA_LEN reports the lengths in use once they change. A phone
+ * without data length extension leaves the request unanswered. Bluedroid does not say
+ * which connection the event is for, so make one request at a time.
+ *
+ * @param bda       Peer address.
+ * @param tx_octets Longest payload the remote sends, BLE_TRANSPORT_MIN_DATA_LEN to
+ *                  BLE_TRANSPORT_MAX_DATA_LEN.
+ * @return
+ *     - ESP_OK: If the request was sent.
+ *     - Other error codes if the host rejected it; no event follows.
+ */
+esp_err_t ble_transport_set_data_len(const esp_bd_addr_t bda, uint16_t tx_octets);
+
+/**
+ * @brief Reads the number of entries the controller's accept list holds.
+ *
+ * @param size Set to the size.
+ * @return
+ *     - ESP_OK: On success.
+ *     - Other error codes if the size is unknown.
+ */
+esp_err_t ble_transport_accept_list_size(uint16_t *size);
+
+/**
+ * @brief Adds an address to the controller's accept list, or removes it.
+ *
+ * Advertising must be stopped. BLE_TRANSPORT_EVT_ACCEPT_LIST reports the outcome; on
+ * NimBLE it is delivered before this function returns.
+ *
+ * @param add  true to add, false to remove.
+ * @param bda  Address.
+ * @param type BLE_ADDR_TYPE_PUBLIC or BLE_ADDR_TYPE_RANDOM.
+ * @return
+ *     - ESP_OK: If the change was handed to the host.
+ *     - Other error codes if the host rejected it; no event follows.
+ */
+esp_err_t ble_transport_accept_list_update(bool add, const esp_bd_addr_t bda, esp_ble_addr_type_t type);
+
+/**
+ * @brief Asks a connected phone to encrypt the link.
+ *
+ * A bonded phone encrypts with the keys of its bond; any other phone is asked to pair.
+ * BLE_TRANSPORT_EVT_AUTH reports the outcome, unless the phone ignores the request.
+ *
+ * @param bda Peer address.
+ * @return
+ *     - ESP_OK: If the request was sent.
+ *     - Other error codes if the host rejected it; no event follows.
+ */
+esp_err_t ble_transport_secure(const esp_bd_addr_t bda);
+
+/**
+ * @brief Reads the bonds the host keeps.
+ *
+ * @param bonds Output array.
+ * @param max   Size of the output array.
+ * @return Number of entries written.
+ */
+int ble_transport_bonds(ble_transport_bond_t *bonds, int max);
+
+/**
+ * @brief Hands the host the keys of a bond it does not have, e.g. after a reset.
+ *
+ * On NimBLE the identity resolving key also goes into the controller's resolving list.
+ *
+ * @param bond Keys.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NOT_SUPPORTED: On Bluedroid, which only takes keys from pairing; the
+ *       phone has to pair again.
+ *     - Other error codes on failure.
+ */
+esp_err_t ble_transport_bond_add(const ble_transport_bond_t *bond);
+
+/**
+ * @brief Drops the bond with a phone. Bluedroid also disconnects the phone if it is connected.
+ *
+ * @param bda Identity address.
+ * @return
+ *     - ESP_OK: If the bond was dropped or the request handed to the host.
+ *     - Other error codes on failure.
+ */
+esp_err_t ble_transport_bond_remove(const esp_bd_addr_t bda);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_TRANSPORT_H
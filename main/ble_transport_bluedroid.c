@@ -0,0 +1,671 @@
+/**
+ * @file ble_transport_bluedroid.c
+ * @brief BLE transport on the Bluedroid host.
+ *
+ * The service is created from a static attribute table. Reads and writes of values and
+ * CCCDs are answered here and handed to the server as events; GAP and GATT events
+ * arrive in the BTC task. Prepared writes are collected here and handed over whole once
+ * the phone executes them.
+ *
+ * Bluedroid keeps its bonds in its own NVS namespace and only takes keys from pairing,
+ * so a bond lost there cannot be handed back from the registry.
+ */
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BT_BLUEDROID_ENABLED
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_bt_device.h"
+#include "esp_gatts_api.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gatt_common_api.h"
+#include "esp_log.h"
+#include "ble_transport.h"
+#include "ble_adv_payload.h"
+#include "bt_boot.h"
+#include "bt_trace.h"
+
+#define TAG "BLE_BLUEDROID"
+
+#define CHAR_MAX_LEN        (CONFIG_BLE_LOCAL_MTU - 3)   // ATT notification header is 3 bytes
+
+/*
+ * Attributes of the service, in handle order. A new characteristic is a declaration
+ * row, a value row and, if it notifies, a CCCD row, plus an index here and a
+ * ble_attr_t entry in attr_rows.
+ */
+enum {
+    IDX_SVC,
+    IDX_REMOTE_CHAR,
+    IDX_REMOTE_VAL,
+    IDX_REMOTE_CCCD,
+    IDX_DIAG_CHAR,
+    IDX_DIAG_VAL,
+    IDX_DUMP_CHAR,
+    IDX_DUMP_VAL,
+    IDX_DUMP_CCCD,
+    IDX_PROV_CHAR,
+    IDX_PROV_VAL,
+    ATTR_COUNT,
+};
+
+static const uint8_t attr_rows[BLE_ATTR_COUNT] = {
+    [BLE_ATTR_REMOTE_VAL] = IDX_REMOTE_VAL,
+    [BLE_ATTR_REMOTE_CCCD] = IDX_REMOTE_CCCD,
+    [BLE_ATTR_DIAG_VAL] = IDX_DIAG_VAL,
+    [BLE_ATTR_DUMP_VAL] = IDX_DUMP_VAL,
+    [BLE_ATTR_DUMP_CCCD] = IDX_DUMP_CCCD,
+    [BLE_ATTR_PROV_VAL] = IDX_PROV_VAL,
+};
+
+typedef struct {
+    bool used;
+    uint16_t conn_id;
+    uint16_t mtu;
+} mtu_entry_t;
+
+// Prepared write in progress; one attribute of one connection at a time
+typedef struct {
+    uint8_t *buf;               // NULL while no prepared write is in progress
+    uint16_t conn_id;
+    uint16_t handle;
+    uint16_t len;
+} prep_write_t;
+
+static const ble_transport_callbacks_t *callbacks;
+static esp_gatt_if_t gatt_if;
+static uint16_t handles[ATTR_COUNT];
+static bool service_started;
+static bool adv_data_set;
+static bool scan_rsp_set;
+static bool ready;
+static mtu_entry_t mtus[CONFIG_BLE_MAX_CONNECTIONS];    // For slicing long reads
+static prep_write_t prep;
+// Peers of the PHY and data length requests in progress, which their events leave out
+static esp_bd_addr_t phy_bda;
+static esp_bd_addr_t data_len_bda;
+
+static const uint16_t primary_service_uuid = ESP_GATT_UUID_PRI_SERVICE;
+static const uint16_t char_declare_uuid = ESP_GATT_UUID_CHAR_DECLARE;
+static const uint16_t cccd_uuid = ESP_GATT_UUID_CHAR_CLIENT_CONFIG;
+static const uint16_t service_uuid = BLE_TRANSPORT_SERVICE_UUID;
+static const uint8_t remote_char_uuid[ESP_UUID_LEN_128] = { BLE_TRANSPORT_UUID128(0x34, 0x12) };
+static const uint8_t diag_char_uuid[ESP_UUID_LEN_128] = { BLE_TRANSPORT_UUID128(0x35, 0x12) };
+static const uint8_t dump_char_uuid[ESP_UUID_LEN_128] = { BLE_TRANSPORT_UUID128(0x36, 0x12) };
+static const uint8_t prov_char_uuid[ESP_UUID_LEN_128] = { BLE_TRANSPORT_UUID128(0x37, 0x12) };
+
+static const uint8_t remote_props = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE |
+                                    ESP_GATT_CHAR_PROP_BIT_NOTIFY | ESP_GATT_CHAR_PROP_BIT_INDICATE;
+static const uint8_t diag_props = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE;
+static const uint8_t dump_props = ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_NOTIFY;
+static const uint8_t prov_props = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE;
+static const uint8_t remote_init_value[] = { 'i', 'n', 'i', 't' };
+static const uint8_t cccd_init_value[2] = { 0x00, 0x00 };
+
+#define DECLARE(props) \
+    { { ESP_GATT_AUTO_RSP }, { ESP_UUID_LEN_16, (uint8_t *)&char_declare_uuid, ESP_GATT_PERM_READ, \
+                               sizeof(uint8_t), sizeof(uint8_t), (uint8_t *)&(props) } }
+#define CCCD() \
+    { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_16, (uint8_t *)&cccd_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, \
+                                 sizeof(cccd_init_value), sizeof(cccd_init_value), (uint8_t *)cccd_init_value } }
+
+// Reads and writes of values and CCCDs are answered by gatts_event_handler()
+static const esp_gatts_attr_db_t gatt_db[ATTR_COUNT] = {
+    [IDX_SVC] = { { ESP_GATT_AUTO_RSP }, { ESP_UUID_LEN_16, (uint8_t *)&primary_service_uuid, ESP_GATT_PERM_READ,
+                                           sizeof(service_uuid), sizeof(service_uuid), (uint8_t *)&service_uuid } },
+
+    [IDX_REMOTE_CHAR] = DECLARE(remote_props),
+    [IDX_REMOTE_VAL] = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_128, (uint8_t *)remote_char_uuid,
+                                                    ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, CHAR_MAX_LEN,
+                                                    sizeof(remote_init_value), (uint8_t *)remote_init_value } },
+    [IDX_REMOTE_CCCD] = CCCD(),
+
+    [IDX_DIAG_CHAR] = DECLARE(diag_props),
+    [IDX_DIAG_VAL] = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_128, (uint8_t *)diag_char_uuid,
+                                                  ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, ESP_GATT_MAX_ATTR_LEN,
+                                                  0, NULL } },
+
+    [IDX_DUMP_CHAR] = DECLARE(dump_props),
+    [IDX_DUMP_VAL] = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_128, (uint8_t *)dump_char_uuid, ESP_GATT_PERM_WRITE,
+                                                  sizeof(uint8_t), 0, NULL } },
+    [IDX_DUMP_CCCD] = CCCD(),
+
+    [IDX_PROV_CHAR] = DECLARE(prov_props),
+    [IDX_PROV_VAL] = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_128, (uint8_t *)prov_char_uuid,
+                                                  ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, BLE_TRANSPORT_MAX_ATTR_LEN,
+                                                  0, NULL } },
+};
+
+static void post(const ble_transport_evt_t *evt) {
+    callbacks->on_event(evt);
+}
+
+// Returns the attribute of a handle, or BLE_ATTR_COUNT
+static ble_attr_t find_attr(uint16_t handle) {
+    for (int i = 0; i < BLE_ATTR_COUNT; i++) {
+        if (handles[attr_rows[i]] == handle) {
+            return i;
+        }
+    }
+    return BLE_ATTR_COUNT;
+}
+
+static uint16_t get_mtu(uint16_t conn_id) {
+    for (int i = 0; i < CONFIG_BLE_MAX_CONNECTIONS; i++) {
+        if (mtus[i].used && mtus[i].conn_id == conn_id) {
+            return mtus[i].mtu;
+        }
+    }
+    return ESP_GATT_DEF_BLE_MTU_SIZE;
+}
+
+static void set_mtu(uint16_t conn_id, uint16_t mtu) {
+    int free_slot = -1;
+
+    for (int i = 0; i < CONFIG_BLE_MAX_CONNECTIONS; i++) {
+        if (mtus[i].used && mtus[i].conn_id == conn_id) {
+            mtus[i].mtu = mtu;
+            return;
+        }
+        if (!mtus[i].used && free_slot < 0) {
+            free_slot = i;
+        }
+    }
+    if (free_slot >= 0) {
+        mtus[free_slot] = (mtu_entry_t) { .used = true, .conn_id = conn_id, .mtu = mtu };
+    }
+}
+
+static void clear_mtu(uint16_t conn_id) {
+    for (int i = 0; i < CONFIG_BLE_MAX_CONNECTIONS; i++) {
+        if (mtus[i].conn_id == conn_id) {
+            mtus[i].used = false;
+        }
+    }
+}
+
+static void handle_read(esp_gatt_if_t gatts_if_param, esp_ble_gatts_cb_param_t *param) {
+    esp_gatt_rsp_t rsp = {};
+    esp_gatt_status_t status = ESP_GATT_OK;
+    ble_attr_t attr = find_attr(param->read.handle);
+    const uint8_t *value = NULL;
+    size_t len = 0;
+
+    if (attr < BLE_ATTR_COUNT) {
+        // A long read continues from the value returned at offset 0
+        value = callbacks->on_read(param->read.conn_id, attr, param->read.offset == 0, &len);
+    }
+    if (value == NULL) {
+        status = ESP_GATT_READ_NOT_PERMIT;
+    } else if (param->read.offset > len) {
+        status = ESP_GATT_INVALID_OFFSET;
+    } else {
+        size_t chunk = len - param->read.offset;
+        uint16_t mtu = get_mtu(param->read.conn_id);
+        if (chunk > mtu - 1) {
+            chunk = mtu - 1;        // ATT read response header is 1 byte
+        }
+        rsp.attr_value.handle = param->read.handle;
+        rsp.attr_value.offset = param->read.offset;
+        rsp.attr_value.len = chunk;
+        memcpy(rsp.attr_value.value, &value[param->read.offset], chunk);
+    }
+    esp_ble_gatts_send_response(gatts_if_param, param->read.conn_id, param->read.trans_id, status, &rsp);
+}
+
+static void drop_prep_write(void) {
+    free(prep.buf);
+    prep.buf = NULL;
+}
+
+// Collects one part of a prepared write; the phone expects the part echoed back
+static void handle_prep_write(esp_gatt_if_t gatts_if_param, esp_ble_gatts_cb_param_t *param) {
+    esp_gatt_status_t status = ESP_GATT_OK;
+
+    if (prep.buf != NULL && (prep.conn_id != param->write.conn_id || prep.handle != param->write.handle)) {
+        status = ESP_GATT_PREPARE_Q_FULL;
+    } else if (param->write.offset + param->write.len > BLE_TRANSPORT_MAX_ATTR_LEN) {
+        status = ESP_GATT_INVALID_ATTR_LEN;
+    } else if (prep.buf == NULL) {
+        prep.buf = malloc(BLE_TRANSPORT_MAX_ATTR_LEN);
+        prep.conn_id = param->write.conn_id;
+        prep.handle = param->write.handle;
+        prep.len = 0;
+        if (prep.buf == NULL) {
+            status = ESP_GATT_NO_RESOURCES;
+        }
+    }
+    if (status == ESP_GATT_OK) {
+        memcpy(&prep.buf[param->write.offset], param->write.value, param->write.len);
+        if (param->write.offset + param->write.len > prep.len) {
+            prep.len = param->write.offset + param->write.len;
+        }
+    }
+
+    if (param->write.need_rsp) {
+        esp_gatt_rsp_t rsp = {};
+        rsp.attr_value.handle = param->write.handle;
+        rsp.attr_value.offset = param->write.offset;
+        rsp.attr_value.len = param->write.len;
+        memcpy(rsp.attr_value.value, param->write.value, param->write.len);
+        esp_ble_gatts_send_response(gatts_if_param, param->write.conn_id, param->write.trans_id, status, &rsp);
+    }
+}
+
+static void handle_exec_write(esp_gatt_if_t gatts_if_param, esp_ble_gatts_cb_param_t *param) {
+    ble_transport_evt_t evt = {};
+
+    esp_ble_gatts_send_response(gatts_if_param, param->exec_write.conn_id, param->exec_write.trans_id,
+                                ESP_GATT_OK, NULL);
+    if (prep.buf == NULL || prep.conn_id != param->exec_write.conn_id) {
+        return;
+    }
+    evt.write.attr = find_attr(prep.handle);
+    if (param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC && evt.write.attr != BLE_ATTR_COUNT) {
+        evt.type = BLE_TRANSPORT_EVT_WRITE;
+        evt.conn_id = prep.conn_id;
+        evt.write.value = prep.buf;
+        evt.write.len = prep.len;
+        post(&evt);
+    }
+    drop_prep_write();
+}
+
+// Advertising waits for the attribute table, the advertising data and the scan response
+static void post_ready_if_done(void) {
+    if (!ready && service_started && adv_data_set && scan_rsp_set) {
+        ready = true;
+        ble_transport_evt_t evt = { .type = BLE_TRANSPORT_EVT_READY };
+        post(&evt);
+    }
+}
+
+static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+    ble_transport_evt_t evt = {};
+
+    switch (event) {
+        case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
+        case ESP_GAP_BLE_SCAN_RSP_DATA_RAW_SET_COMPLETE_EVT:
+            // Run in parallel with the attribute table
+            if (param->adv_data_raw_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+                ESP_LOGE(TAG, "Advertising data rejected, event %d, status %d", event, param->adv_data_raw_cmpl.status);
+                break;
+            }
+            if (event == ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT) {
+                adv_data_set = true;
+            } else {
+                scan_rsp_set = true;
+            }
+            if (adv_data_set && scan_rsp_set) {
+                bt_boot_mark(BT_BOOT_ADV_DATA);
+            }
+            post_ready_if_done();
+            break;
+        case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
+            evt.type = BLE_TRANSPORT_EVT_ADV_STARTED;
+            evt.adv_started.status = param->adv_start_cmpl.status;
+            post(&evt);
+            break;
+        case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+            evt.type = BLE_TRANSPORT_EVT_CONN_PARAMS;
+            evt.conn_params.status = param->update_conn_params.status;
+            memcpy(evt.conn_params.bda, param->update_conn_params.bda, sizeof(esp_bd_addr_t));
+            evt.conn_params.interval = param->update_conn_params.conn_int;
+            evt.conn_params.latency = param->update_conn_params.latency;
+            post(&evt);
+            break;
+        case ESP_GAP_BLE_UPDATE_WHITELIST_COMPLETE_EVT:
+            evt.type = BLE_TRANSPORT_EVT_ACCEPT_LIST;
+            evt.accept_list.status = param->update_whitelist_cmpl.status;
+            post(&evt);
+            break;
+        case ESP_GAP_BLE_SET_PREFERRED_PHY_COMPLETE_EVT:
+            // Only a rejected request ends here; an accepted one ends in the update below
+            if (param->set_perf_phy.status == ESP_BT_STATUS_SUCCESS) {
+                break;
+            }
+            evt.type = BLE_TRANSPORT_EVT_PHY;
+            evt.phy.status = param->set_perf_phy.status;
+            memcpy(evt.phy.bda, phy_bda, sizeof(esp_bd_addr_t));
+            evt.phy.tx_phy = BLE_TRANSPORT_PHY_1M;
+            evt.phy.rx_phy = BLE_TRANSPORT_PHY_1M;
+            post(&evt);
+            break;
+        case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+            evt.type = BLE_TRANSPORT_EVT_PHY;
+            evt.phy.status = param->phy_update.status;
+            memcpy(evt.phy.bda, param->phy_update.bda, sizeof(esp_bd_addr_t));
+            evt.phy.tx_phy = param->phy_update.tx_phy;
+            evt.phy.rx_phy = param->phy_update.rx_phy;
+            post(&evt);
+            break;
+        case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+            evt.type = BLE_TRANSPORT_EVT_DATA_LEN;
+            evt.data_len.status = param->pkt_data_length_cmpl.status;
+            memcpy(evt.data_len.bda, data_len_bda, sizeof(esp_bd_addr_t));
+            evt.data_len.tx_octets = param->pkt_data_length_cmpl.params.tx_len;
+            evt.data_len.rx_octets = param->pkt_data_length_cmpl.params.rx_len;
+            post(&evt);
+            break;
+#ifdef CONFIG_BT_BLE_SMP_ENABLE
+        case ESP_GAP_BLE_SEC_REQ_EVT:
+            // The phone asks to pair
+            esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr,
+                                     callbacks->on_pair(param->ble_security.ble_req.bd_addr));
+            break;
+        case ESP_GAP_BLE_AUTH_CMPL_EVT: {
+            const esp_ble_auth_cmpl_t *auth = &param->ble_security.auth_cmpl;
+            evt.type = BLE_TRANSPORT_EVT_AUTH;
+            evt.auth.status = auth->success ? 0 : auth->fail_reason != 0 ? auth->fail_reason : UINT8_MAX;
+            memcpy(evt.auth.bda, auth->bd_addr, sizeof(esp_bd_addr_t));
+            post(&evt);
+            break;
+        }
+#endif // CONFIG_BT_BLE_SMP_ENABLE
+        default:
+            break;
+    }
+}
+
+static void gatts_event_handler(esp_gatts_cb_event_t event,
+                                esp_gatt_if_t gatts_if_param,
+                                esp_ble_gatts_cb_param_t *param) {
+    ble_transport_evt_t evt = {};
+
+    switch (event) {
+        case ESP_GATTS_REG_EVT: {
+            ESP_LOGI(TAG, "ESP_GATTS_REG_EVT");
+            gatt_if = gatts_if_param;
+            esp_err_t ret = esp_ble_gatts_create_attr_tab(gatt_db, gatt_if, ATTR_COUNT, 0);
+            if (ret) {
+                ESP_LOGE(TAG, "Failed to create attribute table: %s", esp_err_to_name(ret));
+            }
+            break;
+        }
+
+        case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+            if (param->add_attr_tab.status != ESP_GATT_OK || param->add_attr_tab.num_handle != ATTR_COUNT) {
+                ESP_LOGE(TAG, "Attribute table not created, status 0x%x, %d handles",
+                         param->add_attr_tab.status, param->add_attr_tab.num_handle);
+                break;
+            }
+            memcpy(handles, param->add_attr_tab.handles, sizeof(handles));
+            ESP_LOGI(TAG, "Service created, handles %d to %d", handles[0], handles[ATTR_COUNT - 1]);
+            esp_ble_gatts_start_service(handles[IDX_SVC]);
+            break;
+
+        case ESP_GATTS_START_EVT:
+            service_started = param->start.status == ESP_GATT_OK;
+            bt_boot_mark(BT_BOOT_SERVICE);
+            post_ready_if_done();
+            break;
+
+        case ESP_GATTS_CONNECT_EVT:
+            evt.type = BLE_TRANSPORT_EVT_CONNECT;
+            evt.conn_id = param->connect.conn_id;
+            memcpy(evt.connect.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+            evt.connect.addr_type = param->connect.ble_addr_type;
+            evt.connect.interval = param->connect.conn_params.interval;
+            post(&evt);
+            break;
+
+        case ESP_GATTS_DISCONNECT_EVT:
+            clear_mtu(param->disconnect.conn_id);
+            if (prep.buf != NULL && prep.conn_id == param->disconnect.conn_id) {
+                drop_prep_write();
+            }
+            evt.type = BLE_TRANSPORT_EVT_DISCONNECT;
+            evt.conn_id = param->disconnect.conn_id;
+            evt.disconnect.reason = param->disconnect.reason;
+            post(&evt);
+            break;
+
+        case ESP_GATTS_WRITE_EVT: {
+            if (param->write.is_prep) {
+                handle_prep_write(gatts_if_param, param);
+                break;
+            }
+            if (param->write.need_rsp) {
+                esp_gatt_rsp_t rsp = {};
+                rsp.attr_value.handle = param->write.handle;
+                rsp.attr_value.len = param->write.len;
+                memcpy(rsp.attr_value.value, param->write.value, param->write.len);
+                esp_ble_gatts_send_response(gatts_if_param, param->write.conn_id, param->write.trans_id,
+                                            ESP_GATT_OK, &rsp);
+            }
+
+            evt.write.attr = find_attr(param->write.handle);
+            if (evt.write.attr == BLE_ATTR_COUNT) {
+                break;
+            }
+            evt.type = BLE_TRANSPORT_EVT_WRITE;
+            evt.conn_id = param->write.conn_id;
+            evt.write.value = param->write.value;
+            evt.write.len = param->write.len;
+            post(&evt);
+            break;
+        }
+
+        case ESP_GATTS_EXEC_WRITE_EVT:
+            handle_exec_write(gatts_if_param, param);
+            break;
+
+        case ESP_GATTS_READ_EVT:
+            handle_read(gatts_if_param, param);
+            break;
+
+        case ESP_GATTS_MTU_EVT:
+            set_mtu(param->mtu.conn_id, param->mtu.mtu);
+            evt.type = BLE_TRANSPORT_EVT_MTU;
+            evt.conn_id = param->mtu.conn_id;
+            evt.mtu.mtu = param->mtu.mtu;
+            post(&evt);
+            break;
+
+        case ESP_GATTS_CONGEST_EVT:
+            evt.type = BLE_TRANSPORT_EVT_CONGEST;
+            evt.conn_id = param->congest.conn_id;
+            evt.congest.congested = param->congest.congested;
+            post(&evt);
+            break;
+
+        case ESP_GATTS_CONF_EVT:
+            evt.sent.attr = find_attr(param->conf.handle);
+            if (evt.sent.attr == BLE_ATTR_COUNT) {
+                break;
+            }
+            evt.type = BLE_TRANSPORT_EVT_SENT;
+            evt.conn_id = param->conf.conn_id;
+            evt.sent.ok = param->conf.status == ESP_GATT_OK;
+            post(&evt);
+            break;
+
+        default:
+            BT_TRACE(BLE, DEBUG, BLE_UNHANDLED, event, 0);
+            break;
+    }
+}
+
+#ifdef CONFIG_BT_BLE_SMP_ENABLE
+// Bonding with LE Secure Connections only; the remote has no display or keyboard, so Just Works
+static void set_security(void) {
+    esp_ble_auth_req_t auth_req = ESP_LE_AUTH_REQ_SC_BOND;
+    esp_ble_io_cap_t io_cap = ESP_IO_CAP_NONE;
+    uint8_t key_size = BLE_TRANSPORT_KEY_LEN;
+    uint8_t keys = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+    uint8_t only_sc = ESP_BLE_ONLY_ACCEPT_SPECIFIED_AUTH_ENABLE;
+
+    ESP_ERROR_CHECK(esp_ble_gap_set_security_param(ESP_BLE_SM_AUTHEN_REQ_MODE, &auth_req, sizeof(auth_req)));
+    ESP_ERROR_CHECK(esp_ble_gap_set_security_param(ESP_BLE_SM_IOCAP_MODE, &io_cap, sizeof(io_cap)));
+    ESP_ERROR_CHECK(esp_ble_gap_set_security_param(ESP_BLE_SM_MAX_KEY_SIZE, &key_size, sizeof(key_size)));
+    ESP_ERROR_CHECK(esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &keys, sizeof(keys)));
+    ESP_ERROR_CHECK(esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &keys, sizeof(keys)));
+    ESP_ERROR_CHECK(esp_ble_gap_set_security_param(ESP_BLE_SM_ONLY_ACCEPT_SPECIFIED_SEC_AUTH, &only_sc,
+                                                   sizeof(only_sc)));
+}
+#endif // CONFIG_BT_BLE_SMP_ENABLE
+
+void ble_transport_init(const ble_transport_callbacks_t *cbs) {
+    callbacks = cbs;
+
+    esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT);
+    esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_bt_controller_init(&bt_cfg));
+    ESP_ERROR_CHECK(esp_bt_controller_enable(ESP_BT_MODE_BLE));
+    bt_boot_mark(BT_BOOT_CONTROLLER);
+    ESP_ERROR_CHECK(esp_bluedroid_init());
+    ESP_ERROR_CHECK(esp_bluedroid_enable());
+    bt_boot_mark(BT_BOOT_HOST);
+
+    ESP_ERROR_CHECK(esp_ble_gatts_register_callback(gatts_event_handler));
+    ESP_ERROR_CHECK(esp_ble_gap_register_callback(gap_event_handler));
+    ESP_ERROR_CHECK(esp_bt_dev_set_device_name(BLE_TRANSPORT_DEVICE_NAME));
+#ifdef CONFIG_BT_BLE_SMP_ENABLE
+    set_security();
+#endif
+
+    // The advertising data is set while the service is being built
+    ESP_ERROR_CHECK(esp_ble_gap_config_adv_data_raw((uint8_t *)ble_adv_payload, ble_adv_payload_len));
+    ESP_ERROR_CHECK(esp_ble_gap_config_scan_rsp_data_raw((uint8_t *)ble_scan_rsp_payload, ble_scan_rsp_payload_len));
+    ESP_ERROR_CHECK(esp_ble_gatts_app_register(0));
+
+    // Offer a larger MTU so the phone's MTU request on connect is answered with room for batches
+    ESP_ERROR_CHECK(esp_ble_gatt_set_local_mtu(CONFIG_BLE_LOCAL_MTU));
+}
+
+esp_err_t ble_transport_adv_start(const ble_transport_adv_t *adv) {
+    esp_ble_adv_params_t params = {
+        .adv_type = adv->directed ? ADV_TYPE_DIRECT_IND_HIGH : adv->broadcast ? ADV_TYPE_NONCONN_IND : ADV_TYPE_IND,
+        .adv_int_min = adv->int_min,
+        .adv_int_max = adv->int_max,
+        .own_addr_type = BLE_ADDR_TYPE_PUBLIC,
+        .peer_addr_type = adv->peer_type,
+        .channel_map = ADV_CHNL_ALL,
+        .adv_filter_policy = adv->accept_list ? ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST : ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
+    };
+
+    memcpy(params.peer_addr, adv->peer, sizeof(params.peer_addr));
+    return esp_ble_gap_start_advertising(&params);
+}
+
+void ble_transport_adv_stop(void) {
+    esp_ble_gap_stop_advertising();
+}
+
+esp_err_t ble_transport_adv_set_data(const uint8_t *data, size_t len) {
+    if (data == NULL) {
+        data = ble_adv_payload;
+        len = ble_adv_payload_len;
+    }
+    return esp_ble_gap_config_adv_data_raw((uint8_t *)data, len);
+}
+
+esp_err_t ble_transport_send(uint16_t conn_id, ble_attr_t attr, const void *data, uint16_t len, bool indicate) {
+    return esp_ble_gatts_send_indicate(gatt_if, conn_id, handles[attr_rows[attr]], len, (uint8_t *)data, indicate);
+}
+
+void ble_transport_close(uint16_t conn_id) {
+    esp_ble_gatts_close(gatt_if, conn_id);
+}
+
+esp_err_t ble_transport_update_conn_params(const esp_bd_addr_t bda, uint16_t min_int, uint16_t max_int,
+                                           uint16_t latency, uint16_t timeout) {
+    esp_ble_conn_update_params_t params = {
+        .min_int = min_int,
+        .max_int = max_int,
+        .latency = latency,
+        .timeout = timeout,
+    };
+
+    memcpy(params.bda, bda, sizeof(params.bda));
+    return esp_ble_gap_update_conn_params(&params);
+}
+
+esp_err_t ble_transport_set_phy_2m(const esp_bd_addr_t bda) {
+    memcpy(phy_bda, bda, sizeof(phy_bda));
+    return esp_ble_gap_set_preferred_phy(phy_bda, 0, ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_2M_PREF_MASK,
+                                         ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+}
+
+esp_err_t ble_transport_set_data_len(const esp_bd_addr_t bda, uint16_t tx_octets) {
+    memcpy(data_len_bda, bda, sizeof(data_len_bda));
+    return esp_ble_gap_set_pkt_data_len(data_len_bda, tx_octets);
+}
+
+esp_err_t ble_transport_accept_list_size(uint16_t *size) {
+    return esp_ble_gap_get_whitelist_size(size);
+}
+
+esp_err_t ble_transport_accept_list_update(bool add, const esp_bd_addr_t bda, esp_ble_addr_type_t type) {
+    return esp_ble_gap_update_whitelist(add, (uint8_t *)bda,
+                                        type == BLE_ADDR_TYPE_RANDOM ? BLE_WL_ADDR_TYPE_RANDOM
+                                                                     : BLE_WL_ADDR_TYPE_PUBLIC);
+}
+
+#ifdef CONFIG_BT_BLE_SMP_ENABLE
+esp_err_t ble_transport_secure(const esp_bd_addr_t bda) {
+    return esp_ble_set_encryption((uint8_t *)bda, ESP_BLE_SEC_ENCRYPT_NO_MITM);
+}
+
+int ble_transport_bonds(ble_transport_bond_t *out, int max) {
+    int count = esp_ble_get_bond_device_num();
+    int written = 0;
+
+    if (count <= 0) {
+        return 0;
+    }
+    esp_ble_bond_dev_t *bonds = malloc(count * sizeof(esp_ble_bond_dev_t));
+    if (bonds == NULL) {
+        ESP_LOGE(TAG, "Failed to read the bonded phones");
+        return 0;
+    }
+    if (esp_ble_get_bond_device_list(&count, bonds) == ESP_OK) {
+        for (int i = 0; i < count && written < max; i++) {
+            const esp_ble_bond_key_info_t *keys = &bonds[i].bond_key;
+            if (!(keys->key_mask & ESP_LE_KEY_PENC)) {
+                continue;
+            }
+            ble_transport_bond_t *b = &out[written++];
+            bool random = (keys->key_mask & ESP_LE_KEY_PID) && keys->pid_key.addr_type == BLE_ADDR_TYPE_RANDOM;
+            memcpy(b->bda, bonds[i].bd_addr, sizeof(esp_bd_addr_t));
+            b->type = random ? BLE_ADDR_TYPE_RANDOM : BLE_ADDR_TYPE_PUBLIC;
+            b->key_size = keys->penc_key.key_size;
+            memcpy(b->ltk, keys->penc_key.ltk, BLE_TRANSPORT_KEY_LEN);
+            b->has_irk = (keys->key_mask & ESP_LE_KEY_PID) != 0;
+            memcpy(b->irk, keys->pid_key.irk, BLE_TRANSPORT_KEY_LEN);
+        }
+    }
+    free(bonds);
+    return written;
+}
+
+esp_err_t ble_transport_bond_add(const ble_transport_bond_t *bond) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t ble_transport_bond_remove(const esp_bd_addr_t bda) {
+    return esp_ble_remove_bond_device((uint8_t *)bda);
+}
+#else
+esp_err_t ble_transport_secure(const esp_bd_addr_t bda) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+int ble_transport_bonds(ble_transport_bond_t *out, int max) {
+    return 0;
+}
+
+esp_err_t ble_transport_bond_add(const ble_transport_bond_t *bond) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t ble_transport_bond_remove(const esp_bd_addr_t bda) {
+    return ESP_OK;
+}
+#endif // CONFIG_BT_BLE_SMP_ENABLE
+
+#endif // CONFIG_BT_BLUEDROID_ENABLED
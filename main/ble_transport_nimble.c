@@ -0,0 +1,687 @@
+/**
+ * @file ble_transport_nimble.c
+ * @brief BLE transport on the NimBLE host.
+ *
+ * The service is registered from a static definition with the same characteristics,
+ * properties and handle order as the Bluedroid attribute table; NimBLE adds the CCCDs
+ * and answers them itself, and CCCD changes are reported to the server as writes.
+ * Events arrive in the nimble_host task, except the results of advertising starts and
+ * accept list changes, which NimBLE returns from the call and are delivered before it
+ * returns.
+ *
+ * NimBLE stores addresses least significant byte first; they are reversed here so the
+ * rest of the remote sees them as Bluedroid does.
+ *
+ * With CONFIG_BT_NIMBLE_NVS_PERSIST off (sdkconfig.nimble) the host keeps its bonds in
+ * RAM only; the keys live in the paired-device registry and are handed back at start.
+ *
+ * Experimental: this file has not been built against ESP-IDF yet, so it is behind
+ * CONFIG_BLE_TRANSPORT_NIMBLE.
+ */
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+
+#ifndef CONFIG_BLE_TRANSPORT_NIMBLE
+#error "The NimBLE transport is experimental; enable CONFIG_BLE_TRANSPORT_NIMBLE to build it"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "host/ble_hs.h"
+#include "host/util/util.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+#include "ble_transport.h"
+#include "ble_adv_payload.h"
+#include "bt_boot.h"
+#include "bt_trace.h"
+
+#define TAG "BLE_NIMBLE"
+
+#define MAX_PEERS           CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#ifdef CONFIG_BT_NIMBLE_WHITELIST_SIZE
+#define ACCEPT_LIST_SIZE    CONFIG_BT_NIMBLE_WHITELIST_SIZE
+#else
+#define ACCEPT_LIST_SIZE    12
+#endif
+// Air time of a packet of that many octets on the 1M PHY, in us
+#define DATA_LEN_TX_TIME(octets) (((octets) + 14) * 8)
+
+#define NIMBLE_CHECK(x) do {                                    \
+        int rc_ = (x);                                          \
+        if (rc_ != 0) {                                         \
+            ESP_LOGE(TAG, "%s failed: %d", #x, rc_);            \
+            abort();                                            \
+        }                                                       \
+    } while (0)
+
+typedef struct {
+    bool used;
+    uint16_t handle;
+    esp_bd_addr_t bda;
+    size_t read_pos;            // Bytes of the current long read sent so far
+    bool read_done;             // The next read starts a new value
+} peer_t;
+
+void ble_store_config_init(void);
+
+static const ble_transport_callbacks_t *callbacks;
+static portMUX_TYPE peers_mux = portMUX_INITIALIZER_UNLOCKED;
+static peer_t peers[MAX_PEERS];
+static uint16_t val_handles[BLE_ATTR_COUNT];    // CCCD entries stay 0; a CCCD follows its value
+static ble_transport_adv_t last_adv;
+static ble_addr_t accept_list[ACCEPT_LIST_SIZE];
+static uint8_t accept_count;
+static uint8_t write_buf[BLE_TRANSPORT_MAX_ATTR_LEN];  // Only used in the nimble_host task
+
+static const ble_uuid16_t service_uuid = BLE_UUID16_INIT(BLE_TRANSPORT_SERVICE_UUID);
+static const ble_uuid128_t remote_char_uuid = BLE_UUID128_INIT(BLE_TRANSPORT_UUID128(0x34, 0x12));
+static const ble_uuid128_t diag_char_uuid = BLE_UUID128_INIT(BLE_TRANSPORT_UUID128(0x35, 0x12));
+static const ble_uuid128_t dump_char_uuid = BLE_UUID128_INIT(BLE_TRANSPORT_UUID128(0x36, 0x12));
+static const ble_uuid128_t prov_char_uuid = BLE_UUID128_INIT(BLE_TRANSPORT_UUID128(0x37, 0x12));
+
+static int access_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int gap_event(struct ble_gap_event *event, void *arg);
+
+static const struct ble_gatt_svc_def services[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = &service_uuid.u,
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = &remote_char_uuid.u,
+                .access_cb = access_cb,
+                .arg = (void *)BLE_ATTR_REMOTE_VAL,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY |
+                         BLE_GATT_CHR_F_INDICATE,
+                .val_handle = &val_handles[BLE_ATTR_REMOTE_VAL],
+            },
+            {
+                .uuid = &diag_char_uuid.u,
+                .access_cb = access_cb,
+                .arg = (void *)BLE_ATTR_DIAG_VAL,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+                .val_handle = &val_handles[BLE_ATTR_DIAG_VAL],
+            },
+            {
+                .uuid = &dump_char_uuid.u,
+                .access_cb = access_cb,
+                .arg = (void *)BLE_ATTR_DUMP_VAL,
+                .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &val_handles[BLE_ATTR_DUMP_VAL],
+            },
+            {
+                // Long writes are queued by the host and reach access_cb whole
+                .uuid = &prov_char_uuid.u,
+                .access_cb = access_cb,
+                .arg = (void *)BLE_ATTR_PROV_VAL,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+                .val_handle = &val_handles[BLE_ATTR_PROV_VAL],
+            },
+            { 0 },
+        },
+    },
+    { 0 },
+};
+
+static void post(const ble_transport_evt_t *evt) {
+    callbacks->on_event(evt);
+}
+
+static esp_err_t to_esp_err(int rc) {
+    switch (rc) {
+        case 0:
+            return ESP_OK;
+        case BLE_HS_ENOMEM:
+            return ESP_ERR_NO_MEM;
+        case BLE_HS_ENOTCONN:
+        case BLE_HS_EALREADY:
+        case BLE_HS_EBUSY:
+        case BLE_HS_ENOTSYNCED:
+            return ESP_ERR_INVALID_STATE;
+        default:
+            return ESP_FAIL;
+    }
+}
+
+static void to_bda(esp_bd_addr_t bda, const ble_addr_t *addr) {
+    for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+        bda[i] = addr->val[ESP_BD_ADDR_LEN - 1 - i];
+    }
+}
+
+static void to_addr(ble_addr_t *addr, const esp_bd_addr_t bda, esp_ble_addr_type_t type) {
+    addr->type = type == BLE_ADDR_TYPE_RANDOM ? BLE_ADDR_RANDOM : BLE_ADDR_PUBLIC;
+    for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+        addr->val[i] = bda[ESP_BD_ADDR_LEN - 1 - i];
+    }
+}
+
+// Call with peers_mux held
+static peer_t *find_peer(uint16_t handle) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].used && peers[i].handle == handle) {
+            return &peers[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the attribute of a value or CCCD handle, or BLE_ATTR_COUNT
+static ble_attr_t find_attr(uint16_t handle, bool cccd) {
+    static const ble_attr_t cccd_of[BLE_ATTR_COUNT] = {
+        [BLE_ATTR_REMOTE_VAL] = BLE_ATTR_REMOTE_CCCD,
+        [BLE_ATTR_DUMP_VAL] = BLE_ATTR_DUMP_CCCD,
+    };
+
+    for (int i = 0; i < BLE_ATTR_COUNT; i++) {
+        if (val_handles[i] != 0 && val_handles[i] == handle) {
+            return cccd ? cccd_of[i] : i;
+        }
+    }
+    return BLE_ATTR_COUNT;
+}
+
+/*
+ * NimBLE asks for the whole value on every read request and cuts out the part at the
+ * request's offset itself, without telling the access callback the offset. A long read
+ * is followed here instead: it ends with the first response that is not full.
+ */
+static int read_value(uint16_t conn_handle, ble_attr_t attr, struct os_mbuf *om) {
+    uint16_t room = ble_att_mtu(conn_handle) - 1;   // ATT read response header is 1 byte
+    size_t len = 0;
+
+    portENTER_CRITICAL(&peers_mux);
+    peer_t *p = find_peer(conn_handle);
+    bool refresh = p == NULL || p->read_done;
+    portEXIT_CRITICAL(&peers_mux);
+
+    const uint8_t *value = callbacks->on_read(conn_handle, attr, refresh, &len);
+    if (value == NULL) {
+        return BLE_ATT_ERR_READ_NOT_PERMITTED;
+    }
+
+    portENTER_CRITICAL(&peers_mux);
+    if (p != NULL && p->used) {
+        size_t pos = refresh ? 0 : p->read_pos;
+        size_t chunk = pos < len ? len - pos : 0;
+        if (chunk > room) {
+            chunk = room;
+        }
+        p->read_pos = pos + chunk;
+        p->read_done = chunk < room;
+    }
+    portEXIT_CRITICAL(&peers_mux);
+
+    return os_mbuf_append(om, value, len) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int access_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    ble_attr_t attr = (ble_attr_t)(intptr_t)arg;
+    ble_transport_evt_t evt = {};
+    uint16_t len = 0;
+
+    switch (ctxt->op) {
+        case BLE_GATT_ACCESS_OP_READ_CHR:
+            return read_value(conn_handle, attr, ctxt->om);
+        case BLE_GATT_ACCESS_OP_WRITE_CHR:
+            if (ble_hs_mbuf_to_flat(ctxt->om, write_buf, sizeof(write_buf), &len) != 0) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            evt.type = BLE_TRANSPORT_EVT_WRITE;
+            evt.conn_id = conn_handle;
+            evt.write.attr = attr;
+            evt.write.value = write_buf;
+            evt.write.len = len;
+            post(&evt);
+            return 0;
+        default:
+            return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+static void on_connect(struct ble_gap_event *event) {
+    struct ble_gap_conn_desc desc;
+    ble_transport_evt_t evt = {
+        .type = BLE_TRANSPORT_EVT_CONNECT,
+        .conn_id = event->connect.conn_handle,
+    };
+
+    if (event->connect.status != 0) {
+        // Advertising stops on a failed connection; keep the same tier going
+        ESP_LOGW(TAG, "Connection failed: %d", event->connect.status);
+        if (!last_adv.directed) {
+            ble_transport_adv_start(&last_adv);
+        }
+        return;
+    }
+    if (ble_gap_conn_find(event->connect.conn_handle, &desc) != 0) {
+        return;
+    }
+    to_bda(evt.connect.bda, &desc.peer_id_addr);
+    evt.connect.addr_type = desc.peer_id_addr.type;
+    evt.connect.interval = desc.conn_itvl;
+
+    portENTER_CRITICAL(&peers_mux);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (!peers[i].used) {
+            peers[i] = (peer_t) { .used = true, .handle = desc.conn_handle, .read_done = true };
+            memcpy(peers[i].bda, evt.connect.bda, sizeof(esp_bd_addr_t));
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&peers_mux);
+    post(&evt);
+}
+
+static void on_disconnect(struct ble_gap_event *event) {
+    int reason = event->disconnect.reason;
+    ble_transport_evt_t evt = {
+        .type = BLE_TRANSPORT_EVT_DISCONNECT,
+        .conn_id = event->disconnect.conn.conn_handle,
+        // Reported as the HCI reason, as Bluedroid does
+        .disconnect.reason = reason >= BLE_HS_ERR_HCI_BASE ? reason - BLE_HS_ERR_HCI_BASE : reason,
+    };
+
+    portENTER_CRITICAL(&peers_mux);
+    peer_t *p = find_peer(evt.conn_id);
+    if (p != NULL) {
+        p->used = false;
+    }
+    portEXIT_CRITICAL(&peers_mux);
+    post(&evt);
+}
+
+static int gap_event(struct ble_gap_event *event, void *arg) {
+    struct ble_gap_conn_desc desc;
+    ble_transport_evt_t evt = {};
+
+    switch (event->type) {
+        case BLE_GAP_EVENT_CONNECT:
+            on_connect(event);
+            break;
+        case BLE_GAP_EVENT_DISCONNECT:
+            on_disconnect(event);
+            break;
+        case BLE_GAP_EVENT_CONN_UPDATE:
+            if (ble_gap_conn_find(event->conn_update.conn_handle, &desc) != 0) {
+                break;
+            }
+            evt.type = BLE_TRANSPORT_EVT_CONN_PARAMS;
+            evt.conn_id = event->conn_update.conn_handle;
+            evt.conn_params.status = event->conn_update.status == 0 ? 0 : UINT8_MAX;
+            to_bda(evt.conn_params.bda, &desc.peer_id_addr);
+            evt.conn_params.interval = desc.conn_itvl;
+            evt.conn_params.latency = desc.conn_latency;
+            post(&evt);
+            break;
+        case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+            if (ble_gap_conn_find(event->phy_updated.conn_handle, &desc) != 0) {
+                break;
+            }
+            evt.type = BLE_TRANSPORT_EVT_PHY;
+            evt.conn_id = event->phy_updated.conn_handle;
+            evt.phy.status = event->phy_updated.status == 0 ? 0 : UINT8_MAX;
+            to_bda(evt.phy.bda, &desc.peer_id_addr);
+            evt.phy.tx_phy = event->phy_updated.tx_phy;
+            evt.phy.rx_phy = event->phy_updated.rx_phy;
+            post(&evt);
+            break;
+        case BLE_GAP_EVENT_DATA_LEN_CHG:
+            if (ble_gap_conn_find(event->data_len_chg.conn_handle, &desc) != 0) {
+                break;
+            }
+            evt.type = BLE_TRANSPORT_EVT_DATA_LEN;
+            evt.conn_id = event->data_len_chg.conn_handle;
+            to_bda(evt.data_len.bda, &desc.peer_id_addr);
+            evt.data_len.tx_octets = event->data_len_chg.max_tx_octets;
+            evt.data_len.rx_octets = event->data_len_chg.max_rx_octets;
+            post(&evt);
+            break;
+        case BLE_GAP_EVENT_MTU:
+            evt.type = BLE_TRANSPORT_EVT_MTU;
+            evt.conn_id = event->mtu.conn_handle;
+            evt.mtu.mtu = event->mtu.value;
+            post(&evt);
+            break;
+        case BLE_GAP_EVENT_SUBSCRIBE:
+            if (event->subscribe.reason == BLE_GAP_SUBSCRIBE_REASON_TERM) {
+                break;      // Connection gone; the disconnect clears the subscription
+            }
+            evt.write.attr = find_attr(event->subscribe.attr_handle, true);
+            if (evt.write.attr == BLE_ATTR_COUNT) {
+                break;
+            }
+            write_buf[0] = event->subscribe.cur_notify | event->subscribe.cur_indicate << 1;
+            write_buf[1] = 0;
+            evt.type = BLE_TRANSPORT_EVT_WRITE;
+            evt.conn_id = event->subscribe.conn_handle;
+            evt.write.value = write_buf;
+            evt.write.len = 2;
+            post(&evt);
+            break;
+        case BLE_GAP_EVENT_ENC_CHANGE:
+            if (ble_gap_conn_find(event->enc_change.conn_handle, &desc) != 0) {
+                break;
+            }
+            evt.type = BLE_TRANSPORT_EVT_AUTH;
+            evt.conn_id = event->enc_change.conn_handle;
+            evt.auth.status = event->enc_change.status == 0 ? 0 : UINT8_MAX;
+            to_bda(evt.auth.bda, &desc.peer_id_addr);
+            post(&evt);
+            break;
+        case BLE_GAP_EVENT_REPEAT_PAIRING: {
+            // A bonded phone pairs again; its old bond goes only if the server lets it
+            esp_bd_addr_t bda;
+            if (ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc) != 0) {
+                return BLE_GAP_REPEAT_PAIRING_IGNORE;
+            }
+            to_bda(bda, &desc.peer_id_addr);
+            if (!callbacks->on_pair(bda)) {
+                return BLE_GAP_REPEAT_PAIRING_IGNORE;
+            }
+            ble_store_util_delete_peer(&desc.peer_id_addr);
+            return BLE_GAP_REPEAT_PAIRING_RETRY;
+        }
+        case BLE_GAP_EVENT_NOTIFY_TX:
+            // An indication is reported once when sent, with status 0, and again when confirmed
+            if (event->notify_tx.indication && event->notify_tx.status == 0) {
+                break;
+            }
+            evt.sent.attr = find_attr(event->notify_tx.attr_handle, false);
+            if (evt.sent.attr == BLE_ATTR_COUNT) {
+                break;
+            }
+            evt.type = BLE_TRANSPORT_EVT_SENT;
+            evt.conn_id = event->notify_tx.conn_handle;
+            evt.sent.ok = event->notify_tx.indication ? event->notify_tx.status == BLE_HS_EDONE
+                                                      : event->notify_tx.status == 0;
+            post(&evt);
+            break;
+        default:
+            BT_TRACE(BLE, DEBUG, BLE_UNHANDLED, event->type, 0);
+            break;
+    }
+    return 0;
+}
+
+static void on_sync(void) {
+    bt_boot_mark(BT_BOOT_HOST);
+    NIMBLE_CHECK(ble_hs_util_ensure_addr(0));
+
+    // The same bytes as Bluedroid, built at compile time
+    NIMBLE_CHECK(ble_gap_adv_set_data(ble_adv_payload, ble_adv_payload_len));
+    NIMBLE_CHECK(ble_gap_adv_rsp_set_data(ble_scan_rsp_payload, ble_scan_rsp_payload_len));
+    bt_boot_mark(BT_BOOT_ADV_DATA);
+
+    // The service was registered before the host started and is live now
+    bt_boot_mark(BT_BOOT_SERVICE);
+    ble_transport_evt_t evt = { .type = BLE_TRANSPORT_EVT_READY };
+    post(&evt);
+}
+
+static void on_reset(int reason) {
+    ESP_LOGE(TAG, "Host reset, reason %d", reason);
+}
+
+static void host_task(void *param) {
+    nimble_port_run();
+    nimble_port_freertos_deinit();
+}
+
+void ble_transport_init(const ble_transport_callbacks_t *cbs) {
+    callbacks = cbs;
+
+    ESP_ERROR_CHECK(nimble_port_init());
+    bt_boot_mark(BT_BOOT_CONTROLLER);
+
+    ble_hs_cfg.sync_cb = on_sync;
+    ble_hs_cfg.reset_cb = on_reset;
+    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+    // Bonding with LE Secure Connections; the remote has no display or keyboard, so Just Works
+    ble_hs_cfg.sm_bonding = 1;
+    ble_hs_cfg.sm_sc = 1;
+    ble_hs_cfg.sm_mitm = 0;
+    ble_hs_cfg.sm_io_cap = BLE_HS_IO_NO_INPUT_OUTPUT;
+    ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+
+    ble_svc_gap_init();
+    ble_svc_gatt_init();
+    NIMBLE_CHECK(ble_gatts_count_cfg(services));
+    NIMBLE_CHECK(ble_gatts_add_svcs(services));
+    NIMBLE_CHECK(ble_svc_gap_device_name_set(BLE_TRANSPORT_DEVICE_NAME));
+
+    // Offer a larger MTU so the phone's MTU request on connect is answered with room for batches
+    NIMBLE_CHECK(ble_att_set_preferred_mtu(CONFIG_BLE_LOCAL_MTU));
+    ble_store_config_init();
+
+    nimble_port_freertos_init(host_task);
+}
+
+esp_err_t ble_transport_adv_start(const ble_transport_adv_t *adv) {
+    struct ble_gap_adv_params params = {};
+    ble_addr_t peer;
+
+    last_adv = *adv;
+    if (adv->directed) {
+        params.conn_mode = BLE_GAP_CONN_MODE_DIR;
+        params.high_duty_cycle = 1;
+        to_addr(&peer, adv->peer, adv->peer_type);
+    } else {
+        params.conn_mode = adv->broadcast ? BLE_GAP_CONN_MODE_NON : BLE_GAP_CONN_MODE_UND;
+        params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+        params.itvl_min = adv->int_min;
+        params.itvl_max = adv->int_max;
+        params.filter_policy = adv->accept_list ? BLE_HCI_ADV_FILT_CONN : BLE_HCI_ADV_FILT_NONE;
+    }
+
+    int rc = ble_gap_adv_start(BLE_OWN_ADDR_PUBLIC, adv->directed ? &peer : NULL, BLE_HS_FOREVER, &params,
+                               gap_event, NULL);
+    if (rc != 0 && rc < BLE_HS_ERR_HCI_BASE) {
+        return to_esp_err(rc);
+    }
+    // Refused by the controller, or started
+    ble_transport_evt_t evt = {
+        .type = BLE_TRANSPORT_EVT_ADV_STARTED,
+        .adv_started.status = rc == 0 ? 0 : rc - BLE_HS_ERR_HCI_BASE,
+    };
+    post(&evt);
+    return ESP_OK;
+}
+
+void ble_transport_adv_stop(void) {
+    ble_gap_adv_stop();
+}
+
+esp_err_t ble_transport_adv_set_data(const uint8_t *data, size_t len) {
+    if (data == NULL) {
+        data = ble_adv_payload;
+        len = ble_adv_payload_len;
+    }
+    return to_esp_err(ble_gap_adv_set_data(data, len));
+}
+
+esp_err_t ble_transport_send(uint16_t conn_id, ble_attr_t attr, const void *data, uint16_t len, bool indicate) {
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(data, len);
+    if (om == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    // Takes the buffer either way
+    int rc = indicate ? ble_gatts_indicate_custom(conn_id, val_handles[attr], om)
+                      : ble_gatts_notify_custom(conn_id, val_handles[attr], om);
+    return to_esp_err(rc);
+}
+
+void ble_transport_close(uint16_t conn_id) {
+    ble_gap_terminate(conn_id, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+// Returns the connection handle of a peer, or -1
+static int find_handle(const esp_bd_addr_t bda) {
+    int handle = -1;
+
+    portENTER_CRITICAL(&peers_mux);
+    for (int i = 0; i < MAX_PEERS && handle < 0; i++) {
+        if (peers[i].used && memcmp(peers[i].bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+            handle = peers[i].handle;
+        }
+    }
+    portEXIT_CRITICAL(&peers_mux);
+    return handle;
+}
+
+esp_err_t ble_transport_update_conn_params(const esp_bd_addr_t bda, uint16_t min_int, uint16_t max_int,
+                                           uint16_t latency, uint16_t timeout) {
+    struct ble_gap_upd_params params = {
+        .itvl_min = min_int,
+        .itvl_max = max_int,
+        .latency = latency,
+        .supervision_timeout = timeout,
+    };
+    int handle = find_handle(bda);
+
+    if (handle < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return to_esp_err(ble_gap_update_params(handle, &params));
+}
+
+esp_err_t ble_transport_set_phy_2m(const esp_bd_addr_t bda) {
+    int handle = find_handle(bda);
+
+    if (handle < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return to_esp_err(ble_gap_set_prefered_le_phy(handle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+                                                  BLE_GAP_LE_PHY_CODED_ANY));
+}
+
+esp_err_t ble_transport_set_data_len(const esp_bd_addr_t bda, uint16_t tx_octets) {
+    int handle = find_handle(bda);
+
+    if (handle < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return to_esp_err(ble_gap_set_data_len(handle, tx_octets, DATA_LEN_TX_TIME(tx_octets)));
+}
+
+esp_err_t ble_transport_accept_list_size(uint16_t *size) {
+    *size = ACCEPT_LIST_SIZE;
+    return ESP_OK;
+}
+
+// NimBLE replaces the whole list at once, so the list is kept here and written out on every change
+esp_err_t ble_transport_accept_list_update(bool add, const esp_bd_addr_t bda, esp_ble_addr_type_t type) {
+    ble_addr_t list[ACCEPT_LIST_SIZE];
+    ble_addr_t addr;
+    uint8_t count = 0;
+    ble_transport_evt_t evt = { .type = BLE_TRANSPORT_EVT_ACCEPT_LIST };
+
+    to_addr(&addr, bda, type);
+    for (int i = 0; i < accept_count; i++) {
+        if (memcmp(accept_list[i].val, addr.val, sizeof(addr.val)) != 0) {
+            list[count++] = accept_list[i];
+        }
+    }
+    if (add) {
+        if (count == ACCEPT_LIST_SIZE) {
+            evt.accept_list.status = UINT8_MAX;
+            post(&evt);
+            return ESP_OK;
+        }
+        list[count++] = addr;
+    }
+
+    int rc = ble_gap_wl_set(list, count);
+    if (rc != 0 && rc < BLE_HS_ERR_HCI_BASE) {
+        return to_esp_err(rc);
+    }
+    if (rc == 0) {
+        memcpy(accept_list, list, count * sizeof(ble_addr_t));
+        accept_count = count;
+    }
+    evt.accept_list.status = rc == 0 ? 0 : rc - BLE_HS_ERR_HCI_BASE;
+    post(&evt);
+    return ESP_OK;
+}
+
+esp_err_t ble_transport_secure(const esp_bd_addr_t bda) {
+    int handle = find_handle(bda);
+
+    if (handle < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return to_esp_err(ble_gap_security_initiate(handle));
+}
+
+int ble_transport_bonds(ble_transport_bond_t *bonds, int max) {
+    ble_addr_t addrs[MYNEWT_VAL(BLE_STORE_MAX_BONDS)];
+    int count = 0;
+    int written = 0;
+
+    if (ble_store_util_bonded_peers(addrs, &count, MYNEWT_VAL(BLE_STORE_MAX_BONDS)) != 0) {
+        ESP_LOGE(TAG, "Failed to read the bonded phones");
+        return 0;
+    }
+    for (int i = 0; i < count && written < max; i++) {
+        struct ble_store_key_sec key = { .peer_addr = addrs[i] };
+        struct ble_store_value_sec value;
+        if (ble_store_read_peer_sec(&key, &value) != 0 || !value.ltk_present) {
+            continue;
+        }
+        ble_transport_bond_t *b = &bonds[written++];
+        to_bda(b->bda, &addrs[i]);
+        b->type = addrs[i].type == BLE_ADDR_RANDOM ? BLE_ADDR_TYPE_RANDOM : BLE_ADDR_TYPE_PUBLIC;
+        b->key_size = value.key_size;
+        memcpy(b->ltk, value.ltk, BLE_TRANSPORT_KEY_LEN);
+        b->has_irk = value.irk_present;
+        memcpy(b->irk, value.irk, BLE_TRANSPORT_KEY_LEN);
+    }
+    return written;
+}
+
+esp_err_t ble_transport_bond_add(const ble_transport_bond_t *bond) {
+    struct ble_store_value_sec value = {
+        .key_size = bond->key_size,
+        .ltk_present = 1,
+        .sc = 1,
+    };
+
+    to_addr(&value.peer_addr, bond->bda, bond->type);
+    memcpy(value.ltk, bond->ltk, BLE_TRANSPORT_KEY_LEN);
+    // As a peripheral the host looks the LTK up in our keys when the phone encrypts
+    int rc = ble_store_write_our_sec(&value);
+    if (rc == 0) {
+        value.irk_present = bond->has_irk;
+        memcpy(value.irk, bond->irk, BLE_TRANSPORT_KEY_LEN);
+        rc = ble_store_write_peer_sec(&value);
+    }
+    return to_esp_err(rc);
+}
+
+// The store needs the address type, so the bond is looked up by address
+esp_err_t ble_transport_bond_remove(const esp_bd_addr_t bda) {
+    ble_addr_t addrs[MYNEWT_VAL(BLE_STORE_MAX_BONDS)];
+    int count = 0;
+
+    if (ble_store_util_bonded_peers(addrs, &count, MYNEWT_VAL(BLE_STORE_MAX_BONDS)) != 0) {
+        return ESP_FAIL;
+    }
+    for (int i = 0; i < count; i++) {
+        esp_bd_addr_t peer;
+        to_bda(peer, &addrs[i]);
+        if (memcmp(peer, bda, sizeof(esp_bd_addr_t)) == 0) {
+            return to_esp_err(ble_store_util_delete_peer(&addrs[i]));
+        }
+    }
+    return ESP_OK;
+}
+
+#endif // CONFIG_BT_NIMBLE_ENABLED
@@ -0,0 +1,568 @@
+/**
+ * @file ble_tx.c
+ * @brief Reliable delivery of button events over BLE.
+ *
+ * Every event gets a sequence number and stays in a ring until the phone confirms it.
+ * Confirmation comes either from a GATT indication confirmation (when the phone enabled
+ * indications in the CCCD) or from an "ack:<seq>" write on the characteristic (when it
+ * enabled notifications). Unconfirmed events are retransmitted with exponential backoff
+ * and keep their sequence number, so the phone can drop duplicates.
+ *
+ * While no phone is subscribed the same ring buffers presses: they are timestamped,
+ * dropped once older than CONFIG_BLE_TX_EVENT_TTL_MS, and flushed in order as soon as
+ * the phone reconnects and enables notifications or indications.
+ *
+ * Sending pauses while the stack reports congestion; events queued in the meantime are
+ * coalesced into full batches when it clears.
+ *
+ * With several phones connected, the ring is shared but delivery is tracked per
+ * connection: each phone gets its own batches, window, retransmission backoff and
+ * congestion pause, and a record is released once every subscribed phone has it. A
+ * slow phone only delays its own copy, until the ring overflows.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "ble_tx.h"
+#include "ble_server.h"
+#include "ble_conn_params.h"
+#include "bt_trace.h"
+#include "bt_latency.h"
+#include "bt_pm.h"
+#include "bt_timesync.h"
+#include "flight_rec.h"
+
+#define TAG "BLE_TX"
+
+#define TX_QUEUE_LEN        CONFIG_BLE_TX_QUEUE_LEN
+#define TX_WINDOW           CONFIG_BLE_TX_WINDOW
+#define TX_RETRY_TICKS      pdMS_TO_TICKS(CONFIG_BLE_TX_RETRY_MS)
+#define TX_MAX_BACKOFF      4       // Retry interval stops doubling after 2^4 * CONFIG_BLE_TX_RETRY_MS
+#define TX_TTL_US           ((int64_t)CONFIG_BLE_TX_EVENT_TTL_MS * 1000)
+#define TX_PAYLOAD_MAX_LEN  (CONFIG_BLE_LOCAL_MTU - 3)
+#define TX_SEPARATOR        '\n'
+#define TX_RECORD_MAX_LEN   40      // "short:4:65535:" plus a 13-digit millisecond timestamp
+
+// Delivery state of one record to one connection
+typedef struct {
+    bool sent;
+    bool done;              // Confirmed or acknowledged by this phone
+    bool conf_pending;      // First transmission is waiting for its ESP_GATTS_CONF_EVT
+    uint8_t retries;
+    TickType_t sent_at;
+    uint32_t pdu;           // Counter value of the notification that first carried the record
+    uint32_t tx_pdu;        // Counter value of the notification that last carried it
+    bool lost;              // The stack refused its last transmission; no confirmation covers it
+    int64_t sent_us;        // esp_timer time of the first transmission
+} tx_delivery_t;
+
+typedef struct {
+    uint16_t seq;
+    uint8_t type;
+    uint8_t button;
+    int64_t edge_us;        // esp_timer time of the GPIO edge
+    int64_t created_us;     // esp_timer time the event task dequeued the press, for the time-to-live
+    tx_delivery_t dlv[BLE_SERVER_MAX_CONN];
+} tx_record_t;
+
+// Per-connection transmit state
+typedef struct {
+    bool indication_pending;
+    uint32_t pdu_sent;          // Notifications and indications handed to the stack
+    uint32_t pdu_confirmed;     // ESP_GATTS_CONF_EVTs received for them
+    bool congested;
+    int64_t stall_start_us;
+} tx_conn_t;
+
+static tx_record_t ring[TX_QUEUE_LEN];
+static size_t ring_head;    // Oldest record not yet delivered to every phone
+static size_t ring_count;
+static uint16_t next_seq;
+static tx_conn_t conns[BLE_SERVER_MAX_CONN];
+static ble_tx_stats_t stats;
+static SemaphoreHandle_t lock;
+
+static inline tx_record_t *ring_at(size_t i) {
+    return &ring[(ring_head + i) % TX_QUEUE_LEN];
+}
+
+static inline bool seq_before_or_equal(uint16_t a, uint16_t b) {
+    return (int16_t)(a - b) <= 0;
+}
+
+static TickType_t retry_interval(const tx_delivery_t *d) {
+    uint8_t shift = d->retries < TX_MAX_BACKOFF ? d->retries : TX_MAX_BACKOFF;
+    return TX_RETRY_TICKS << shift;
+}
+
+static int format_record(const tx_record_t *rec, char *out, size_t out_len) {
+    const char* type_str = (rec->type == BUTTON_EVENT_SHORT) ? "short" : "long";
+    int64_t press_ms;
+
+    // Converted at send time so presses buffered before the first sync still get phone time
+    if (bt_timesync_to_phone_ms(rec->edge_us, &press_ms)) {
+        return snprintf(out, out_len, "%s:%d:%u:%lld", type_str, rec->button, rec->seq, (long long)press_ms);
+    }
+    return snprintf(out, out_len, "%s:%d:%u", type_str, rec->button, rec->seq);
+}
+
+// True if no other phone has had the record yet
+static bool first_send(const tx_record_t *rec, int conn) {
+    for (int c = 0; c < BLE_SERVER_MAX_CONN; c++) {
+        if (c != conn && rec->dlv[c].sent_us != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void drop_head(size_t n) {
+    ring_head = (ring_head + n) % TX_QUEUE_LEN;
+    ring_count -= n;
+}
+
+// Records are kept in press order, so expired ones are always at the head
+static void drop_expired(int64_t now_us) {
+    size_t expired = 0;
+    while (expired < ring_count && now_us - ring_at(expired)->created_us > TX_TTL_US) {
+        expired++;
+    }
+    if (expired > 0) {
+        BT_TRACE(TX, WARN, TX_EXPIRED, expired, CONFIG_BLE_TX_EVENT_TTL_MS);
+        flight_rec_log(FLIGHT_REC_TX_DROP, 1, expired, ring_at(0)->seq);
+        drop_head(expired);
+        stats.dropped_expired += expired;
+    }
+}
+
+// Drops records from the head once every subscribed phone has them. With no phone
+// subscribed nothing is released, so presses wait for the next one to subscribe.
+static size_t release_delivered(void) {
+    bool subscribed[BLE_SERVER_MAX_CONN];
+    bool any = false;
+    size_t released = 0;
+
+    for (int c = 0; c < BLE_SERVER_MAX_CONN; c++) {
+        subscribed[c] = ble_server_is_subscribed(c);
+        any |= subscribed[c];
+    }
+    while (any && released < ring_count) {
+        tx_record_t *rec = ring_at(released);
+        bool delivered = true;
+        for (int c = 0; c < BLE_SERVER_MAX_CONN && delivered; c++) {
+            delivered = !subscribed[c] || rec->dlv[c].done;
+        }
+        if (!delivered) {
+            break;
+        }
+        released++;
+    }
+    drop_head(released);
+    return released;
+}
+
+static void end_stall(tx_conn_t *tc, int64_t now_us) {
+    uint32_t stall_ms = (now_us - tc->stall_start_us) / 1000;
+    stats.stall_time_ms += stall_ms;
+    if (stall_ms > stats.max_stall_ms) {
+        stats.max_stall_ms = stall_ms;
+    }
+}
+
+bool ble_tx_init(void) {
+    lock = xSemaphoreCreateMutex();
+    if (lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create tx lock");
+        return false;
+    }
+    return true;
+}
+
+void ble_tx_enqueue(button_event_type_t type, int button, int64_t edge_us, int64_t dequeued_us) {
+    int64_t now_us = dequeued_us;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    drop_expired(now_us);
+    if (ring_count == TX_QUEUE_LEN) {
+        BT_TRACE(TX, WARN, TX_QUEUE_FULL, ring_at(0)->seq, 0);
+        flight_rec_log(FLIGHT_REC_TX_DROP, 0, 1, ring_at(0)->seq);
+        drop_head(1);
+        stats.dropped_full++;
+    }
+    tx_record_t *rec = ring_at(ring_count++);
+    *rec = (tx_record_t) {
+        .seq = next_seq++,
+        .type = type,
+        .button = button,
+        .edge_us = edge_us,
+        .created_us = now_us,
+    };
+    flight_rec_log(FLIGHT_REC_BUTTON_EVENT, button, type, rec->seq);
+    if (ring_count > stats.queue_peak) {
+        stats.queue_peak = ring_count;
+    }
+    xSemaphoreGive(lock);
+}
+
+bool ble_tx_batch_full(void) {
+    char record[TX_RECORD_MAX_LEN];
+    bool full = false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int c = 0; c < BLE_SERVER_MAX_CONN && !full; c++) {
+        if (!ble_server_is_subscribed(c)) {
+            continue;
+        }
+        size_t limit = ble_server_get_max_payload(c);
+        size_t len = 0;
+        for (size_t i = 0; i < ring_count && len < limit; i++) {
+            tx_record_t *rec = ring_at(i);
+            if (!rec->dlv[c].sent && !rec->dlv[c].done) {
+                len += format_record(rec, record, sizeof(record)) + 1;
+            }
+        }
+        full = len >= limit;
+    }
+    xSemaphoreGive(lock);
+    return full;
+}
+
+bool ble_tx_unsent(void) {
+    bool unsent = false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int c = 0; c < BLE_SERVER_MAX_CONN && !unsent; c++) {
+        if (!ble_server_is_subscribed(c)) {
+            continue;
+        }
+        for (size_t i = 0; i < ring_count && !unsent; i++) {
+            tx_delivery_t *d = &ring_at(i)->dlv[c];
+            unsent = !d->sent && !d->done;
+        }
+    }
+    xSemaphoreGive(lock);
+    return unsent;
+}
+
+TickType_t ble_tx_next_timeout(void) {
+    TickType_t now = xTaskGetTickCount();
+    TickType_t timeout = portMAX_DELAY;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int c = 0; c < BLE_SERVER_MAX_CONN; c++) {
+        // An outstanding indication is resolved by its confirmation or by the ATT timeout
+        // dropping the link, never by a retransmission.
+        if (!ble_server_is_subscribed(c) || conns[c].indication_pending) {
+            continue;
+        }
+        bool waiting = false;
+        for (size_t i = 0; i < ring_count; i++) {
+            tx_delivery_t *d = &ring_at(i)->dlv[c];
+            if (d->done) {
+                continue;
+            }
+            waiting = true;
+            if (!d->sent) {
+                continue;
+            }
+            TickType_t elapsed = now - d->sent_at;
+            TickType_t interval = retry_interval(d);
+            TickType_t remaining = elapsed < interval ? interval - elapsed : 0;
+            if (remaining < timeout) {
+                timeout = remaining;
+            }
+        }
+        TickType_t hold = waiting ? ble_conn_params_hold_ticks(c) : 0;
+        if (hold > 0 && hold < timeout) {
+            timeout = hold;
+        }
+    }
+    xSemaphoreGive(lock);
+    return timeout;
+}
+
+// Sends what is new or due to one phone; its window, batch size and backoff are its own
+static void process_conn(int conn) {
+    tx_conn_t *tc = &conns[conn];
+    char payload[TX_PAYLOAD_MAX_LEN + 1];
+    char record[TX_RECORD_MAX_LEN];
+
+    // Let a pending switch to the fast interval land first; its result wakes the event task
+    if (ble_conn_params_hold_ticks(conn) > 0) {
+        return;
+    }
+    while (ble_server_is_subscribed(conn)) {
+        bool indicate = ble_server_indications_enabled(conn);
+        size_t limit = ble_server_get_max_payload(conn);
+        if (limit > TX_PAYLOAD_MAX_LEN) {
+            limit = TX_PAYLOAD_MAX_LEN;
+        }
+        TickType_t now = xTaskGetTickCount();
+        int64_t now_us = esp_timer_get_time();
+        size_t len = 0;
+        size_t in_flight = 0;
+        size_t first = 0;
+        size_t last = 0;
+        size_t packed = 0;
+        uint16_t first_seq = 0;
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (tc->congested) {
+            // Hold everything back; ble_tx_on_congest() wakes the event task when it clears
+            xSemaphoreGive(lock);
+            return;
+        }
+        if (indicate && tc->indication_pending) {
+            // Only one indication may be outstanding; its confirmation restarts sending
+            xSemaphoreGive(lock);
+            return;
+        }
+        for (size_t i = 0; i < ring_count; i++) {
+            tx_record_t *rec = ring_at(i);
+            tx_delivery_t *d = &rec->dlv[conn];
+            if (d->done) {
+                continue;
+            }
+            bool due = !d->sent || (now - d->sent_at) >= retry_interval(d);
+            if (d->sent && !due) {
+                in_flight++;
+                continue;
+            }
+            if (in_flight + packed >= TX_WINDOW) {
+                break;
+            }
+            int rec_len = format_record(rec, record, sizeof(record));
+            if (len > 0 && len + 1 + rec_len > limit) {
+                break;
+            }
+            if (len > 0) {
+                payload[len++] = TX_SEPARATOR;
+            } else {
+                first = i;
+                first_seq = rec->seq;
+            }
+            memcpy(&payload[len], record, rec_len);
+            len += rec_len;
+            last = i;
+            packed++;
+        }
+        for (size_t i = first; packed > 0 && i <= last; i++) {
+            tx_record_t *rec = ring_at(i);
+            tx_delivery_t *d = &rec->dlv[conn];
+            if (d->done || (d->sent && (now - d->sent_at) < retry_interval(d))) {
+                continue;
+            }
+            if (d->sent) {
+                d->retries++;
+                stats.retransmits++;
+            } else if (d->sent_us == 0) {
+                d->conf_pending = true;
+                d->pdu = tc->pdu_sent;
+                d->sent_us = now_us;
+                bt_latency_record(BT_LATENCY_DEQUEUE_TO_SEND, rec->created_us, now_us);
+                if (first_send(rec, conn)) {
+                    bt_pm_on_event_sent(rec->edge_us, now_us);
+                }
+            }
+            d->sent = true;
+            d->sent_at = now;
+            d->tx_pdu = tc->pdu_sent;
+            d->lost = false;
+        }
+        uint32_t pdu = packed > 0 ? tc->pdu_sent++ : tc->pdu_sent;
+        tc->indication_pending = indicate && packed > 0;
+        xSemaphoreGive(lock);
+
+        if (packed == 0) {
+            return;
+        }
+
+        payload[len] = '\0';
+        BT_TRACE(TX, INFO, TX_SEND, packed, first_seq);
+        esp_err_t err = send_ble_message(conn, payload, indicate);
+        flight_rec_log(FLIGHT_REC_TX_SEND, packed, first_seq, err);
+        if (err != ESP_OK) {
+            // Leave the records marked as sent: they are retried when their backoff expires
+            BT_TRACE(TX, WARN, TX_SEND_FAILED, err, packed);
+            xSemaphoreTake(lock, portMAX_DELAY);
+            tc->indication_pending = false;
+            // No ESP_GATTS_CONF_EVT will come for this one
+            tc->pdu_sent--;
+            for (size_t i = 0; i < ring_count; i++) {
+                tx_delivery_t *d = &ring_at(i)->dlv[conn];
+                if (d->conf_pending && d->pdu == pdu) {
+                    d->conf_pending = false;
+                }
+                // The counter value goes to the next PDU, whose confirmation must not cover these
+                if (d->sent && !d->done && d->tx_pdu == pdu) {
+                    d->lost = true;
+                }
+            }
+            xSemaphoreGive(lock);
+            return;
+        }
+        if (indicate) {
+            return;
+        }
+    }
+}
+
+void ble_tx_process(void) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    drop_expired(esp_timer_get_time());
+    // A phone that unsubscribed no longer holds records back
+    release_delivered();
+    xSemaphoreGive(lock);
+
+    for (int c = 0; c < BLE_SERVER_MAX_CONN; c++) {
+        process_conn(c);
+    }
+}
+
+void ble_tx_on_ack(int conn, uint16_t seq) {
+    size_t acked = 0;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (size_t i = 0; i < ring_count; i++) {
+        tx_delivery_t *d = &ring_at(i)->dlv[conn];
+        if (!d->sent || !seq_before_or_equal(ring_at(i)->seq, seq)) {
+            break;
+        }
+        // The phone acks its newest record, which may be past one the stack refused
+        if (!d->done && !d->lost) {
+            d->done = true;
+            acked++;
+        }
+    }
+    release_delivered();
+    xSemaphoreGive(lock);
+
+    BT_TRACE(TX, DEBUG, TX_ACKED, acked, seq);
+
+    if (acked > 0) {
+        flight_rec_log(FLIGHT_REC_TX_ACK, acked, seq, 0);
+        bt_event_wake();
+    }
+}
+
+void ble_tx_on_confirm(int conn, bool ok) {
+    tx_conn_t *tc = &conns[conn];
+    int64_t now_us = esp_timer_get_time();
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (tc->pdu_confirmed != tc->pdu_sent) {
+        uint32_t pdu = tc->pdu_confirmed++;
+        for (size_t i = 0; i < ring_count; i++) {
+            tx_record_t *rec = ring_at(i);
+            tx_delivery_t *d = &rec->dlv[conn];
+            if (d->conf_pending && d->pdu == pdu) {
+                d->conf_pending = false;
+                if (ok) {
+                    bt_latency_record(BT_LATENCY_SEND_TO_CONF, d->sent_us, now_us);
+                    bt_latency_record(BT_LATENCY_EDGE_TO_CONF, rec->edge_us, now_us);
+                }
+            }
+        }
+    }
+    if (!tc->indication_pending) {
+        xSemaphoreGive(lock);
+        return;
+    }
+    tc->indication_pending = false;
+    flight_rec_log(FLIGHT_REC_TX_CONFIRM, ok, 0, 0);
+
+    for (size_t i = 0; i < ring_count; i++) {
+        tx_delivery_t *d = &ring_at(i)->dlv[conn];
+        // A record whose send the stack refused was not in the indication; it waits for its backoff
+        if (!d->sent || d->done || d->lost) {
+            continue;
+        }
+        if (ok) {
+            d->done = true;
+        } else {
+            // Retransmit right away; the backoff applies if the link keeps failing
+            d->sent_at -= retry_interval(d);
+        }
+    }
+    release_delivered();
+    xSemaphoreGive(lock);
+
+    bt_event_wake();
+}
+
+void ble_tx_on_disconnect(int conn) {
+    tx_conn_t *tc = &conns[conn];
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (tc->congested) {
+        end_stall(tc, esp_timer_get_time());
+    }
+    *tc = (tx_conn_t) { 0 };
+    for (size_t i = 0; i < ring_count; i++) {
+        ring_at(i)->dlv[conn] = (tx_delivery_t) { 0 };
+    }
+    // The phones still connected may have everything this one was holding back
+    size_t released = release_delivered();
+    xSemaphoreGive(lock);
+
+    if (released > 0) {
+        bt_event_wake();
+    }
+}
+
+void ble_tx_on_congest(int conn, bool is_congested) {
+    tx_conn_t *tc = &conns[conn];
+    int64_t now_us = esp_timer_get_time();
+    uint32_t stall_ms = 0;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (is_congested && !tc->congested) {
+        tc->stall_start_us = now_us;
+        stats.stalls++;
+    } else if (!is_congested && tc->congested) {
+        stall_ms = (now_us - tc->stall_start_us) / 1000;
+        end_stall(tc, now_us);
+    }
+    bool resumed = tc->congested && !is_congested;
+    tc->congested = is_congested;
+    xSemaphoreGive(lock);
+
+    if (resumed) {
+        BT_TRACE(TX, INFO, TX_CONGEST_CLEARED, stall_ms, conn);
+        bt_event_wake();
+    }
+}
+
+void ble_tx_get_stats(ble_tx_stats_t *out) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *out = stats;
+    out->queue_depth = ring_count;
+    out->in_flight = 0;
+    for (size_t i = 0; i < ring_count; i++) {
+        for (int c = 0; c < BLE_SERVER_MAX_CONN; c++) {
+            if (ring_at(i)->dlv[c].sent && !ring_at(i)->dlv[c].done) {
+                out->in_flight++;
+                break;
+            }
+        }
+    }
+    out->congested = false;
+    for (int c = 0; c < BLE_SERVER_MAX_CONN; c++) {
+        if (conns[c].congested) {
+            out->congested = true;
+            out->stall_time_ms += (esp_timer_get_time() - conns[c].stall_start_us) / 1000;
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_tx_reset_queue_peak(void) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    stats.queue_peak = ring_count;
+    xSemaphoreGive(lock);
+}
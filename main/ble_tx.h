@@ -0,0 +1,137 @@
+#ifndef BLE_TX_H
+#define BLE_TX_H
+
+// ble_tx.h - Reliable, sequence-numbered delivery of button events over BLE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "bt_event.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Transmit queue counters, for diagnostics.
+ */
+typedef struct {
+    uint32_t queue_depth;       // Events currently queued, sent or not
+    uint32_t queue_peak;        // Highest queue depth since boot
+    uint32_t in_flight;         // Events sent and waiting for confirmation from any phone
+    uint32_t retransmits;       // Events sent more than once
+    uint32_t dropped_full;      // Events dropped because the queue overflowed
+    uint32_t dropped_expired;   // Events dropped because their time-to-live passed
+    uint32_t stalls;            // Number of congestion episodes reported by the stack
+    uint32_t stall_time_ms;     // Total time spent congested
+    uint32_t max_stall_ms;      // Longest single congestion episode
+    bool congested;             // The stack currently reports congestion on any connection
+} ble_tx_stats_t;
+
+/**
+ * @brief Initializes the transmit queue.
+ *
+ * Must be called before any other ble_tx function, before the event task starts.
+ *
+ * @return true on success, false if the lock could not be allocated.
+ */
+bool ble_tx_init(void);
+
+/**
+ * @brief Queues a button event for delivery and assigns it the next sequence number.
+ *
+ * The event stays queued until the phone confirms it, either through a GATT indication
+ * confirmation or an "ack:<seq>" write. While no phone is subscribed the event is held
+ * for up to CONFIG_BLE_TX_EVENT_TTL_MS and sent once a phone subscribes. If the queue is
+ * full the oldest event is dropped.
+ *
+ * @param type         Short or long press.
+ * @param button       1-based button number as shown to the user.
+ * @param edge_us      esp_timer time of the GPIO edge, for latency accounting.
+ * @param dequeued_us  esp_timer time the event task took the event off its queue.
+ */
+void ble_tx_enqueue(button_event_type_t type, int button, int64_t edge_us, int64_t dequeued_us);
+
+/**
+ * @brief Sends queued events that are new or due for retransmission to every subscribed phone.
+ *
+ * Packs as many records as fit into one notification for each connection, keeping at
+ * most CONFIG_BLE_TX_WINDOW events unconfirmed per connection. Called from the event
+ * task only.
+ */
+void ble_tx_process(void);
+
+/**
+ * @brief Returns true if the unsent events already fill one notification to any subscribed phone.
+ */
+bool ble_tx_batch_full(void);
+
+/**
+ * @brief Returns true if an event waits to be handed to the stack for a subscribed phone.
+ */
+bool ble_tx_unsent(void);
+
+/**
+ * @brief Returns how long the event task may sleep before a retransmission is due.
+ *
+ * @return Ticks until the earliest retransmission, or portMAX_DELAY if nothing is in flight.
+ */
+TickType_t ble_tx_next_timeout(void);
+
+/**
+ * @brief Handles an app-level cumulative acknowledgment written by the phone.
+ *
+ * @param conn Connection slot the write came from.
+ * @param seq  Highest sequence number the phone has received in order.
+ */
+void ble_tx_on_ack(int conn, uint16_t seq);
+
+/**
+ * @brief Handles ESP_GATTS_CONF_EVT for the oldest notification or indication sent.
+ *
+ * Records send-to-confirm latency for the events it carried. If it confirms the
+ * outstanding indication, those events are released, or retried if it failed.
+ *
+ * @param conn Connection slot the confirmation came from.
+ * @param ok   true if the stack reported success.
+ */
+void ble_tx_on_confirm(int conn, bool ok);
+
+/**
+ * @brief Forgets what was sent on a connection after its link drops.
+ *
+ * Events the remaining phones already have are released; the rest are sent again in
+ * full if the phone reconnects before they expire.
+ *
+ * @param conn Connection slot that disconnected.
+ */
+void ble_tx_on_disconnect(int conn);
+
+/**
+ * @brief Pauses or resumes sending when the stack reports congestion.
+ *
+ * While congested, new events keep accumulating and leave as fuller batches once the
+ * stack reports that its buffers drained, instead of overflowing the controller.
+ *
+ * @param conn      Connection slot the event is for.
+ * @param congested Value from ESP_GATTS_CONGEST_EVT.
+ */
+void ble_tx_on_congest(int conn, bool congested);
+
+/**
+ * @brief Copies the current transmit queue counters.
+ *
+ * @param stats Output structure.
+ */
+void ble_tx_get_stats(ble_tx_stats_t *stats);
+
+/**
+ * @brief Restarts peak queue depth tracking from the current depth.
+ */
+void ble_tx_reset_queue_peak(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_TX_H
@@ -0,0 +1,35 @@
+#ifndef BLE_TYPES_H
+#define BLE_TYPES_H
+
+// ble_types.h - Address types shared by the modules above the BLE transport
+//
+// The Bluedroid definitions are used as they are. NimBLE builds do not have the
+// Bluedroid API headers, so the few types the rest of the remote uses are defined here
+// with the same names and layout: addresses are stored most significant byte first.
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BT_BLUEDROID_ENABLED
+
+#include "esp_bt_defs.h"
+
+#else
+
+#define ESP_BD_ADDR_LEN 6
+
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+
+typedef enum {
+    BLE_ADDR_TYPE_PUBLIC = 0x00,
+    BLE_ADDR_TYPE_RANDOM = 0x01,
+    BLE_ADDR_TYPE_RPA_PUBLIC = 0x02,
+    BLE_ADDR_TYPE_RPA_RANDOM = 0x03,
+} esp_ble_addr_type_t;
+
+#define ESP_BD_ADDR_STR         "%02x:%02x:%02x:%02x:%02x:%02x"
+#define ESP_BD_ADDR_HEX(addr)   addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]
+
+#endif // CONFIG_BT_BLUEDROID_ENABLED
+
+#endif // BLE_TYPES_H
@@ -0,0 +1,92 @@
+/**
+ * @file bt_boot.c
+ * @brief Boot timeline stamps.
+ *
+ * Stages are reached from app_main(), the BLE bring-up task and the BTC task. Each
+ * stamp is written once, under a spinlock, and never changes afterwards.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "bt_boot.h"
+
+#define TAG "BT_BOOT"
+
+static const char *const stage_names[BT_BOOT_STAGE_COUNT] = {
+    [BT_BOOT_APP_MAIN] = "app_main",
+    [BT_BOOT_BUTTONS] = "buttons armed",
+    [BT_BOOT_NVS] = "NVS ready",
+    [BT_BOOT_STORAGE] = "device cache loaded",
+    [BT_BOOT_CONTROLLER] = "BLE controller up",
+    [BT_BOOT_HOST] = "BLE host up",
+    [BT_BOOT_ADV_DATA] = "advertising data set",
+    [BT_BOOT_SERVICE] = "GATT service started",
+    [BT_BOOT_FIRST_ADV] = "first advertisement",
+    [BT_BOOT_INIT_DONE] = "app_main done",
+    [BT_BOOT_FIRST_CONNECT] = "first connection",
+};
+
+static portMUX_TYPE boot_mux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t stamps[BT_BOOT_STAGE_COUNT];
+
+bool bt_boot_mark(bt_boot_stage_t stage) {
+    int64_t now_us = esp_timer_get_time();
+    bool first = false;
+
+    portENTER_CRITICAL(&boot_mux);
+    if (stamps[stage] == 0) {
+        stamps[stage] = now_us;
+        first = true;
+    }
+    portEXIT_CRITICAL(&boot_mux);
+    return first;
+}
+
+int64_t bt_boot_time_us(bt_boot_stage_t stage) {
+    portENTER_CRITICAL(&boot_mux);
+    int64_t t = stamps[stage];
+    portEXIT_CRITICAL(&boot_mux);
+    return t;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+    *p++ = v & 0xFF;
+    *p++ = (v >> 8) & 0xFF;
+    *p++ = (v >> 16) & 0xFF;
+    *p++ = v >> 24;
+    return p;
+}
+
+size_t bt_boot_serialize(uint8_t *buf, size_t len) {
+    size_t needed = 1 + BT_BOOT_STAGE_COUNT * 5;
+    int64_t copy[BT_BOOT_STAGE_COUNT];
+
+    if (len < needed) {
+        return 0;
+    }
+    portENTER_CRITICAL(&boot_mux);
+    for (size_t i = 0; i < BT_BOOT_STAGE_COUNT; i++) {
+        copy[i] = stamps[i];
+    }
+    portEXIT_CRITICAL(&boot_mux);
+
+    uint8_t *p = buf;
+    *p++ = BT_BOOT_STAGE_COUNT;
+    for (size_t i = 0; i < BT_BOOT_STAGE_COUNT; i++) {
+        *p++ = i;
+        p = put_u32(p, copy[i] > UINT32_MAX ? UINT32_MAX : (uint32_t)copy[i]);
+    }
+    return p - buf;
+}
+
+void bt_boot_dump(void) {
+    for (size_t i = 0; i < BT_BOOT_STAGE_COUNT; i++) {
+        int64_t t = bt_boot_time_us(i);
+        if (t == 0) {
+            ESP_LOGI(TAG, "%-22s not reached", stage_names[i]);
+            continue;
+        }
+        ESP_LOGI(TAG, "%-22s %8lld us", stage_names[i], (long long)t);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef BT_BOOT_H
+#define BT_BOOT_H
+
+// bt_boot.h - Boot timeline: esp_timer stamps of each startup stage
+//
+// Each stage is stamped the first time it is reached, so the timeline describes this
+// boot only. It is logged once the remote first advertises and can be read later on
+// diagnostics page 4.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// IDs on the wire are the enum values; append new stages at the end
+typedef enum {
+    BT_BOOT_APP_MAIN,       // app_main() entered
+    BT_BOOT_BUTTONS,        // Event task running and button interrupts armed
+    BT_BOOT_NVS,            // NVS flash initialized
+    BT_BOOT_STORAGE,        // Device count and cache loaded
+    BT_BOOT_CONTROLLER,     // BLE controller enabled
+    BT_BOOT_HOST,           // BLE host (Bluedroid or NimBLE) enabled
+    BT_BOOT_ADV_DATA,       // Advertising data set
+    BT_BOOT_SERVICE,        // GATT service started
+    BT_BOOT_FIRST_ADV,      // First advertising started
+    BT_BOOT_INIT_DONE,      // app_main() finished
+    BT_BOOT_FIRST_CONNECT,  // First phone connected
+    BT_BOOT_STAGE_COUNT,
+} bt_boot_stage_t;
+
+/**
+ * @brief Stamps a stage with the current esp_timer time, unless it was stamped already.
+ *
+ * Safe to call from any task.
+ *
+ * @param stage Stage reached.
+ * @return true if this call stamped the stage.
+ */
+bool bt_boot_mark(bt_boot_stage_t stage);
+
+/**
+ * @brief Returns the time a stage was reached, in microseconds since boot, or 0 if it was not.
+ */
+int64_t bt_boot_time_us(bt_boot_stage_t stage);
+
+/**
+ * @brief Serializes the timeline for the diagnostics characteristic.
+ *
+ * Layout (little-endian):
+ *   u8  stage count, then per stage: u8 stage ID (bt_boot_stage_t), u32 time in us
+ *       since boot, 0 if the stage was not reached
+ *
+ * @param buf Output buffer.
+ * @param len Size of the output buffer.
+ * @return Number of bytes written, or 0 if the buffer is too small.
+ */
+size_t bt_boot_serialize(uint8_t *buf, size_t len);
+
+/**
+ * @brief Logs the timeline to the console.
+ */
+void bt_boot_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_BOOT_H
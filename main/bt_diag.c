@@ -0,0 +1,98 @@
+/**
+ * @file bt_diag.c
+ * @brief Routes diagnostics characteristic reads and commands to the modules that own the data.
+ */
+
+#include "esp_log.h"
+#include "ble_adv.h"
+#include "ble_link.h"
+#include "bt_boot.h"
+#include "bt_diag.h"
+#include "bt_latency.h"
+#include "bt_pm.h"
+#include "bt_telemetry.h"
+
+#define TAG "BT_DIAG"
+
+static uint8_t selected_page = BT_DIAG_PAGE_LATENCY;
+
+void bt_diag_command(uint8_t cmd) {
+    uint8_t page = cmd & BT_DIAG_CMD_PAGE_MASK;
+
+    switch (page) {
+        case BT_DIAG_PAGE_LATENCY:
+            if (cmd & BT_DIAG_CMD_DUMP) {
+                bt_latency_dump();
+            }
+            if (cmd & BT_DIAG_CMD_RESET) {
+                bt_latency_reset();
+            }
+            break;
+        case BT_DIAG_PAGE_MEMORY:
+            if (cmd & BT_DIAG_CMD_DUMP) {
+                bt_telemetry_dump();
+            }
+            if (cmd & BT_DIAG_CMD_RESET) {
+                bt_telemetry_reset();
+            }
+            break;
+        case BT_DIAG_PAGE_ADV:
+            if (cmd & BT_DIAG_CMD_DUMP) {
+                ble_adv_dump();
+            }
+            if (cmd & BT_DIAG_CMD_RESET) {
+                ble_adv_reset();
+            }
+            break;
+        case BT_DIAG_PAGE_BOOT:
+            // The timeline belongs to this boot and has nothing to reset
+            if (cmd & BT_DIAG_CMD_DUMP) {
+                bt_boot_dump();
+            }
+            break;
+        case BT_DIAG_PAGE_LINK:
+            if (cmd & BT_DIAG_CMD_DUMP) {
+                ble_link_dump();
+            }
+            if (cmd & BT_DIAG_CMD_RESET) {
+                ble_link_reset();
+            }
+            break;
+        case BT_DIAG_PAGE_POWER:
+            if (cmd & BT_DIAG_CMD_DUMP) {
+                bt_pm_dump();
+            }
+            if (cmd & BT_DIAG_CMD_RESET) {
+                bt_pm_reset();
+            }
+            break;
+        default:
+            ESP_LOGW(TAG, "Unknown diagnostics page %u", page);
+            break;
+    }
+    selected_page = page;
+}
+
+size_t bt_diag_read(uint8_t *buf, size_t len) {
+    if (len < 1) {
+        return 0;
+    }
+    buf[0] = selected_page;
+
+    switch (selected_page) {
+        case BT_DIAG_PAGE_LATENCY:
+            return 1 + bt_latency_serialize(buf + 1, len - 1);
+        case BT_DIAG_PAGE_MEMORY:
+            return 1 + bt_telemetry_serialize(buf + 1, len - 1);
+        case BT_DIAG_PAGE_ADV:
+            return 1 + ble_adv_serialize(buf + 1, len - 1);
+        case BT_DIAG_PAGE_BOOT:
+            return 1 + bt_boot_serialize(buf + 1, len - 1);
+        case BT_DIAG_PAGE_LINK:
+            return 1 + ble_link_serialize(buf + 1, len - 1);
+        case BT_DIAG_PAGE_POWER:
+            return 1 + bt_pm_serialize(buf + 1, len - 1);
+        default:
+            return 1;
+    }
+}
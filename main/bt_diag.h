@@ -0,0 +1,53 @@
+#ifndef BT_DIAG_H
+#define BT_DIAG_H
+
+// bt_diag.h - Diagnostics pages served on the diagnostics GATT characteristic
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The phone writes one command byte to the diagnostics characteristic and then reads it:
+ *   bits 0-5  page to serve on the next read (bt_diag_page_t)
+ *   bit 6     also print the page to the console
+ *   bit 7     reset the page's counters
+ * Every page starts with a one-byte page ID followed by the page's own layout.
+ */
+#define BT_DIAG_CMD_PAGE_MASK   0x3F
+#define BT_DIAG_CMD_DUMP        0x40
+#define BT_DIAG_CMD_RESET       0x80
+
+typedef enum {
+    BT_DIAG_PAGE_LATENCY = 1,   // bt_latency_serialize()
+    BT_DIAG_PAGE_MEMORY = 2,    // bt_telemetry_serialize()
+    BT_DIAG_PAGE_ADV = 3,       // ble_adv_serialize()
+    BT_DIAG_PAGE_BOOT = 4,      // bt_boot_serialize()
+    BT_DIAG_PAGE_LINK = 5,      // ble_link_serialize()
+    BT_DIAG_PAGE_POWER = 6,     // bt_pm_serialize()
+} bt_diag_page_t;
+
+/**
+ * @brief Handles a command byte written to the diagnostics characteristic.
+ *
+ * @param cmd Page selector combined with BT_DIAG_CMD_* flags.
+ */
+void bt_diag_command(uint8_t cmd);
+
+/**
+ * @brief Serializes the currently selected page.
+ *
+ * @param buf Output buffer.
+ * @param len Size of the output buffer.
+ * @return Number of bytes written. An unknown page yields just its page ID.
+ */
+size_t bt_diag_read(uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_DIAG_H
@@ -1,3 +1,4 @@
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
@@ -5,6 +6,14 @@
 #include "bt_event.h"
 #include "bt_gpio.h"
 #include "ble_server.h"
+#include "ble_tx.h"
+#include "ble_beacon.h"
+#include "bt_trace.h"
+#include "bt_latency.h"
+#include "bt_pm.h"
+#include "bt_sched.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
 
 // From your BLE code
 extern void app_notify_button_event(const char* type, int button_number);
@@ -13,41 +22,99 @@ extern void app_notify_button_event(const char* type, int button_number);
 #define EVENT_QUEUE_LEN 10
 
 static QueueHandle_t event_queue;
+static uint8_t queue_peak;
 
 static void bt_event_task(void *arg) {
     button_event_t evt;
-    char msg[32];
-    
+
     while (1) {
-        if (xQueueReceive(event_queue, &evt, portMAX_DELAY)) {
-            const char* type_str = (evt.type == BUTTON_EVENT_SHORT) ? "short" : "long";
-            int button_index = get_button_index(evt.button_number);
-            if (button_index < 0) {
-                ESP_LOGW(TAG, "Button index not found for GPIO %d", evt.button_number);
-                continue;
-            }
-            button_index++; // Convert to 1-based index for user-friendly output
-            snprintf(msg, sizeof(msg), "%s:%d", type_str, button_index);
-            ESP_LOGI(TAG, "Sending BLE event: %s", msg);
-            send_ble_message(msg);
+        if (xQueueReceive(event_queue, &evt, ble_tx_next_timeout()) && evt.type != BUTTON_EVENT_NONE) {
+            // Collect everything that arrives until the flush deadline, so chords and
+            // repeats leave in one notification instead of one per event.
+            TickType_t start = xTaskGetTickCount();
+            TickType_t window = pdMS_TO_TICKS(CONFIG_BT_EVENT_FLUSH_DEADLINE_MS);
+
+            do {
+                if (evt.type == BUTTON_EVENT_NONE) {
+                    continue;
+                }
+                int64_t dequeued_us = esp_timer_get_time();
+                UBaseType_t depth = uxQueueMessagesWaiting(event_queue) + 1;
+                if (depth > queue_peak) {
+                    queue_peak = depth;
+                }
+                bt_latency_record(BT_LATENCY_QUEUE_TO_DEQUEUE, evt.queued_us, dequeued_us);
+                int button_index = get_button_index(evt.button_number);
+                if (button_index < 0) {
+                    BT_TRACE(EVT, WARN, EVT_BAD_BUTTON, evt.button_number, 0);
+                    continue;
+                }
+                button_index++; // Convert to 1-based index for user-friendly output
+                ble_beacon_send(evt.type, button_index);    // Ahead of GATT: needs no connection
+                ble_tx_enqueue(evt.type, button_index, evt.edge_us, dequeued_us);
+                if (ble_tx_batch_full()) {
+                    break;
+                }
+            } while (xQueueReceive(event_queue, &evt, window - MIN(window, xTaskGetTickCount() - start)));
         }
+        ble_tx_process();
+        bt_pm_check_press();
     }
 }
 
 void bt_event_task_start(void) {
+    if (!ble_tx_init()) {
+        return;
+    }
     event_queue = xQueueCreate(EVENT_QUEUE_LEN, sizeof(button_event_t));
     if (event_queue == NULL) {
         ESP_LOGE(TAG, "Failed to create event queue");
         return;
     }
-    xTaskCreate(bt_event_task, "bt_event_task", 4096, NULL, 10, NULL);
+    xTaskCreatePinnedToCore(bt_event_task, "bt_event_task", 4096, NULL, BT_SCHED_EVENT_TASK_PRIO, NULL,
+                            bt_sched_affinity(BT_SCHED_EVENT_TASK_CORE));
 }
 
-bool bt_event_send(button_event_type_t type, int button_number) {
+bool IRAM_ATTR bt_event_send(button_event_type_t type, int button_number, int64_t edge_us) {
     if (!event_queue) return false;
     button_event_t evt = {
         .type = type,
-        .button_number = button_number
+        .button_number = button_number,
+        .edge_us = edge_us,
+        .queued_us = esp_timer_get_time(),
     };
-    return xQueueSend(event_queue, &evt, 0) == pdTRUE;
+    bt_latency_record(BT_LATENCY_EDGE_TO_QUEUE, edge_us, evt.queued_us);
+    // Called from the button ISR; the FromISR variant also wakes the event task right away
+    BaseType_t sent;
+    if (xPortInIsrContext()) {
+        BaseType_t woken = pdFALSE;
+        sent = xQueueSendFromISR(event_queue, &evt, &woken);
+        if (woken) {
+            portYIELD_FROM_ISR();
+        }
+    } else {
+        sent = xQueueSend(event_queue, &evt, 0);
+    }
+    if (sent != pdTRUE) {
+        BT_TRACE(EVT, WARN, EVT_QUEUE_FULL, button_number, 0);
+        return false;
+    }
+    return true;
+}
+
+void bt_event_wake(void) {
+    if (!event_queue) return;
+    button_event_t evt = {
+        .type = BUTTON_EVENT_NONE,
+    };
+    xQueueSend(event_queue, &evt, 0);
+}
+
+void bt_event_get_queue_depth(uint8_t *depth, uint8_t *peak) {
+    *depth = event_queue ? uxQueueMessagesWaiting(event_queue) : 0;
+    *peak = queue_peak;
+}
+
+void bt_event_reset_queue_peak(void) {
+    queue_peak = 0;
 }
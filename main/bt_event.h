@@ -5,18 +5,56 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef enum {
     BUTTON_EVENT_SHORT,
-    BUTTON_EVENT_LONG
+    BUTTON_EVENT_LONG,
+    BUTTON_EVENT_NONE,  // Internal: wakes the event task to send pending events
 } button_event_type_t;
 
 typedef struct {
     button_event_type_t type;
     int button_number;
+    int64_t edge_us;    // esp_timer time of the GPIO edge that completed the press
+    int64_t queued_us;  // esp_timer time the event entered the queue
 } button_event_t;
 
 void bt_event_task_start(void);
-bool bt_event_send(button_event_type_t type, int button_number);
+
+/**
+ * @brief Queues a button event for the event task.
+ *
+ * Safe to call from the button ISR.
+ *
+ * @param type           Short or long press.
+ * @param button_number  GPIO number of the button.
+ * @param edge_us        esp_timer time of the GPIO edge, for latency accounting.
+ * @return true if the event was queued, false if the queue is full or not created.
+ */
+bool bt_event_send(button_event_type_t type, int button_number, int64_t edge_us);
+
+/**
+ * @brief Wakes the event task so it can send events that are waiting on the link.
+ *
+ * Called from BLE callbacks when a confirmation, ack or subscription frees up room
+ * for more events. Safe to call from any task.
+ */
+void bt_event_wake(void);
+
+/**
+ * @brief Reports how many events are waiting in the event queue and the highest depth seen.
+ *
+ * @param depth Output: events currently queued.
+ * @param peak  Output: highest depth observed by the event task since boot or the last reset.
+ */
+void bt_event_get_queue_depth(uint8_t *depth, uint8_t *peak);
+
+/**
+ * @brief Clears the event queue peak depth.
+ */
+void bt_event_reset_queue_peak(void);
 
 #ifdef __cplusplus
 }
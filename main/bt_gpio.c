@@ -17,6 +17,15 @@
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "bt_event.h"
+#include "bt_trace.h"
+#include "flight_rec.h"
+#include "bt_sched.h"
+#include "ble_conn_params.h"
+#include "ble_adv.h"
+#include "bt_pm.h"
+#ifdef CONFIG_PM_ENABLE
+#include "hal/gpio_ll.h"
+#endif
 
 
 #define NUM_BUTTONS 4
@@ -33,7 +42,7 @@ static const gpio_num_t button_gpios[NUM_BUTTONS] = {
 static const char *TAG = "BUTTONS";
 
 // Typedef for callback
-typedef void (*button_cb_t)(gpio_num_t gpio, bool long_press);
+typedef void (*button_cb_t)(gpio_num_t gpio, bool long_press, int64_t edge_us);
 
 // User-provided callback
 static button_cb_t user_button_callback = NULL;
@@ -48,12 +57,32 @@ typedef struct {
 
 static button_state_t button_states[NUM_BUTTONS];
 
+#ifdef CONFIG_PM_ENABLE
+// Level interrupts that follow the pin fire on both edges, and unlike edge interrupts they
+// also wake the chip from light sleep. The wakeup is enabled once, in init_buttons(), and
+// follows the interrupt type.
+#define BUTTON_INTR_TYPE GPIO_INTR_DISABLE      // Armed once the handler is in place
+#define LEVEL_INTR_TYPE(level) ((level) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL)
+
+// Arms the interrupt for the level the pin is not at. The driver's calls are not safe in
+// an IRAM ISR, so this goes to the register directly.
+static inline void IRAM_ATTR follow_level(gpio_num_t gpio, int level) {
+    gpio_ll_set_intr_type(GPIO_LL_GET_HW(GPIO_PORT_0), gpio, LEVEL_INTR_TYPE(level));
+}
+#else
+#define BUTTON_INTR_TYPE GPIO_INTR_ANYEDGE
+
+static inline void follow_level(gpio_num_t gpio, int level) {
+}
+#endif // CONFIG_PM_ENABLE
+
 static void IRAM_ATTR button_isr_handler(void *arg) {
     gpio_num_t gpio = (gpio_num_t)(uint32_t)arg;
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
     int index = -1;
     static int64_t last_isr_time[NUM_BUTTONS] = {0};
-    int64_t now = esp_timer_get_time() / 1000; // ms
+    int64_t edge_us = esp_timer_get_time();
+    int64_t now = edge_us / 1000; // ms
     const int DEBOUNCE_TIME_MS = 20;
 
     for (int i = 0; i < NUM_BUTTONS; i++) {
@@ -63,17 +92,29 @@ static void IRAM_ATTR button_isr_handler(void *arg) {
         }
     }
     if (index < 0) return;
+
+    // Re-armed before anything else, or the level interrupt would fire again at once
+    int level = gpio_get_level(gpio);
+    follow_level(gpio, level);
+    BT_TRACE(GPIO, DEBUG, GPIO_EDGE, gpio, level);
     
     // Debounce logic
     if ((now - last_isr_time[index]) < DEBOUNCE_TIME_MS) {
         return; // Ignore due to debounce
     }
     last_isr_time[index] = now;
+    // Full speed from here until the event is handed to the stack
+    bt_pm_on_edge_from_isr();
+    flight_rec_log(FLIGHT_REC_BUTTON_EDGE, gpio, level, 0);
 
-    if (gpio_get_level(gpio) == 0) {  // Falling edge = press
+    if (level == 0) {  // Falling edge = press
         button_states[index].press_time = esp_timer_get_time() / 1000; // ms
         button_states[index].long_press_triggered = false;
         xTimerStartFromISR(button_states[index].timer, &xHigherPriorityTaskWoken);
+        // Start the switch to the fast interval while the button is still down
+        ble_conn_params_on_activity_from_isr();
+        // Or, while disconnected, go back to the fastest advertising
+        ble_adv_on_activity_from_isr();
     } else {  // Rising edge = release
         xTimerStopFromISR(button_states[index].timer, &xHigherPriorityTaskWoken);
 
@@ -81,11 +122,11 @@ static void IRAM_ATTR button_isr_handler(void *arg) {
         int64_t now = esp_timer_get_time() / 1000;
         if (button_states[index].long_press_triggered) {
             if (user_button_callback) {
-                user_button_callback(gpio, true); // long press
+                user_button_callback(gpio, true, edge_us); // long press
             }
         } else if ((now - button_states[index].press_time) < LONG_PRESS_TIME_MS) {
             if (user_button_callback) {
-                user_button_callback(gpio, false); // short press
+                user_button_callback(gpio, false, edge_us); // short press
             }
         }
     }
@@ -105,14 +146,22 @@ static void long_press_timer_callback(TimerHandle_t xTimer) {
         }
     }
 }
-static void button_event_handler(gpio_num_t gpio, bool long_press) {
+static void IRAM_ATTR button_event_handler(gpio_num_t gpio, bool long_press, int64_t edge_us) {
     // ESP_LOGI("BTN_EVT", "GPIO %d %s press", (uint16_t)gpio, long_press ? "LONG" : "SHORT");
 
     // Do something like send Bluetooth command
     if (long_press) {
-        bt_event_send(BUTTON_EVENT_LONG, gpio);
+        bt_event_send(BUTTON_EVENT_LONG, gpio, edge_us);
     } else {
-        bt_event_send(BUTTON_EVENT_SHORT, gpio);
+        bt_event_send(BUTTON_EVENT_SHORT, gpio, edge_us);
+    }
+}
+
+// The GPIO interrupt is allocated on the core that installs the ISR service
+static void install_isr_service(void *arg) {
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Failed to install GPIO ISR service: %s", esp_err_to_name(err));
     }
 }
 
@@ -120,7 +169,9 @@ void init_buttons(void) {
     user_button_callback = button_event_handler; // Set the user callback
 
     // Install ISR service only once
-    gpio_install_isr_service(0);
+    if (bt_sched_call_on_core(BT_SCHED_BUTTON_ISR_CORE, install_isr_service, NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to install GPIO ISR service on core %d", BT_SCHED_BUTTON_ISR_CORE);
+    }
 
     for (int i = 0; i < NUM_BUTTONS; i++) {
         gpio_num_t gpio = button_gpios[i];
@@ -139,16 +190,30 @@ void init_buttons(void) {
             .mode = GPIO_MODE_INPUT,
             .pull_up_en = GPIO_PULLUP_ENABLE,
             .pull_down_en = GPIO_PULLDOWN_DISABLE,
-            .intr_type = GPIO_INTR_ANYEDGE
+            .intr_type = BUTTON_INTR_TYPE
         };
         gpio_config(&io_conf);
 
         gpio_isr_handler_add(gpio, button_isr_handler, (void *)(uint32_t)gpio);
+#ifdef CONFIG_PM_ENABLE
+        // Armed once the handler is in place, so a button held at boot cannot storm
+        gpio_wakeup_enable(gpio, LEVEL_INTR_TYPE(gpio_get_level(gpio)));
+        gpio_intr_enable(gpio);
+#endif
     }
 
     ESP_LOGI(TAG, "Buttons initialized");
 }
  
+bool bt_gpio_any_pressed(void) {
+    for (int i = 0; i < NUM_BUTTONS; i++) {
+        if (gpio_get_level(button_gpios[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int get_button_index(gpio_num_t gpio) {
     for (int i = 0; i < NUM_BUTTONS; i++) {
         if (button_gpios[i] == gpio) {
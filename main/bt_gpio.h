@@ -4,6 +4,7 @@
 // bt_gpio.h - GPIO control for Bluetooth door key project
 
 
+#include <stdbool.h>
 #include "driver/gpio.h"
 
 #ifdef __cplusplus
@@ -31,6 +32,11 @@ void init_buttons(void);
  */
 int get_button_index(gpio_num_t gpio);
 
+/**
+ * @brief Returns true if any button is held down.
+ */
+bool bt_gpio_any_pressed(void);
+
 #ifdef __cplusplus
 }
 #endif
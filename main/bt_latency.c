@@ -0,0 +1,83 @@
+/**
+ * @file bt_latency.c
+ * @brief Fixed-bucket log2 latency histograms.
+ *
+ * Counters are plain static words updated with relaxed atomics, so recording a sample
+ * never allocates, never takes a lock, and is safe from the button ISR.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "bt_latency.h"
+
+#define TAG "BT_LATENCY"
+
+static const char *const stage_names[BT_LATENCY_STAGE_COUNT] = {
+    [BT_LATENCY_EDGE_TO_QUEUE] = "edge->queue",
+    [BT_LATENCY_QUEUE_TO_DEQUEUE] = "queue->dequeue",
+    [BT_LATENCY_DEQUEUE_TO_SEND] = "dequeue->send",
+    [BT_LATENCY_SEND_TO_CONF] = "send->conf",
+    [BT_LATENCY_EDGE_TO_CONF] = "edge->conf",
+};
+
+static DRAM_ATTR uint32_t histograms[BT_LATENCY_STAGE_COUNT][BT_LATENCY_BUCKETS];
+
+static inline int bucket_for(uint64_t us) {
+    uint32_t clamped = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    int bucket = clamped > 0 ? 31 - __builtin_clz(clamped) : 0;
+    return bucket < BT_LATENCY_BUCKETS ? bucket : BT_LATENCY_BUCKETS - 1;
+}
+
+void IRAM_ATTR bt_latency_record(bt_latency_stage_t stage, int64_t start_us, int64_t end_us) {
+    if (stage >= BT_LATENCY_STAGE_COUNT || start_us == 0 || end_us < start_us) {
+        return;
+    }
+    __atomic_fetch_add(&histograms[stage][bucket_for(end_us - start_us)], 1, __ATOMIC_RELAXED);
+}
+
+void bt_latency_reset(void) {
+    for (int stage = 0; stage < BT_LATENCY_STAGE_COUNT; stage++) {
+        for (int bucket = 0; bucket < BT_LATENCY_BUCKETS; bucket++) {
+            __atomic_store_n(&histograms[stage][bucket], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+size_t bt_latency_serialize(uint8_t *buf, size_t len) {
+    size_t needed = 2 + BT_LATENCY_STAGE_COUNT * BT_LATENCY_BUCKETS * sizeof(uint32_t);
+    if (len < needed) {
+        return 0;
+    }
+
+    uint8_t *p = buf;
+    *p++ = BT_LATENCY_STAGE_COUNT;
+    *p++ = BT_LATENCY_BUCKETS;
+    for (int stage = 0; stage < BT_LATENCY_STAGE_COUNT; stage++) {
+        for (int bucket = 0; bucket < BT_LATENCY_BUCKETS; bucket++) {
+            uint32_t count = __atomic_load_n(&histograms[stage][bucket], __ATOMIC_RELAXED);
+            *p++ = count & 0xFF;
+            *p++ = (count >> 8) & 0xFF;
+            *p++ = (count >> 16) & 0xFF;
+            *p++ = (count >> 24) & 0xFF;
+        }
+    }
+    return needed;
+}
+
+void bt_latency_dump(void) {
+    for (int stage = 0; stage < BT_LATENCY_STAGE_COUNT; stage++) {
+        uint32_t total = 0;
+        for (int bucket = 0; bucket < BT_LATENCY_BUCKETS; bucket++) {
+            total += __atomic_load_n(&histograms[stage][bucket], __ATOMIC_RELAXED);
+        }
+        ESP_LOGI(TAG, "%s: %lu samples", stage_names[stage], (unsigned long)total);
+        for (int bucket = 0; bucket < BT_LATENCY_BUCKETS; bucket++) {
+            uint32_t count = __atomic_load_n(&histograms[stage][bucket], __ATOMIC_RELAXED);
+            if (count > 0) {
+                ESP_LOGI(TAG, "  >= %8lu us: %lu", bucket > 0 ? 1UL << bucket : 0UL, (unsigned long)count);
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef BT_LATENCY_H
+#define BT_LATENCY_H
+
+// bt_latency.h - Per-stage latency histograms for the button event pipeline
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BT_LATENCY_BUCKETS  24  // Bucket i counts samples in [2^i, 2^(i+1)) us, the last one is open-ended
+
+typedef enum {
+    BT_LATENCY_EDGE_TO_QUEUE,       // ISR edge -> event queued
+    BT_LATENCY_QUEUE_TO_DEQUEUE,    // Event queued -> dequeued in bt_event_task()
+    BT_LATENCY_DEQUEUE_TO_SEND,     // Dequeued -> handed to send_ble_message()
+    BT_LATENCY_SEND_TO_CONF,        // send_ble_message() -> ESP_GATTS_CONF_EVT
+    BT_LATENCY_EDGE_TO_CONF,        // End to end
+    BT_LATENCY_STAGE_COUNT
+} bt_latency_stage_t;
+
+/**
+ * @brief Adds one sample to a stage histogram.
+ *
+ * Lock-free and allocation-free; safe to call from any task or ISR.
+ *
+ * @param stage     Pipeline stage the interval belongs to.
+ * @param start_us  esp_timer time at the start of the stage. Samples with a zero start are ignored.
+ * @param end_us    esp_timer time at the end of the stage.
+ */
+void bt_latency_record(bt_latency_stage_t stage, int64_t start_us, int64_t end_us);
+
+/**
+ * @brief Clears all histograms.
+ */
+void bt_latency_reset(void);
+
+/**
+ * @brief Serializes all histograms for the diagnostics characteristic.
+ *
+ * Layout: one byte stage count, one byte bucket count, then stage-major little-endian
+ * uint32 bucket counters.
+ *
+ * @param buf Output buffer.
+ * @param len Size of the output buffer.
+ * @return Number of bytes written, or 0 if the buffer is too small.
+ */
+size_t bt_latency_serialize(uint8_t *buf, size_t len);
+
+/**
+ * @brief Prints all non-empty histograms to the console.
+ */
+void bt_latency_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_LATENCY_H
@@ -0,0 +1,341 @@
+/**
+ * @file bt_pm.c
+ * @brief esp_pm locks held while a press is on its way out and while the BLE host works.
+ *
+ * Both holds take the same two counted locks, ESP_PM_CPU_FREQ_MAX and
+ * ESP_PM_NO_LIGHT_SLEEP, so either one keeps the CPU fast and awake. The press hold is
+ * taken in the button ISR, which the edge itself wakes from light sleep, and ended by
+ * the event task once the event is handed to the stack; a timer checks again while it
+ * is on, for presses that end without an event. The BLE hold is restarted by every host
+ * event and ends CONFIG_BT_PM_BLE_HOLD_MS after the last one.
+ *
+ * In measure mode every other press hold is kept without the locks, and the
+ * edge-to-send latency of each event is recorded against the hold it was sent in.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#endif
+#include "bt_pm.h"
+#include "bt_gpio.h"
+#include "ble_tx.h"
+
+#define TAG "BT_PM"
+
+#define PRESS_CHECK_TICKS   pdMS_TO_TICKS(100)
+#define BLE_HOLD_TICKS      pdMS_TO_TICKS(CONFIG_BT_PM_BLE_HOLD_MS)
+#ifdef CONFIG_BT_PM_MEASURE
+#define MEASURE             true
+#else
+#define MEASURE             false
+#endif
+#define FLAG_PM_ENABLE      0x01
+#define FLAG_MEASURE        0x02
+
+typedef enum {
+    GROUP_LOCKED,           // Presses with the locks
+    GROUP_FREE,             // Presses without them, in measure mode
+    GROUP_COUNT
+} group_t;
+
+typedef struct {
+    uint32_t events;
+    uint64_t total_us;
+    uint32_t max_us;
+} latency_t;
+
+static portMUX_TYPE pm_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool press_hold;
+static bool press_locked;           // The press hold took the locks
+static int64_t press_since_us;
+static uint32_t edges;              // Accepted edges, so a check does not end a hold an edge just extended
+static uint32_t press_holds;
+static bool ble_hold;
+static TickType_t ble_activity_at;
+static uint8_t holds;               // Holds on, of either kind
+static int64_t held_since_us;
+static int64_t held_us;             // Time with a hold on, up to held_since_us
+static int64_t reset_us;
+static latency_t latency[GROUP_COUNT];
+static TimerHandle_t press_timer;
+static TimerHandle_t ble_timer;
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t cpu_lock;
+static esp_pm_lock_handle_t sleep_lock;
+#endif
+
+static void IRAM_ATTR lock(void) {
+#ifdef CONFIG_PM_ENABLE
+    if (cpu_lock != NULL) {
+        esp_pm_lock_acquire(cpu_lock);
+        esp_pm_lock_acquire(sleep_lock);
+    }
+#endif
+}
+
+static void unlock(void) {
+#ifdef CONFIG_PM_ENABLE
+    if (cpu_lock != NULL) {
+        esp_pm_lock_release(sleep_lock);
+        esp_pm_lock_release(cpu_lock);
+    }
+#endif
+}
+
+// Call with pm_mux held
+static void IRAM_ATTR hold_on(int64_t now_us) {
+    if (holds++ == 0) {
+        held_since_us = now_us;
+    }
+}
+
+// Call with pm_mux held
+static void hold_off(int64_t now_us) {
+    if (--holds == 0) {
+        held_us += now_us - held_since_us;
+    }
+}
+
+void IRAM_ATTR bt_pm_on_edge_from_isr(void) {
+    int64_t now_us = esp_timer_get_time();
+    bool started = false;
+    bool locked = false;
+
+    portENTER_CRITICAL_ISR(&pm_mux);
+    edges++;
+    if (!press_hold) {
+        press_hold = started = true;
+        press_locked = locked = !MEASURE || (press_holds & 1) == 0;
+        press_holds++;
+        press_since_us = now_us;
+        hold_on(now_us);
+    }
+    portEXIT_CRITICAL_ISR(&pm_mux);
+
+    if (locked) {
+        lock();
+    }
+    if (started && press_timer != NULL) {
+        BaseType_t woken = pdFALSE;
+        xTimerStartFromISR(press_timer, &woken);
+        if (woken) {
+            portYIELD_FROM_ISR();
+        }
+    }
+}
+
+void bt_pm_check_press(void) {
+    portENTER_CRITICAL(&pm_mux);
+    bool on = press_hold;
+    uint32_t seen = edges;
+    portEXIT_CRITICAL(&pm_mux);
+
+    if (!on || bt_gpio_any_pressed() || ble_tx_unsent()) {
+        return;
+    }
+
+    bool ended = false;
+    bool locked = false;
+    portENTER_CRITICAL(&pm_mux);
+    if (press_hold && edges == seen) {
+        press_hold = false;
+        ended = true;
+        locked = press_locked;
+        hold_off(esp_timer_get_time());
+    }
+    portEXIT_CRITICAL(&pm_mux);
+
+    if (ended) {
+        xTimerStop(press_timer, 0);
+    }
+    if (locked) {
+        unlock();
+    }
+}
+
+void bt_pm_on_event_sent(int64_t edge_us, int64_t sent_us) {
+    portENTER_CRITICAL(&pm_mux);
+    // Events that waited for a phone to connect say nothing about the clock
+    if (press_hold && edge_us >= press_since_us && sent_us >= edge_us) {
+        latency_t *l = &latency[press_locked ? GROUP_LOCKED : GROUP_FREE];
+        uint32_t us = sent_us - edge_us;
+        l->events++;
+        l->total_us += us;
+        if (us > l->max_us) {
+            l->max_us = us;
+        }
+    }
+    portEXIT_CRITICAL(&pm_mux);
+}
+
+void bt_pm_on_ble_activity(void) {
+    bool started = false;
+
+    portENTER_CRITICAL(&pm_mux);
+    ble_activity_at = xTaskGetTickCount();
+    if (!ble_hold) {
+        ble_hold = started = true;
+        hold_on(esp_timer_get_time());
+    }
+    portEXIT_CRITICAL(&pm_mux);
+
+    if (started) {
+        lock();
+    }
+    if (ble_timer != NULL) {
+        xTimerReset(ble_timer, 0);
+    }
+}
+
+static void press_timer_callback(TimerHandle_t timer) {
+    bt_pm_check_press();
+}
+
+static void ble_timer_callback(TimerHandle_t timer) {
+    bool ended = false;
+
+    portENTER_CRITICAL(&pm_mux);
+    // Activity since the timer fired has restarted it
+    if (ble_hold && xTaskGetTickCount() - ble_activity_at >= BLE_HOLD_TICKS) {
+        ble_hold = false;
+        ended = true;
+        hold_off(esp_timer_get_time());
+    }
+    portEXIT_CRITICAL(&pm_mux);
+
+    if (ended) {
+        unlock();
+    }
+}
+
+esp_err_t bt_pm_init(void) {
+    reset_us = esp_timer_get_time();
+    press_timer = xTimerCreate("pm_press", PRESS_CHECK_TICKS, pdTRUE, NULL, press_timer_callback);
+    ble_timer = xTimerCreate("pm_ble", BLE_HOLD_TICKS, pdFALSE, NULL, ble_timer_callback);
+    if (press_timer == NULL || ble_timer == NULL) {
+        ESP_LOGE(TAG, "Failed to create the hold timers");
+        return ESP_ERR_NO_MEM;
+    }
+
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_config_t config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_BT_PM_MIN_FREQ_MHZ,
+#ifdef CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true,
+#endif
+    };
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure power management: %s", esp_err_to_name(err));
+        return err;
+    }
+    esp_pm_lock_handle_t cpu, sleep;
+    if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "bt_cpu", &cpu) != ESP_OK ||
+        esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "bt_awake", &sleep) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create the power management locks");
+        return ESP_ERR_NO_MEM;
+    }
+    sleep_lock = sleep;
+    cpu_lock = cpu;     // Last: the ISR uses the locks once this is set
+    // The buttons wake the chip with level interrupts, see init_buttons()
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+    ESP_LOGI(TAG, "CPU %d-%d MHz, light sleep %s%s", config.min_freq_mhz, config.max_freq_mhz,
+             config.light_sleep_enable ? "on" : "off", MEASURE ? ", measuring" : "");
+#endif
+    return ESP_OK;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+    *p++ = v & 0xFF;
+    *p++ = (v >> 8) & 0xFF;
+    *p++ = (v >> 16) & 0xFF;
+    *p++ = v >> 24;
+    return p;
+}
+
+// Copies the counters, with the time up to now
+static void snapshot(int64_t *total_us, int64_t *busy_us, latency_t out[GROUP_COUNT]) {
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&pm_mux);
+    *total_us = now_us - reset_us;
+    *busy_us = held_us + (holds > 0 ? now_us - held_since_us : 0);
+    memcpy(out, latency, sizeof(latency));
+    portEXIT_CRITICAL(&pm_mux);
+}
+
+static uint32_t mean_us(const latency_t *l) {
+    return l->events > 0 ? l->total_us / l->events : 0;
+}
+
+size_t bt_pm_serialize(uint8_t *buf, size_t len) {
+    size_t needed = 1 + 8 + GROUP_COUNT * 12;
+    int64_t total_us, busy_us;
+    latency_t copy[GROUP_COUNT];
+
+    if (len < needed) {
+        return 0;
+    }
+    snapshot(&total_us, &busy_us, copy);
+
+    uint8_t *p = buf;
+#ifdef CONFIG_PM_ENABLE
+    *p++ = FLAG_PM_ENABLE | (MEASURE ? FLAG_MEASURE : 0);
+#else
+    *p++ = MEASURE ? FLAG_MEASURE : 0;
+#endif
+    p = put_u32(p, total_us / 1000);
+    p = put_u32(p, busy_us / 1000);
+    for (int g = 0; g < GROUP_COUNT; g++) {
+        p = put_u32(p, copy[g].events);
+        p = put_u32(p, mean_us(&copy[g]));
+        p = put_u32(p, copy[g].max_us);
+    }
+    return p - buf;
+}
+
+void bt_pm_dump(void) {
+    int64_t total_us, busy_us;
+    latency_t copy[GROUP_COUNT];
+
+    snapshot(&total_us, &busy_us, copy);
+    uint32_t free_permille = total_us > 0 ? (total_us - busy_us) * 1000 / total_us : 0;
+    ESP_LOGI(TAG, "Clock free to drop %lu.%lu%% of %lld s", (unsigned long)free_permille / 10,
+             (unsigned long)free_permille % 10, (long long)(total_us / 1000000));
+    ESP_LOGI(TAG, "Presses with locks: %lu, edge to send mean %lu us, max %lu us",
+             (unsigned long)copy[GROUP_LOCKED].events, (unsigned long)mean_us(&copy[GROUP_LOCKED]),
+             (unsigned long)copy[GROUP_LOCKED].max_us);
+    if (MEASURE) {
+        ESP_LOGI(TAG, "Presses without: %lu, edge to send mean %lu us, max %lu us",
+                 (unsigned long)copy[GROUP_FREE].events, (unsigned long)mean_us(&copy[GROUP_FREE]),
+                 (unsigned long)copy[GROUP_FREE].max_us);
+        if (copy[GROUP_LOCKED].events > 0 && copy[GROUP_FREE].events > 0) {
+            ESP_LOGI(TAG, "Power saving adds %ld us per press without the locks",
+                     (long)mean_us(&copy[GROUP_FREE]) - (long)mean_us(&copy[GROUP_LOCKED]));
+        }
+    }
+#ifdef CONFIG_PM_PROFILING
+    esp_pm_dump_locks(stdout);
+#endif
+}
+
+void bt_pm_reset(void) {
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&pm_mux);
+    reset_us = now_us;
+    held_us = 0;
+    held_since_us = now_us;
+    memset(latency, 0, sizeof(latency));
+    portEXIT_CRITICAL(&pm_mux);
+}
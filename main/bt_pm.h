@@ -0,0 +1,90 @@
+#ifndef BT_PM_H
+#define BT_PM_H
+
+// bt_pm.h - Power management around the press path and the BLE host
+//
+// With PM_ENABLE (the sdkconfig.pm profile) the CPU drops to CONFIG_BT_PM_MIN_FREQ_MHZ
+// and sleeps between connection events, except while one of two holds is on:
+//   - press: from a button edge until no button is down and no event waits to be
+//     handed to the stack for a subscribed phone,
+//   - BLE: for CONFIG_BT_PM_BLE_HOLD_MS after each BLE host event.
+// Each hold keeps the CPU at full speed and out of light sleep with esp_pm locks. A
+// button edge wakes the chip from light sleep. Without PM_ENABLE the holds are only
+// timed, for diagnostics page 6.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Configures frequency scaling and light sleep and creates the locks and timers.
+ *
+ * Call before the buttons and the BLE stack are initialized.
+ *
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NO_MEM: If a lock or timer could not be created.
+ *     - Other error codes from esp_pm_configure().
+ */
+esp_err_t bt_pm_init(void);
+
+/**
+ * @brief Starts the press hold, or extends it. Called from the button ISR on every
+ * accepted edge.
+ */
+void bt_pm_on_edge_from_isr(void);
+
+/**
+ * @brief Ends the press hold if no button is down and nothing waits to be sent.
+ *
+ * Called by the event task after each send pass; a timer also checks while the hold is on.
+ */
+void bt_pm_check_press(void);
+
+/**
+ * @brief Records the latency of an event handed to the stack for the first time.
+ *
+ * @param edge_us esp_timer time of the GPIO edge.
+ * @param sent_us esp_timer time the event was handed to the stack.
+ */
+void bt_pm_on_event_sent(int64_t edge_us, int64_t sent_us);
+
+/**
+ * @brief Starts or extends the BLE hold. Called for every BLE host event.
+ */
+void bt_pm_on_ble_activity(void);
+
+/**
+ * @brief Serializes hold times and press latencies for the diagnostics characteristic.
+ *
+ * Layout (little-endian):
+ *   u8  flags: bit 0 PM_ENABLE, bit 1 CONFIG_BT_PM_MEASURE
+ *   u32 time since boot or reset (ms), u32 of it with a hold on (ms)
+ *   then for presses with the locks and presses without them (measure mode only):
+ *       u32 events, u32 mean edge-to-send latency (us), u32 maximum (us)
+ *
+ * @param buf Output buffer.
+ * @param len Size of the output buffer.
+ * @return Number of bytes written, or 0 if the buffer is too small.
+ */
+size_t bt_pm_serialize(uint8_t *buf, size_t len);
+
+/**
+ * @brief Logs hold times, press latencies and, with PM_PROFILING, the esp_pm mode statistics.
+ */
+void bt_pm_dump(void);
+
+/**
+ * @brief Clears the counters.
+ */
+void bt_pm_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_PM_H
@@ -0,0 +1,260 @@
+/**
+ * @file bt_prov.c
+ * @brief Applies provisioning batches written over BLE to the paired-device registry.
+ *
+ * A batch is checked as a whole first, so a malformed one is rejected before anything
+ * is written. It is then applied in the timer service task as one data_storage batch:
+ * one NVS handle, one commit, and one cache update that the accept list follows.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "bt_prov.h"
+#include "data_storage.h"
+#include "ble_beacon.h"
+
+#define TAG "BT_PROV"
+
+#define REQUEST_MAX_LEN     512     // Longest value of the characteristic
+#define RESULT_MAX_LEN      512
+#define MAX_DEVICES         CONFIG_BT_PROV_MAX_DEVICES
+#define PEND_TIMEOUT_TICKS  pdMS_TO_TICKS(100)
+
+_Static_assert(BT_PROV_KEY_LEN == BT_DEVICE_KEY_LEN, "provisioned keys are stored as they are");
+_Static_assert(BT_PROV_NAME_MAX <= BT_DEVICE_NAME_MAX, "a batch takes every name an item can carry");
+
+typedef struct {
+    uint8_t op;
+    esp_bd_addr_t mac;
+    char name[BT_PROV_NAME_MAX + 1];
+    uint8_t key[BT_PROV_KEY_LEN];
+    uint8_t start;                  // First position of a list
+} item_t;
+
+static portMUX_TYPE prov_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool pending;                // A batch is being applied; it owns request and result
+
+static uint8_t request[REQUEST_MAX_LEN];
+static size_t request_len;
+static uint8_t result[RESULT_MAX_LEN] = { BT_PROV_BATCH_NONE, 0 };
+static size_t result_len = 2;
+
+// Returns the bytes the item takes up, or 0 if it is malformed
+static size_t parse_item(const uint8_t *data, size_t len, item_t *item) {
+    size_t used = 1;
+
+    memset(item, 0, sizeof(*item));
+    item->op = data[0];
+    switch (item->op) {
+        case BT_PROV_OP_ADD:
+        case BT_PROV_OP_RENAME:
+            if (len < used + ESP_BD_ADDR_LEN + 1) {
+                return 0;
+            }
+            memcpy(item->mac, &data[used], ESP_BD_ADDR_LEN);
+            used += ESP_BD_ADDR_LEN;
+            uint8_t name_len = data[used++];
+            if (name_len > BT_PROV_NAME_MAX || len < used + name_len) {
+                return 0;
+            }
+            memcpy(item->name, &data[used], name_len);
+            return used + name_len;
+        case BT_PROV_OP_REMOVE:
+            if (len < used + ESP_BD_ADDR_LEN) {
+                return 0;
+            }
+            memcpy(item->mac, &data[used], ESP_BD_ADDR_LEN);
+            return used + ESP_BD_ADDR_LEN;
+        case BT_PROV_OP_KEY:
+            if (len < used + ESP_BD_ADDR_LEN + BT_PROV_KEY_LEN) {
+                return 0;
+            }
+            memcpy(item->mac, &data[used], ESP_BD_ADDR_LEN);
+            used += ESP_BD_ADDR_LEN;
+            memcpy(item->key, &data[used], BT_PROV_KEY_LEN);
+            return used + BT_PROV_KEY_LEN;
+        case BT_PROV_OP_LIST:
+            if (len < used + 1) {
+                return 0;
+            }
+            item->start = data[used];
+            return used + 1;
+        case BT_PROV_OP_CLEAR:
+            return used;
+        default:
+            return 0;
+    }
+}
+
+static uint8_t item_status(esp_err_t err) {
+    switch (err) {
+        case ESP_OK:
+            return BT_PROV_ITEM_OK;
+        case ESP_ERR_NVS_NOT_FOUND:
+            return BT_PROV_ITEM_NOT_FOUND;
+        case ESP_ERR_NO_MEM:
+            return BT_PROV_ITEM_FULL;
+        default:
+            return BT_PROV_ITEM_FAILED;
+    }
+}
+
+// Lists the stored phones from item->start into out, leaving room bytes at most
+static size_t list_devices(const item_t *item, uint8_t *out, size_t room) {
+    int total = bt_device_batch_size();
+    size_t pos = 2;
+    uint8_t listed = 0;
+
+    for (int i = item->start; i < total; i++) {
+        esp_bd_addr_t mac;
+        char name[BT_PROV_NAME_MAX + 1];
+        if (bt_device_batch_get(i, mac, name, sizeof(name)) != ESP_OK) {
+            name[0] = '\0';
+        }
+        size_t name_len = strlen(name);
+        if (pos + ESP_BD_ADDR_LEN + 1 + name_len > room) {
+            break;
+        }
+        memcpy(&out[pos], mac, ESP_BD_ADDR_LEN);
+        pos += ESP_BD_ADDR_LEN;
+        out[pos++] = name_len;
+        memcpy(&out[pos], name, name_len);
+        pos += name_len;
+        listed++;
+    }
+    out[0] = total > UINT8_MAX ? UINT8_MAX : total;
+    out[1] = listed;
+    return pos;
+}
+
+static void finish(void) {
+    portENTER_CRITICAL(&prov_mux);
+    pending = false;
+    portEXIT_CRITICAL(&prov_mux);
+}
+
+// Applies the batch in request; runs in the timer service task
+static void apply(void *arg1, uint32_t arg2) {
+    item_t item;
+    size_t offset = 0;
+    int count = 0;
+    bool malformed = false;
+
+    while (offset < request_len && !malformed) {
+        size_t used = parse_item(&request[offset], request_len - offset, &item);
+        malformed = used == 0 || count == BT_PROV_MAX_ITEMS;
+        offset += used;
+        result[2 + 2 * count] = item.op;
+        result[3 + 2 * count] = BT_PROV_ITEM_SKIPPED;
+        count++;
+    }
+    result[1] = count;
+    result_len = 2 + 2 * count;
+    if (malformed) {
+        ESP_LOGW(TAG, "Item %d of the batch is malformed, batch rejected", count - 1);
+        result[0] = BT_PROV_BATCH_REJECTED;
+        result[result_len - 1] = BT_PROV_ITEM_MALFORMED;
+        finish();
+        return;
+    }
+
+    esp_err_t err = bt_device_batch_begin(MAX_DEVICES);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open the device registry: %s", esp_err_to_name(err));
+        result[0] = BT_PROV_BATCH_FAILED;
+        finish();
+        return;
+    }
+
+    // Every item gets its opcode and status; a list also gets the bytes after them
+    offset = 0;
+    result_len = 2;
+    for (int i = 0; i < count; i++) {
+        offset += parse_item(&request[offset], request_len - offset, &item);
+        size_t at = result_len;
+        result_len += 2;
+        result[at] = item.op;
+        switch (item.op) {
+            case BT_PROV_OP_ADD:
+                err = bt_device_batch_add(item.mac, item.name);
+                break;
+            case BT_PROV_OP_REMOVE:
+                err = bt_device_batch_remove(item.mac);
+                break;
+            case BT_PROV_OP_RENAME:
+                err = bt_device_batch_rename(item.mac, item.name);
+                break;
+            case BT_PROV_OP_KEY:
+                err = bt_device_batch_set_key(item.mac, item.key);
+                break;
+            case BT_PROV_OP_LIST:
+                // Leave room for the opcodes and statuses of the items after it
+                result_len += list_devices(&item, &result[result_len],
+                                           sizeof(result) - result_len - 2 * (count - i - 1));
+                err = ESP_OK;
+                break;
+            default:
+                bt_device_batch_clear();
+                err = ESP_OK;
+                break;
+        }
+        result[at + 1] = item_status(err);
+    }
+
+    bool partial;
+    err = bt_device_batch_commit(&partial);
+    result[0] = err == ESP_OK ? BT_PROV_BATCH_DONE : partial ? BT_PROV_BATCH_PARTIAL : BT_PROV_BATCH_FAILED;
+    if (err == ESP_OK || partial) {
+        ble_beacon_load_keys();
+    }
+    ESP_LOGI(TAG, "Batch of %d items %s, %ld phones paired", count,
+             err == ESP_OK ? "committed" : partial ? "partly committed" : "failed", get_device_count_cache());
+    finish();
+}
+
+void bt_prov_write(const uint8_t *data, size_t len) {
+    if (len == 0 || len > sizeof(request)) {
+        ESP_LOGW(TAG, "Ignoring a batch of %u bytes", (unsigned)len);
+        return;
+    }
+
+    portENTER_CRITICAL(&prov_mux);
+    bool busy = pending;
+    pending = true;
+    portEXIT_CRITICAL(&prov_mux);
+    if (busy) {
+        ESP_LOGW(TAG, "Previous batch still being applied, batch dropped");
+        return;
+    }
+
+    memcpy(request, data, len);
+    request_len = len;
+    if (xTimerPendFunctionCall(apply, NULL, 0, PEND_TIMEOUT_TICKS) != pdPASS) {
+        ESP_LOGE(TAG, "Timer queue full, batch dropped");
+        result[0] = BT_PROV_BATCH_FAILED;
+        result[1] = 0;
+        result_len = 2;
+        finish();
+    }
+}
+
+size_t bt_prov_read(uint8_t *buf, size_t len) {
+    size_t out_len;
+
+    if (len < 2) {
+        return 0;
+    }
+    portENTER_CRITICAL(&prov_mux);
+    if (pending) {
+        buf[0] = BT_PROV_BATCH_PENDING;
+        buf[1] = 0;
+        out_len = 2;
+    } else {
+        out_len = result_len < len ? result_len : len;
+        memcpy(buf, result, out_len);
+    }
+    portEXIT_CRITICAL(&prov_mux);
+    return out_len;
+}
@@ -0,0 +1,93 @@
+#ifndef BT_PROV_H
+#define BT_PROV_H
+
+// bt_prov.h - Paired-phone provisioning served on the provisioning GATT characteristic
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The phone writes a batch of items to the provisioning characteristic, as one write or
+ * as a prepared (long) write of up to 512 bytes, and then reads the result. Addresses
+ * are 6 bytes, most significant first; names are 0 to BT_PROV_NAME_MAX bytes, not
+ * terminated.
+ *   0x01 add     address, name length, name   Adds a phone, or renames it if stored
+ *   0x02 remove  address
+ *   0x03 rename  address, name length, name
+ *   0x04 list    first position                Lists the phones from that position
+ *   0x05 clear                                 Removes every phone
+ *   0x06 key     address, 16-byte key          Sets the phone's event broadcast key
+ *
+ * Items are applied in order, the registry is committed once at the end of the batch,
+ * and a list item sees the changes made before it. A malformed item rejects the whole
+ * batch before anything is written, as does an item past BT_PROV_MAX_ITEMS.
+ *
+ * The commit is not atomic: flash takes the changes one entry at a time, and a write
+ * that fails stops the commit where it is. The batch is then BT_PROV_BATCH_PARTIAL and
+ * the registry holds part of it, the same after a reboot; the phone lists the phones to
+ * see which, and writes the rest again.
+ *
+ * The result is the batch status, the item count and, per item, its opcode and status.
+ * A list item that succeeded adds the number of phones stored, the number listed and,
+ * per phone, its address, name length and name; it lists as many phones as fit.
+ */
+#define BT_PROV_NAME_MAX    32
+#define BT_PROV_KEY_LEN     16
+#define BT_PROV_MAX_ITEMS   64
+
+typedef enum {
+    BT_PROV_OP_ADD = 0x01,
+    BT_PROV_OP_REMOVE = 0x02,
+    BT_PROV_OP_RENAME = 0x03,
+    BT_PROV_OP_LIST = 0x04,
+    BT_PROV_OP_CLEAR = 0x05,
+    BT_PROV_OP_KEY = 0x06,
+} bt_prov_op_t;
+
+typedef enum {
+    BT_PROV_BATCH_DONE = 0,         // Applied and committed
+    BT_PROV_BATCH_PENDING = 1,      // Still being applied, read again
+    BT_PROV_BATCH_REJECTED = 2,     // Malformed, nothing written
+    BT_PROV_BATCH_FAILED = 3,       // The registry could not be opened or committed, nothing written
+    BT_PROV_BATCH_NONE = 4,         // No batch written since boot
+    BT_PROV_BATCH_PARTIAL = 5,      // The commit failed after part of the batch was written
+} bt_prov_batch_status_t;
+
+typedef enum {
+    BT_PROV_ITEM_OK = 0,
+    BT_PROV_ITEM_NOT_FOUND = 1,
+    BT_PROV_ITEM_MALFORMED = 2,     // Unknown opcode, truncated or name too long
+    BT_PROV_ITEM_FULL = 3,          // CONFIG_BT_PROV_MAX_DEVICES phones are stored
+    BT_PROV_ITEM_FAILED = 4,        // Storage error
+    BT_PROV_ITEM_SKIPPED = 5,       // Not applied, the batch was rejected or failed
+} bt_prov_item_status_t;
+
+/**
+ * @brief Handles a batch written to the provisioning characteristic.
+ *
+ * The batch is applied in the timer service task, away from the BLE host. A batch
+ * written while the previous one is still being applied is dropped.
+ *
+ * @param data Batch.
+ * @param len  Batch length.
+ */
+void bt_prov_write(const uint8_t *data, size_t len);
+
+/**
+ * @brief Serializes the result of the last batch.
+ *
+ * @param buf Output buffer.
+ * @param len Size of the output buffer.
+ * @return Number of bytes written.
+ */
+size_t bt_prov_read(uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_PROV_H
@@ -0,0 +1,158 @@
+/**
+ * @file bt_sched.c
+ * @brief Core placement helpers and the wake-up jitter benchmark.
+ */
+
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_ipc.h"
+#include "esp_log.h"
+#include "bt_sched.h"
+
+#define TAG "BT_SCHED"
+
+esp_err_t bt_sched_call_on_core(int core, void (*fn)(void *arg), void *arg) {
+#if portNUM_PROCESSORS > 1
+    if (core >= 0 && core != xPortGetCoreID()) {
+        return esp_ipc_call_blocking(core, fn, arg);
+    }
+#endif
+    fn(arg);
+    return ESP_OK;
+}
+
+void bt_sched_log_profile(void) {
+    ESP_LOGI(TAG, "BLE host on core %d; button ISR on core %d, event task on core %d prio %d, "
+             "storage on core %d prio %d",
+             BT_SCHED_BLE_HOST_CORE, BT_SCHED_BUTTON_ISR_CORE, BT_SCHED_EVENT_TASK_CORE,
+             BT_SCHED_EVENT_TASK_PRIO, BT_SCHED_STORAGE_CORE, BT_SCHED_STORAGE_PRIO);
+#if portNUM_PROCESSORS > 1
+    if (BT_SCHED_EVENT_TASK_CORE == BT_SCHED_BLE_HOST_CORE) {
+        ESP_LOGW(TAG, "Event task shares core %d with the BLE host; presses wait behind radio work",
+                 BT_SCHED_BLE_HOST_CORE);
+    }
+#endif
+}
+
+#ifdef CONFIG_BT_SCHED_BENCH
+
+#include "driver/gptimer.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+#define BENCH_PERIOD_US     1000
+#define BENCH_SAMPLES       CONFIG_BT_SCHED_BENCH_SAMPLES
+#define BENCH_LOAD_BUSY_US  ((int64_t)portTICK_PERIOD_MS * 1000 * CONFIG_BT_SCHED_BENCH_LOAD_PCT / 100)
+#define BENCH_LOAD_PRIO     (configMAX_PRIORITIES - 5)  // Bluedroid's BTU task
+
+static gptimer_handle_t bench_timer;
+static TaskHandle_t bench_waiter;
+static volatile int64_t alarm_us;
+static volatile bool alarm_pending;     // Set by the ISR, cleared once the waiter has measured it
+
+static bool IRAM_ATTR bench_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg) {
+    BaseType_t woken = pdFALSE;
+
+    // Skip alarms while the waiter is late, so every sample measures one full wake-up
+    if (!alarm_pending) {
+        alarm_us = esp_timer_get_time();
+        alarm_pending = true;
+        vTaskNotifyGiveFromISR(bench_waiter, &woken);
+    }
+    return woken == pdTRUE;
+}
+
+// Runs on the button ISR core so the alarm interrupt is allocated there
+static void bench_timer_create(void *arg) {
+    esp_err_t *err = arg;
+    gptimer_config_t config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000,
+    };
+    gptimer_event_callbacks_t callbacks = {
+        .on_alarm = bench_alarm,
+    };
+
+    *err = gptimer_new_timer(&config, &bench_timer);
+    if (*err == ESP_OK) {
+        *err = gptimer_register_event_callbacks(bench_timer, &callbacks, NULL);
+    }
+}
+
+// Keeps the BLE host's core busy for the configured share of every tick
+static void bench_load_task(void *arg) {
+    while (1) {
+        int64_t start = esp_timer_get_time();
+        while (esp_timer_get_time() - start < BENCH_LOAD_BUSY_US) {
+        }
+        vTaskDelay(1);
+    }
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_phase(const char *name, uint32_t *samples) {
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        samples[i] = (uint32_t)(esp_timer_get_time() - alarm_us);
+        alarm_pending = false;
+    }
+    qsort(samples, BENCH_SAMPLES, sizeof(samples[0]), compare_u32);
+    ESP_LOGI(TAG, "Wake-up latency %s: min %lu us, p50 %lu us, p99 %lu us, max %lu us", name,
+             (unsigned long)samples[0], (unsigned long)samples[BENCH_SAMPLES / 2],
+             (unsigned long)samples[(BENCH_SAMPLES - 1) * 99 / 100], (unsigned long)samples[BENCH_SAMPLES - 1]);
+}
+
+static void bench_task(void *arg) {
+    gptimer_alarm_config_t alarm = {
+        .alarm_count = BENCH_PERIOD_US,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    TaskHandle_t load = NULL;
+    esp_err_t err = ESP_ERR_NO_MEM;
+
+    uint32_t *samples = malloc(BENCH_SAMPLES * sizeof(uint32_t));
+    if (samples) {
+        bt_sched_call_on_core(BT_SCHED_BUTTON_ISR_CORE, bench_timer_create, &err);
+    }
+    if (err == ESP_OK) {
+        gptimer_enable(bench_timer);
+        gptimer_set_alarm_action(bench_timer, &alarm);
+        gptimer_start(bench_timer);
+
+        bench_phase("idle", samples);
+        if (xTaskCreatePinnedToCore(bench_load_task, "bt_sched_load", 2048, NULL, BENCH_LOAD_PRIO, &load,
+                                    bt_sched_affinity(BT_SCHED_BLE_HOST_CORE)) == pdPASS) {
+            bench_phase("under BLE load", samples);
+            vTaskDelete(load);
+        }
+
+        gptimer_stop(bench_timer);
+        gptimer_disable(bench_timer);
+    } else {
+        ESP_LOGE(TAG, "Jitter benchmark failed to start: %s", esp_err_to_name(err));
+    }
+    if (bench_timer) {
+        gptimer_del_timer(bench_timer);
+        bench_timer = NULL;
+    }
+    free(samples);
+    vTaskDelete(NULL);
+}
+
+esp_err_t bt_sched_bench_start(void) {
+    if (xTaskCreatePinnedToCore(bench_task, "bt_sched_bench", 3072, NULL, BT_SCHED_EVENT_TASK_PRIO,
+                                &bench_waiter, bt_sched_affinity(BT_SCHED_EVENT_TASK_CORE)) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create benchmark task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+#endif // CONFIG_BT_SCHED_BENCH
@@ -0,0 +1,104 @@
+#ifndef BT_SCHED_H
+#define BT_SCHED_H
+
+// bt_sched.h - Core and priority placement of the button path (CONFIG_BT_SCHED_PROFILE)
+//
+// Cores are -1 for "any core". On a single-core chip everything runs on core 0.
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#define BT_SCHED_BLE_HOST_CORE      CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#elif defined(CONFIG_BT_NIMBLE_PINNED_TO_CORE)
+#define BT_SCHED_BLE_HOST_CORE      CONFIG_BT_NIMBLE_PINNED_TO_CORE
+#else
+#define BT_SCHED_BLE_HOST_CORE      0
+#endif
+
+#if portNUM_PROCESSORS == 1
+#define BT_SCHED_BUTTON_ISR_CORE    0
+#define BT_SCHED_EVENT_TASK_CORE    0
+#define BT_SCHED_STORAGE_CORE       0
+#elif defined(CONFIG_BT_SCHED_PROFILE_ISOLATED)
+#define BT_SCHED_BUTTON_ISR_CORE    (1 - BT_SCHED_BLE_HOST_CORE)
+#define BT_SCHED_EVENT_TASK_CORE    (1 - BT_SCHED_BLE_HOST_CORE)
+#define BT_SCHED_STORAGE_CORE       BT_SCHED_BLE_HOST_CORE
+#elif defined(CONFIG_BT_SCHED_PROFILE_CUSTOM)
+#define BT_SCHED_BUTTON_ISR_CORE    CONFIG_BT_SCHED_BUTTON_ISR_CORE
+#define BT_SCHED_EVENT_TASK_CORE    CONFIG_BT_SCHED_EVENT_TASK_CORE
+#define BT_SCHED_STORAGE_CORE       CONFIG_BT_SCHED_STORAGE_CORE
+#else
+#define BT_SCHED_BUTTON_ISR_CORE    (-1)
+#define BT_SCHED_EVENT_TASK_CORE    (-1)
+#define BT_SCHED_STORAGE_CORE       (-1)
+#endif
+
+#define BT_SCHED_EVENT_TASK_PRIO    CONFIG_BT_SCHED_EVENT_TASK_PRIO
+#define BT_SCHED_STORAGE_PRIO       CONFIG_BT_SCHED_STORAGE_PRIO
+
+/**
+ * @brief Converts a configured core to the xCoreID argument of xTaskCreatePinnedToCore().
+ */
+static inline BaseType_t bt_sched_affinity(int core) {
+    return core < 0 ? tskNO_AFFINITY : core;
+}
+
+/**
+ * @brief Runs a function on the given core and waits for it to return.
+ *
+ * Used to allocate interrupts, which land on the core that allocates them.
+ *
+ * @param core Core to run on, or -1 to run on the calling core.
+ * @param fn   Function to run.
+ * @param arg  Argument passed to fn.
+ * @return
+ *     - ESP_OK: If fn ran.
+ *     - Otherwise: The error from esp_ipc_call_blocking().
+ */
+esp_err_t bt_sched_call_on_core(int core, void (*fn)(void *arg), void *arg);
+
+/**
+ * @brief Logs where the button path and the BLE host run.
+ *
+ * Warns if the event task shares its core with the BLE host.
+ */
+void bt_sched_log_profile(void);
+
+#ifdef CONFIG_BT_SCHED_BENCH
+
+/**
+ * @brief Starts the wake-up jitter benchmark in the background.
+ *
+ * Fires a 1 kHz timer interrupt on the button ISR core and measures how long a task
+ * with the event task's core and priority takes to wake up, for
+ * CONFIG_BT_SCHED_BENCH_SAMPLES samples idle and as many under a synthetic load that
+ * keeps the BLE host's core busy for CONFIG_BT_SCHED_BENCH_LOAD_PCT of every tick at
+ * the BLE host's priority. Logs min, median, 99th percentile and max for each phase,
+ * then frees everything it allocated.
+ *
+ * @return
+ *     - ESP_OK: If the benchmark was started.
+ *     - ESP_ERR_NO_MEM: If its task could not be created.
+ */
+esp_err_t bt_sched_bench_start(void);
+
+#else
+
+static inline esp_err_t bt_sched_bench_start(void) {
+    return ESP_OK;
+}
+
+#endif // CONFIG_BT_SCHED_BENCH
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_SCHED_H
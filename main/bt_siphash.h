@@ -0,0 +1,29 @@
+#ifndef BT_SIPHASH_H
+#define BT_SIPHASH_H
+
+// bt_siphash.h - SipHash-2-4, a keyed hash for authenticating short messages
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BT_SIPHASH_KEY_LEN  16
+
+/**
+ * @brief Computes SipHash-2-4 of a message.
+ *
+ * @param key  128-bit key, as 16 bytes.
+ * @param data Message.
+ * @param len  Message length.
+ * @return The 64-bit hash. Its little-endian bytes are the reference byte output.
+ */
+uint64_t bt_siphash24(const uint8_t key[BT_SIPHASH_KEY_LEN], const uint8_t *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_SIPHASH_H
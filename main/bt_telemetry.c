@@ -0,0 +1,190 @@
+/**
+ * @file bt_telemetry.c
+ * @brief Periodic sampler for stack high-water marks, heap fragmentation and queue depth.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "bt_telemetry.h"
+#include "bt_event.h"
+#include "ble_tx.h"
+
+#define TAG "BT_TELEMETRY"
+
+#define TELEMETRY_PERIOD_TICKS  pdMS_TO_TICKS(CONFIG_BT_TELEMETRY_PERIOD_MS)
+#define TELEMETRY_TASK_PRIO     1
+#define TELEMETRY_NO_TASK       0xFFFF
+
+typedef struct {
+    const char *name;
+    uint32_t caps;
+} heap_desc_t;
+
+// IDs on the wire are the array indices; append new entries at the end
+static const heap_desc_t heaps[] = {
+    { "internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT },
+    { "default", MALLOC_CAP_DEFAULT },
+    { "dma", MALLOC_CAP_DMA },
+};
+#define NUM_HEAPS (sizeof(heaps) / sizeof(heaps[0]))
+
+static const char *const task_names[] = {
+    "bt_event_task",
+    "bt_trace_task",
+    "bt_telemetry",
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+    "nimble_host",
+    "",                 // Keeps the IDs on the wire; NimBLE has a single host task
+#else
+    "BTC_TASK",
+    "BTU_TASK",
+#endif
+    "btController",
+    "Tmr Svc",
+    "esp_timer",
+    "flight_rec",
+};
+#define NUM_TASKS (sizeof(task_names) / sizeof(task_names[0]))
+
+typedef struct {
+    uint32_t free;
+    uint32_t min_free;
+    uint32_t largest;
+} heap_sample_t;
+
+typedef struct {
+    uint32_t uptime_s;
+    heap_sample_t heap[NUM_HEAPS];
+    uint16_t stack_hwm[NUM_TASKS];
+    uint8_t event_queue_len;
+    uint8_t event_queue_peak;
+    uint16_t tx_queue_len;
+    uint16_t tx_queue_peak;
+} telemetry_sample_t;
+
+static void take_sample(telemetry_sample_t *sample) {
+    ble_tx_stats_t tx_stats;
+
+    sample->uptime_s = esp_timer_get_time() / 1000000;
+    for (size_t i = 0; i < NUM_HEAPS; i++) {
+        sample->heap[i].free = heap_caps_get_free_size(heaps[i].caps);
+        sample->heap[i].min_free = heap_caps_get_minimum_free_size(heaps[i].caps);
+        sample->heap[i].largest = heap_caps_get_largest_free_block(heaps[i].caps);
+    }
+    for (size_t i = 0; i < NUM_TASKS; i++) {
+        TaskHandle_t task = xTaskGetHandle(task_names[i]);
+        // Stack units are bytes on ESP-IDF
+        sample->stack_hwm[i] = task ? uxTaskGetStackHighWaterMark(task) : TELEMETRY_NO_TASK;
+    }
+    bt_event_get_queue_depth(&sample->event_queue_len, &sample->event_queue_peak);
+    ble_tx_get_stats(&tx_stats);
+    sample->tx_queue_len = tx_stats.queue_depth;
+    sample->tx_queue_peak = tx_stats.queue_peak;
+}
+
+static void check_thresholds(const telemetry_sample_t *sample) {
+    for (size_t i = 0; i < NUM_TASKS; i++) {
+        if (sample->stack_hwm[i] != TELEMETRY_NO_TASK && sample->stack_hwm[i] < CONFIG_BT_TELEMETRY_STACK_MIN_FREE) {
+            ESP_LOGW(TAG, "Task %s has only %u stack bytes left", task_names[i], sample->stack_hwm[i]);
+        }
+    }
+    for (size_t i = 0; i < NUM_HEAPS; i++) {
+        const heap_sample_t *heap = &sample->heap[i];
+        if (heap->free < CONFIG_BT_TELEMETRY_HEAP_MIN_FREE) {
+            ESP_LOGW(TAG, "Heap %s low: free %lu, min %lu", heaps[i].name,
+                     (unsigned long)heap->free, (unsigned long)heap->min_free);
+        }
+        // Plenty free but no block big enough for a quarter of it means the heap is fragmenting
+        if (heap->free >= CONFIG_BT_TELEMETRY_HEAP_MIN_FREE && heap->largest < heap->free / 4) {
+            ESP_LOGW(TAG, "Heap %s fragmented: free %lu, largest block %lu", heaps[i].name,
+                     (unsigned long)heap->free, (unsigned long)heap->largest);
+        }
+    }
+}
+
+static void bt_telemetry_task(void *arg) {
+    telemetry_sample_t sample;
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1) {
+        vTaskDelayUntil(&last_wake, TELEMETRY_PERIOD_TICKS);
+        take_sample(&sample);
+        check_thresholds(&sample);
+    }
+}
+
+esp_err_t bt_telemetry_init(void) {
+    if (xTaskCreate(bt_telemetry_task, "bt_telemetry", 3072, NULL, TELEMETRY_TASK_PRIO, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create telemetry task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v) {
+    *p++ = v & 0xFF;
+    *p++ = v >> 8;
+    return p;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+    p = put_u16(p, v & 0xFFFF);
+    return put_u16(p, v >> 16);
+}
+
+size_t bt_telemetry_serialize(uint8_t *buf, size_t len) {
+    size_t needed = 4 + 1 + NUM_HEAPS * 13 + 1 + NUM_TASKS * 3 + 6;
+    telemetry_sample_t sample;
+
+    if (len < needed) {
+        return 0;
+    }
+    take_sample(&sample);
+
+    uint8_t *p = put_u32(buf, sample.uptime_s);
+    *p++ = NUM_HEAPS;
+    for (size_t i = 0; i < NUM_HEAPS; i++) {
+        *p++ = i;
+        p = put_u32(p, sample.heap[i].free);
+        p = put_u32(p, sample.heap[i].min_free);
+        p = put_u32(p, sample.heap[i].largest);
+    }
+    *p++ = NUM_TASKS;
+    for (size_t i = 0; i < NUM_TASKS; i++) {
+        *p++ = i;
+        p = put_u16(p, sample.stack_hwm[i]);
+    }
+    *p++ = sample.event_queue_len;
+    *p++ = sample.event_queue_peak;
+    p = put_u16(p, sample.tx_queue_len);
+    p = put_u16(p, sample.tx_queue_peak);
+    return p - buf;
+}
+
+void bt_telemetry_dump(void) {
+    telemetry_sample_t sample;
+
+    take_sample(&sample);
+    ESP_LOGI(TAG, "Uptime %lu s", (unsigned long)sample.uptime_s);
+    for (size_t i = 0; i < NUM_HEAPS; i++) {
+        ESP_LOGI(TAG, "Heap %-8s free %6lu  min %6lu  largest %6lu", heaps[i].name,
+                 (unsigned long)sample.heap[i].free, (unsigned long)sample.heap[i].min_free,
+                 (unsigned long)sample.heap[i].largest);
+    }
+    for (size_t i = 0; i < NUM_TASKS; i++) {
+        if (sample.stack_hwm[i] != TELEMETRY_NO_TASK) {
+            ESP_LOGI(TAG, "Task %-14s stack free %u", task_names[i], sample.stack_hwm[i]);
+        }
+    }
+    ESP_LOGI(TAG, "Event queue %u (peak %u), tx queue %u (peak %u)",
+             sample.event_queue_len, sample.event_queue_peak, sample.tx_queue_len, sample.tx_queue_peak);
+}
+
+void bt_telemetry_reset(void) {
+    bt_event_reset_queue_peak();
+    ble_tx_reset_queue_peak();
+}
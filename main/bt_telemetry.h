@@ -0,0 +1,56 @@
+#ifndef BT_TELEMETRY_H
+#define BT_TELEMETRY_H
+
+// bt_telemetry.h - Periodic stack, heap and queue telemetry
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Starts the low-priority sampler task.
+ *
+ * Every CONFIG_BT_TELEMETRY_PERIOD_MS it samples stack high-water marks of the tracked
+ * tasks, free, minimum free and largest free heap block per capability, and queue peaks.
+ * A warning is logged when a stack or heap drops below its configured threshold.
+ *
+ * @return
+ *     - ESP_OK: If the sampler was started.
+ *     - ESP_ERR_NO_MEM: If the task could not be created.
+ */
+esp_err_t bt_telemetry_init(void);
+
+/**
+ * @brief Takes a fresh sample and serializes it for the diagnostics characteristic.
+ *
+ * Layout (little-endian):
+ *   u32 uptime in seconds
+ *   u8  heap count, then per heap: u8 heap ID, u32 free, u32 minimum free, u32 largest free block
+ *   u8  task count, then per task: u8 task ID, u16 stack high-water mark in bytes (0xFFFF if absent)
+ *   u8  event queue length, u8 event queue peak, u16 tx queue length, u16 tx queue peak
+ *
+ * @param buf Output buffer.
+ * @param len Size of the output buffer.
+ * @return Number of bytes written, or 0 if the buffer is too small.
+ */
+size_t bt_telemetry_serialize(uint8_t *buf, size_t len);
+
+/**
+ * @brief Logs a fresh sample to the console.
+ */
+void bt_telemetry_dump(void);
+
+/**
+ * @brief Clears the queue peak counters.
+ */
+void bt_telemetry_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_TELEMETRY_H
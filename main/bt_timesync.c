@@ -0,0 +1,74 @@
+/**
+ * @file bt_timesync.c
+ * @brief Tracks the phone clock against esp_timer.
+ *
+ * The phone writes "time:<epoch_ms>" to the remote characteristic whenever it likes,
+ * typically after subscribing and then every few minutes. The firmware keeps the
+ * offset from the latest sample and a drift estimate in parts per million from the
+ * change in offset between samples, so press timestamps can be reported in phone time.
+ */
+
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "bt_timesync.h"
+
+#define TAG "BT_TIMESYNC"
+
+#define DRIFT_MIN_INTERVAL_US   (10 * 1000000LL)    // Shorter intervals are dominated by link jitter
+#define DRIFT_MAX_PPM           500
+
+static portMUX_TYPE sync_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool synced;
+static int64_t ref_local_us;    // esp_timer time of the latest sample
+static int64_t ref_phone_us;    // Phone time of the latest sample
+static int32_t drift_ppm;       // Phone clock rate relative to esp_timer, minus one, in ppm
+
+void bt_timesync_update(int64_t phone_ms, int64_t local_us) {
+    int64_t phone_us = phone_ms * 1000;
+
+    portENTER_CRITICAL(&sync_mux);
+    if (synced && local_us - ref_local_us >= DRIFT_MIN_INTERVAL_US) {
+        // Offset change over the interval, relative to the interval, is the drift
+        int64_t old_offset = ref_phone_us - ref_local_us;
+        int64_t new_offset = phone_us - local_us;
+        int64_t sample_ppm = (new_offset - old_offset) * 1000000 / (local_us - ref_local_us);
+        if (sample_ppm > DRIFT_MAX_PPM) {
+            sample_ppm = DRIFT_MAX_PPM;
+        } else if (sample_ppm < -DRIFT_MAX_PPM) {
+            sample_ppm = -DRIFT_MAX_PPM;
+        }
+        drift_ppm = (3 * drift_ppm + (int32_t)sample_ppm) / 4;
+    }
+    ref_local_us = local_us;
+    ref_phone_us = phone_us;
+    bool first = !synced;
+    synced = true;
+    int32_t drift = drift_ppm;
+    portEXIT_CRITICAL(&sync_mux);
+
+    struct timeval tv = {
+        .tv_sec = phone_ms / 1000,
+        .tv_usec = (phone_ms % 1000) * 1000,
+    };
+    settimeofday(&tv, NULL);
+
+    if (first) {
+        ESP_LOGI(TAG, "Clock synced to phone time %lld ms", (long long)phone_ms);
+    } else {
+        ESP_LOGD(TAG, "Clock resynced, drift %ld ppm", (long)drift);
+    }
+}
+
+bool bt_timesync_to_phone_ms(int64_t local_us, int64_t *phone_ms) {
+    portENTER_CRITICAL(&sync_mux);
+    bool ok = synced;
+    int64_t elapsed_us = local_us - ref_local_us;
+    int64_t phone_us = ref_phone_us + elapsed_us + elapsed_us * drift_ppm / 1000000;
+    portEXIT_CRITICAL(&sync_mux);
+
+    if (ok) {
+        *phone_ms = phone_us / 1000;
+    }
+    return ok;
+}
@@ -0,0 +1,40 @@
+#ifndef BT_TIMESYNC_H
+#define BT_TIMESYNC_H
+
+// bt_timesync.h - Phone clock offset and drift tracking
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Feeds a phone clock sample received over BLE.
+ *
+ * Updates the offset between the phone clock and esp_timer, refines the drift
+ * estimate once samples are far enough apart, and sets the system time.
+ *
+ * @param phone_ms  Phone time in milliseconds since the Unix epoch.
+ * @param local_us  esp_timer time at which the sample was received.
+ */
+void bt_timesync_update(int64_t phone_ms, int64_t local_us);
+
+/**
+ * @brief Converts an esp_timer timestamp to phone time.
+ *
+ * Works for timestamps taken before the first sync as well, since esp_timer
+ * counts monotonically from boot.
+ *
+ * @param local_us  esp_timer time to convert.
+ * @param phone_ms  Output: phone time in milliseconds since the Unix epoch.
+ * @return true if the clock has been synced at least once, false otherwise.
+ */
+bool bt_timesync_to_phone_ms(int64_t local_us, int64_t *phone_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_TIMESYNC_H
@@ -0,0 +1,144 @@
+/**
+ * @file bt_trace.c
+ * @brief Per-core binary trace rings and the task that formats them.
+ */
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BT_TRACE_ENABLE
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "bt_trace.h"
+
+#define TAG "BT_TRACE"
+
+#define TRACE_RING_LEN      CONFIG_BT_TRACE_BUF_LEN
+#define TRACE_FLUSH_TICKS   pdMS_TO_TICKS(CONFIG_BT_TRACE_FLUSH_MS)
+#define TRACE_TASK_PRIO     1
+#define TRACE_LINE_LEN      96
+
+typedef struct {
+    uint32_t time_us;
+    uint16_t id;
+    uint8_t module;
+    uint8_t level;
+    uint32_t arg[2];
+} trace_entry_t;
+
+typedef struct {
+    trace_entry_t entries[TRACE_RING_LEN];
+    uint32_t head;      // Total entries written; head % TRACE_RING_LEN is the next slot
+    uint32_t tail;      // Total entries printed
+    portMUX_TYPE mux;
+} trace_ring_t;
+
+static DRAM_ATTR trace_ring_t rings[portNUM_PROCESSORS] = {
+    [0 ... portNUM_PROCESSORS - 1] = { .mux = portMUX_INITIALIZER_UNLOCKED },
+};
+
+#define TRACE_FMT_ENTRY(name, fmt) fmt,
+static const char *const trace_formats[BT_TRACE_ID_COUNT] = {
+    BT_TRACE_EVENTS(TRACE_FMT_ENTRY)
+};
+#undef TRACE_FMT_ENTRY
+
+static const char *const module_tags[BT_TRACE_MOD_COUNT] = {
+    [BT_TRACE_MOD_GPIO] = "BUTTONS",
+    [BT_TRACE_MOD_EVT] = "BT_EVT",
+    [BT_TRACE_MOD_TX] = "BLE_TX",
+    [BT_TRACE_MOD_BLE] = "BLE_SERVER",
+    [BT_TRACE_MOD_STORAGE] = "NVS_STORAGE",
+};
+
+void IRAM_ATTR bt_trace_record(bt_trace_module_t module, uint8_t level, bt_trace_id_t id, uint32_t a, uint32_t b) {
+    trace_ring_t *ring = &rings[xPortGetCoreID()];
+    uint32_t now = (uint32_t)esp_timer_get_time();
+
+    portENTER_CRITICAL_SAFE(&ring->mux);
+    trace_entry_t *entry = &ring->entries[ring->head % TRACE_RING_LEN];
+    entry->time_us = now;
+    entry->id = id;
+    entry->module = module;
+    entry->level = level;
+    entry->arg[0] = a;
+    entry->arg[1] = b;
+    ring->head++;
+    portEXIT_CRITICAL_SAFE(&ring->mux);
+}
+
+static void print_entry(int core, const trace_entry_t *entry) {
+    char line[TRACE_LINE_LEN];
+    const char *tag = entry->module < BT_TRACE_MOD_COUNT ? module_tags[entry->module] : TAG;
+
+    if (entry->id >= BT_TRACE_ID_COUNT) {
+        ESP_LOGW(TAG, "Unknown trace id %u", entry->id);
+        return;
+    }
+    snprintf(line, sizeof(line), trace_formats[entry->id],
+             (unsigned long)entry->arg[0], (unsigned long)entry->arg[1]);
+
+    switch (entry->level) {
+        case BT_TRACE_LEVEL_ERROR:
+            ESP_LOGE(tag, "[%d %lu] %s", core, (unsigned long)entry->time_us, line);
+            break;
+        case BT_TRACE_LEVEL_WARN:
+            ESP_LOGW(tag, "[%d %lu] %s", core, (unsigned long)entry->time_us, line);
+            break;
+        case BT_TRACE_LEVEL_INFO:
+            ESP_LOGI(tag, "[%d %lu] %s", core, (unsigned long)entry->time_us, line);
+            break;
+        default:
+            ESP_LOGD(tag, "[%d %lu] %s", core, (unsigned long)entry->time_us, line);
+            break;
+    }
+}
+
+static void drain_ring(int core) {
+    trace_ring_t *ring = &rings[core];
+    trace_entry_t entry;
+
+    while (1) {
+        portENTER_CRITICAL(&ring->mux);
+        if (ring->tail == ring->head) {
+            portEXIT_CRITICAL(&ring->mux);
+            return;
+        }
+        uint32_t lost = 0;
+        if (ring->head - ring->tail > TRACE_RING_LEN) {
+            lost = ring->head - ring->tail - TRACE_RING_LEN;
+            ring->tail = ring->head - TRACE_RING_LEN;
+        }
+        entry = ring->entries[ring->tail % TRACE_RING_LEN];
+        ring->tail++;
+        portEXIT_CRITICAL(&ring->mux);
+
+        if (lost > 0) {
+            ESP_LOGW(TAG, "Core %d trace ring overrun, %lu entries lost", core, (unsigned long)lost);
+        }
+        print_entry(core, &entry);
+    }
+}
+
+static void bt_trace_task(void *arg) {
+    while (1) {
+        vTaskDelay(TRACE_FLUSH_TICKS);
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            drain_ring(core);
+        }
+    }
+}
+
+esp_err_t bt_trace_init(void) {
+    if (xTaskCreate(bt_trace_task, "bt_trace_task", 3072, NULL, TRACE_TASK_PRIO, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create trace task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+#endif // CONFIG_BT_TRACE_ENABLE
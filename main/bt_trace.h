@@ -0,0 +1,120 @@
+#ifndef BT_TRACE_H
+#define BT_TRACE_H
+
+// bt_trace.h - Deferred binary trace for hot paths
+//
+// BT_TRACE() stores a trace ID and two raw 32-bit arguments in a per-core ring buffer
+// without any formatting. A low-priority task formats the records with the strings
+// below and prints them through esp_log later. Each module has its own compile-time
+// level (CONFIG_BT_TRACE_LEVEL_<MODULE>); calls above that level compile to nothing.
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BT_TRACE_LEVEL_NONE     0
+#define BT_TRACE_LEVEL_ERROR    1
+#define BT_TRACE_LEVEL_WARN     2
+#define BT_TRACE_LEVEL_INFO     3
+#define BT_TRACE_LEVEL_DEBUG    4
+
+typedef enum {
+    BT_TRACE_MOD_GPIO,
+    BT_TRACE_MOD_EVT,
+    BT_TRACE_MOD_TX,
+    BT_TRACE_MOD_BLE,
+    BT_TRACE_MOD_STORAGE,
+    BT_TRACE_MOD_COUNT
+} bt_trace_module_t;
+
+/*
+ * Trace IDs and their format strings. Both arguments are printed as unsigned long.
+ * Add new entries at the end so IDs in captured buffers keep their meaning.
+ */
+#define BT_TRACE_EVENTS(X) \
+    X(GPIO_EDGE,            "GPIO %lu level %lu") \
+    X(EVT_BAD_BUTTON,       "Button index not found for GPIO %lu") \
+    X(EVT_QUEUE_FULL,       "Event queue full, dropped event for GPIO %lu") \
+    X(TX_SEND,              "Sending %lu events starting at seq %lu") \
+    X(TX_SEND_FAILED,       "Send failed: 0x%lx (%lu events)") \
+    X(TX_QUEUE_FULL,        "Tx queue full, dropping event seq %lu") \
+    X(TX_EXPIRED,           "Dropping %lu events older than %lu ms") \
+    X(TX_ACKED,             "Acked %lu events up to seq %lu") \
+    X(TX_CONGEST_CLEARED,   "Congestion cleared after %lu ms") \
+    X(BLE_CONNECT,          "Device connected, conn_id %lu") \
+    X(BLE_DISCONNECT,       "Device disconnected, conn_id %lu reason 0x%lx") \
+    X(BLE_MTU,              "MTU exchanged: %lu (conn_id %lu)") \
+    X(BLE_CCCD,             "Client wrote CCCD 0x%04lx (conn_id %lu)") \
+    X(BLE_WRITE,            "Write event, handle %lu len %lu") \
+    X(BLE_CONGEST,          "Link congested: %lu (conn_id %lu)") \
+    X(BLE_CONF,             "Indication confirm status %lu (conn_id %lu)") \
+    X(BLE_UNHANDLED,        "Unhandled GATT event %lu") \
+    X(BLE_ADV_STARTED,      "Advertising started, status %lu") \
+    X(BLE_CONN_PARAMS,      "Connection interval %lu (1.25 ms units), latency %lu") \
+    X(BLE_ADV_CONNECT,      "Connected in advertising tier %lu after %lu ms") \
+    X(BLE_PHY,              "PHY tx %lu rx %lu") \
+    X(BLE_DATA_LEN,         "Data length tx %lu rx %lu octets") \
+    X(BLE_AUTH,             "Encryption status 0x%lx (conn_id %lu)")
+
+#define BT_TRACE_ENUM_ENTRY(name, fmt) BT_TRACE_##name,
+typedef enum {
+    BT_TRACE_EVENTS(BT_TRACE_ENUM_ENTRY)
+    BT_TRACE_ID_COUNT
+} bt_trace_id_t;
+#undef BT_TRACE_ENUM_ENTRY
+
+#ifdef CONFIG_BT_TRACE_ENABLE
+
+/**
+ * @brief Records a trace entry if the module's configured level allows it.
+ *
+ * Safe to call from tasks and from IRAM interrupt handlers on either core.
+ *
+ * @param mod  Module name without prefix, e.g. BLE.
+ * @param lvl  Level name without prefix, e.g. INFO.
+ * @param id   Trace ID without prefix, e.g. BLE_CONNECT.
+ * @param a    First argument, stored as uint32_t.
+ * @param b    Second argument, stored as uint32_t.
+ */
+#define BT_TRACE(mod, lvl, id, a, b) do { \
+        if (BT_TRACE_LEVEL_##lvl <= CONFIG_BT_TRACE_LEVEL_##mod) { \
+            bt_trace_record(BT_TRACE_MOD_##mod, BT_TRACE_LEVEL_##lvl, BT_TRACE_##id, \
+                            (uint32_t)(a), (uint32_t)(b)); \
+        } \
+    } while (0)
+
+/**
+ * @brief Appends a raw record to the current core's trace ring. Use BT_TRACE() instead.
+ */
+void bt_trace_record(bt_trace_module_t module, uint8_t level, bt_trace_id_t id, uint32_t a, uint32_t b);
+
+/**
+ * @brief Starts the low-priority task that formats and prints trace records.
+ *
+ * Records made before this call are kept in the ring buffers and printed once it runs.
+ *
+ * @return
+ *     - ESP_OK: If the task was started.
+ *     - ESP_ERR_NO_MEM: If the task could not be created.
+ */
+esp_err_t bt_trace_init(void);
+
+#else
+
+#define BT_TRACE(mod, lvl, id, a, b) do { (void)(a); (void)(b); } while (0)
+
+static inline esp_err_t bt_trace_init(void) {
+    return ESP_OK;
+}
+
+#endif // CONFIG_BT_TRACE_ENABLE
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BT_TRACE_H
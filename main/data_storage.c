@@ -4,13 +4,15 @@
 #ifdef CONFIG_NVS_ENABLE
 
 #ifdef CONFIG_BT_ENABLED
-#include "esp_bt_defs.h" // For esp_bd_addr_t
+#include "ble_types.h"   // For esp_bd_addr_t
 #endif // CONFIG_BT_ENABLED
 
 #include "data_storage.h" // For data storage functions
 #include "esp_log.h"     // For ESP_LOGI
 #include "nvs_flash.h"   // For NVS functions
 #include "nvs.h"         // For NVS handle and operations
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h" // For the cache lock
 #include <string.h>      // For strncmp
 
 
@@ -20,14 +22,34 @@
 #define BT_MAC_PREFIX_KEY_LEN 32
 #define BT_NAME_KEY_LEN 32
 #define NVS_BT_STORAGE "nvs"
+#define BT_LAST_PEER_KEY "last_peer"
+#define BT_KEY_KEY_PREFIX "bt_%d_bkey"
+#define BT_KEY_KEY_LEN 32
+#define BEACON_COUNTER_KEY "bcn_ctr"
+#define BT_CCCD_KEY_PREFIX "bt_%d_cccd"
+#define BT_CCCD_KEY_LEN 32
+#define BT_CCCD_BLOB_LEN 4     // Remote and dump CCCD, little-endian
+#define BT_BOND_KEY_PREFIX "bt_%d_bond"
+#define BT_BOND_KEY_LEN 32
+// Version, address type, key size, flags, LTK, IRK
+#define BT_BOND_BLOB_LEN (4 + BT_DEVICE_LTK_LEN + BT_DEVICE_IRK_LEN)
+#define BT_BOND_VERSION 1
+#define BT_BOND_FLAG_IRK 0x01
 
 static const char* TAG = "NVS_STORAGE";
 
 #ifdef CONFIG_BT_ENABLED
 static esp_bd_addr_t* mac_cache = NULL;
+static bt_device_bond_t* bond_cache = NULL;    // Same order as mac_cache
 #endif // CONFIG_BT_ENABLED
 
 static int32_t device_count_cache = 0;
+// Guards the cache: the BLE host task reads it while the timer service task changes it
+static SemaphoreHandle_t cache_lock = NULL;
+
+#ifdef CONFIG_BT_ENABLED
+static bt_device_change_cb_t change_cbs[BT_DEVICE_CHANGE_CB_MAX];
+#endif // CONFIG_BT_ENABLED
 
 
 esp_err_t load_bt_count(int32_t* count) {
@@ -67,8 +89,22 @@ esp_err_t save_bt_count(int32_t count) {
     return err;
 }
 
-esp_err_t data_storageInitialize(void) {
-    int32_t dummy_device_count = 0;
+static void lock_cache(void) {
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+}
+
+static void unlock_cache(void) {
+    xSemaphoreGive(cache_lock);
+}
+
+esp_err_t data_storage_flash_init(void) {
+    if (cache_lock == NULL) {
+        cache_lock = xSemaphoreCreateMutex();
+        if (cache_lock == NULL) {
+            ESP_LOGI(TAG, "Failed to create the cache lock");
+            return ESP_ERR_NO_MEM;
+        }
+    }
 
     esp_err_t err = nvs_flash_init();
     if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -77,7 +113,11 @@ esp_err_t data_storageInitialize(void) {
         err = nvs_flash_init();
         ESP_LOGI(TAG, "NVS flash reinit status: %s", esp_err_to_name(err));
     }
-    ESP_ERROR_CHECK(err);
+    return err;
+}
+
+esp_err_t data_storageInitialize(void) {
+    int32_t dummy_device_count = 0;
 
     if (load_bt_count(&dummy_device_count) != ESP_OK) {
         ESP_LOGI(TAG, "Failed to load device count, initializing to 0");
@@ -92,86 +132,263 @@ esp_err_t data_storageInitialize(void) {
 
 
 int32_t get_device_count_cache(void) {
-    return device_count_cache;
+    lock_cache();
+    int32_t count = device_count_cache;
+    unlock_cache();
+    return count;
 }
 
 #ifdef CONFIG_BT_ENABLED
 
-esp_err_t load_all_bt_devices_to_cache(void) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
-        return err;
+// Erases what is stored for a device besides its address and name
+static void erase_device_extras(nvs_handle_t nvs_handle, int index) {
+    char key_key[BT_KEY_KEY_LEN];
+    char cccd_key[BT_CCCD_KEY_LEN];
+    char bond_key[BT_BOND_KEY_LEN];
+    snprintf(key_key, sizeof(key_key), BT_KEY_KEY_PREFIX, index);
+    snprintf(cccd_key, sizeof(cccd_key), BT_CCCD_KEY_PREFIX, index);
+    snprintf(bond_key, sizeof(bond_key), BT_BOND_KEY_PREFIX, index);
+    nvs_erase_key(nvs_handle, key_key);
+    nvs_erase_key(nvs_handle, cccd_key);
+    nvs_erase_key(nvs_handle, bond_key);
+}
+
+// Reads the bond keys of the device at an index; a device without them gets a zero key size
+static void load_bond(nvs_handle_t nvs_handle, int index, bt_device_bond_t* bond) {
+    char bond_key[BT_BOND_KEY_LEN];
+    uint8_t blob[BT_BOND_BLOB_LEN];
+    size_t len = sizeof(blob);
+    snprintf(bond_key, sizeof(bond_key), BT_BOND_KEY_PREFIX, index);
+
+    memset(bond, 0, sizeof(*bond));
+    if (nvs_get_blob(nvs_handle, bond_key, blob, &len) != ESP_OK || len != sizeof(blob) ||
+        blob[0] != BT_BOND_VERSION) {
+        return;
     }
+    bond->addr_type = blob[1];
+    bond->key_size = blob[2];
+    bond->has_irk = (blob[3] & BT_BOND_FLAG_IRK) != 0;
+    memcpy(bond->ltk, &blob[4], BT_DEVICE_LTK_LEN);
+    memcpy(bond->irk, &blob[4 + BT_DEVICE_LTK_LEN], BT_DEVICE_IRK_LEN);
+}
 
-    err = nvs_get_i32(nvs_handle, BT_COUNT_KEY, &device_count_cache);
+// Returns the index a device is stored at, or -1
+static int find_device_index(nvs_handle_t nvs_handle, const esp_bd_addr_t mac) {
+    int32_t count = 0;
+    nvs_get_i32(nvs_handle, BT_COUNT_KEY, &count);
+
+    for (int i = 0; i < count; i++) {
+        char mac_key[BT_MAC_PREFIX_KEY_LEN];
+        esp_bd_addr_t stored_mac;
+        snprintf(mac_key, sizeof(mac_key), BT_MAC_KEY_PREFIX, i);
+
+        size_t mac_len = sizeof(esp_bd_addr_t);
+        if (nvs_get_blob(nvs_handle, mac_key, stored_mac, &mac_len) == ESP_OK && mac_len == sizeof(esp_bd_addr_t) &&
+            memcmp(stored_mac, mac, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Reads the devices stored up to the count, skipping holes; *macs and *bonds are NULL if there are none
+static esp_err_t read_devices(nvs_handle_t nvs_handle, esp_bd_addr_t** macs_out, bt_device_bond_t** bonds_out,
+                              int32_t* count_out) {
+    int32_t stored_count = 0;
+    *macs_out = NULL;
+    *bonds_out = NULL;
+    *count_out = 0;
+
+    esp_err_t err = nvs_get_i32(nvs_handle, BT_COUNT_KEY, &stored_count);
     if (err != ESP_OK) {
         ESP_LOGI(TAG, "Error loading device count: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
         return err;
     }
 
-    ESP_LOGI(TAG, "Device count cache: %ld", device_count_cache);
+    ESP_LOGI(TAG, "Device count cache: %ld", stored_count);
 
-    if (device_count_cache <= 0) {
+    if (stored_count <= 0) {
         ESP_LOGI(TAG, "No devices to load");
-        nvs_close(nvs_handle);
         return ESP_OK;
     }
 
-    if (mac_cache != NULL) {
-        free(mac_cache);
-    }
-
-    mac_cache = malloc(device_count_cache * sizeof(esp_bd_addr_t));
-    if (mac_cache == NULL) {
+    esp_bd_addr_t* macs = malloc(stored_count * sizeof(esp_bd_addr_t));
+    bt_device_bond_t* bonds = malloc(stored_count * sizeof(bt_device_bond_t));
+    if (macs == NULL || bonds == NULL) {
+        free(macs);
+        free(bonds);
         ESP_LOGI(TAG, "Failed to allocate memory for MAC cache");
-        nvs_close(nvs_handle);
         return ESP_ERR_NO_MEM;
     }
 
-    for (int i = 0; i < device_count_cache; i++) {
+    // The delete functions leave holes in the index range; the cache skips them
+    int32_t count = 0;
+    for (int i = 0; i < stored_count; i++) {
         char mac_key[BT_MAC_PREFIX_KEY_LEN];
         snprintf(mac_key, sizeof(mac_key), BT_MAC_KEY_PREFIX, i);
 
         size_t mac_len = sizeof(esp_bd_addr_t);
-        err = nvs_get_blob(nvs_handle, mac_key, mac_cache[i], &mac_len);
-        if (err != ESP_OK) {
+        err = nvs_get_blob(nvs_handle, mac_key, macs[count], &mac_len);
+        if (err == ESP_OK && mac_len == sizeof(esp_bd_addr_t)) {
+            load_bond(nvs_handle, i, &bonds[count]);
+            count++;
+        } else if (err != ESP_ERR_NVS_NOT_FOUND) {
             ESP_LOGI(TAG, "Error loading MAC for index %d: %s", i, esp_err_to_name(err));
-            free(mac_cache);
-            mac_cache = NULL;
-            device_count_cache = 0;
-            nvs_close(nvs_handle);
-            return err;
         }
     }
 
     ESP_LOGI(TAG, "Loaded MAC addresses:");
-    for (int i = 0; i < device_count_cache; i++) {
+    for (int i = 0; i < count; i++) {
         char mac_str[18];
         snprintf(mac_str, sizeof(mac_str), "%02X:%02X:%02X:%02X:%02X:%02X",
-                 mac_cache[i][0], mac_cache[i][1], mac_cache[i][2],
-                 mac_cache[i][3], mac_cache[i][4], mac_cache[i][5]);
-        ESP_LOGI(TAG, "Device %d: %s", i, mac_str);
+                 macs[i][0], macs[i][1], macs[i][2],
+                 macs[i][3], macs[i][4], macs[i][5]);
+        ESP_LOGI(TAG, "Device %d: %s%s", i, mac_str, bonds[i].key_size > 0 ? ", bonded" : "");
     }
 
+    *macs_out = macs;
+    *bonds_out = bonds;
+    *count_out = count;
+    return ESP_OK;
+}
+
+esp_err_t load_all_bt_devices_to_cache(void) {
+    nvs_handle_t nvs_handle;
+    esp_bd_addr_t* macs;
+    bt_device_bond_t* bonds;
+    int32_t count;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // Loaded aside and swapped in, so readers never see a cache half loaded
+    err = read_devices(nvs_handle, &macs, &bonds, &count);
     nvs_close(nvs_handle);
+    if (err == ESP_ERR_NO_MEM) {
+        lock_cache();
+        free(mac_cache);
+        free(bond_cache);
+        mac_cache = NULL;
+        bond_cache = NULL;
+        device_count_cache = 0;
+        unlock_cache();
+        return err;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    lock_cache();
+    esp_bd_addr_t* old_macs = mac_cache;
+    bt_device_bond_t* old_bonds = bond_cache;
+    mac_cache = macs;
+    bond_cache = bonds;
+    device_count_cache = count;
+    unlock_cache();
+    free(old_macs);
+    free(old_bonds);
     return ESP_OK;
 }
 
+esp_err_t add_bt_device_change_callback(bt_device_change_cb_t cb) {
+    for (int i = 0; i < BT_DEVICE_CHANGE_CB_MAX; i++) {
+        if (change_cbs[i] == NULL) {
+            change_cbs[i] = cb;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+static void notify_change(const esp_bd_addr_t mac, bool added) {
+    for (int i = 0; i < BT_DEVICE_CHANGE_CB_MAX && change_cbs[i] != NULL; i++) {
+        change_cbs[i](mac, added);
+    }
+}
+
+// Caller holds the cache lock
+static int find_in_cache(const esp_bd_addr_t mac) {
+    for (int i = 0; mac_cache != NULL && i < device_count_cache; i++) {
+        if (memcmp(mac_cache[i], mac, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Keeps the cache in step with a device saved to NVS
+static void cache_add(const esp_bd_addr_t mac) {
+    lock_cache();
+    if (find_in_cache(mac) >= 0) {
+        unlock_cache();
+        return;
+    }
+    // A new device has no bond yet; delete erased the keys of the one it replaces
+    bt_device_bond_t* grown_bonds = realloc(bond_cache, (device_count_cache + 1) * sizeof(bt_device_bond_t));
+    if (grown_bonds == NULL) {
+        unlock_cache();
+        ESP_LOGI(TAG, "Failed to grow MAC cache");
+        return;
+    }
+    bond_cache = grown_bonds;
+    esp_bd_addr_t* grown = realloc(mac_cache, (device_count_cache + 1) * sizeof(esp_bd_addr_t));
+    if (grown == NULL) {
+        unlock_cache();
+        ESP_LOGI(TAG, "Failed to grow MAC cache");
+        return;
+    }
+    mac_cache = grown;
+    memset(&bond_cache[device_count_cache], 0, sizeof(bt_device_bond_t));
+    memcpy(mac_cache[device_count_cache++], mac, sizeof(esp_bd_addr_t));
+    unlock_cache();
+    // Outside the lock, as the callbacks read the cache
+    notify_change(mac, true);
+}
+
+// Keeps the cache in step with a device deleted from NVS
+static void cache_remove(const esp_bd_addr_t mac) {
+    lock_cache();
+    int index = find_in_cache(mac);
+    if (index < 0) {
+        unlock_cache();
+        return;
+    }
+    device_count_cache--;
+    memmove(mac_cache[index], mac_cache[index + 1], (device_count_cache - index) * sizeof(esp_bd_addr_t));
+    memmove(&bond_cache[index], &bond_cache[index + 1], (device_count_cache - index) * sizeof(bt_device_bond_t));
+    unlock_cache();
+    notify_change(mac, false);
+}
+
+// Copies the last device in the cache; returns false if the cache is empty
+static bool cache_last(esp_bd_addr_t mac) {
+    lock_cache();
+    bool found = mac_cache != NULL && device_count_cache > 0;
+    if (found) {
+        memcpy(mac, mac_cache[device_count_cache - 1], sizeof(esp_bd_addr_t));
+    }
+    unlock_cache();
+    return found;
+}
+
 esp_err_t get_bt_device_mac_from_cache(int index, esp_bd_addr_t* mac) {
+    lock_cache();
     if (index < 0 || index >= device_count_cache) {
+        unlock_cache();
         ESP_LOGI(TAG, "Index out of bounds: %d", index);
         return ESP_ERR_INVALID_ARG;
     }
 
     if (mac_cache == NULL) {
+        unlock_cache();
         ESP_LOGI(TAG, "MAC cache is not initialized");
         return ESP_ERR_INVALID_STATE;
     }
 
     memcpy(mac, mac_cache[index], sizeof(esp_bd_addr_t));
+    unlock_cache();
     return ESP_OK;
 }
 
@@ -205,11 +422,275 @@ esp_err_t save_bt_device(int index, esp_bd_addr_t mac, const char* name) {
         return err;
     }
 
+    err = nvs_commit(nvs_handle);
+    nvs_close(nvs_handle);
+    if (err == ESP_OK) {
+        cache_add(mac);
+    }
+    return err;
+}
+
+esp_err_t save_last_peer(const esp_bd_addr_t mac, uint8_t addr_type) {
+    uint8_t blob[sizeof(esp_bd_addr_t) + 1];
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    memcpy(blob, mac, sizeof(esp_bd_addr_t));
+    blob[sizeof(esp_bd_addr_t)] = addr_type;
+    err = nvs_set_blob(nvs_handle, BT_LAST_PEER_KEY, blob, sizeof(blob));
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error saving last peer: %s", esp_err_to_name(err));
+        nvs_close(nvs_handle);
+        return err;
+    }
+
+    err = nvs_commit(nvs_handle);
+    nvs_close(nvs_handle);
+    return err;
+}
+
+esp_err_t load_last_peer(esp_bd_addr_t mac, uint8_t* addr_type) {
+    uint8_t blob[sizeof(esp_bd_addr_t) + 1];
+    size_t len = sizeof(blob);
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_get_blob(nvs_handle, BT_LAST_PEER_KEY, blob, &len);
+    nvs_close(nvs_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (len != sizeof(blob)) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(mac, blob, sizeof(esp_bd_addr_t));
+    *addr_type = blob[sizeof(esp_bd_addr_t)];
+    return ESP_OK;
+}
+
+int load_bt_device_keys(uint8_t (*keys)[BT_DEVICE_KEY_LEN], int max) {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return 0;
+    }
+
+    int32_t count = 0;
+    nvs_get_i32(nvs_handle, BT_COUNT_KEY, &count);
+
+    // A key is only kept for a device that is stored, so holes have none
+    int loaded = 0;
+    for (int i = 0; i < count && loaded < max; i++) {
+        char key_key[BT_KEY_KEY_LEN];
+        snprintf(key_key, sizeof(key_key), BT_KEY_KEY_PREFIX, i);
+
+        size_t key_len = BT_DEVICE_KEY_LEN;
+        if (nvs_get_blob(nvs_handle, key_key, keys[loaded], &key_len) == ESP_OK && key_len == BT_DEVICE_KEY_LEN) {
+            loaded++;
+        }
+    }
+
+    nvs_close(nvs_handle);
+    return loaded;
+}
+
+// Batches are declared with the batch functions at the end of this file
+static bool batch_open(void);
+
+esp_err_t save_bt_device_cccd(const esp_bd_addr_t mac, uint16_t cccd, uint16_t dump_cccd) {
+    // A batch may have removed the device already, and the values would outlive it
+    if (batch_open()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    int index = find_device_index(nvs_handle, mac);
+    if (index < 0) {
+        nvs_close(nvs_handle);
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    char cccd_key[BT_CCCD_KEY_LEN];
+    uint8_t blob[BT_CCCD_BLOB_LEN] = { cccd & 0xFF, cccd >> 8, dump_cccd & 0xFF, dump_cccd >> 8 };
+    snprintf(cccd_key, sizeof(cccd_key), BT_CCCD_KEY_PREFIX, index);
+    err = nvs_set_blob(nvs_handle, cccd_key, blob, sizeof(blob));
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error saving CCCD: %s", esp_err_to_name(err));
+        nvs_close(nvs_handle);
+        return err;
+    }
+
     err = nvs_commit(nvs_handle);
     nvs_close(nvs_handle);
     return err;
 }
 
+esp_err_t load_bt_device_cccd(const esp_bd_addr_t mac, uint16_t* cccd, uint16_t* dump_cccd) {
+    *cccd = 0;
+    *dump_cccd = 0;
+    // Most connections on an open remote are from phones that are not stored
+    lock_cache();
+    bool stored = find_in_cache(mac) >= 0;
+    unlock_cache();
+    if (!stored) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    int index = find_device_index(nvs_handle, mac);
+    if (index < 0) {
+        nvs_close(nvs_handle);
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    char cccd_key[BT_CCCD_KEY_LEN];
+    uint8_t blob[BT_CCCD_BLOB_LEN];
+    size_t len = sizeof(blob);
+    snprintf(cccd_key, sizeof(cccd_key), BT_CCCD_KEY_PREFIX, index);
+    if (nvs_get_blob(nvs_handle, cccd_key, blob, &len) == ESP_OK && len == sizeof(blob)) {
+        *cccd = blob[0] | blob[1] << 8;
+        *dump_cccd = blob[2] | blob[3] << 8;
+    }
+
+    nvs_close(nvs_handle);
+    return ESP_OK;
+}
+
+// Writes or, for a NULL bond, erases the bond keys of a stored device and updates the cache
+static esp_err_t store_bond(const esp_bd_addr_t mac, const bt_device_bond_t* bond) {
+    // A batch may have removed the device already, and the keys would outlive it
+    if (batch_open()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    int index = find_device_index(nvs_handle, mac);
+    if (index < 0) {
+        nvs_close(nvs_handle);
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    char bond_key[BT_BOND_KEY_LEN];
+    snprintf(bond_key, sizeof(bond_key), BT_BOND_KEY_PREFIX, index);
+    if (bond != NULL) {
+        uint8_t blob[BT_BOND_BLOB_LEN] = {
+            BT_BOND_VERSION, bond->addr_type, bond->key_size, bond->has_irk ? BT_BOND_FLAG_IRK : 0,
+        };
+        memcpy(&blob[4], bond->ltk, BT_DEVICE_LTK_LEN);
+        memcpy(&blob[4 + BT_DEVICE_LTK_LEN], bond->irk, BT_DEVICE_IRK_LEN);
+        err = nvs_set_blob(nvs_handle, bond_key, blob, sizeof(blob));
+    } else {
+        err = nvs_erase_key(nvs_handle, bond_key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error saving bond: %s", esp_err_to_name(err));
+        nvs_close(nvs_handle);
+        return err;
+    }
+
+    err = nvs_commit(nvs_handle);
+    nvs_close(nvs_handle);
+    lock_cache();
+    int cached = find_in_cache(mac);
+    if (err == ESP_OK && cached >= 0) {
+        if (bond != NULL) {
+            bond_cache[cached] = *bond;
+        } else {
+            memset(&bond_cache[cached], 0, sizeof(bt_device_bond_t));
+        }
+    }
+    unlock_cache();
+    return err;
+}
+
+esp_err_t save_bt_device_bond(const esp_bd_addr_t mac, const bt_device_bond_t* bond) {
+    if (bond->key_size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return store_bond(mac, bond);
+}
+
+esp_err_t erase_bt_device_bond(const esp_bd_addr_t mac) {
+    return store_bond(mac, NULL);
+}
+
+esp_err_t load_bt_device_bond(const esp_bd_addr_t mac, bt_device_bond_t* bond) {
+    // Copied out under the lock, as a commit may move or free the entry right after
+    lock_cache();
+    int index = find_in_cache(mac);
+    if (index < 0) {
+        unlock_cache();
+        memset(bond, 0, sizeof(*bond));
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    *bond = bond_cache[index];
+    unlock_cache();
+    return ESP_OK;
+}
+
+esp_err_t save_beacon_counter(uint32_t counter) {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_u32(nvs_handle, BEACON_COUNTER_KEY, counter);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error saving beacon counter: %s", esp_err_to_name(err));
+        nvs_close(nvs_handle);
+        return err;
+    }
+
+    err = nvs_commit(nvs_handle);
+    nvs_close(nvs_handle);
+    return err;
+}
+
+esp_err_t load_beacon_counter(uint32_t* counter) {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_get_u32(nvs_handle, BEACON_COUNTER_KEY, counter);
+    nvs_close(nvs_handle);
+    return err;
+}
+
 esp_err_t load_bt_device(int index, esp_bd_addr_t* mac, char* name, size_t name_len) {
     nvs_handle_t nvs_handle;
     esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READONLY, &nvs_handle);
@@ -245,18 +726,16 @@ esp_err_t load_bt_device(int index, esp_bd_addr_t* mac, char* name, size_t name_
 }
 
 bool is_bt_device_exist_in_cache(esp_bd_addr_t mac_to_check) {
+    lock_cache();
     if (mac_cache == NULL) {
+        unlock_cache();
         ESP_LOGI(TAG, "MAC cache is not initialized");
         return false;
     }
 
-    for (int i = 0; i < device_count_cache; i++) {
-        if (memcmp(mac_cache[i], mac_to_check, sizeof(esp_bd_addr_t)) == 0) {
-            return true;
-        }
-    }
-
-    return false;
+    bool found = find_in_cache(mac_to_check) >= 0;
+    unlock_cache();
+    return found;
 }
 
 bool is_bt_device_exist(esp_bd_addr_t mac_to_check) {
@@ -321,6 +800,7 @@ esp_err_t delete_all_bt_devices(void) {
 
         nvs_erase_key(nvs_handle, mac_key);
         nvs_erase_key(nvs_handle, name_key);
+        erase_device_extras(nvs_handle, i);
     }
 
     nvs_erase_key(nvs_handle, BT_COUNT_KEY);
@@ -328,12 +808,18 @@ esp_err_t delete_all_bt_devices(void) {
     err = nvs_commit(nvs_handle);
     nvs_close(nvs_handle);
 
-    // Clear the cache
+    // Clear the cache one device at a time, so the change callback sees each go
+    esp_bd_addr_t mac;
+    while (cache_last(mac)) {
+        cache_remove(mac);
+    }
+    lock_cache();
     device_count_cache = 0;
-    if (mac_cache != NULL) {
-        free(mac_cache);
-        mac_cache = NULL;
-    }    
+    free(mac_cache);
+    mac_cache = NULL;
+    free(bond_cache);
+    bond_cache = NULL;
+    unlock_cache();
 
     return err;
 }
@@ -367,9 +853,13 @@ esp_err_t delete_bt_device(esp_bd_addr_t mac_to_check) {
 
             nvs_erase_key(nvs_handle, mac_key);
             nvs_erase_key(nvs_handle, name_key);
+            erase_device_extras(nvs_handle, i);
 
             err = nvs_commit(nvs_handle);
             nvs_close(nvs_handle);
+            if (err == ESP_OK) {
+                cache_remove(mac);
+            }
             return err;
         }
     }
@@ -391,6 +881,10 @@ esp_err_t delete_bt_device_by_index(int index) {
     snprintf(mac_key, sizeof(mac_key), BT_MAC_KEY_PREFIX, index);
     snprintf(name_key, sizeof(name_key), BT_NAME_KEY_PREFIX, index);
 
+    esp_bd_addr_t mac;
+    size_t mac_len = sizeof(mac);
+    bool have_mac = nvs_get_blob(nvs_handle, mac_key, mac, &mac_len) == ESP_OK && mac_len == sizeof(mac);
+
     err = nvs_erase_key(nvs_handle, mac_key);
     if (err == ESP_ERR_NVS_NOT_FOUND) {
         nvs_close(nvs_handle);
@@ -398,9 +892,13 @@ esp_err_t delete_bt_device_by_index(int index) {
     }
 
     nvs_erase_key(nvs_handle, name_key);
+    erase_device_extras(nvs_handle, index);
 
     err = nvs_commit(nvs_handle);
     nvs_close(nvs_handle);
+    if (err == ESP_OK && have_mac) {
+        cache_remove(mac);
+    }
     return err;
 }
 
@@ -431,11 +929,19 @@ esp_err_t delete_bt_device_by_name(const char* name) {
             char mac_key[BT_MAC_PREFIX_KEY_LEN];
             snprintf(mac_key, sizeof(mac_key), BT_MAC_KEY_PREFIX, i);
 
+            esp_bd_addr_t mac;
+            size_t mac_len = sizeof(mac);
+            bool have_mac = nvs_get_blob(nvs_handle, mac_key, mac, &mac_len) == ESP_OK && mac_len == sizeof(mac);
+
             nvs_erase_key(nvs_handle, mac_key);
             nvs_erase_key(nvs_handle, name_key);
+            erase_device_extras(nvs_handle, i);
 
             err = nvs_commit(nvs_handle);
             nvs_close(nvs_handle);
+            if (err == ESP_OK && have_mac) {
+                cache_remove(mac);
+            }
             return err;
         }
     }
@@ -489,13 +995,16 @@ esp_err_t update_bt_device_name(esp_bd_addr_t mac, const char* new_name) {
 }
 
 esp_err_t get_paired_mac_list_from_cache(char* device_mac_list, size_t list_len) {
+    lock_cache();
     if (mac_cache == NULL) {
+        unlock_cache();
         ESP_LOGI(TAG, "MAC cache is not initialized");
         return ESP_ERR_INVALID_STATE;
     }
 
     size_t required_len = device_count_cache * 18; // Each MAC address is 17 chars + 1 for ','
     if (list_len < required_len) {
+        unlock_cache();
         ESP_LOGI(TAG, "Provided buffer is too small. Required: %zu, Provided: %zu", required_len, list_len);
         return ESP_ERR_INVALID_SIZE;
     }
@@ -520,15 +1029,351 @@ esp_err_t get_paired_mac_list_from_cache(char* device_mac_list, size_t list_len)
         ptr--; // Remove the last comma
     }
     *ptr = '\0'; // Null-terminate the string
-    ESP_LOGE(TAG, "Paired MAC list: %s", device_mac_list);
+    unlock_cache();
+    ESP_LOGD(TAG, "Paired MAC list: %s", device_mac_list);
     if (ptr - device_mac_list >= list_len) {
         ESP_LOGI(TAG, "Buffer overflow detected");
         return ESP_ERR_NO_MEM;
     }
-    ESP_LOGE(TAG, "Paired MAC list length: %zu", ptr - device_mac_list);
+    ESP_LOGD(TAG, "Paired MAC list length: %zu", ptr - device_mac_list);
 
     return ESP_OK;
 }
 
+// Brings the cache in step with flash, calling back for every device that came or went
+static void cache_resync(nvs_handle_t nvs_handle) {
+    esp_bd_addr_t* macs;
+    bt_device_bond_t* bonds;
+    int32_t count;
+
+    if (read_devices(nvs_handle, &macs, &bonds, &count) != ESP_OK) {
+        ESP_LOGI(TAG, "Failed to read the devices back, the cache may not match flash");
+        return;
+    }
+    for (int i = get_device_count_cache() - 1; i >= 0; i--) {
+        esp_bd_addr_t mac;
+        bool stored = false;
+        if (get_bt_device_mac_from_cache(i, &mac) != ESP_OK) {
+            continue;
+        }
+        for (int j = 0; j < count && !stored; j++) {
+            stored = memcmp(macs[j], mac, sizeof(esp_bd_addr_t)) == 0;
+        }
+        if (!stored) {
+            cache_remove(mac);
+        }
+    }
+    for (int j = 0; j < count; j++) {
+        cache_add(macs[j]);
+        // A device erased and written again lost its keys
+        lock_cache();
+        int index = find_in_cache(macs[j]);
+        if (index >= 0) {
+            bond_cache[index] = bonds[j];
+        }
+        unlock_cache();
+    }
+    free(macs);
+    free(bonds);
+}
+
+/*
+ * Batches: the registry is read into slots once and every change is staged in them.
+ * The commit writes the changes on one handle, then the count, and updates the cache;
+ * flash is not touched before, so an aborted batch leaves nothing behind. NVS writes
+ * every entry as it is set, so a commit that fails after the first write leaves part of
+ * the batch in flash; the cache is then read back from flash, as a reboot would.
+ */
+
+typedef struct {
+    bool used;          // Holds a device once the batch is committed
+    bool added;         // The device was added by the batch; its address is written on commit
+    bool erase;         // The device stored here when the batch began goes, with its keys and CCCDs
+    bool name_set;
+    bool key_set;
+    esp_bd_addr_t mac;
+    char name[BT_DEVICE_NAME_MAX + 1];
+    uint8_t key[BT_DEVICE_KEY_LEN];
+} batch_slot_t;
+
+static nvs_handle_t batch_handle;
+static batch_slot_t* batch_slots = NULL;
+static int32_t batch_count;         // Indices in use, holes included
+static int32_t batch_cap;
+
+static int batch_find(const esp_bd_addr_t mac) {
+    for (int i = 0; i < batch_count; i++) {
+        if (batch_slots[i].used && memcmp(batch_slots[i].mac, mac, sizeof(esp_bd_addr_t)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static esp_err_t batch_set_name(int index, const char* name) {
+    if (strlen(name) > BT_DEVICE_NAME_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    strcpy(batch_slots[index].name, name);
+    batch_slots[index].name_set = true;
+    return ESP_OK;
+}
+
+static void batch_erase(int index) {
+    batch_slot_t* slot = &batch_slots[index];
+
+    // A device the batch added was never written; one stored before is erased on commit
+    slot->erase = slot->erase || !slot->added;
+    slot->used = false;
+    slot->added = false;
+    slot->name_set = false;
+    slot->key_set = false;
+}
+
+// Writes the staged changes of one index; sets *written once it may have changed flash
+static esp_err_t batch_write(int index, bool* written) {
+    const batch_slot_t* slot = &batch_slots[index];
+    char mac_key[BT_MAC_PREFIX_KEY_LEN];
+    char name_key[BT_NAME_KEY_LEN];
+    char key_key[BT_KEY_KEY_LEN];
+    esp_err_t err = ESP_OK;
+    snprintf(mac_key, sizeof(mac_key), BT_MAC_KEY_PREFIX, index);
+    snprintf(name_key, sizeof(name_key), BT_NAME_KEY_PREFIX, index);
+    snprintf(key_key, sizeof(key_key), BT_KEY_KEY_PREFIX, index);
+
+    if (slot->erase) {
+        nvs_erase_key(batch_handle, mac_key);
+        nvs_erase_key(batch_handle, name_key);
+        erase_device_extras(batch_handle, index);
+        *written = true;
+    }
+    if (!slot->used) {
+        return ESP_OK;
+    }
+    if (slot->added) {
+        err = nvs_set_blob(batch_handle, mac_key, slot->mac, sizeof(esp_bd_addr_t));
+        *written |= err == ESP_OK;
+    }
+    if (err == ESP_OK && slot->name_set) {
+        err = nvs_set_str(batch_handle, name_key, slot->name);
+        *written |= err == ESP_OK;
+    }
+    if (err == ESP_OK && slot->key_set) {
+        err = nvs_set_blob(batch_handle, key_key, slot->key, BT_DEVICE_KEY_LEN);
+        *written |= err == ESP_OK;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error saving device %d: %s", index, esp_err_to_name(err));
+    }
+    return err;
+}
+
+static bool batch_open(void) {
+    return batch_slots != NULL;
+}
+
+static void batch_close(void) {
+    nvs_close(batch_handle);
+    free(batch_slots);
+    batch_slots = NULL;
+}
+
+esp_err_t bt_device_batch_begin(int max_devices) {
+    if (batch_slots != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = nvs_open(NVS_BT_STORAGE, NVS_READWRITE, &batch_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    batch_count = 0;
+    err = nvs_get_i32(batch_handle, BT_COUNT_KEY, &batch_count);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "Error loading count: %s", esp_err_to_name(err));
+        nvs_close(batch_handle);
+        return err;
+    }
+    if (batch_count < 0) {
+        batch_count = 0;
+    }
+
+    batch_cap = batch_count > max_devices ? batch_count : max_devices;
+    batch_slots = calloc(batch_cap > 0 ? batch_cap : 1, sizeof(batch_slot_t));
+    if (batch_slots == NULL) {
+        nvs_close(batch_handle);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < batch_count; i++) {
+        char mac_key[BT_MAC_PREFIX_KEY_LEN];
+        snprintf(mac_key, sizeof(mac_key), BT_MAC_KEY_PREFIX, i);
+
+        size_t mac_len = sizeof(esp_bd_addr_t);
+        batch_slots[i].used = nvs_get_blob(batch_handle, mac_key, batch_slots[i].mac, &mac_len) == ESP_OK &&
+                              mac_len == sizeof(esp_bd_addr_t);
+    }
+    return ESP_OK;
+}
+
+esp_err_t bt_device_batch_add(const esp_bd_addr_t mac, const char* name) {
+    if (strlen(name) > BT_DEVICE_NAME_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    int index = batch_find(mac);
+    if (index >= 0) {
+        return batch_set_name(index, name);
+    }
+
+    // Fill the first hole before growing the index range
+    for (index = 0; index < batch_count && batch_slots[index].used; index++) {
+    }
+    if (index == batch_cap) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    batch_slots[index].used = true;
+    batch_slots[index].added = true;
+    memcpy(batch_slots[index].mac, mac, sizeof(esp_bd_addr_t));
+    batch_set_name(index, name);
+    if (index == batch_count) {
+        batch_count++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t bt_device_batch_remove(const esp_bd_addr_t mac) {
+    int index = batch_find(mac);
+    if (index < 0) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    batch_erase(index);
+    return ESP_OK;
+}
+
+esp_err_t bt_device_batch_rename(const esp_bd_addr_t mac, const char* name) {
+    int index = batch_find(mac);
+    if (index < 0) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    return batch_set_name(index, name);
+}
+
+esp_err_t bt_device_batch_set_key(const esp_bd_addr_t mac, const uint8_t key[BT_DEVICE_KEY_LEN]) {
+    int index = batch_find(mac);
+    if (index < 0) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    memcpy(batch_slots[index].key, key, BT_DEVICE_KEY_LEN);
+    batch_slots[index].key_set = true;
+    return ESP_OK;
+}
+
+void bt_device_batch_clear(void) {
+    for (int i = 0; i < batch_count; i++) {
+        if (batch_slots[i].used) {
+            batch_erase(i);
+        }
+    }
+}
+
+int bt_device_batch_size(void) {
+    int size = 0;
+    for (int i = 0; i < batch_count; i++) {
+        size += batch_slots[i].used;
+    }
+    return size;
+}
+
+esp_err_t bt_device_batch_get(int position, esp_bd_addr_t mac, char* name, size_t name_len) {
+    for (int i = 0; i < batch_count; i++) {
+        if (!batch_slots[i].used || position-- > 0) {
+            continue;
+        }
+        memcpy(mac, batch_slots[i].mac, sizeof(esp_bd_addr_t));
+        if (batch_slots[i].name_set) {
+            snprintf(name, name_len, "%s", batch_slots[i].name);
+            return ESP_OK;
+        }
+
+        // Not renamed, so the name in flash is the device's
+        char name_key[BT_NAME_KEY_LEN];
+        snprintf(name_key, sizeof(name_key), BT_NAME_KEY_PREFIX, i);
+        size_t len = name_len;
+        if (nvs_get_str(batch_handle, name_key, name, &len) != ESP_OK) {
+            name[0] = '\0';
+        }
+        return ESP_OK;
+    }
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t bt_device_batch_commit(bool* partial) {
+    esp_err_t err = ESP_OK;
+    bool written = false;
+
+    if (partial != NULL) {
+        *partial = false;
+    }
+    // Trailing holes too: a device removed from the end still has keys and CCCDs to erase
+    for (int i = 0; i < batch_count && err == ESP_OK; i++) {
+        err = batch_write(i, &written);
+    }
+
+    // Trailing holes are dropped from the index range, inner ones are reused by later adds
+    while (batch_count > 0 && !batch_slots[batch_count - 1].used) {
+        batch_count--;
+    }
+
+    if (err == ESP_OK) {
+        err = nvs_set_i32(batch_handle, BT_COUNT_KEY, batch_count);
+        written |= err == ESP_OK;
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(batch_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "Error committing device batch%s: %s", written ? ", partly written" : "",
+                 esp_err_to_name(err));
+        if (written) {
+            cache_resync(batch_handle);
+        }
+        if (partial != NULL) {
+            *partial = written;
+        }
+        batch_close();
+        return err;
+    }
+
+    // Bring the cache in step, so the change callback sees every device that came or went.
+    // A device removed and added again lost its keys, so it goes and comes back as well.
+    for (int i = get_device_count_cache() - 1; i >= 0; i--) {
+        esp_bd_addr_t mac;
+        if (get_bt_device_mac_from_cache(i, &mac) != ESP_OK) {
+            continue;
+        }
+        int index = batch_find(mac);
+        if (index < 0 || batch_slots[index].added) {
+            cache_remove(mac);
+        }
+    }
+    for (int i = 0; i < batch_count; i++) {
+        if (batch_slots[i].used) {
+            cache_add(batch_slots[i].mac);
+        }
+    }
+
+    batch_close();
+    return ESP_OK;
+}
+
+void bt_device_batch_abort(void) {
+    if (batch_slots != NULL) {
+        batch_close();
+    }
+}
+
 #endif // CONFIG_BT_ENABLED
-#endif // CONFIG_NVS_ENABLE
\ No newline at end of file
+#endif // CONFIG_NVS_ENABLE
@@ -2,20 +2,37 @@
 #define DATA_STORAGE_H
 
 #if CONFIG_BT_ENABLED
-#include "esp_bt_defs.h" // For esp_bd_addr_t
+#include "ble_types.h"   // For esp_bd_addr_t
 #endif // CONFIG_BT_ENABLED
 
 #include "esp_err.h"     // For esp_err_t
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief Initializes the NVS flash partition, erasing it if its layout is outdated.
+ *
+ * The BLE controller keeps its PHY calibration in NVS and the host its configuration,
+ * so this must run before ble_server_init(). It also creates the lock of the device
+ * cache, which the BLE host task reads while other tasks change it; everything else in
+ * this module may run alongside the BLE bring-up.
+ *
+ * @return
+ *     - ESP_OK: If NVS is ready.
+ *     - ESP_ERR_NO_MEM: If the cache lock could not be created.
+ *     - Other error codes on failure.
+ */
+esp_err_t data_storage_flash_init(void);
+
 /**
  * @brief Initializes the data storage system.
  *
- * This function sets up the non-volatile storage (NVS) for storing Bluetooth device data.
- * It must be called before using any other functions in this module.
+ * This function sets up the Bluetooth device count in non-volatile storage (NVS).
+ * It must be called after data_storage_flash_init() and before using any other
+ * functions in this module.
  * 
  * @return
  *     - ESP_OK: If the initialization was successful.
@@ -42,6 +59,143 @@ esp_err_t save_bt_count(int32_t count);
  */
 esp_err_t save_bt_device(int index, esp_bd_addr_t mac, const char* name);
 
+/**
+ * @brief Saves the address of the phone that connected last.
+ *
+ * Used to advertise directly to it after a disconnect or reset.
+ *
+ * @param mac MAC address of the phone.
+ * @param addr_type Its address type (esp_ble_addr_type_t).
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t save_last_peer(const esp_bd_addr_t mac, uint8_t addr_type);
+
+/**
+ * @brief Loads the address saved by save_last_peer().
+ *
+ * @param mac Output MAC address of the phone.
+ * @param addr_type Output address type.
+ * @return
+ *     - ESP_OK: If an address was loaded.
+ *     - ESP_ERR_NVS_NOT_FOUND: If no phone has connected yet.
+ *     - Other error codes on failure.
+ */
+esp_err_t load_last_peer(esp_bd_addr_t mac, uint8_t* addr_type);
+
+#define BT_DEVICE_KEY_LEN 16
+
+/**
+ * @brief Loads the event broadcast keys of the stored devices.
+ *
+ * Keys are set with bt_device_batch_set_key() and erased with their device.
+ *
+ * @param keys Output array of keys, in the order the devices are stored.
+ * @param max Size of the output array.
+ * @return Number of keys loaded. Devices without a key are skipped.
+ */
+int load_bt_device_keys(uint8_t (*keys)[BT_DEVICE_KEY_LEN], int max);
+
+/**
+ * @brief Saves the CCCD values a bonded device wrote, so they can be restored when it reconnects.
+ *
+ * The values are erased with their device.
+ *
+ * @param mac MAC address of the device.
+ * @param cccd CCCD of the remote characteristic.
+ * @param dump_cccd CCCD of the dump characteristic.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NVS_NOT_FOUND: If the device is not stored.
+ *     - ESP_ERR_INVALID_STATE: If a batch is open.
+ *     - Other error codes on failure.
+ */
+esp_err_t save_bt_device_cccd(const esp_bd_addr_t mac, uint16_t cccd, uint16_t dump_cccd);
+
+/**
+ * @brief Loads the CCCD values saved by save_bt_device_cccd().
+ *
+ * @param mac MAC address of the device.
+ * @param cccd Output CCCD of the remote characteristic, 0 if none was saved.
+ * @param dump_cccd Output CCCD of the dump characteristic, 0 if none was saved.
+ * @return
+ *     - ESP_OK: If the device is stored, whether or not values were saved for it.
+ *     - ESP_ERR_NVS_NOT_FOUND: If the device is not stored.
+ *     - Other error codes on failure.
+ */
+esp_err_t load_bt_device_cccd(const esp_bd_addr_t mac, uint16_t* cccd, uint16_t* dump_cccd);
+
+#define BT_DEVICE_LTK_LEN 16
+#define BT_DEVICE_IRK_LEN 16
+
+/**
+ * @brief Keys of an LE Secure Connections bond, kept with the device they belong to.
+ */
+typedef struct {
+    uint8_t addr_type;                  // Type of the device's identity address (esp_ble_addr_type_t)
+    uint8_t key_size;                   // Encryption key size in octets, 0 if the device is not bonded
+    bool has_irk;                       // The device uses resolvable private addresses
+    uint8_t ltk[BT_DEVICE_LTK_LEN];     // Long term key
+    uint8_t irk[BT_DEVICE_IRK_LEN];     // The device's identity resolving key
+} bt_device_bond_t;
+
+/**
+ * @brief Saves the bond keys of a stored device.
+ *
+ * The keys are loaded into the cache with the device and erased with it.
+ *
+ * @param mac MAC address of the device, its identity address.
+ * @param bond Keys, with a non-zero key size.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_INVALID_ARG: If the key size is 0.
+ *     - ESP_ERR_NVS_NOT_FOUND: If the device is not stored.
+ *     - ESP_ERR_INVALID_STATE: If a batch is open.
+ *     - Other error codes on failure.
+ */
+esp_err_t save_bt_device_bond(const esp_bd_addr_t mac, const bt_device_bond_t* bond);
+
+/**
+ * @brief Erases the bond keys of a stored device, keeping the device.
+ *
+ * @param mac MAC address of the device.
+ * @return
+ *     - ESP_OK: On success, also if the device had no keys.
+ *     - ESP_ERR_NVS_NOT_FOUND: If the device is not stored.
+ *     - ESP_ERR_INVALID_STATE: If a batch is open.
+ *     - Other error codes on failure.
+ */
+esp_err_t erase_bt_device_bond(const esp_bd_addr_t mac);
+
+/**
+ * @brief Reads the bond keys of a device from the cache.
+ *
+ * @param mac MAC address of the device.
+ * @param bond Output keys; the key size is 0 if the device has none.
+ * @return
+ *     - ESP_OK: If the device is in the cache, bonded or not.
+ *     - ESP_ERR_NVS_NOT_FOUND: If it is not.
+ */
+esp_err_t load_bt_device_bond(const esp_bd_addr_t mac, bt_device_bond_t* bond);
+
+/**
+ * @brief Saves the event broadcast counter.
+ *
+ * @param counter First counter value not used yet.
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t save_beacon_counter(uint32_t counter);
+
+/**
+ * @brief Loads the counter saved by save_beacon_counter().
+ *
+ * @param counter Output counter.
+ * @return
+ *     - ESP_OK: If a counter was loaded.
+ *     - ESP_ERR_NVS_NOT_FOUND: If none was saved yet.
+ *     - Other error codes on failure.
+ */
+esp_err_t load_beacon_counter(uint32_t* counter);
+
 /**
  * @brief 
  *
@@ -229,6 +383,144 @@ int32_t get_device_count_cache(void);
  */
 esp_err_t get_paired_mac_list_from_cache(char* device_mac_list, size_t list_len);
 
+/**
+ * @brief Called when a device is added to or removed from the cache.
+ *
+ * @param mac   MAC address of the device.
+ * @param added true if the device was added, false if it was removed.
+ */
+typedef void (*bt_device_change_cb_t)(const esp_bd_addr_t mac, bool added);
+
+#define BT_DEVICE_CHANGE_CB_MAX 2
+
+/**
+ * @brief Registers a function to call on every change to the cache after it was loaded.
+ *
+ * save_bt_device() adds a new device to the cache and the delete functions remove it.
+ * The callbacks run in the task that made the change, in the order they were added.
+ *
+ * @param cb Function to call.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NO_MEM: If BT_DEVICE_CHANGE_CB_MAX functions are registered already.
+ */
+esp_err_t add_bt_device_change_callback(bt_device_change_cb_t cb);
+
+/*
+ * Batches change several devices with a single nvs_commit(). Between
+ * bt_device_batch_begin() and bt_device_batch_commit() the changes are staged in RAM
+ * and seen by bt_device_batch_get(), but not by flash, the cache or the other functions
+ * of this module, so an aborted batch changes nothing. The commit writes them on one
+ * open handle, then the count, and updates the cache; the change callback then runs
+ * once for every device added or removed. A device removed and added again in the same
+ * batch loses its keys and CCCDs, and is reported as removed and added. NVS writes each
+ * entry as it is set, so a commit that fails part way leaves some of the changes in
+ * flash; the commit then reads the cache back from flash, so it holds what a reboot
+ * would load, and calls back for the devices that came or went.
+ * Only one batch can be open at a time, and nothing else may change the devices while
+ * it is.
+ */
+
+#define BT_DEVICE_NAME_MAX 32       // Longest name a batch takes, in bytes
+
+/**
+ * @brief Opens a batch of device changes.
+ *
+ * @param max_devices Number of devices the batch may grow the registry to.
+ * @return
+ *     - ESP_OK: If the batch is open.
+ *     - ESP_ERR_INVALID_STATE: If another batch is open.
+ *     - Other error codes if the registry could not be read.
+ */
+esp_err_t bt_device_batch_begin(int max_devices);
+
+/**
+ * @brief Adds a device, or renames it if it is already stored.
+ *
+ * @param mac MAC address of the device.
+ * @param name Name of the device.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NO_MEM: If the registry holds max_devices devices.
+ *     - ESP_ERR_INVALID_SIZE: If the name is longer than BT_DEVICE_NAME_MAX.
+ */
+esp_err_t bt_device_batch_add(const esp_bd_addr_t mac, const char* name);
+
+/**
+ * @brief Removes a device.
+ *
+ * @param mac MAC address of the device.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NVS_NOT_FOUND: If the device is not stored.
+ */
+esp_err_t bt_device_batch_remove(const esp_bd_addr_t mac);
+
+/**
+ * @brief Renames a device.
+ *
+ * @param mac MAC address of the device.
+ * @param name New name of the device.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NVS_NOT_FOUND: If the device is not stored.
+ *     - ESP_ERR_INVALID_SIZE: If the name is longer than BT_DEVICE_NAME_MAX.
+ */
+esp_err_t bt_device_batch_rename(const esp_bd_addr_t mac, const char* name);
+
+/**
+ * @brief Sets the event broadcast key of a device.
+ *
+ * @param mac MAC address of the device.
+ * @param key Key, BT_DEVICE_KEY_LEN bytes.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NVS_NOT_FOUND: If the device is not stored.
+ */
+esp_err_t bt_device_batch_set_key(const esp_bd_addr_t mac, const uint8_t key[BT_DEVICE_KEY_LEN]);
+
+/**
+ * @brief Removes every device.
+ */
+void bt_device_batch_clear(void);
+
+/**
+ * @brief Returns the number of devices stored, with the batch's changes applied.
+ */
+int bt_device_batch_size(void);
+
+/**
+ * @brief Reads a device, with the batch's changes applied.
+ *
+ * @param position Position of the device, from 0 to bt_device_batch_size() - 1.
+ * @param mac Output MAC address of the device.
+ * @param name Output buffer for the device name.
+ * @param name_len Length of the output buffer for the device name.
+ * @return
+ *     - ESP_OK: On success.
+ *     - ESP_ERR_NVS_NOT_FOUND: If position is out of range.
+ */
+esp_err_t bt_device_batch_get(int position, esp_bd_addr_t mac, char* name, size_t name_len);
+
+/**
+ * @brief Writes the changes and the count, commits the batch and updates the cache.
+ *
+ * The batch is closed whatever the outcome.
+ *
+ * @param partial Optional output, set to true if the commit failed after part of the
+ *                batch was written to flash.
+ * @return
+ *     - ESP_OK: On success. The cache matches the registry.
+ *     - Other error codes if a write or the commit failed. If part of the batch was
+ *       written, the cache is read back from flash; otherwise it is left unchanged.
+ */
+esp_err_t bt_device_batch_commit(bool* partial);
+
+/**
+ * @brief Closes the batch and drops its changes.
+ */
+void bt_device_batch_abort(void);
+
 #endif // CONFIG_BT_ENABLED
 
 #ifdef __cplusplus
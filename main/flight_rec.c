@@ -0,0 +1,318 @@
+/**
+ * @file flight_rec.c
+ * @brief Append-only, sector-rotating flight recorder.
+ *
+ * Hot paths only copy a 16-byte record into a queue. A low-priority task batches
+ * records and appends them to the flight recorder partition, so flash writes (which
+ * stall both caches) happen rarely and never on the button or BLE paths. The same task
+ * streams the log to the phone on request.
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "ble_server.h"
+#include "flight_rec.h"
+#include "bt_sched.h"
+
+#define TAG "FLIGHT_REC"
+
+#define REC_QUEUE_LEN           CONFIG_FLIGHT_REC_QUEUE_LEN
+#define REC_FLUSH_TICKS         pdMS_TO_TICKS(CONFIG_FLIGHT_REC_FLUSH_MS)
+#define REC_BATCH_LEN           16      // Records per flash write
+#define REC_CTRL_DUMP           0       // Queue-only record type that requests a dump
+#define REC_CHECK_SEED          0xA5
+#define ENTRIES_PER_SECTOR      ((FLIGHT_REC_SECTOR_SIZE - sizeof(flight_rec_sector_t)) / sizeof(flight_rec_entry_t))
+#define DUMP_CREDITS            4       // Dump notifications handed to the stack but not yet confirmed
+#define DUMP_CONFIRM_TIMEOUT    pdMS_TO_TICKS(1000)
+#define DUMP_RETRY_TICKS        pdMS_TO_TICKS(10)
+
+_Static_assert(sizeof(flight_rec_sector_t) == 16, "flight_rec_sector_t is part of the flash format");
+_Static_assert(sizeof(flight_rec_entry_t) == 16, "flight_rec_entry_t is part of the flash format");
+
+static const esp_partition_t *partition;
+static QueueHandle_t rec_queue;
+static SemaphoreHandle_t dump_credits;
+static uint32_t lost;               // Records dropped because rec_queue was full
+
+// Owned by flight_rec_task() after init
+static size_t sector_count;
+static size_t cur_sector;           // Sector being appended to
+static size_t cur_entry;            // Next free entry slot in cur_sector
+static uint32_t cur_sector_seq;
+static uint32_t boot_count;
+static flight_rec_entry_t batch[REC_BATCH_LEN];
+static size_t batch_len;
+static TickType_t batch_started;
+
+static uint8_t entry_check(const flight_rec_entry_t *entry) {
+    const uint8_t *bytes = (const uint8_t *)entry;
+    uint8_t check = REC_CHECK_SEED;
+
+    for (size_t i = 0; i < sizeof(*entry); i++) {
+        if (i != offsetof(flight_rec_entry_t, check)) {
+            check ^= bytes[i];
+        }
+    }
+    return check;
+}
+
+static bool read_sector_header(size_t sector, flight_rec_sector_t *hdr) {
+    if (esp_partition_read(partition, sector * FLIGHT_REC_SECTOR_SIZE, hdr, sizeof(*hdr)) != ESP_OK) {
+        return false;
+    }
+    return hdr->magic == FLIGHT_REC_SECTOR_MAGIC && hdr->version == FLIGHT_REC_VERSION &&
+           hdr->entry_size == sizeof(flight_rec_entry_t);
+}
+
+static esp_err_t start_sector(size_t sector, uint32_t sector_seq) {
+    flight_rec_sector_t hdr = {
+        .magic = FLIGHT_REC_SECTOR_MAGIC,
+        .sector_seq = sector_seq,
+        .boot_count = boot_count,
+        .version = FLIGHT_REC_VERSION,
+        .entry_size = sizeof(flight_rec_entry_t),
+    };
+    size_t offset = sector * FLIGHT_REC_SECTOR_SIZE;
+
+    esp_err_t err = esp_partition_erase_range(partition, offset, FLIGHT_REC_SECTOR_SIZE);
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition, offset, &hdr, sizeof(hdr));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start sector %u: %s", (unsigned)sector, esp_err_to_name(err));
+        return err;
+    }
+    cur_sector = sector;
+    cur_entry = 0;
+    cur_sector_seq = sector_seq;
+    return ESP_OK;
+}
+
+static void flush_batch(void) {
+    size_t done = 0;
+
+    while (done < batch_len) {
+        if (cur_entry == ENTRIES_PER_SECTOR &&
+            start_sector((cur_sector + 1) % sector_count, cur_sector_seq + 1) != ESP_OK) {
+            break;
+        }
+        size_t n = MIN(batch_len - done, ENTRIES_PER_SECTOR - cur_entry);
+        size_t offset = cur_sector * FLIGHT_REC_SECTOR_SIZE + sizeof(flight_rec_sector_t) +
+                        cur_entry * sizeof(flight_rec_entry_t);
+        esp_err_t err = esp_partition_write(partition, offset, &batch[done], n * sizeof(flight_rec_entry_t));
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to write %u records: %s", (unsigned)n, esp_err_to_name(err));
+            break;
+        }
+        cur_entry += n;
+        done += n;
+    }
+    batch_len = 0;
+}
+
+static void append(flight_rec_entry_t *entry) {
+    entry->check = entry_check(entry);
+    if (batch_len == 0) {
+        batch_started = xTaskGetTickCount();
+    }
+    batch[batch_len++] = *entry;
+    if (batch_len == REC_BATCH_LEN) {
+        flush_batch();
+    }
+}
+
+static void refill_credits(void) {
+    while (xSemaphoreGive(dump_credits) == pdTRUE) {
+    }
+}
+
+static bool dump_send(const void *data, size_t len) {
+    if (xSemaphoreTake(dump_credits, DUMP_CONFIRM_TIMEOUT) != pdTRUE) {
+        return false;
+    }
+    // A full link buffer drains within a few connection events; only a lost phone ends the dump
+    TickType_t start = xTaskGetTickCount();
+    esp_err_t err;
+    while ((err = ble_server_send_dump(data, len)) != ESP_OK && err != ESP_ERR_INVALID_STATE &&
+           xTaskGetTickCount() - start < DUMP_CONFIRM_TIMEOUT) {
+        vTaskDelay(DUMP_RETRY_TICKS);
+    }
+    if (err != ESP_OK) {
+        xSemaphoreGive(dump_credits);
+        return false;
+    }
+    return true;
+}
+
+static void dump_log(void) {
+    uint8_t chunk[CONFIG_BLE_LOCAL_MTU - 3];
+    flight_rec_sector_t hdr;
+    size_t valid = 0;
+
+    flush_batch();
+    // Confirms that came after the last dump ended were not counted
+    refill_credits();
+    if (!ble_server_dump_subscribed()) {
+        ESP_LOGW(TAG, "Dump requested but notifications are not enabled");
+        ble_server_dump_end();
+        return;
+    }
+    for (size_t i = 0; i < sector_count; i++) {
+        valid += read_sector_header(i, &hdr);
+    }
+
+    uint32_t preamble[2] = { FLIGHT_REC_DUMP_MAGIC, valid * FLIGHT_REC_SECTOR_SIZE };
+    size_t payload = MIN(ble_server_dump_max_payload(), sizeof(chunk));
+    bool ok = dump_send(preamble, sizeof(preamble));
+
+    // The sector after the current one is the oldest
+    for (size_t i = 1; ok && i <= sector_count; i++) {
+        size_t sector = (cur_sector + i) % sector_count;
+        if (!read_sector_header(sector, &hdr)) {
+            continue;
+        }
+        for (size_t off = 0; ok && off < FLIGHT_REC_SECTOR_SIZE; off += payload) {
+            size_t len = MIN(payload, FLIGHT_REC_SECTOR_SIZE - off);
+            ok = esp_partition_read(partition, sector * FLIGHT_REC_SECTOR_SIZE + off, chunk, len) == ESP_OK &&
+                 dump_send(chunk, len);
+        }
+    }
+    if (ok) {
+        ESP_LOGI(TAG, "Dumped %u sectors", (unsigned)valid);
+    } else {
+        ESP_LOGW(TAG, "Dump aborted");
+    }
+    ble_server_dump_end();
+}
+
+static void flight_rec_task(void *arg) {
+    flight_rec_entry_t entry;
+
+    while (1) {
+        TickType_t timeout = portMAX_DELAY;
+        if (batch_len > 0) {
+            TickType_t age = xTaskGetTickCount() - batch_started;
+            timeout = REC_FLUSH_TICKS - MIN(age, REC_FLUSH_TICKS);
+        }
+
+        if (xQueueReceive(rec_queue, &entry, timeout) != pdTRUE) {
+            flush_batch();
+        } else if (entry.type == REC_CTRL_DUMP) {
+            dump_log();
+        } else {
+            append(&entry);
+        }
+
+        uint32_t dropped = __atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            flight_rec_entry_t lost_entry = {
+                .time_ms = (uint32_t)(esp_timer_get_time() / 1000),
+                .type = FLIGHT_REC_LOST,
+                .b = dropped,
+            };
+            append(&lost_entry);
+        }
+    }
+}
+
+esp_err_t flight_rec_init(void) {
+    flight_rec_sector_t hdr;
+    bool found = false;
+    size_t newest = 0;
+    uint32_t newest_seq = 0;
+    uint32_t last_boot = 0;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                         FLIGHT_REC_PARTITION_LABEL);
+    if (partition == NULL || partition->size < 2 * FLIGHT_REC_SECTOR_SIZE) {
+        ESP_LOGW(TAG, "No usable '%s' partition, flight recorder disabled", FLIGHT_REC_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    sector_count = partition->size / FLIGHT_REC_SECTOR_SIZE;
+
+    for (size_t i = 0; i < sector_count; i++) {
+        if (!read_sector_header(i, &hdr)) {
+            continue;
+        }
+        if (!found || (int32_t)(hdr.sector_seq - newest_seq) > 0) {
+            newest = i;
+            newest_seq = hdr.sector_seq;
+            last_boot = hdr.boot_count;
+        }
+        found = true;
+    }
+
+    // Every boot starts in a fresh sector so the header's boot count covers all its records
+    boot_count = last_boot + 1;
+    esp_err_t err = found ? start_sector((newest + 1) % sector_count, newest_seq + 1) : start_sector(0, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    dump_credits = xSemaphoreCreateCounting(DUMP_CREDITS, DUMP_CREDITS);
+    rec_queue = xQueueCreate(REC_QUEUE_LEN, sizeof(flight_rec_entry_t));
+    if (dump_credits == NULL || rec_queue == NULL ||
+        xTaskCreatePinnedToCore(flight_rec_task, "flight_rec", 3072, NULL, BT_SCHED_STORAGE_PRIO, NULL,
+                                bt_sched_affinity(BT_SCHED_STORAGE_CORE)) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start flight recorder");
+        rec_queue = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Boot %lu, %u sectors, writing sector %u",
+             (unsigned long)boot_count, (unsigned)sector_count, (unsigned)cur_sector);
+    flight_rec_log(FLIGHT_REC_BOOT, esp_reset_reason(), boot_count, 0);
+    return ESP_OK;
+}
+
+void IRAM_ATTR flight_rec_log(flight_rec_type_t type, uint16_t a, uint32_t b, uint32_t c) {
+    if (rec_queue == NULL) {
+        return;
+    }
+
+    flight_rec_entry_t entry = {
+        .time_ms = (uint32_t)(esp_timer_get_time() / 1000),
+        .type = type,
+        .a = a,
+        .b = b,
+        .c = c,
+    };
+    BaseType_t queued = xPortInIsrContext() ? xQueueSendFromISR(rec_queue, &entry, NULL)
+                                            : xQueueSend(rec_queue, &entry, 0);
+    if (queued != pdTRUE) {
+        __atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool flight_rec_dump_start(void) {
+    flight_rec_entry_t entry = { .type = REC_CTRL_DUMP };
+
+    if (rec_queue == NULL || xQueueSendToFront(rec_queue, &entry, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Dump request dropped");
+        return false;
+    }
+    return true;
+}
+
+void flight_rec_on_dump_confirm(void) {
+    if (dump_credits != NULL) {
+        xSemaphoreGive(dump_credits);
+    }
+}
+
+void flight_rec_on_dump_disconnect(void) {
+    // Notifications still queued for the phone are never confirmed
+    if (dump_credits != NULL) {
+        refill_credits();
+    }
+}
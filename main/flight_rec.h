@@ -0,0 +1,117 @@
+#ifndef FLIGHT_REC_H
+#define FLIGHT_REC_H
+
+// flight_rec.h - Append-only flight recorder in a dedicated flash partition
+//
+// The partition is a ring of 4 KB sectors. Each sector starts with a
+// flight_rec_sector_t header followed by fixed-size flight_rec_entry_t records;
+// erased slots read as 0xFF. Every boot starts a new sector, and the oldest sector
+// is erased when the ring wraps. tools/flight_rec_decode.py decodes partition
+// images and BLE dumps.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLIGHT_REC_PARTITION_LABEL  "flightrec"
+#define FLIGHT_REC_SECTOR_SIZE      4096
+#define FLIGHT_REC_SECTOR_MAGIC     0x43455246  // "FREC"
+#define FLIGHT_REC_DUMP_MAGIC       0x50445246  // "FRDP"
+#define FLIGHT_REC_VERSION          1
+
+/*
+ * Record types. Values are stored in flash, so never renumber them.
+ */
+typedef enum {
+    FLIGHT_REC_BOOT = 1,            // a: esp_reset_reason_t, b: boot count
+    FLIGHT_REC_BUTTON_EDGE = 2,     // a: GPIO, b: level
+    FLIGHT_REC_BUTTON_EVENT = 3,    // a: button (1-based), b: button_event_type_t, c: seq
+    FLIGHT_REC_BLE_CONNECT = 4,     // a: conn_id
+    FLIGHT_REC_BLE_DISCONNECT = 5,  // a: conn_id, b: reason
+    FLIGHT_REC_BLE_CONGEST = 6,     // a: conn_id, b: congested
+    FLIGHT_REC_TX_SEND = 7,         // a: events in the PDU, b: first seq, c: esp_err_t
+    FLIGHT_REC_TX_CONFIRM = 8,      // a: 1 if the indication was confirmed
+    FLIGHT_REC_TX_ACK = 9,          // a: events released, b: acked seq
+    FLIGHT_REC_TX_DROP = 10,        // a: 0 queue full / 1 expired, b: events dropped, c: first seq
+    FLIGHT_REC_LOST = 11,           // b: records lost because the recorder queue was full
+    FLIGHT_REC_CONN_PARAMS = 12,    // a: HCI status, b: interval in 1.25 ms units, c: peripheral latency
+    FLIGHT_REC_ADV_CONNECT = 13,    // a: ble_adv_tier_t, b: time to connect in ms
+    FLIGHT_REC_LINK_PHY = 14,       // a: HCI status, b: tx PHY, c: rx PHY (1M 1, 2M 2, coded 3)
+    FLIGHT_REC_LINK_DATA_LEN = 15,  // a: HCI status, b: tx octets, c: rx octets
+} flight_rec_type_t;
+
+typedef struct {
+    uint32_t magic;         // FLIGHT_REC_SECTOR_MAGIC
+    uint32_t sector_seq;    // Increases by one for every sector started, across boots
+    uint32_t boot_count;    // Boot the sector was written in
+    uint16_t version;       // FLIGHT_REC_VERSION
+    uint16_t entry_size;    // sizeof(flight_rec_entry_t)
+} flight_rec_sector_t;
+
+typedef struct {
+    uint32_t time_ms;       // Milliseconds since boot
+    uint8_t type;           // flight_rec_type_t; 0xFF marks an erased slot
+    uint8_t check;          // XOR of the other bytes with 0xA5, detects torn writes
+    uint16_t a;
+    uint32_t b;
+    uint32_t c;
+} flight_rec_entry_t;
+
+/**
+ * @brief Finds the flight recorder partition, starts a new sector and starts the writer task.
+ *
+ * If the partition is missing, recording is disabled and flight_rec_log() does nothing.
+ *
+ * @return
+ *     - ESP_OK: If the recorder is running.
+ *     - ESP_ERR_NOT_FOUND: If the partition table has no flight recorder partition.
+ *     - ESP_ERR_NO_MEM: If the queue or task could not be created.
+ *     - Other error codes from the flash driver.
+ */
+esp_err_t flight_rec_init(void);
+
+/**
+ * @brief Queues a record for the writer task.
+ *
+ * Never blocks and never touches flash; safe to call from tasks and IRAM interrupt
+ * handlers. If the queue is full the record is counted and a FLIGHT_REC_LOST record
+ * is written once there is room again.
+ *
+ * @param type Record type.
+ * @param a    First argument, see flight_rec_type_t.
+ * @param b    Second argument.
+ * @param c    Third argument.
+ */
+void flight_rec_log(flight_rec_type_t type, uint16_t a, uint32_t b, uint32_t c);
+
+/**
+ * @brief Asks the writer task to stream the whole log on the dump characteristic.
+ *
+ * Pending records are written first. The stream starts with an 8-byte preamble,
+ * FLIGHT_REC_DUMP_MAGIC and the number of bytes that follow, both little-endian,
+ * followed by every valid sector, oldest first, in notifications of the full MTU payload.
+ * ble_server_dump_end() is called once the stream is over, sent or aborted.
+ *
+ * @return false if the request was dropped, and no stream follows.
+ */
+bool flight_rec_dump_start(void);
+
+/**
+ * @brief Returns a send credit to the dump stream. Called from ESP_GATTS_CONF_EVT.
+ */
+void flight_rec_on_dump_confirm(void);
+
+/**
+ * @brief Returns every outstanding send credit. Called when the phone taking the dump disconnects.
+ */
+void flight_rec_on_dump_disconnect(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FLIGHT_REC_H
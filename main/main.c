@@ -8,11 +8,13 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h>
 #include "nvs.h"
 #include "nvs_flash.h"
-// #include "freertos/FreeRTOS.h"
-// #include "freertos/task.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 // #include "freertos/queue.h"
 #include "esp_log.h"
 
@@ -26,6 +28,8 @@
 // #endif //CONFIG_BT_ENABLED
 
 #include "ble_server.h"
+#include "ble_accept.h"
+#include "ble_bond.h"
 
 
 
@@ -36,13 +40,63 @@
 #include "data_storage.h"
 #include "bt_gpio.h"
 #include "bt_event.h"
+#include "bt_trace.h"
+#include "bt_telemetry.h"
+#include "flight_rec.h"
+#include "bt_sched.h"
+#include "bt_boot.h"
+#include "bt_pm.h"
 
 
 #define BT_MAIN_TAG "BT_MAIN"
 
+#define BLE_INIT_STACK  4096
+#define BLE_INIT_PRIO   (tskIDLE_PRIORITY + 2)     // Above app_main, so the controller starts first
+
+static SemaphoreHandle_t ble_init_done;
+
+// Brings up the controller and Bluedroid while app_main loads the device cache
+static void ble_init_task(void *arg)
+{
+    ble_server_init();
+    ESP_LOGI(BT_MAIN_TAG, "BLE server initialized");
+    xSemaphoreGive(ble_init_done);
+    vTaskDelete(NULL);
+}
 
 void app_main(void)
 {
+    bt_boot_mark(BT_BOOT_APP_MAIN);
+
+    ESP_ERROR_CHECK(bt_trace_init());
+
+    // Not fatal: without the partition the remote works, it just keeps no log
+    flight_rec_init();
+
+    // Before the buttons, whose ISR takes the locks
+    ESP_ERROR_CHECK(bt_pm_init());
+
+    // Buttons first: presses during the rest of boot are queued and go out once a phone connects
+    bt_event_task_start();
+    ESP_LOGI(BT_MAIN_TAG, "Bluetooth event task started");
+
+    init_buttons();
+    ESP_LOGI(BT_MAIN_TAG, "Button GPIO initialized");
+    bt_boot_mark(BT_BOOT_BUTTONS);
+
+#ifdef CONFIG_NVS_ENABLE
+    // The controller reads its PHY calibration from NVS, so the partition must be up before it
+    ESP_ERROR_CHECK(data_storage_flash_init());
+    bt_boot_mark(BT_BOOT_NVS);
+#endif // CONFIG_NVS_ENABLE
+
+    ble_init_done = xSemaphoreCreateBinary();
+    if (ble_init_done == NULL ||
+        xTaskCreatePinnedToCore(ble_init_task, "ble_init", BLE_INIT_STACK, NULL, BLE_INIT_PRIO, NULL,
+                                tskNO_AFFINITY) != pdPASS) {
+        ESP_LOGE(BT_MAIN_TAG, "Failed to start BLE init task");
+        abort();
+    }
 
 #ifdef CONFIG_NVS_ENABLE
     ESP_ERROR_CHECK(data_storageInitialize());
@@ -51,15 +105,17 @@ void app_main(void)
 
     ESP_ERROR_CHECK(load_all_bt_devices_to_cache());
     ESP_LOGI(BT_MAIN_TAG, "All Bluetooth devices loaded into cache");
+    ble_accept_load_cache();
+    ble_bond_load_cache();
+    bt_boot_mark(BT_BOOT_STORAGE);
 
-    bt_event_task_start();
-    ESP_LOGI(BT_MAIN_TAG, "Bluetooth event task started");
-
-    init_buttons();
-    ESP_LOGI(BT_MAIN_TAG, "Button GPIO initialized");
+    xSemaphoreTake(ble_init_done, portMAX_DELAY);
+    vSemaphoreDelete(ble_init_done);
 
-    ble_server_init();
-    ESP_LOGI(BT_MAIN_TAG, "BLE server initialized");
+    ESP_ERROR_CHECK(bt_telemetry_init());
 
+    bt_sched_log_profile();
+    bt_sched_bench_start();
 
+    bt_boot_mark(BT_BOOT_INIT_DONE);
 }
@@ -0,0 +1,18 @@
+# Dynamic frequency scaling and automatic light sleep, layered on top of the project configuration:
+#   idf.py -B build_pm -D SDKCONFIG=build_pm/sdkconfig -D SDKCONFIG_DEFAULTS="sdkconfig;sdkconfig.pm" build
+# It also layers on top of sdkconfig.nimble. The press path and the BLE host hold the
+# CPU at full speed and out of light sleep while they work (see bt_pm.h).
+CONFIG_PM_ENABLE=y
+CONFIG_FREERTOS_USE_TICKLESS_IDLE=y
+CONFIG_FREERTOS_IDLE_TIME_BEFORE_SLEEP=3
+
+# Lock and sleep code in IRAM, so waking up does not wait for the flash
+CONFIG_PM_SLP_IRAM_OPT=y
+CONFIG_PM_RTOS_IDLE_OPT=y
+
+# The controller sleeps between connection events. The main crystal stays on in light
+# sleep, so it keeps connection timing without an external 32 kHz crystal.
+CONFIG_BT_CTRL_MODEM_SLEEP=y
+CONFIG_BT_CTRL_MODEM_SLEEP_MODE_1=y
+CONFIG_BT_CTRL_LPCLK_SEL_MAIN_XTAL=y
+CONFIG_BT_CTRL_MAIN_XTAL_PU_DURING_LIGHT_SLEEP=y
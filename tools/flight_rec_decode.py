@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Decode the flight recorder log written by main/flight_rec.c.
+
+Accepted inputs:
+  - a dump received from the dump characteristic (starts with the "FRDP" preamble),
+  - an image of the flightrec partition, e.g.
+        esptool.py read_flash 0x1C0000 0x40000 flightrec.bin
+  - a whole-flash image, such as the file backing the linux target's partition
+    emulation, with --offset and --size selecting the flightrec partition.
+
+Records are printed oldest first, grouped by boot.
+"""
+
+import argparse
+import struct
+import sys
+
+SECTOR_SIZE = 4096
+SECTOR_MAGIC = 0x43455246   # "FREC"
+DUMP_MAGIC = 0x50445246     # "FRDP"
+VERSION = 1
+HEADER = struct.Struct("<IIIHH")
+ENTRY = struct.Struct("<IBBHII")
+CHECK_SEED = 0xA5
+
+RESET_REASONS = [
+    "unknown", "power-on", "external", "software", "panic", "interrupt watchdog",
+    "task watchdog", "other watchdog", "deep sleep", "brownout", "SDIO", "USB",
+    "JTAG", "eFuse", "power glitch", "CPU lockup",
+]
+
+PRESS_TYPES = ["short", "long"]
+ADV_TIERS = ["directed", "fast", "slow"]
+PHYS = ["?", "1M", "2M", "coded"]
+
+
+def reset_reason(value):
+    return RESET_REASONS[value] if value < len(RESET_REASONS) else str(value)
+
+
+def press_type(value):
+    return PRESS_TYPES[value] if value < len(PRESS_TYPES) else str(value)
+
+
+def adv_tier(value):
+    return ADV_TIERS[value] if value < len(ADV_TIERS) else str(value)
+
+
+def phy(value):
+    return PHYS[value] if value < len(PHYS) else str(value)
+
+
+RECORD_FORMATS = {
+    1: lambda a, b, c: f"boot {b}, reset reason {reset_reason(a)}",
+    2: lambda a, b, c: f"GPIO {a} level {b}",
+    3: lambda a, b, c: f"button {a} {press_type(b)} press, seq {c}",
+    4: lambda a, b, c: f"connected, conn_id {a}",
+    5: lambda a, b, c: f"disconnected, conn_id {a} reason 0x{b:02x}",
+    6: lambda a, b, c: f"congestion {'started' if b else 'cleared'}, conn_id {a}",
+    7: lambda a, b, c: f"sent {a} events from seq {b}" + ("" if c == 0 else f", error 0x{c:x}"),
+    8: lambda a, b, c: "indication " + ("confirmed" if a else "failed"),
+    9: lambda a, b, c: f"phone acked {a} events up to seq {b}",
+    10: lambda a, b, c: f"dropped {b} events from seq {c}, " + ("queue full" if a == 0 else "expired"),
+    11: lambda a, b, c: f"{b} records lost, recorder queue full",
+    12: lambda a, b, c: (f"connection interval {b * 1.25:g} ms, latency {c}" if a == 0
+                         else f"connection parameter update failed, status 0x{a:02x}"),
+    13: lambda a, b, c: f"connected in {adv_tier(a)} advertising after {b} ms",
+    14: lambda a, b, c: (f"PHY tx {phy(b)} rx {phy(c)}" if a == 0
+                         else f"PHY update failed, status 0x{a:02x}"),
+    15: lambda a, b, c: (f"data length tx {b} rx {c} octets" if a == 0
+                         else f"data length update failed, status 0x{a:02x}"),
+}
+
+
+def entry_check(raw):
+    check = CHECK_SEED
+    for i, byte in enumerate(raw):
+        if i != 5:
+            check ^= byte
+    return check
+
+
+def read_sectors(data):
+    sectors = []
+    for offset in range(0, len(data) - SECTOR_SIZE + 1, SECTOR_SIZE):
+        magic, seq, boot, version, entry_size = HEADER.unpack_from(data, offset)
+        if magic != SECTOR_MAGIC:
+            continue
+        if version != VERSION or entry_size != ENTRY.size:
+            print(f"Skipping sector at 0x{offset:x}: version {version}, entry size {entry_size}",
+                  file=sys.stderr)
+            continue
+        sectors.append((seq, boot, data[offset:offset + SECTOR_SIZE]))
+    return sorted(sectors, key=lambda sector: sector[0])
+
+
+def decode(data, out):
+    torn = 0
+    last_boot = None
+    for seq, boot, sector in read_sectors(data):
+        if boot != last_boot:
+            out.write(f"=== boot {boot} ===\n")
+            last_boot = boot
+        for offset in range(HEADER.size, SECTOR_SIZE, ENTRY.size):
+            raw = sector[offset:offset + ENTRY.size]
+            time_ms, rec_type, check, a, b, c = ENTRY.unpack(raw)
+            if rec_type == 0xFF:
+                break
+            if check != entry_check(raw):
+                torn += 1
+                continue
+            fmt = RECORD_FORMATS.get(rec_type)
+            text = fmt(a, b, c) if fmt else f"type {rec_type}: {a} {b} {c}"
+            out.write(f"{time_ms // 1000:7d}.{time_ms % 1000:03d} {text}\n")
+    if torn:
+        out.write(f"({torn} records failed the integrity check)\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", type=argparse.FileType("rb"), help="dump or flash image")
+    parser.add_argument("--offset", type=lambda v: int(v, 0), default=0,
+                        help="offset of the flightrec partition in a whole-flash image")
+    parser.add_argument("--size", type=lambda v: int(v, 0), default=None,
+                        help="size of the flightrec partition in a whole-flash image")
+    args = parser.parse_args()
+
+    data = args.image.read()
+    if len(data) >= 8 and struct.unpack_from("<I", data)[0] == DUMP_MAGIC:
+        length = struct.unpack_from("<I", data, 4)[0]
+        if len(data) - 8 < length:
+            print(f"Dump is truncated: {len(data) - 8} of {length} bytes", file=sys.stderr)
+        data = data[8:8 + length]
+    else:
+        end = args.offset + args.size if args.size is not None else len(data)
+        data = data[args.offset:end]
+
+    decode(data, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
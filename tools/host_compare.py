@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""Compare the Bluedroid and NimBLE builds of the remote: image size, static RAM,
+heap left after boot and the boot timeline.
+
+Sizes come from building both hosts side by side, from the project configuration
+(sdkconfig) and, for NimBLE, the overrides in sdkconfig.nimble:
+    build_bluedroid/   SDKCONFIG_DEFAULTS="sdkconfig"
+    build_nimble/      SDKCONFIG_DEFAULTS="sdkconfig;sdkconfig.nimble"
+
+Heap and boot times come from serial logs of each build, captured from reset until the
+first telemetry sample, e.g.
+    idf.py -B build_nimble flash monitor | tee nimble.log
+The script reads the boot timeline logged at the first advertisement (BT_BOOT) and the
+first heap sample (BT_TELEMETRY).
+
+Run from the project root with the ESP-IDF environment exported.
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+HOSTS = {
+    "bluedroid": "sdkconfig",
+    "nimble": "sdkconfig;sdkconfig.nimble",
+}
+
+ANSI = re.compile(r"\x1b\[[0-9;]*m")
+BOOT_LINE = re.compile(r"BT_BOOT: (.+?)\s+(\d+) us$")
+HEAP_LINE = re.compile(r"BT_TELEMETRY: Heap (\S+)\s+free\s+(\d+)\s+min\s+(\d+)")
+
+
+def build_dir(host):
+    return "build_" + host
+
+
+def build(host):
+    d = build_dir(host)
+    cmd = ["idf.py", "-B", d, "-D", "SDKCONFIG=" + os.path.join(d, "sdkconfig"),
+           "-D", "SDKCONFIG_DEFAULTS=" + HOSTS[host], "build"]
+    print(" ".join(cmd), file=sys.stderr)
+    subprocess.run(cmd, check=True)
+
+
+def sizes(host):
+    """Returns (image bytes, {memory type: used bytes}) of a finished build."""
+    d = build_dir(host)
+    with open(os.path.join(d, "project_description.json")) as f:
+        desc = json.load(f)
+    image = os.path.getsize(os.path.join(d, desc["app_bin"]))
+
+    out = subprocess.run(["idf.py", "-B", d, "size", "--format", "json2"], check=True,
+                         capture_output=True, text=True).stdout
+    report = json.loads(out[out.index("{"):])
+    used = {name: mem.get("used", 0) for name, mem in report.get("memory_types", {}).items()}
+    return image, used
+
+
+def parse_log(path):
+    """Returns ({stage: us}, {heap: (free, min)}) from a serial log."""
+    stages = {}
+    heaps = {}
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = ANSI.sub("", line).rstrip()
+            m = BOOT_LINE.search(line)
+            if m:
+                stages.setdefault(m.group(1), int(m.group(2)))
+                continue
+            m = HEAP_LINE.search(line)
+            if m and m.group(1) not in heaps:
+                heaps[m.group(1)] = (int(m.group(2)), int(m.group(3)))
+    return stages, heaps
+
+
+def row(name, a, b, unit):
+    if a is None or b is None:
+        print(f"  {name:<26} {fmt(a):>10} {fmt(b):>10}")
+        return
+    print(f"  {name:<26} {a:>10} {b:>10} {b - a:>+10} {unit}")
+
+
+def fmt(value):
+    return "-" if value is None else str(value)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--no-build", action="store_true", help="use the existing build directories")
+    parser.add_argument("--no-size", action="store_true", help="skip the size comparison")
+    parser.add_argument("--bluedroid-log", help="serial log of the Bluedroid build")
+    parser.add_argument("--nimble-log", help="serial log of the NimBLE build")
+    args = parser.parse_args()
+
+    print(f"  {'':<26} {'bluedroid':>10} {'nimble':>10} {'delta':>10}")
+
+    if not args.no_size:
+        if not args.no_build:
+            for host in HOSTS:
+                build(host)
+        (image_b, used_b), (image_n, used_n) = sizes("bluedroid"), sizes("nimble")
+        print("Size")
+        row("app image", image_b, image_n, "bytes")
+        for name in sorted(set(used_b) | set(used_n)):
+            row(name + " used", used_b.get(name), used_n.get(name), "bytes")
+
+    if args.bluedroid_log and args.nimble_log:
+        stages_b, heaps_b = parse_log(args.bluedroid_log)
+        stages_n, heaps_n = parse_log(args.nimble_log)
+        print("Heap after boot")
+        for name in sorted(set(heaps_b) | set(heaps_n)):
+            row(name + " free", heaps_b.get(name, (None,))[0], heaps_n.get(name, (None,))[0], "bytes")
+            row(name + " min free", heaps_b.get(name, (None, None))[1], heaps_n.get(name, (None, None))[1], "bytes")
+        print("Boot timeline")
+        for name in list(dict.fromkeys(list(stages_b) + list(stages_n))):
+            row(name, stages_b.get(name), stages_n.get(name), "us")
+
+
+if __name__ == "__main__":
+    main()